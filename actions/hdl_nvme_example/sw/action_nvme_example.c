@@ -0,0 +1,178 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Software model of the NVMe example action for SNAP_CONFIG=CPU, such
+ * that snapblock can run without a card. The drive is an anonymous
+ * mapping of NVME_DRIVE_SIZE bytes. A transfer is started by writing
+ * ACTION_CNT and runs right away, its completion is queued for
+ * ACTION_STATUS as the hardware does it: 0x10 or'ed with the slot.
+ *
+ * libsnap reports no NVMe for software cards. Programs which use the
+ * model are linked with -Wl,--wrap=snap_card_ioctl, the wrapper below
+ * then reports NVMe for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+#define ACTION_TYPE_NVME_EXAMPLE	0x10140001
+
+#define ACTION_CONFIG		0x30
+#define  ACTION_CONFIG_COPY_HN	0x03	/* Memcopy Host DRAM to NVMe */
+#define  ACTION_CONFIG_COPY_NH	0x04	/* Memcopy NVMe to Host DRAM */
+#define ACTION_SRC_LOW		0x34
+#define ACTION_SRC_HIGH		0x38
+#define ACTION_DEST_LOW		0x3c
+#define ACTION_DEST_HIGH	0x40
+#define ACTION_CNT		0x44
+#define ACTION_STATUS		0x4c
+#define  ACTION_STATUS_COMPLETED 0x10
+#define ACTION_REGS		0x100
+
+#define NVME_LB_SIZE		512
+#define NVME_DRIVE_SIZE		(4ull * 1024 * 1024 * 1024)
+#define NVME_DONE_MAX		64	/* Queued completions, >= slots */
+
+static pthread_mutex_t nvme_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t nvme_regs[ACTION_REGS / 4];
+static uint32_t nvme_done[NVME_DONE_MAX];
+static unsigned int nvme_done_head, nvme_done_tail;
+static uint8_t *nvme_drive;
+
+int __real_snap_card_ioctl(struct snap_card *card, unsigned int cmd,
+			   unsigned long arg);
+int __wrap_snap_card_ioctl(struct snap_card *card, unsigned int cmd,
+			   unsigned long arg);
+
+int __wrap_snap_card_ioctl(struct snap_card *card, unsigned int cmd,
+			   unsigned long arg)
+{
+	int rc = __real_snap_card_ioctl(card, cmd, arg);
+	const char *config = getenv("SNAP_CONFIG");
+
+	if ((rc == 0) && (cmd == GET_NVME_ENABLED) && (config != NULL) &&
+	    ((strcmp(config, "CPU") == 0) || (strcmp(config, "1") == 0)))
+		*(unsigned long *)arg = 1;
+	return rc;
+}
+
+static void nvme_transfer(uint32_t config, uint32_t bytes)
+{
+	uint64_t src, dst;
+	unsigned int slot = (config >> 8) & 0x0f;
+
+	src = nvme_regs[ACTION_SRC_LOW / 4] |
+		(uint64_t)nvme_regs[ACTION_SRC_HIGH / 4] << 32;
+	dst = nvme_regs[ACTION_DEST_LOW / 4] |
+		(uint64_t)nvme_regs[ACTION_DEST_HIGH / 4] << 32;
+
+	switch (config & 0xff) {
+	case ACTION_CONFIG_COPY_HN:
+		if (dst * NVME_LB_SIZE + bytes > NVME_DRIVE_SIZE)
+			goto err;
+		memcpy(nvme_drive + dst * NVME_LB_SIZE,
+		       (void *)(unsigned long)src, bytes);
+		break;
+	case ACTION_CONFIG_COPY_NH:
+		if (src * NVME_LB_SIZE + bytes > NVME_DRIVE_SIZE)
+			goto err;
+		memcpy((void *)(unsigned long)dst,
+		       nvme_drive + src * NVME_LB_SIZE, bytes);
+		break;
+	default:
+		goto err;
+	}
+	nvme_done[nvme_done_tail++ % NVME_DONE_MAX] =
+		ACTION_STATUS_COMPLETED | slot;
+	return;
+ err:
+	fprintf(stderr, "err: nvme model: bad transfer config=%x "
+		"src=%llx dst=%llx %u bytes\n", config,
+		(long long)src, (long long)dst, bytes);
+}
+
+static int mmio_write32(struct snap_card *card __attribute__((unused)),
+			uint64_t offs, uint32_t data)
+{
+	if (offs >= ACTION_REGS)
+		return 0;
+
+	pthread_mutex_lock(&nvme_lock);
+	nvme_regs[offs / 4] = data;
+	if (offs == ACTION_CNT)		/* written last */
+		nvme_transfer(nvme_regs[ACTION_CONFIG / 4], data);
+	pthread_mutex_unlock(&nvme_lock);
+	return 0;
+}
+
+static int mmio_read32(struct snap_card *card __attribute__((unused)),
+		       uint64_t offs, uint32_t *data)
+{
+	*data = 0;
+	if (offs >= ACTION_REGS)
+		return 0;
+
+	pthread_mutex_lock(&nvme_lock);
+	if (offs == ACTION_STATUS) {
+		if (nvme_done_head != nvme_done_tail)
+			*data = nvme_done[nvme_done_head++ % NVME_DONE_MAX];
+	} else
+		*data = nvme_regs[offs / 4];
+	pthread_mutex_unlock(&nvme_lock);
+	return 0;
+}
+
+/* Transfers run from MMIO, there is no job to execute */
+static int action_main(struct snap_sim_action *action,
+		       void *job __attribute__((unused)),
+		       unsigned int job_len __attribute__((unused)))
+{
+	action->job.retc = SNAP_RETC_SUCCESS;
+	return 0;
+}
+
+static struct snap_sim_action action = {
+	.vendor_id = SNAP_VENDOR_ID_ANY,
+	.device_id = SNAP_DEVICE_ID_ANY,
+	.action_type = ACTION_TYPE_NVME_EXAMPLE,
+	.job = { .retc = SNAP_RETC_FAILURE, },
+	.state = ACTION_IDLE,
+	.main = action_main,
+	.priv_data = NULL,	/* this is passed back as void *card */
+	.mmio_write32 = mmio_write32,
+	.mmio_read32 = mmio_read32,
+	.next = NULL,
+};
+
+static void _init(void) __attribute__((constructor));
+static void _init(void)
+{
+	nvme_drive = mmap(NULL, NVME_DRIVE_SIZE, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (nvme_drive == MAP_FAILED) {
+		fprintf(stderr, "err: nvme model: no memory for the drive\n");
+		return;
+	}
+	snap_action_register(&action);
+}
@@ -41,6 +41,9 @@ static const char *version = GIT_VERSION;
 
 static int err_detected = 0;
 static int random_seed = 0;
+static unsigned int async_depth = 0;	/* 0: blocking cblk_read/write */
+
+#define ASYNC_DEPTH_MAX	16
 
 typedef enum {
 	OP_READ = 0,
@@ -77,6 +80,8 @@ static void usage(const char *prog)
 	       "                            INC is filling the blocks with\n"
 	       "                            and increasing number.\n"
 	       "  -M, --use-mmap            create output file using mmap.\n"
+	       "  -A, --async <depth>       keep up to depth (max %d) async\n"
+	       "                            requests per thread in flight.\n"
 	       "  <file.bin>\n"
 	       "\n"
 	       "Known limitation:\n"
@@ -95,7 +100,7 @@ static void usage(const char *prog)
 	       "  Write file content into the NVMe device:\n"
 	       "    snap_cblk -C0 --write cblk_read.bin\n"
 	       "\n",
-	       prog);
+	       prog, ASYNC_DEPTH_MAX);
 }
 
 static inline
@@ -320,6 +325,105 @@ static void rqueue_free(struct rqueue *rq)
 typedef void * (* worker_thread_t)(void *data);
 typedef int (* cblk_read_write_f)(chunk_id_t id, void *buf, off_t lba,
 		size_t nblocks, int flags);
+typedef int (* cblk_aread_awrite_f)(chunk_id_t id, void *buf,
+		cflash_offset_t lba, size_t nblocks, int *tag,
+		cblk_arw_status_t *status, int flags);
+
+static void rqueue_add_stats(struct rqueue *rq, unsigned long diff_usec,
+			unsigned long nblocks)
+{
+	/* Update statistics under lock to make it consistent */
+	pthread_mutex_lock(&rq->read_lock);
+	if (diff_usec < rq->min_read_usecs)
+		rq->min_read_usecs = diff_usec;
+	if (diff_usec > rq->max_read_usecs)
+		rq->max_read_usecs = diff_usec;
+	rq->total_usecs += diff_usec;
+	rq->total_bytes += nblocks * rq->lba_size;
+	pthread_mutex_unlock(&rq->read_lock);
+}
+
+/**
+ * Like __read_write_thread(), but keeps up to async_depth requests in
+ * flight and harvests them in the order they were issued.
+ */
+static void *__aread_awrite_thread(struct thread_data *d,
+				   cblk_aread_awrite_f func)
+{
+	int rc;
+	uint64_t status;
+	struct rqueue *rq = d->rq;
+	unsigned long nblocks = rq->nblocks;
+	unsigned int head = 0, tail = 0;
+	int tag[ASYNC_DEPTH_MAX];
+	struct timeval stime[ASYNC_DEPTH_MAX], etime;
+	int more = 1;
+
+	block_trace("[%s] NEW THREAD ALIVE %u\n", __func__, d->num);
+	while (!err_detected) {
+		/* Fill the pipeline ... */
+		while (more && (head - tail < async_depth)) {
+			unsigned long lba;
+			void *buf;
+			unsigned int i = head % ASYNC_DEPTH_MAX;
+
+			pthread_mutex_lock(&rq->read_lock);
+			if (rq->lba_idx == rq->num_lba/rq->nblocks) {
+				pthread_mutex_unlock(&rq->read_lock);
+				more = 0;
+				break;
+			}
+			lba = rq->lba[rq->lba_idx];
+			buf = rq->buf + (lba - rq->start_lba) * rq->lba_size;
+			rq->lba_idx++;
+			pthread_mutex_unlock(&rq->read_lock);
+
+			gettimeofday(&stime[i], NULL);
+			rc = func(cid, buf, lba, nblocks, &tag[i], NULL,
+				  CBLK_ARW_WAIT_CMD_FLAGS);
+			if (rc != 0) {
+				fprintf(stderr, "err: async request LBA=%lu "
+					"unhappy rc=%d! %s\n", lba, rc,
+					strerror(errno));
+				goto err_out;
+			}
+			head++;
+		}
+		if (head == tail)
+			break;
+
+		/* ... and wait for the oldest request */
+		rc = cblk_aresult(cid, &tag[tail % ASYNC_DEPTH_MAX], &status,
+				  CBLK_ARESULT_BLOCKING);
+		if (rc != (int)nblocks) {
+			fprintf(stderr, "err: cblk_aresult unhappy rc=%d! %s\n",
+				rc, strerror((int)status));
+			goto err_out;
+		}
+		gettimeofday(&etime, NULL);
+		rqueue_add_stats(rq, timediff_usec(&etime,
+				&stime[tail % ASYNC_DEPTH_MAX]), nblocks);
+		tail++;
+		pthread_testcancel();
+	}
+	/* Collect what is left after an error of another thread */
+	for (; tail != head; tail++)
+		cblk_aresult(cid, &tag[tail % ASYNC_DEPTH_MAX], &status,
+			     CBLK_ARESULT_BLOCKING);
+
+	block_trace("[%s] THREAD %u STOPPED\n", __func__, d->num);
+	d->thread_rc = 0;
+	pthread_exit(&d->thread_rc);
+
+err_out:
+	for (; tail != head; tail++)
+		cblk_aresult(cid, &tag[tail % ASYNC_DEPTH_MAX], &status,
+			     CBLK_ARESULT_BLOCKING);
+	err_detected = 1;		/* inform others to stop */
+	d->thread_rc = -2;
+	pthread_exit(&d->thread_rc);
+}
+
 /**
  * Get block from the queue, trigger read and collect results.
  */
@@ -333,6 +437,10 @@ static void *__read_write_thread(void *data, cblk_read_write_f func)
 	struct rqueue *rq = d->rq;
 	struct timeval stime, etime;
 
+	if (async_depth)
+		return __aread_awrite_thread(d, (func == cblk_read) ?
+					     cblk_aread : cblk_awrite);
+
 	block_trace("[%s] NEW THREAD ALIVE %u\n", __func__, d->num);
 	while (!err_detected) {
 		unsigned long diff_usec;
@@ -370,15 +478,7 @@ static void *__read_write_thread(void *data, cblk_read_write_f func)
 			goto err_out;
 		}
 
-		/* Update statistics under lock to make it consistent */
-		pthread_mutex_lock(&rq->read_lock);
-		if (diff_usec < rq->min_read_usecs)
-			rq->min_read_usecs = diff_usec;
-		if (diff_usec > rq->max_read_usecs)
-			rq->max_read_usecs = diff_usec;
-		rq->total_usecs += diff_usec;
-		rq->total_bytes += nblocks * rq->lba_size;
-		pthread_mutex_unlock(&rq->read_lock);
+		rqueue_add_stats(rq, diff_usec, nblocks);
 		pthread_testcancel();
 	}
 	block_trace("[%s] THREAD %u STOPPED\n", __func__, d->num);
@@ -558,6 +658,7 @@ int main(int argc, char *argv[])
 			{ "pattern",	required_argument, NULL, 'p' },
 			{ "random",	required_argument, NULL, 'R' },
 			{ "use-mmap",	no_argument,	   NULL, 'M' },
+			{ "async",	required_argument, NULL, 'A' },
 
 			{ "format",	no_argument,	   NULL, 'f' },
 			{ "write",	no_argument,	   NULL, 'w' },
@@ -573,7 +674,7 @@ int main(int argc, char *argv[])
 			{ 0,		no_argument,	   NULL, 0   },
 		};
 
-		ch = getopt_long(argc, argv, "MR:p:C:X:xfwrs:t:n:b:p:Vqrvh",
+		ch = getopt_long(argc, argv, "MA:R:p:C:X:xfwrs:t:n:b:p:Vqrvh",
 				 long_options, &option_index);
 		if (ch == -1)	/* all params processed ? */
 			break;
@@ -611,6 +712,9 @@ int main(int argc, char *argv[])
 		case 'M':
 			use_mmap = 1;
 			break;
+		case 'A':
+			async_depth = strtoul(optarg, NULL, 0);
+			break;
 		case 'w':
 			_op = OP_WRITE;
 			break;
@@ -650,6 +754,13 @@ int main(int argc, char *argv[])
 		goto err_out;
 	}
 
+	if (async_depth > ASYNC_DEPTH_MAX) {
+		fprintf(stderr, "err: async depth %u too large (max %d)!\n",
+			async_depth, ASYNC_DEPTH_MAX);
+		usage(argv[0]);
+		goto err_out;
+	}
+
 	srand(random_seed);
 	switch_cpu(cpu, verbose_flag);
 	cblk_init(NULL, 0);
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmark for the snapblock slot allocator: threads loop on
+ * get_req()/put_req() without doing I/O, so only the cost and the
+ * contention of taking and returning a slot is measured. The allocator
+ * is static, snapblock.c is therefore built into this program instead
+ * of linking libsnapcblk. The number of slots comes from CBLK_SLOTS.
+ *
+ * Without a card run it against the software model of the action:
+ *   SNAP_CONFIG=CPU CBLK_SLOTS=16 snap_cblk_slots -t 4
+ */
+
+#include "snapblock.c"
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#define THREADS_MAX	64
+
+static const char *version = GIT_VERSION;
+
+static volatile int slots_go, slots_stop;
+
+struct slots_thread {
+	pthread_t tid;
+	unsigned long ops;
+	int err;
+};
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-V]\n"
+	       "  -C, --card <cardno>       can be (0...3)\n"
+	       "  -t, --threads <n>         threads (max %d), default 4\n"
+	       "  -s, --seconds <n>         run time, default 2\n"
+	       "\n"
+	       "Example without a card:\n"
+	       "  SNAP_CONFIG=CPU CBLK_SLOTS=16 %s -t 4\n"
+	       "\n",
+	       prog, THREADS_MAX, prog);
+}
+
+static void *slots_thread(void *arg)
+{
+	struct slots_thread *t = (struct slots_thread *)arg;
+	struct cblk_req *req;
+
+	while (!slots_go)
+		;
+	while (!slots_stop) {
+		req = get_req(&chunk, 1, 0, 1, 1, 0);
+		if (req == NULL) {
+			t->err = errno;
+			break;
+		}
+		put_req(&chunk, req);
+		t->ops++;
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	int card_no = 0;
+	unsigned int i, threads = 4, seconds = 2;
+	unsigned long ops = 0;
+	char device[128];
+	chunk_id_t id;
+	struct slots_thread t[THREADS_MAX];
+	struct rusage r0, r1;
+	struct timeval stime, etime;
+	long long diff_usec;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	required_argument, NULL, 'C' },
+			{ "threads",	required_argument, NULL, 't' },
+			{ "seconds",	required_argument, NULL, 's' },
+			{ "version",	no_argument,	   NULL, 'V' },
+			{ "help",	no_argument,	   NULL, 'h' },
+			{ 0,		no_argument,	   NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:t:s:Vh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 't':
+			threads = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 's':
+			seconds = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((threads == 0) || (threads > THREADS_MAX) || (seconds == 0)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	id = cblk_open(device, 16, O_RDWR, 0ull, 0);
+	if (id == (chunk_id_t)-1) {
+		fprintf(stderr, "err: opening %s failed!\n", device);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&t[i].tid, NULL, slots_thread, &t[i]) != 0) {
+			fprintf(stderr, "err: starting thread %u failed!\n", i);
+			slots_stop = 1;
+			slots_go = 1;
+			threads = i;
+			rc = -1;
+			break;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &r0);
+	gettimeofday(&stime, NULL);
+	slots_go = 1;
+	if (rc == 0)
+		sleep(seconds);
+	slots_stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		if (t[i].err) {
+			fprintf(stderr, "err: thread %u: get_req failed: %s\n",
+				i, strerror(t[i].err));
+			rc = -1;
+		}
+		ops += t[i].ops;
+	}
+	gettimeofday(&etime, NULL);
+	getrusage(RUSAGE_SELF, &r1);
+	diff_usec = timediff_usec(&etime, &stime);
+
+	/* vcsw/kop: voluntary context switches per 1000 get/put pairs */
+	if (ops != 0)
+		printf("threads=%u slots=%u  %.2f Mops/s  %.0f ns/op  "
+		       "%.2f vcsw/kop\n", threads, chunk.nslots,
+		       (double)ops / diff_usec,
+		       diff_usec * 1000.0 * threads / ops,
+		       (r1.ru_nvcsw - r0.ru_nvcsw) * 1000.0 / ops);
+
+	cblk_close(id, 0);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <err.h>
 #include <pthread.h>
@@ -48,6 +49,8 @@
 #define CONFIG_BUSY_TIMEOUT_SEC		10
 #define CONFIG_REQ_TIMEOUT_SEC		5
 #define CONFIG_REQ_DURATION_USEC	100000 /* usec */
+#define CONFIG_WRITEBACK_SEC		1 /* flush dirty blocks at least that often */
+#define CONFIG_DIRTY_RATIO		20 /* % of the cache */
 
 static int cblk_maxretries = CONFIG_MAX_RETRIES;
 static int cblk_reqtimeout = CONFIG_REQ_TIMEOUT_SEC;
@@ -57,6 +60,8 @@ static int cblk_prefetch = 0;
 static int cblk_nblocks = CBLK_NBLOCKS;
 
 static int cblk_caching = 1;
+static int cblk_writeback = 0;
+static int cblk_dirty_ratio = CONFIG_DIRTY_RATIO;
 static int cblk_prefetch_threshold = CBLK_PREFETCH_THRESHOLD;
 
 static inline void _backtrace(const char *file, int line)
@@ -142,30 +147,10 @@ static inline long int timediff_usec(struct timeval *a, struct timeval *b)
 	return res.tv_sec * 1000000 + res.tv_usec;
 }
 
-typedef struct atomic_t {
-	pthread_mutex_t lock;
-	unsigned long count;
-} atomic_t;
-
-static inline void atomic_init(atomic_t *a, unsigned long v)
-{
-	pthread_mutex_init(&a->lock, NULL);
-	a->count = v;
-}
-
-static inline unsigned long atomic_inc(atomic_t *a)
-{
-	unsigned long v;
-	pthread_mutex_lock(&a->lock);
-	v = a->count++;
-	pthread_mutex_unlock(&a->lock);
-	return v;
-}
-
 #define SNAP_N250S_NVME_SIZE (800ull * 1024 * 1024 * 1024) /* FIXME n TiB */
 #define __CBLK_BLOCK_SIZE 4096
 
-#define CBLK_IDX_MAX		16	/* FIXME Should be 16 */
+#define CBLK_IDX_MAX		16	/* 4 bit slot number in the action */
 #define CBLK_NBLOCKS_MAX	32	/* 128 KiB / 4KiB */
 #define CBLK_NBLOCKS_WRITE_MAX	2	/* writing is just 1 or 2 blocks */
 
@@ -177,10 +162,52 @@ enum cblk_status {
 	CBLK_ERROR = 4,
 };
 
+static int cblk_slots = CBLK_IDX_MAX;
+
 static const char *cblk_status_str[] = {
 	"IDLE", "READING", "WRITING", "READY", "ERROR"
 };
 
+/*
+ * Tags of cblk_aread/cblk_awrite. A tag lives from the call until
+ * cblk_aresult harvests it. The request slot is only held while the
+ * hardware works on it: the completion thread copies the data, gives
+ * the slot back and marks the tag DONE. Tags with a user status are
+ * freed right away. cblk_listio chains the tags of adjacent LBAs to
+ * one request, each one owning nblocks starting at boff.
+ */
+#define CBLK_ATAG_MIN		CBLK_IDX_MAX
+#define CBLK_ATAG_DEFAULT	256
+
+enum cblk_atag_state {
+	CBLK_ATAG_FREE = 0,
+	CBLK_ATAG_PENDING = 1,
+	CBLK_ATAG_DONE = 2,
+};
+
+struct cblk_atag {
+	enum cblk_atag_state state;
+	int tag;		/* index or user tag */
+	int user_tag;
+	void *ubuf;		/* user buffer of cblk_aread */
+	cblk_arw_status_t *ustatus; /* completion status for the user */
+	size_t nblocks;		/* 0 after a failure */
+	unsigned int boff;	/* block offset in req->buf */
+	struct cblk_atag *next;	/* same request */
+	struct cblk_lio *lio;	/* cblk_listio tag, not in c->atag */
+	int err;		/* errno of the request */
+};
+
+/*
+ * Tags of one cblk_listio call. They post to the status in the
+ * cblk_io_t. The block is freed with the last completion, the caller
+ * holds one more reference while issuing.
+ */
+struct cblk_lio {
+	unsigned int refs;	/* protected by c->async_m */
+	struct cblk_atag atag[];
+};
+
 struct cache_way;
 
 struct cblk_req {
@@ -205,6 +232,8 @@ struct cblk_req {
 	struct timeval h_etime;	/* hardware completion time */
 	int use_wait_sem;	/* blocking or prefetch */
 	struct cache_way *pblock[CBLK_NBLOCKS_MAX];
+	uint32_t pinned;	/* blocks pinned for req_cache_overlay */
+	struct cblk_atag *atag;	/* set for cblk_aread/cblk_awrite */
 };
 
 static inline void cblk_set_status(struct cblk_req *req,
@@ -237,7 +266,8 @@ struct cblk_dev {
 	int timeout;
 	uint8_t *buf;
 
-	unsigned int idx;
+	unsigned int nslots;	/* CBLK_SLOTS, up to CBLK_IDX_MAX */
+	unsigned long slot_free;	/* IDLE slots, atomic bitmap */
 	struct cblk_req req[CBLK_IDX_MAX];
 	enum cblk_status req_status;
 	int prefetch_offs[CBLK_IDX_MAX];	/* list of LBA offsets to prefetch */
@@ -247,7 +277,23 @@ struct cblk_dev {
 	pthread_t done_tid[CONFIG_COMPLETION_THREADS];	/* completion thread(s) */
 	pthread_cond_t idle_c;	/* idle management for completion thread */
 	pthread_mutex_t idle_m;
-	int work_in_flight;
+	int work_in_flight;	/* atomic */
+
+	pthread_t wb_tid;		/* write-back flusher */
+	pthread_mutex_t wb_m;
+	pthread_cond_t wb_kick;		/* wake the flusher */
+	pthread_cond_t wb_done;		/* dirty blocks were cleaned */
+	pthread_mutex_t wb_flush_m;	/* one flush pass at a time */
+	int wb_stop;
+	int wb_err;			/* first failure since cblk_sync */
+	long int wb_max;		/* dirty blocks before writers wait */
+	long int wb_background;		/* dirty blocks to flush right away */
+
+	pthread_mutex_t async_m;	/* protects the atag states */
+	pthread_cond_t async_c;		/* a tag got DONE or FREE */
+	struct cblk_atag *atag;
+	unsigned int atag_max;
+	unsigned int atag_idx;
 
 	/* statistics */
 	long int prefetches;
@@ -260,6 +306,15 @@ struct cblk_dev {
 	long int   block_reads_4k;
 	long int block_writes;
 	long int   block_writes_4k;
+	long int block_areads;
+	long int block_awrites;
+	long int aresult_no_cmplt;
+	long int listio_ios;
+	long int listio_cmds;
+	long int wb_blocks;
+	long int wb_flushed;
+	long int wb_cmds;
+	long int wb_throttled;
 	long long int wbytes_total;
 	long long int rbytes_total;
 	struct timeval start_time;	/* time when loading this */
@@ -316,11 +371,6 @@ static struct cblk_dev chunk = {
 
 #define NVME_DRIVE1		0x10	/* Select Drive 1 for 0a and 0b */
 
-static const char *action_name[] = {
-	/* 0         1          2          3          4     */
-	"UNKNOWN", "UNKNOWN", "UNKNOWN", "COPY_HN", "COPY_NH",
-};
-
 #define ACTION_SRC_LOW		0x34	/* LBA for 03, 04 */
 #define ACTION_SRC_HIGH		0x38
 #define ACTION_DEST_LOW		0x3c	/* LBA for 03, 04 */
@@ -351,9 +401,12 @@ static const char *action_name[] = {
 #define NVME_MAX_TRANSFER_SIZE	(32 * MEGA_BYTE)  /* NVME limit to Transfer in one chunk */
 
 /* NVME lba cache */
-#define CACHE_MASK		0x000000ff
+#define CACHE_SETS_DEFAULT	256	/* 16 MiB, see CBLK_CACHE_SIZE */
 #define CACHE_WAYS		16 /* 4 * n */
-#define CACHE_ENTRIES		(CACHE_MASK + 1)
+#define CACHE_A1IN_MAX		(CACHE_WAYS / 4) /* 2Q: ways on probation */
+#define CACHE_GHOSTS		(CACHE_WAYS / 2) /* 2Q: evicted LBAs remembered */
+#define CACHE_READ_TRIES	4	/* optimistic reads before locking */
+#define CACHE_DIRTY_WAYS	(CACHE_WAYS - CACHE_WAYS / 4) /* per set */
 
 enum cache_block_status {
 	CACHE_BLOCK_UNUSED = 0,	/* not in use yset */
@@ -365,48 +418,140 @@ static const char *block_status_str[] = {
 	"UNUSED", "VALID", "READING",
 };
 
+/*
+ * LRU evicts the way with the oldest access. 2Q puts new blocks on
+ * probation (A1in, FIFO) and only blocks which come back after they
+ * were evicted from there get into the LRU part (Am). A scan then just
+ * cycles through A1in and leaves the blocks in Am alone.
+ */
+enum cache_policy {
+	CACHE_POLICY_LRU = 0,
+	CACHE_POLICY_2Q = 1,
+};
+
+static const char *cache_policy_str[] = {
+	"LRU", "2Q",
+};
+
+enum cache_queue {
+	CACHE_Q_AM = 0,		/* LRU uses just this one */
+	CACHE_Q_A1IN = 1,
+};
+
 struct cache_way {
 	enum cache_block_status status;
+	enum cache_queue q;
 	off_t lba;		/* lba this cache entry is for */
 	size_t nblocks;		/* use 1 to keep things simple */
 	unsigned int used;	/* # times this block was used */
 	unsigned int count;	/* eviction counter */
+	unsigned int dirty;	/* write-back: not on the device yet */
+	unsigned int wgen;	/* bumped on every write */
+	unsigned int pinned;	/* reads waiting to overlay it */
 	void *buf;		/* data if status is CBLK_BLOCK_VALID */
 };
 
+/*
+ * Writers hold way_lock and make seq odd while they change the set.
+ * cache_read copies without the lock and retries if seq moved.
+ */
 struct cache_entry {
 	pthread_mutex_t way_lock;
+	unsigned int seq;
 	unsigned int count;
+	unsigned int dirty;		/* dirty ways */
+	unsigned int ghost_idx;
+	off_t ghost[CACHE_GHOSTS];	/* 2Q: LBAs evicted from A1in */
 	struct cache_way way[CACHE_WAYS];
 };
 
 typedef uint8_t cache_block_t[__CBLK_BLOCK_SIZE];
 
-static struct cache_entry cache_entries[CACHE_ENTRIES];
+static unsigned long cache_sets = CACHE_SETS_DEFAULT;	/* power of 2 */
+static enum cache_policy cache_policy = CACHE_POLICY_2Q;
+static struct cache_entry *cache_entries = NULL;
 static cache_block_t *cache_blocks = NULL;
+static off_t *cache_dirty_lbas = NULL;	/* cache_flush() */
+static long int cache_dirty = 0;	/* atomic */
 static long int cache_trashing = 0;	/* statistics */
+static long int cache_ghost_hits = 0;
+static long int cache_reserve_misses = 0;	/* no way free on read */
+static long int cache_read_locked = 0;
+
+static inline struct cache_entry *cache_set(off_t lba)
+{
+	return &cache_entries[lba & (cache_sets - 1)];
+}
+
+static inline void cache_lock(struct cache_entry *entry)
+{
+	pthread_mutex_lock(&entry->way_lock);
+	__atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void cache_unlock(struct cache_entry *entry)
+{
+	__atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&entry->way_lock);
+}
+
+static void cache_done(void)
+{
+	__free(cache_blocks);
+	cache_blocks = NULL;
+	__free(cache_entries);
+	cache_entries = NULL;
+	__free(cache_dirty_lbas);
+	cache_dirty_lbas = NULL;
+}
 
 static int cache_init(void)
 {
 	int rc;
 	unsigned int i, j;
 
+	cache_entries = calloc(cache_sets, sizeof(*cache_entries));
+	if (cache_entries == NULL) {
+		perror("err: calloc");
+		return ENOMEM;
+	}
+
 	rc = posix_memalign((void **)&cache_blocks, __CBLK_BLOCK_SIZE,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE);
+		cache_sets * CACHE_WAYS * __CBLK_BLOCK_SIZE);
 	if (rc != 0) {
 		perror("err: posix_memalign");
+		__free(cache_entries);
+		cache_entries = NULL;
 		return rc;
 	}
 
-	for (i = 0; i < CACHE_ENTRIES; i++) {
+	if (cblk_writeback) {
+		cache_dirty_lbas = malloc(cache_sets * CACHE_WAYS *
+					  sizeof(*cache_dirty_lbas));
+		if (cache_dirty_lbas == NULL) {
+			perror("err: malloc");
+			cache_done();
+			return ENOMEM;
+		}
+	}
+	cache_dirty = 0;
+
+	for (i = 0; i < cache_sets; i++) {
 		struct cache_entry *entry = &cache_entries[i];
 		struct cache_way *way = entry->way;
 
 		pthread_mutex_init(&entry->way_lock, NULL);
+		for (j = 0; j < CACHE_GHOSTS; j++)
+			entry->ghost[j] = -1;
 		for (j = 0; j < CACHE_WAYS; j++) {
 			way[j].status = CACHE_BLOCK_UNUSED;
+			way[j].q = CACHE_Q_AM;
 			way[j].count = 0;
 			way[j].used = 0;
+			way[j].dirty = 0;
+			way[j].wgen = 0;
+			way[j].pinned = 0;
 			way[j].buf = &cache_blocks[i * CACHE_WAYS + j];
 		}
 	}
@@ -429,40 +574,77 @@ static inline void __dump_entry(struct cache_entry *entry)
 	}
 }
 
-static void cache_done(void)
-{
-	__free(cache_blocks);
-	cache_blocks = NULL;
-}
 
-/**
- * Returns 0 if data was found and copied to the output buffer.
- *         1 if data is in flight and requested for reading.
- *         negative on error.
+/*
+ * Returns 0 and *w if data was found and copied, 1 if it is in flight,
+ * -1 if it is not in the cache. The caller makes sure the set is stable.
  */
-static int cache_read(off_t lba, void *buf)
+static int __cache_lookup(struct cache_entry *entry, off_t lba, void *buf,
+			  struct cache_way **w)
 {
-	unsigned int i = lba & CACHE_MASK, j;
-	struct cache_entry *entry = &cache_entries[i];
+	unsigned int j;
 	struct cache_way *way = entry->way;
 
-	pthread_mutex_lock(&entry->way_lock);
 	for (j = 0; j < CACHE_WAYS; j++) {
 		if ((way[j].status == CACHE_BLOCK_VALID) && (lba == way[j].lba)) {
-			way[j].count = entry->count++;
-			way[j].used++;
 			memcpy(buf, way[j].buf, __CBLK_BLOCK_SIZE);
-			pthread_mutex_unlock(&entry->way_lock);
+			*w = &way[j];
 			return 0;
 		}
-		if  ((way[j].status == CACHE_BLOCK_READING) && (lba == way[j].lba)) {
-			pthread_mutex_unlock(&entry->way_lock);
+		if  ((way[j].status == CACHE_BLOCK_READING) && (lba == way[j].lba))
 			return 1;
-		}
 	}
+	return -1; /* not found */
+}
+
+/*
+ * A hit only updates replacement hints, without the lock and without
+ * moving seq. A hit in A1in does not promote the block.
+ */
+static inline void cache_touch(struct cache_entry *entry, struct cache_way *w)
+{
+	__atomic_fetch_add(&w->used, 1, __ATOMIC_RELAXED);
+	if (w->q == CACHE_Q_A1IN)
+		return;
+	__atomic_store_n(&w->count, __atomic_fetch_add(&entry->count, 1,
+			 __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns 0 if data was found and copied to the output buffer.
+ *         1 if data is in flight and requested for reading.
+ *         negative on error.
+ */
+static int cache_read(off_t lba, void *buf)
+{
+	int rc;
+	unsigned int seq, tries;
+	struct cache_way *w = NULL;
+	struct cache_entry *entry = cache_set(lba);
+
+	for (tries = 0; tries < CACHE_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;	/* writer busy */
+
+		rc = __cache_lookup(entry, lba, buf, &w);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;	/* set changed, data may be torn */
+
+		if (rc == 0)
+			cache_touch(entry, w);
+		return rc;
+	}
+
+	__atomic_fetch_add(&cache_read_locked, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&entry->way_lock);
+	rc = __cache_lookup(entry, lba, buf, &w);
+	if (rc == 0)
+		cache_touch(entry, w);
 	pthread_mutex_unlock(&entry->way_lock);
 
-	return -1; /* not found */
+	return rc;
 }
 
 /**
@@ -473,7 +655,7 @@ static int cache_read(off_t lba, void *buf)
 static enum cblk_status cache_info(off_t lba)
 {
 	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	struct cache_entry *entry = cache_set(lba);
 	struct cache_way *way = entry->way;
 
 	pthread_mutex_lock(&entry->way_lock);
@@ -491,9 +673,49 @@ static enum cblk_status cache_info(off_t lba)
 	return CACHE_BLOCK_UNUSED;
 }
 
+/* 2Q: was lba evicted from A1in recently? Forgets it if so. */
+static int __cache_ghost_hit(struct cache_entry *entry, off_t lba)
+{
+	unsigned int j;
+
+	for (j = 0; j < CACHE_GHOSTS; j++) {
+		if (entry->ghost[j] == lba) {
+			entry->ghost[j] = -1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void __cache_ghost_add(struct cache_entry *entry, off_t lba)
+{
+	entry->ghost[entry->ghost_idx] = lba;
+	entry->ghost_idx = (entry->ghost_idx + 1) % CACHE_GHOSTS;
+}
+
+/*
+ * Pick the way to replace. lru is the oldest VALID way in Am, fifo the
+ * oldest VALID one in A1in, which holds a1in ways. 2Q takes from A1in
+ * once it is over its share.
+ */
+static struct cache_way *__cache_victim(struct cache_entry *entry,
+					struct cache_way *unused,
+					struct cache_way *lru,
+					struct cache_way *fifo,
+					unsigned int a1in)
+{
+	if (unused != NULL)
+		return unused;
+	if ((fifo != NULL) && ((a1in > CACHE_A1IN_MAX) || (lru == NULL))) {
+		__cache_ghost_add(entry, fifo->lba);
+		return fifo;
+	}
+	return lru;
+}
+
 /**
  * Lockfree version of cache_reserve. Please use this only if you hold
- * the lock to the cache entry.
+ * the lock to the cache entry, taken with cache_lock().
  *
  * @force Enforce reservation. For read this is no trecommended, but
  *        for write it is, since we like to replace the old data as
@@ -501,11 +723,10 @@ static enum cblk_status cache_info(off_t lba)
  */
 static struct cache_way *__cache_reserve(off_t lba, int force)
 {
-	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	unsigned int j, a1in = 0;
+	struct cache_entry *entry = cache_set(lba);
 	struct cache_way *e, *way = entry->way;
-	int reserve_idx = -1;
-	unsigned int min_count = INT_MAX;
+	struct cache_way *unused = NULL, *lru = NULL, *fifo = NULL;
 
 	for (j = 0; j < CACHE_WAYS; j++) {
 		e = &way[j];
@@ -513,59 +734,81 @@ static struct cache_way *__cache_reserve(off_t lba, int force)
 		switch (e->status) {
 		/* continue, since maybe we find one with matching lba */
 		case CACHE_BLOCK_UNUSED:
-			reserve_idx = j;
-			min_count = e->count;
+			unused = e;
 			break;
 		/* avoid double entries */
 		case CACHE_BLOCK_VALID:
 			if (e->lba == lba) {	/* entry is already in cache */
 				/* cache_trace("[%s] %p LBA=%ld/%ld is already VALID!\n",
 					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
+				if (force)
 					goto reserve_entry;
-				} else
+				else
 					return NULL;
 			}
-			if (e->count < min_count) {
-				min_count = e->count;
-				reserve_idx = j;/* replace candidate with smallest count */
+			if (e->dirty || e->pinned) {	/* until flushed/read */
+				if (e->q == CACHE_Q_A1IN)
+					a1in++;
+				break;
 			}
+			/* replace candidates with smallest count */
+			if (e->q == CACHE_Q_A1IN) {
+				a1in++;
+				if ((fifo == NULL) || (e->count < fifo->count))
+					fifo = e;
+			} else if ((lru == NULL) || (e->count < lru->count))
+				lru = e;
 			break;
 		/* do not throw this out unless forced to */
 		case CACHE_BLOCK_READING:
 			if (e->lba == lba) {	/* entry is already in cache */
 				/* cache_trace("[%s] %p LBA=%ld/%ld is already READING!\n",
 					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
+				if (force)
 					goto reserve_entry;
-				} else
+				else
 					return NULL;
 			}
+			if (e->q == CACHE_Q_A1IN)
+				a1in++;
 			break;
 		}
 	}
-	if (reserve_idx == -1) {
+
+	e = __cache_victim(entry, unused, lru, fifo, a1in);
+	if (e == NULL) {
+		if (!force) {	/* reads just skip caching */
+			__atomic_fetch_add(&cache_reserve_misses, 1,
+					   __ATOMIC_RELAXED);
+			return NULL;
+		}
 		dfprintf(stderr, "[%s] warn: No free entry found for LBA=%ld\n",
 			__func__, lba);
 		__dump_entry(entry);
 		return NULL;	/* no entry found! */
 	}
 
-reserve_entry:
-	/* Now reserve */
-	e = &way[reserve_idx];
 	if ((e->status == CACHE_BLOCK_VALID) && (e->used == 0))
-		cache_trashing++;	/* discarding an used entry */
+		/* discarding an used entry */
+		__atomic_fetch_add(&cache_trashing, 1, __ATOMIC_RELAXED);
+
+	e->q = CACHE_Q_AM;
+	if (cache_policy == CACHE_POLICY_2Q) {
+		if (__cache_ghost_hit(entry, lba))
+			__atomic_fetch_add(&cache_ghost_hits, 1,
+					   __ATOMIC_RELAXED);
+		else
+			e->q = CACHE_Q_A1IN;
+	}
 
+reserve_entry:
+	/* Now reserve */
 	/* dfprintf(stderr, "[%s] debug: reserve %p for LBA=%ld %s\n",
 		__func__, e, lba, block_status_str[e->status]); */
 	e->lba = lba;
-	e->count = entry->count++;
+	e->count = __atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED);
 	e->used = 0;
+	e->wgen++;	/* a flush in progress must not clean it */
 	e->status = CACHE_BLOCK_READING;
 	
 	return e;
@@ -578,19 +821,17 @@ reserve_entry:
  * be reused later on. Failing to fill the entry will cause resource
  * leakage and cache malfunction.
  */
-#if 0
 static struct cache_way *cache_reserve(off_t lba, int force)
 {
 	struct cache_way *e;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	struct cache_entry *entry = cache_set(lba);
 
-	pthread_mutex_lock(&entry->way_lock);
+	cache_lock(entry);
 	e = __cache_reserve(lba, force);
-	pthread_mutex_unlock(&entry->way_lock);
+	cache_unlock(entry);
 
 	return e;
 }
-#endif
 
 /**
  * It might happen that a prefetch/write operation changes the state
@@ -617,13 +858,13 @@ static int cache_write_reserved(struct cache_way **e,
 	if (_e == NULL)
 		return -2;
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
+	entry = cache_set(lba);
+	cache_lock(entry);
 
 	if (_e->lba != lba) {
 		dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld reservation lost %s\n",
 			__func__, _e, lba, _e->lba, block_status_str[_e->status]);
-		pthread_mutex_unlock(&entry->way_lock);
+		cache_unlock(entry);
 		return -1;
 	}
 
@@ -631,7 +872,7 @@ static int cache_write_reserved(struct cache_way **e,
 	if (_e->status != CACHE_BLOCK_READING) {
 		/* dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld State is not READING but %s\n",
 			__func__, _e, lba, _e->lba, block_status_str[_e->status]); */
-		pthread_mutex_unlock(&entry->way_lock);
+		cache_unlock(entry);
 		return -2;
 	}
 
@@ -640,7 +881,7 @@ static int cache_write_reserved(struct cache_way **e,
 	_e->status = CACHE_BLOCK_VALID;
 	*e = NULL;	/* mark as not accessible anymore */
 
-	pthread_mutex_unlock(&entry->way_lock);
+	cache_unlock(entry);
 	return 0;
 }
 
@@ -654,15 +895,15 @@ static int cache_unreserve(struct cache_way *e, off_t lba)
 	/* dfprintf(stderr, "[%s] debug: unreserve %p for LBA=%ld %s\n",
 		__func__, e, lba, block_status_str[e->status]); */
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
+	entry = cache_set(lba);
+	cache_lock(entry);
 
 	if (e->lba != lba) {
 		dfprintf(stderr, "[%s] err: LBA=%ld/%ld not consistent!\n",
 			__func__, lba, e->lba);
 		e->status = CACHE_BLOCK_UNUSED;
 		/* __backtrace(); */
-		pthread_mutex_unlock(&entry->way_lock);
+		cache_unlock(entry);
 		return -1;
 	}
 	if (e->status == CACHE_BLOCK_READING) {
@@ -673,7 +914,7 @@ static int cache_unreserve(struct cache_way *e, off_t lba)
 		/* __backtrace(); */
 	}
 
-	pthread_mutex_unlock(&entry->way_lock);
+	cache_unlock(entry);
 	return 0;
 }
 
@@ -687,142 +928,394 @@ static int cache_write(off_t lba, const void *buf, int _used)
 	struct cache_way *e;
 	struct cache_entry *entry;
 
-	entry = &cache_entries[lba & CACHE_MASK];
-	pthread_mutex_lock(&entry->way_lock);
+	entry = cache_set(lba);
+	cache_lock(entry);
 
 	e = __cache_reserve(lba, 1);	/* enforce reservation */
 	if (e == NULL) {
 		fprintf(stderr, "[%s] cache reservation for LBA=%ld failed!\n",
 			__func__, lba);
 		__dump_entry(entry);
-		pthread_mutex_unlock(&entry->way_lock);
+		cache_unlock(entry);
 		return -1;	/* no entry free! */
 	}
 
 	memcpy(e->buf, buf, __CBLK_BLOCK_SIZE);
 	e->used = _used;
 	e->status = CACHE_BLOCK_VALID;
-	pthread_mutex_unlock(&entry->way_lock);
+	cache_unlock(entry);
 
 	return 0;
 }
 
-static void inc_work_in_flight(struct cblk_dev *c)
+/*
+ * Write-back: keep a dirty block in the cache until the read which
+ * missed it on the device copied it. A flush can clean it meanwhile,
+ * but it must not be evicted. Returns -1 if the block is not dirty.
+ */
+static int cache_pin(off_t lba)
 {
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight++;
-	if (c->work_in_flight == 1)
-		/* pthread_cond_signal(&c->idle_c); */
-		pthread_cond_broadcast(&c->idle_c);
-	pthread_mutex_unlock(&c->idle_m);
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way = entry->way;
+
+	if (entry->dirty == 0)	/* racy, rechecked under the lock */
+		return -1;
+
+	pthread_mutex_lock(&entry->way_lock);
+	for (j = 0; j < CACHE_WAYS; j++) {
+		if (way[j].dirty && (way[j].lba == lba)) {
+			way[j].pinned++;
+			pthread_mutex_unlock(&entry->way_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+	return -1;
 }
 
-static void dec_work_in_flight(struct cblk_dev *c)
+static void cache_unpin(off_t lba)
 {
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight--;
-	pthread_mutex_unlock(&c->idle_m);
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way = entry->way;
+
+	pthread_mutex_lock(&entry->way_lock);
+	for (j = 0; j < CACHE_WAYS; j++) {
+		if (way[j].pinned && (way[j].lba == lba)) {
+			way[j].pinned--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&entry->way_lock);
 }
 
-static inline unsigned int work_in_flight(struct cblk_dev *c)
+/*
+ * Reserve the ways for the blocks of a hardware read, __read_complete
+ * fills them. Blocks already in the cache or in flight get none, dirty
+ * ones are pinned for req_cache_overlay instead.
+ */
+static void req_cache_reserve(struct cblk_req *req)
 {
-	int r;
+	unsigned int i;
+
+	if (!cblk_caching)
+		return;
 
-	sem_getvalue(&c->busy_sem, &r);
-	return CBLK_IDX_MAX - r;
+	for (i = 0; i < req->nblocks; i++) {
+		req->pblock[i] = cache_reserve(req->lba + i, 0);
+		if ((req->pblock[i] == NULL) && cblk_writeback &&
+		    (cache_pin(req->lba + i) == 0))
+			req->pinned |= 1u << i;
+	}
 }
 
-static inline void dev_set_status(struct cblk_dev *c,
-				enum cblk_status status)
+/* put_req: the read is done, pinned blocks may be evicted again */
+static void req_cache_unpin(struct cblk_req *req)
 {
-	/* block_trace("  [%s] device new status is %s\n", __func__,
-		cblk_status_str[status]); */
-	c->status = status;
+	unsigned int i;
+
+	for (i = 0; i < req->nblocks; i++)
+		if (req->pinned & (1u << i))
+			cache_unpin(req->lba + i);
+	req->pinned = 0;
 }
 
 /*
- * Action Write and Read are 32 bit MMIO
- *
- * Note:
- *   Adding pthread_setcancelstate() since the simulation version of
- *   libcxl is not really thead safe and keeps locks when interrupted
- *   with pthread_cancel(). That can lead to deadlocks. Marking the
- *   critical section as non-cancelable prevents this.
+ * Write-back: copy the cached blocks over the data read from the
+ * device, which misses what is still dirty or being flushed. The
+ * blocks dirty at req_cache_reserve are pinned, so they are still
+ * there even if a flush cleaned them in the meantime.
  */
-static int __cblk_write(struct cblk_dev *c, uint32_t addr, uint32_t data)
+static void req_cache_overlay(struct cblk_req *req)
 {
-	int rc, oldstate;
+	unsigned int i;
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-	rc = snap_mmio_write32(c->card, (uint64_t)addr, data);
-	if (0 != rc)
-		fprintf(stderr, "err: Write MMIO 32 Err %d\n", rc);
-	pthread_setcancelstate(oldstate, NULL);
-	return rc;
-}
+	if (!cblk_writeback)
+		return;
 
+	for (i = 0; i < req->nblocks; i++)
+		cache_read(req->lba + i, req->buf + i * __CBLK_BLOCK_SIZE);
+}
 
-/* Action or Kernel Write and Read are 32 bit MMIO */
-static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
+/*
+ * Write-back: keep the block in the cache only and mark it dirty.
+ * Returns -1 if the set has no room for another dirty block.
+ */
+static int cache_write_dirty(off_t lba, const void *buf)
 {
-	int rc, oldstate;
+	unsigned int j;
+	struct cache_way *e;
+	struct cache_entry *entry = cache_set(lba);
 
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	cache_lock(entry);
 
-#ifdef CONFIG_MMIO32_NOHWSYNC
-	rc = snap_mmio_read32_nohwsync(c->card, (uint64_t)addr, data);
-#else
-	rc = snap_mmio_read32(c->card, (uint64_t)addr, data);
-#endif
-	if (0 != rc)
-		fprintf(stderr, "err: Read MMIO 32 Err %d\n", rc);
+	if (entry->dirty >= CACHE_DIRTY_WAYS) {
+		for (j = 0; j < CACHE_WAYS; j++)
+			if (entry->way[j].dirty && (entry->way[j].lba == lba))
+				break;
+		if (j == CACHE_WAYS) {
+			cache_unlock(entry);
+			return -1;
+		}
+	}
 
-	pthread_setcancelstate(oldstate, NULL);
-	return rc;
-}
+	e = __cache_reserve(lba, 1);
+	if (e == NULL) {
+		cache_unlock(entry);
+		return -1;
+	}
 
-static void req_setup(struct cblk_req *req,
-		uint32_t action_code,
-		uint64_t dst,
-		uint64_t src,
-		uint32_t size)
-{
-	req->action = action_code | (req->slot << 8);
-	req->dst = dst;
-	req->src = src;
-	req->size = size;
-	req->tries = 0;
+	memcpy(e->buf, buf, __CBLK_BLOCK_SIZE);
+	e->status = CACHE_BLOCK_VALID;
+	if (!e->dirty) {
+		e->dirty = 1;
+		entry->dirty++;
+		__atomic_fetch_add(&cache_dirty, 1, __ATOMIC_RELAXED);
+	}
+	cache_unlock(entry);
+	return 0;
 }
 
 /*
- * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
- *       byte block.
+ * Write-back: a write to the device is about to start. A dirty copy
+ * of the block gets the new data too, else a flush still holding the
+ * old data could land after it and clean the block.
  */
-static void req_start(struct cblk_req *req, struct cblk_dev *c)
+static void req_cache_redirty(struct cblk_req *req)
 {
-	uint8_t action_code = req->action & 0x00ff;
-	int slot = req->slot;
+	unsigned int i, j;
+	struct cache_entry *entry;
+	struct cache_way *way;
 
-	req->tries++;
-	block_trace("    [%s] HW %s memcpy_%x(slot=%u dest=0x%llx, "
-		"src=0x%llx n=%lld bytes) LBA=%ld attempts=%d\n",
-		__func__, action_name[action_code % ACTION_CONFIG_MAX],
-		req->action, slot, (long long)req->dst, (long long)req->src,
-		(long long)req->size, req->lba, req->tries);
+	if (!cblk_writeback)
+		return;
 
-	pthread_mutex_lock(&c->dev_lock);
+	for (i = 0; i < req->nblocks; i++) {
+		entry = cache_set(req->lba + i);
+		way = entry->way;
 
-	__cblk_write(c, ACTION_CONFIG,    req->action);
-	__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
-	__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
-	__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
-	__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
-	__cblk_write(c, ACTION_CNT,       req->size);
+		if (entry->dirty == 0)	/* racy, rechecked under the lock */
+			continue;
 
-	/* Wait for Action to go back to Idle */
-	snap_action_start(c->act);
-	gettimeofday(&req->stime, NULL);
-	gettimeofday(&req->h_stime, NULL);
+		cache_lock(entry);
+		for (j = 0; j < CACHE_WAYS; j++) {
+			if (way[j].dirty && (way[j].lba == req->lba + i)) {
+				memcpy(way[j].buf,
+				       req->buf + i * __CBLK_BLOCK_SIZE,
+				       __CBLK_BLOCK_SIZE);
+				way[j].wgen++;
+				break;
+			}
+		}
+		cache_unlock(entry);
+	}
+}
+
+/* Copy a dirty block for flushing, *wgen tells if it changes meanwhile */
+static int cache_snapshot(off_t lba, void *buf, unsigned int *wgen)
+{
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way = entry->way;
+
+	pthread_mutex_lock(&entry->way_lock);
+	for (j = 0; j < CACHE_WAYS; j++) {
+		if (way[j].dirty && (way[j].lba == lba)) {
+			memcpy(buf, way[j].buf, __CBLK_BLOCK_SIZE);
+			*wgen = way[j].wgen;
+			pthread_mutex_unlock(&entry->way_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+	return -1;
+}
+
+/* The snapshot is on the device, clean the block unless it was rewritten */
+static void cache_clean(off_t lba, unsigned int wgen)
+{
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way = entry->way;
+
+	pthread_mutex_lock(&entry->way_lock);
+	for (j = 0; j < CACHE_WAYS; j++) {
+		if (way[j].dirty && (way[j].lba == lba)) {
+			if (way[j].wgen == wgen) {
+				way[j].dirty = 0;
+				entry->dirty--;
+				__atomic_fetch_sub(&cache_dirty, 1,
+						   __ATOMIC_RELAXED);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+}
+
+/*
+ * Only the step from 0 needs idle_m: the completion thread checks the
+ * counter under it before going to sleep.
+ */
+static void inc_work_in_flight(struct cblk_dev *c, unsigned int n)
+{
+	if (__atomic_fetch_add(&c->work_in_flight, n, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	pthread_mutex_lock(&c->idle_m);
+	pthread_cond_broadcast(&c->idle_c);
+	pthread_mutex_unlock(&c->idle_m);
+}
+
+static void dec_work_in_flight(struct cblk_dev *c)
+{
+	__atomic_fetch_sub(&c->work_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int work_in_flight(struct cblk_dev *c)
+{
+	return __atomic_load_n(&c->work_in_flight, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take up to n slots out of the free bitmap with one compare and swap.
+ * The caller holds that many busy_sem tokens, so normally all of them
+ * are there; slots left in CBLK_ERROR never come back. Returns the
+ * bits taken.
+ */
+static unsigned long slots_claim(struct cblk_dev *c, unsigned int n)
+{
+	unsigned int i;
+	unsigned long old, new;
+
+	old = __atomic_load_n(&c->slot_free, __ATOMIC_RELAXED);
+	do {
+		new = old;
+		for (i = 0; (i < n) && (new != 0); i++)
+			new &= new - 1;		/* lowest free slot */
+	} while (!__atomic_compare_exchange_n(&c->slot_free, &old, new, 0,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+	return old & ~new;
+}
+
+static inline void slot_release(struct cblk_dev *c, struct cblk_req *req)
+{
+	__atomic_fetch_or(&c->slot_free, 1ul << req->slot, __ATOMIC_RELEASE);
+}
+
+static inline void stat_add(time_t *total, time_t v)
+{
+	__atomic_fetch_add(total, v, __ATOMIC_RELAXED);
+}
+
+static inline void stat_max(time_t *max, time_t v)
+{
+	time_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while ((v > old) && !__atomic_compare_exchange_n(max, &old, v, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void stat_min(time_t *min, time_t v)
+{
+	time_t old = __atomic_load_n(min, __ATOMIC_RELAXED);
+
+	while (((old == 0) || (v < old)) &&
+	       !__atomic_compare_exchange_n(min, &old, v, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void dev_set_status(struct cblk_dev *c,
+				enum cblk_status status)
+{
+	/* block_trace("  [%s] device new status is %s\n", __func__,
+		cblk_status_str[status]); */
+	c->status = status;
+}
+
+/*
+ * Action Write and Read are 32 bit MMIO
+ *
+ * Note:
+ *   Adding pthread_setcancelstate() since the simulation version of
+ *   libcxl is not really thead safe and keeps locks when interrupted
+ *   with pthread_cancel(). That can lead to deadlocks. Marking the
+ *   critical section as non-cancelable prevents this.
+ */
+static int __cblk_write(struct cblk_dev *c, uint32_t addr, uint32_t data)
+{
+	int rc, oldstate;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	rc = snap_mmio_write32(c->card, (uint64_t)addr, data);
+	if (0 != rc)
+		fprintf(stderr, "err: Write MMIO 32 Err %d\n", rc);
+	pthread_setcancelstate(oldstate, NULL);
+	return rc;
+}
+
+
+/* Action or Kernel Write and Read are 32 bit MMIO */
+static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
+{
+	int rc, oldstate;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+#ifdef CONFIG_MMIO32_NOHWSYNC
+	rc = snap_mmio_read32_nohwsync(c->card, (uint64_t)addr, data);
+#else
+	rc = snap_mmio_read32(c->card, (uint64_t)addr, data);
+#endif
+	if (0 != rc)
+		fprintf(stderr, "err: Read MMIO 32 Err %d\n", rc);
+
+	pthread_setcancelstate(oldstate, NULL);
+	return rc;
+}
+
+static void req_setup(struct cblk_req *req,
+		uint32_t action_code,
+		uint64_t dst,
+		uint64_t src,
+		uint32_t size)
+{
+	req->action = action_code | (req->slot << 8);
+	req->dst = dst;
+	req->src = src;
+	req->size = size;
+	req->tries = 0;
+}
+
+/*
+ * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
+ *       byte block.
+ */
+static void req_start(struct cblk_req *req, struct cblk_dev *c)
+{
+	uint8_t action_code = req->action & 0x00ff;
+	int slot = req->slot;
+
+	req->tries++;
+	snap_tev(SNAP_TEV_BLK_HW_REQ, slot, req->lba);
+
+	pthread_mutex_lock(&c->dev_lock);
+
+	__cblk_write(c, ACTION_CONFIG,    req->action);
+	__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
+	__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
+	__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
+	__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
+	__cblk_write(c, ACTION_CNT,       req->size);
+
+	/* Wait for Action to go back to Idle */
+	snap_action_start(c->act);
+	gettimeofday(&req->stime, NULL);
+	gettimeofday(&req->h_stime, NULL);
 
 	/*
 	 * Update statistics under device lock.
@@ -911,26 +1404,35 @@ static void stat_req_dump(struct cblk_dev *c)
 }
 
 /**
- * Allocate a free slot for reading. Numbers will go from 0..15.
+ * Allocate a free slot for reading. Numbers will go from 0..nslots-1.
  * Updates work_in_flight and sets the request status to CBLK_READING/WRITING.
  * Returns NULL if no free request is available. Assumes that
- * requests can be completed out of order, so it searches all available
- * blocks. Holds the device lock temporarily to sync updating the
- * internal device status. Sets c->idx to enable round robin searching
- * for a free slot.
+ * requests can be completed out of order. busy_sem counts the free
+ * slots, c->slot_free tells which ones they are; neither needs the
+ * device lock. With nowait set, it returns NULL and errno EAGAIN
+ * instead of waiting for a slot.
  */
 static struct cblk_req *get_req(struct cblk_dev *c,
 				int use_wait_sem,
 				off_t lba, size_t nblocks,
-				int is_write)
+				int is_write, int nowait)
 {
-	int i, slot;
+	int slot;
+	unsigned long bits;
 	struct cblk_req *req;
 
 	while (c->status == CBLK_READY) {
 		int rc;
 		struct timespec ts;
 
+		if (nowait) {
+			if (sem_trywait(&c->busy_sem) == -1) {
+				errno = EAGAIN;
+				return NULL;
+			}
+			goto got_slot;
+		}
+
 		clock_gettime(CLOCK_REALTIME, &ts);
 		ts.tv_sec += cblk_busytimeout;
 	retry:
@@ -947,6 +1449,7 @@ static struct cblk_req *get_req(struct cblk_dev *c,
 			fprintf(stderr, "[%s] warn: sem_timedwait returned rc=%d %s\n",
 				__func__, rc, strerror(errno));
 		}
+	got_slot:
 
 		/* Check if device is still healthy after waiting */
 		if (c->status != CBLK_READY) {
@@ -957,30 +1460,20 @@ static struct cblk_req *get_req(struct cblk_dev *c,
 			return NULL;
 		}
 
-		pthread_mutex_lock(&c->dev_lock);
-
-		for (i = 0; i < CBLK_IDX_MAX; i++) {
-			slot = c->idx;			/* try next slot */
-
+		bits = slots_claim(c, 1);
+		if (bits != 0) {		/* nice it is free */
+			slot = __builtin_ctzl(bits);
 			req = &c->req[slot];
-			if (req->status == CBLK_IDLE) {	/* nice it is free */
-				block_trace("[%s] GIVE OUT WRITE slot %u LBA=%ld\n",
-					__func__, slot, lba);
-
-				gettimeofday(&req->stime, NULL);
-				req->use_wait_sem = use_wait_sem;
-				req->lba = lba;
-				req->nblocks = nblocks;
-				req->is_write = is_write;
-				cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
-
-				inc_work_in_flight(c);
-				pthread_mutex_unlock(&c->dev_lock);
-				return req;
-			}
-			c->idx = (c->idx + 1) % CBLK_IDX_MAX;	/* pick next idx */
+			gettimeofday(&req->stime, NULL);
+			req->use_wait_sem = use_wait_sem;
+			req->lba = lba;
+			req->nblocks = nblocks;
+			req->is_write = is_write;
+			cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
+
+			inc_work_in_flight(c, 1);
+			return req;
 		}
-		pthread_mutex_unlock(&c->dev_lock);
 		fprintf(stderr, "[%s] warn: No IDLE write req for LBA=%ld found!\n",
 			__func__, lba);
 		cblk_req_dump(c);
@@ -989,44 +1482,93 @@ static struct cblk_req *get_req(struct cblk_dev *c,
 	return NULL;
 }
 
+/**
+ * Allocate up to n free slots with one update of the free bitmap.
+ * Waits for the first slot only, and not at all if nowait is set.
+ * The slots are marked READING, the caller fills them in. Returns the
+ * number of slots in reqs, 0 with errno set if there is none.
+ */
+static unsigned int get_reqs(struct cblk_dev *c, struct cblk_req **reqs,
+			     unsigned int n, int nowait)
+{
+	unsigned int i, m, got = 0;
+	unsigned long bits;
+	struct timespec ts;
+
+	if (c->status != CBLK_READY) {
+		errno = EBADFD;
+		return 0;
+	}
+	if (nowait) {
+		if (sem_trywait(&c->busy_sem) == -1) {
+			errno = EAGAIN;
+			return 0;
+		}
+	} else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += cblk_busytimeout;
+		while (sem_timedwait(&c->busy_sem, &ts) == -1)
+			if (errno != EINTR)
+				return 0;
+	}
+	if (c->status != CBLK_READY) {	/* went bad while waiting */
+		sem_post(&c->busy_sem);
+		errno = EBADFD;
+		return 0;
+	}
+	for (m = 1; (m < n) && (sem_trywait(&c->busy_sem) == 0); m++)
+		;
+
+	for (bits = slots_claim(c, m); bits != 0; bits &= bits - 1) {
+		struct cblk_req *req = &c->req[__builtin_ctzl(bits)];
+
+		gettimeofday(&req->stime, NULL);
+		cblk_set_status(req, CBLK_READING);
+		reqs[got++] = req;
+	}
+	if (got)
+		inc_work_in_flight(c, got);
+
+	for (i = got; i < m; i++)	/* give back what we did not use */
+		sem_post(&c->busy_sem);
+	if (got == 0)
+		errno = EIO;
+	return got;
+}
+
 static void put_req(struct cblk_dev *c, struct cblk_req *req)
 {
 	unsigned int i;
 	time_t usecs;
 
-	pthread_mutex_lock(&c->dev_lock);
 	gettimeofday(&req->etime, NULL);
 	usecs = timediff_usec(&req->etime, &req->stime);
 
 	if (cblk_is_write(req)) {
-		if (usecs > c->max_write_usecs)
-			c->max_write_usecs = usecs;
-		if ((c->min_write_usecs == 0) || (usecs < c->min_write_usecs))
-			c->min_write_usecs = usecs;
-		c->avg_write_usecs += usecs;
+		stat_max(&c->max_write_usecs, usecs);
+		stat_min(&c->min_write_usecs, usecs);
+		stat_add(&c->avg_write_usecs, usecs);
 	} else {
-		if (usecs > c->max_read_usecs)
-			c->max_read_usecs = usecs;
-		if ((c->min_read_usecs == 0) || (usecs < c->min_read_usecs))
-			c->min_read_usecs = usecs;
-		c->avg_read_usecs += usecs;
+		stat_max(&c->max_read_usecs, usecs);
+		stat_min(&c->min_read_usecs, usecs);
+		stat_add(&c->avg_read_usecs, usecs);
 
 		if (cblk_caching) {
 			for (i = 0; i < ARRAY_SIZE(req->pblock); i++) {
 				cache_unreserve(req->pblock[i], req->lba + i);
 				req->pblock[i] = NULL;
 			}
+			if (req->pinned)
+				req_cache_unpin(req);
 		}
 	}
 
-	if (req->status != CBLK_ERROR)
-		cblk_set_status(req, CBLK_IDLE);
-
 	dec_work_in_flight(c);
+	if (req->status != CBLK_ERROR) {
+		cblk_set_status(req, CBLK_IDLE);
+		slot_release(c, req);
+	}
 	sem_post(&c->busy_sem);
-
-	/* FIXME Should we do the sem_post(&c->busy_sem); here? */
-	pthread_mutex_unlock(&c->dev_lock);
 }
 
 /**
@@ -1077,13 +1619,7 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 	slot = status & ACTION_STATUS_COMPLETION_MASK;
 	req = &c->req[slot];
 
-	if (status == ACTION_STATUS_WRITE_COMPLETED) {
-		block_trace("    [%s] HW WRITE_COMPLETED %08x slot: %d LBA=%ld\n",
-			__func__, status, slot, req->lba);
-	} else {
-		block_trace("    [%s] HW READ_COMPLETED %08x slot: %d LBA=%ld\n",
-			__func__, status, slot, req->lba);
-	}
+	snap_tev(SNAP_TEV_BLK_HW_DONE, slot, req->lba);
 
 	/* statistics: figure out hardware completion time ... */
 	gettimeofday(&req->h_etime, NULL);
@@ -1139,7 +1675,8 @@ static int check_req_timeouts(struct cblk_dev *c, long int timeout_sec)
 						"ACTION_ERROR_BITS=%08x\n",
 						__func__, i, errbits);
 
-				if (req->use_wait_sem)
+				/* async ones are completed after dropping the lock */
+				if (req->use_wait_sem && (req->atag == NULL))
 					sem_post(&req->wait_sem);
 			} else {
 				/* FIXME Helps but is not optimal ... */
@@ -1185,24 +1722,23 @@ static int __prefetch_read_start(struct cblk_dev *c, off_t lba,
 	/* Check if the block is already in cache or requested */
 	status = cache_info(lba);
 	if ((status == CACHE_BLOCK_VALID) || (status == CACHE_BLOCK_READING)) {
-		block_trace("[%s] skip prefetch LBA=%lu %d KiB status=%s\n",
-			__func__, lba, mem_size/1024, block_status_str[status]);
+		snap_tev(SNAP_TEV_BLK_PREFETCH_SKIP, lba, status);
 		c->prefetch_collisions++;
 		return -2;
 	}
 
-	block_trace("[%s] do prefetch LBA=%lu %d KiB status=%s\n",
-		__func__, lba, mem_size/1024, block_status_str[status]);
+	snap_tev(SNAP_TEV_BLK_PREFETCH, lba, mem_size / __CBLK_BLOCK_SIZE);
 
 	/*
 	 * Get a free read slot, we can read CBLK_NBLOCKS_MAX blocks,
 	 * pysically request the block.
 	 */
-	req = get_req(c, 0, lba, nblocks, 0);
+	req = get_req(c, 0, lba, nblocks, 0, 0);
 	if (req == NULL)
 		return -2;
 
 	c->prefetches++;
+	req_cache_reserve(req);
 	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
 		(uint64_t)req->buf,			/* dst */
 		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
@@ -1226,8 +1762,6 @@ static int __prefetch_blocks(struct cblk_dev *c, off_t lba, unsigned int nblocks
 		if (work_in_flight(c) >= CBLK_PREFETCH_THRESHOLD)
 			continue;
 
-		block_trace("[%s] LBA=%ld+(%d)\n",
-			__func__, lba, c->prefetch_offs[k]);
 		rc = __prefetch_read_start(c, lba + c->prefetch_offs[k],
 					nblocks);
 		if (rc >= 0)
@@ -1261,6 +1795,93 @@ static int __read_complete(struct cblk_dev *c,
 	return 0;
 }
 
+/* Called with c->async_m held */
+static void __lio_put(struct cblk_lio *lio)
+{
+	if (--lio->refs == 0)
+		free(lio);
+}
+
+/**
+ * Mark tag as completed. Called with c->async_m held.
+ */
+static void __atag_done(struct cblk_dev *c, struct cblk_atag *a, int err)
+{
+	cblk_arw_status_t *ustatus = a->ustatus;
+
+	if (ustatus != NULL) {
+		ustatus->blocks_transferred = err ? 0 : a->nblocks;
+		ustatus->fail_errno = err;
+		__sync_synchronize();	/* status last, callers poll it */
+		ustatus->status = err ? CBLK_ARW_STATUS_FAIL :
+			CBLK_ARW_STATUS_SUCCESS;
+		if (a->lio != NULL)
+			__lio_put(a->lio);	/* a is gone now */
+		else
+			a->state = CBLK_ATAG_FREE;
+	} else {
+		if (err)
+			a->nblocks = 0;
+		a->err = err;
+		a->state = CBLK_ATAG_DONE;
+	}
+	pthread_cond_broadcast(&c->async_c);
+}
+
+/**
+ * The hardware is done with an async request, or it failed. Copy read
+ * data to the user buffer or update the cache for writes, give the
+ * slot back and post the result to the tag.
+ */
+static void async_complete(struct cblk_dev *c, struct cblk_req *req)
+{
+	int err = 0;
+	unsigned int i;
+	off_t lba = req->lba;
+	size_t nblocks = req->nblocks;
+	int is_write = cblk_is_write(req);
+	struct cblk_atag *a, *next;
+	struct timeval etime;
+	unsigned long usecs;
+
+	pthread_mutex_lock(&c->async_m);
+	a = req->atag;		/* do it once only */
+	req->atag = NULL;
+	pthread_mutex_unlock(&c->async_m);
+	if (a == NULL)
+		return;
+
+	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
+		err = ETIME;
+	} else if (is_write) {
+		for (i = 0; cblk_caching && (i < nblocks); i++)
+			cache_write(lba + i, req->buf + i * __CBLK_BLOCK_SIZE, 0);
+	} else {
+		req_cache_overlay(req);
+		for (next = a; next != NULL; next = next->next)
+			memcpy(next->ubuf, req->buf + next->boff * __CBLK_BLOCK_SIZE,
+			       next->nblocks * __CBLK_BLOCK_SIZE);
+	}
+
+	gettimeofday(&etime, NULL);
+	usecs = timediff_usec(&etime, &req->stime);
+	if (is_write)
+		put_req(c, req);
+	else
+		__read_complete(c, req, 1);
+
+	pp_add_lba(lba, nblocks, usecs, !is_write);
+	snap_tev(is_write ? SNAP_TEV_BLK_WRITE_END : SNAP_TEV_BLK_READ_END,
+		 err ? 0 : nblocks, 0);
+
+	pthread_mutex_lock(&c->async_m);
+	for (; a != NULL; a = next) {
+		next = a->next;		/* a may be reused once done */
+		__atag_done(c, a, err);
+	}
+	pthread_mutex_unlock(&c->async_m);
+}
+
 /**
  * Try to ping process to a specific CPU. Returns the CPU we are
  * currently running on.
@@ -1301,6 +1922,7 @@ static void *completion_thread(void *arg)
 	struct cblk_dev *c = (struct cblk_dev *)arg;
 
 	block_trace("[%s] arg=%p enter\n", __func__, arg);
+	snap_thread_bind_node(snap_card_numa_node(c->card));
 	pthread_cleanup_push(completion_thread_cleanup, c);
 
 	while (1) {
@@ -1309,7 +1931,7 @@ static void *completion_thread(void *arg)
 		struct timespec timeout;
 
 		pthread_mutex_lock(&c->idle_m);
-		while (c->work_in_flight == 0) {
+		while (work_in_flight(c) == 0) {
 			/* 5 sec delay should be noticable ... */
 			gettimeofday(&now, NULL);
 			timeout.tv_sec = now.tv_sec + 5;
@@ -1330,11 +1952,10 @@ static void *completion_thread(void *arg)
 			struct cblk_req *req = &c->req[slot];
 			if ((req->status == CBLK_READING) ||
 			    (req->status == CBLK_WRITING)) {
-				block_trace("  [%s] waking up slot %d LBA=%ld\n",
-					__func__, slot, req->lba);
-
 				cblk_set_status(req, CBLK_READY);
-				if (req->use_wait_sem) {
+				if (req->atag != NULL) {
+					async_complete(c, req);
+				} else if (req->use_wait_sem) {
 					sem_post(&req->wait_sem);
 				} else {
 					__read_complete(c, req, 0);
@@ -1348,7 +1969,13 @@ static void *completion_thread(void *arg)
 			}
 		} else no_result_counter++;
 
-		check_req_timeouts(c, cblk_reqtimeout); /* sec */
+		if (check_req_timeouts(c, cblk_reqtimeout) != 0) { /* sec */
+			unsigned int i;
+
+			for (i = 0; i < ARRAY_SIZE(c->req); i++)
+				if (c->req[i].status == CBLK_ERROR)
+					async_complete(c, &c->req[i]);
+		}
 		pthread_testcancel();	/* go home if requested */
 	}
 
@@ -1356,33 +1983,250 @@ static void *completion_thread(void *arg)
 	return NULL;
 }
 
-static int put_offslist(void *put_data, int *offslist, unsigned int n,
-			size_t nblocks __attribute__((unused)))
+static int lba_cmp(const void *_a, const void *_b)
 {
-	struct cblk_dev *c = (struct cblk_dev *)put_data;
-
-	if (offslist == NULL) {
-		block_trace("[%s] warn: no offset list provided!\n", __func__);
-		return -1;
-	}
+	off_t a = *(const off_t *)_a, b = *(const off_t *)_b;
 
-	pthread_mutex_lock(&c->dev_lock);
-	memcpy(c->prefetch_offs, offslist, n * sizeof(int));
-	pthread_mutex_unlock(&c->dev_lock);
-	return 0;
+	return (a > b) - (a < b);
 }
 
-chunk_id_t cblk_open(const char *path,
-		int max_num_requests __attribute__((unused)),
-		int mode, uint64_t ext_arg __attribute__((unused)),
-		int flags)
-{
-	int rc;
-	unsigned int i, j;
-	int timeout = ACTION_WAIT_TIME;
-	unsigned long have_nvme = 0;
-	snap_action_flag_t attach_flags = 0;
-	struct cblk_dev *c = &chunk;
+/*
+ * Write the dirty blocks back. Neighbouring blocks are merged up to
+ * CBLK_NBLOCKS_WRITE_MAX per command and up to CBLK_WB_BATCH commands
+ * are in flight. A block rewritten while being flushed stays dirty for
+ * the next pass. Returns 0, or -1 with errno set if a write failed or
+ * the device failed before all blocks were written. Running out of
+ * slots for a while is not an error, the blocks are tried again.
+ */
+#define CBLK_WB_BATCH	8
+
+static int cache_flush(struct cblk_dev *c)
+{
+	int rc = 0;
+	unsigned int i, j, k, n = 0, nreqs, max_reqs;
+	unsigned int wgen[CBLK_WB_BATCH][CBLK_NBLOCKS_WRITE_MAX];
+	struct cblk_req *reqs[CBLK_WB_BATCH];
+	off_t *lbas = cache_dirty_lbas;
+
+	pthread_mutex_lock(&c->wb_flush_m);
+
+	for (i = 0; i < cache_sets; i++) {
+		struct cache_entry *entry = &cache_entries[i];
+
+		if (entry->dirty == 0)
+			continue;
+
+		pthread_mutex_lock(&entry->way_lock);
+		for (j = 0; j < CACHE_WAYS; j++)
+			if (entry->way[j].dirty)
+				lbas[n++] = entry->way[j].lba;
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+	qsort(lbas, n, sizeof(*lbas), lba_cmp);
+
+	max_reqs = MAX(MIN(c->nslots / 2, (unsigned int)CBLK_WB_BATCH), 1U);
+	for (i = 0; i < n; ) {
+		for (nreqs = 0; (nreqs < max_reqs) && (i < n); ) {
+			struct cblk_req *req;
+			off_t lba = lbas[i];
+
+			for (k = 1; (k < CBLK_NBLOCKS_WRITE_MAX) &&
+				     (i + k < n) && (lbas[i + k] == lba + k); k++)
+				;
+
+			req = get_req(c, 1, lba, k, 1, 0);
+			if (req == NULL)
+				break;	/* no slot in time, try again */
+			for (j = 0; j < k; j++)
+				if (cache_snapshot(lba + j, req->buf +
+						   j * __CBLK_BLOCK_SIZE,
+						   &wgen[nreqs][j]) != 0)
+					break;
+			if (j != k) {	/* cleaned meanwhile, not expected */
+				put_req(c, req);
+				i++;
+				continue;
+			}
+
+			req_setup(req, ACTION_CONFIG_COPY_HN, /* Host DDR to NVMe */
+				lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* dst */
+				(uint64_t)req->buf,		      /* src */
+				k * __CBLK_BLOCK_SIZE);		      /* size */
+			req_start(req, c);
+			reqs[nreqs++] = req;
+			i += k;
+		}
+
+		for (j = 0; j < nreqs; j++) {
+			struct cblk_req *req = reqs[j];
+
+			while (req->status == CBLK_WRITING)
+				sem_wait(&req->wait_sem);
+
+			if ((c->status == CBLK_ERROR) ||
+			    (req->status == CBLK_ERROR)) {
+				rc = -1;
+			} else {
+				for (k = 0; k < req->nblocks; k++)
+					cache_clean(req->lba + k, wgen[j][k]);
+				__atomic_fetch_add(&c->wb_flushed,
+					req->nblocks, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&c->wb_cmds, 1,
+					__ATOMIC_RELAXED);
+			}
+			put_req(c, req);
+		}
+
+		pthread_mutex_lock(&c->wb_m);
+		pthread_cond_broadcast(&c->wb_done);
+		pthread_mutex_unlock(&c->wb_m);
+
+		if ((c->status != CBLK_READY) && (i < n)) {
+			rc = -1;	/* nothing will get through */
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&c->wb_flush_m);
+
+	if (rc != 0) {
+		c->wb_err = EIO;
+		errno = EIO;
+	}
+	return rc;
+}
+
+/**
+ * Flushes the dirty blocks in the background, at least every
+ * CONFIG_WRITEBACK_SEC and right away while more than wb_background
+ * are dirty. Writers kick it when they cross that line.
+ */
+static void *writeback_thread(void *arg)
+{
+	long int dirty;
+	struct cblk_dev *c = (struct cblk_dev *)arg;
+	struct timespec ts;
+
+	block_trace("[%s] arg=%p enter\n", __func__, arg);
+	snap_thread_bind_node(snap_card_numa_node(c->card));
+
+	pthread_mutex_lock(&c->wb_m);
+	while (!c->wb_stop) {
+		dirty = __atomic_load_n(&cache_dirty, __ATOMIC_RELAXED);
+		if ((dirty < c->wb_background) || (c->status != CBLK_READY)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += CONFIG_WRITEBACK_SEC;
+			pthread_cond_timedwait(&c->wb_kick, &c->wb_m, &ts);
+			dirty = __atomic_load_n(&cache_dirty, __ATOMIC_RELAXED);
+		}
+		if (c->wb_stop || (c->status != CBLK_READY) || (dirty == 0))
+			continue;
+
+		pthread_mutex_unlock(&c->wb_m);
+		cache_flush(c);
+		pthread_mutex_lock(&c->wb_m);
+	}
+	pthread_mutex_unlock(&c->wb_m);
+	return NULL;
+}
+
+static void writeback_done(struct cblk_dev *c)
+{
+	pthread_cond_destroy(&c->wb_done);
+	pthread_cond_destroy(&c->wb_kick);
+	pthread_mutex_destroy(&c->wb_flush_m);
+	pthread_mutex_destroy(&c->wb_m);
+}
+
+static int writeback_start(struct cblk_dev *c)
+{
+	int rc;
+
+	c->wb_stop = 0;
+	c->wb_err = 0;
+	c->wb_max = MAX((long)cache_sets * CACHE_WAYS * cblk_dirty_ratio / 100,
+			1L);
+	c->wb_background = MAX(c->wb_max / 2, 1L);
+	pthread_mutex_init(&c->wb_m, NULL);
+	pthread_mutex_init(&c->wb_flush_m, NULL);
+	pthread_cond_init(&c->wb_kick, NULL);
+	pthread_cond_init(&c->wb_done, NULL);
+
+	rc = pthread_create(&c->wb_tid, NULL, &writeback_thread, c);
+	if (rc != 0)
+		writeback_done(c);
+	return rc;
+}
+
+static void writeback_stop(struct cblk_dev *c)
+{
+	pthread_mutex_lock(&c->wb_m);
+	c->wb_stop = 1;
+	pthread_cond_broadcast(&c->wb_kick);
+	pthread_mutex_unlock(&c->wb_m);
+
+	pthread_join(c->wb_tid, NULL);
+	c->wb_tid = 0;
+}
+
+/*
+ * Kick the flusher at wb_background dirty blocks, wait for it at the
+ * limit. Returns -1 if it did not make room in time, the caller
+ * writes through then.
+ */
+static int writeback_throttle(struct cblk_dev *c)
+{
+	int rc = 0;
+	long int dirty = __atomic_load_n(&cache_dirty, __ATOMIC_RELAXED);
+	struct timespec ts;
+
+	if (dirty < c->wb_background)
+		return 0;
+
+	pthread_mutex_lock(&c->wb_m);
+	pthread_cond_signal(&c->wb_kick);
+	if (dirty >= c->wb_max) {
+		__atomic_fetch_add(&c->wb_throttled, 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += cblk_busytimeout;
+
+		while ((rc == 0) && (c->status == CBLK_READY) &&
+		       (__atomic_load_n(&cache_dirty, __ATOMIC_RELAXED) >=
+			c->wb_max))
+			rc = pthread_cond_timedwait(&c->wb_done, &c->wb_m, &ts);
+	}
+	pthread_mutex_unlock(&c->wb_m);
+
+	return (rc == 0) ? 0 : -1;
+}
+
+static int put_offslist(void *put_data, int *offslist, unsigned int n,
+			size_t nblocks __attribute__((unused)))
+{
+	struct cblk_dev *c = (struct cblk_dev *)put_data;
+
+	if (offslist == NULL) {
+		block_trace("[%s] warn: no offset list provided!\n", __func__);
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->dev_lock);
+	memcpy(c->prefetch_offs, offslist, n * sizeof(int));
+	pthread_mutex_unlock(&c->dev_lock);
+	return 0;
+}
+
+chunk_id_t cblk_open(const char *path,
+		int max_num_requests,
+		int mode, uint64_t ext_arg __attribute__((unused)),
+		int flags)
+{
+	int rc;
+	unsigned int i, j;
+	int timeout = ACTION_WAIT_TIME;
+	unsigned long have_nvme = 0;
+	snap_action_flag_t attach_flags = 0;
+	struct cblk_dev *c = &chunk;
 
 	block_trace("[%s] opening (%s)\n", __func__, path);
 
@@ -1430,12 +2274,25 @@ chunk_id_t cblk_open(const char *path,
 		goto out_err1;
 	}
 
-	c->buf = snap_malloc(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE * CBLK_NBLOCKS_MAX);
+	/* The card DMAs into the request buffers, keep them node local */
+	c->buf = snap_buf_get_node(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE *
+				   CBLK_NBLOCKS_MAX,
+				   snap_card_numa_node(c->card));
 	if (c->buf == NULL) {
 		fprintf(stderr, "err: Cannot alloc temporary buffer\n");
 		goto out_err2;
 	}
 
+	/* max_num_requests bounds the async requests not harvested yet */
+	c->atag_max = (max_num_requests <= 0) ? CBLK_ATAG_DEFAULT :
+		MAX(max_num_requests, CBLK_ATAG_MIN);
+	c->atag_idx = 0;
+	c->atag = calloc(c->atag_max, sizeof(*c->atag));
+	if (c->atag == NULL) {
+		fprintf(stderr, "err: Cannot alloc async tags\n");
+		goto out_err3;
+	}
+
 	c->status = CBLK_READY;
 	c->req_status = CBLK_IDLE;
 	c->drive = 0;
@@ -1443,7 +2300,9 @@ chunk_id_t cblk_open(const char *path,
 	c->timeout = timeout;
 	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++)
 		c->done_tid[i] = 0;
-	c->idx = 0;
+	c->nslots = cblk_slots;
+	c->slot_free = (1ul << c->nslots) - 1;
+	c->work_in_flight = 0;
 	c->status_read_count = 0;
 	c->cache_hits = 0;
 	c->cache_hits_4k = 0;
@@ -1472,9 +2331,20 @@ chunk_id_t cblk_open(const char *path,
 	c->rtime_total.tv_usec = 0;
 	gettimeofday(&c->start_time, NULL);
 
-	sem_init(&c->busy_sem, 0, CBLK_IDX_MAX);
+	sem_init(&c->busy_sem, 0, c->nslots);
 	pthread_mutex_init(&c->idle_m, NULL);
 	pthread_cond_init(&c->idle_c, NULL);
+	pthread_mutex_init(&c->async_m, NULL);
+	pthread_cond_init(&c->async_c, NULL);
+	c->block_areads = 0;
+	c->block_awrites = 0;
+	c->aresult_no_cmplt = 0;
+	c->listio_ios = 0;
+	c->listio_cmds = 0;
+	c->wb_blocks = 0;
+	c->wb_flushed = 0;
+	c->wb_cmds = 0;
+	c->wb_throttled = 0;
 
 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
 		struct cblk_req *req = &c->req[i];
@@ -1489,6 +2359,8 @@ chunk_id_t cblk_open(const char *path,
 		req->size = 0;
 		req->tries = 0;
 		req->err_total = 0;
+		req->atag = NULL;
+		req->pinned = 0;
 		cblk_set_status(req, CBLK_IDLE);
 		sem_init(&req->wait_sem, 0, 0);
 
@@ -1508,15 +2380,26 @@ chunk_id_t cblk_open(const char *path,
 	if (rc != 0)
 		goto out_err4;
 
+	if (cblk_writeback) {
+		rc = writeback_start(c);
+		if (rc != 0)
+			goto out_err5;
+	}
+
 	rc = pp_init(cblk_prefetch, put_offslist, cblk_nblocks, c);
 	if (rc != 0)
-		goto out_err5;
+		goto out_err6;
 
 	pp_get_offslist(c->prefetch_offs, cblk_prefetch, cblk_nblocks);
 
 	pthread_mutex_unlock(&c->dev_lock);
 	return 0;
 
+ out_err6:
+	if (cblk_writeback) {
+		writeback_stop(c);
+		writeback_done(c);
+	}
  out_err5:
 	cache_done();
  out_err4:
@@ -1528,7 +2411,9 @@ chunk_id_t cblk_open(const char *path,
 		c->done_tid[i] = 0;
 	}
  out_err3:
-	__free(c->buf);
+	__free(c->atag);
+	c->atag = NULL;
+	snap_buf_put(c->buf);
 	c->buf = NULL;
  out_err2:
 	snap_detach_action(c->act);
@@ -1548,7 +2433,7 @@ chunk_id_t cblk_open(const char *path,
 int cblk_close(chunk_id_t id __attribute__((unused)),
 		int flags __attribute__((unused)))
 {
-	int rc;
+	int rc, err = 0;
 	unsigned int i;
 	struct cblk_dev *c = &chunk;
 	struct timeval etime;
@@ -1558,6 +2443,16 @@ int cblk_close(chunk_id_t id __attribute__((unused)),
 		return -1;
 	}
 
+	if (cblk_writeback) {		/* completions are still needed */
+		writeback_stop(c);
+		if ((cache_flush(c) != 0) || (c->wb_err != 0)) {
+			fprintf(stderr, "[%s] err: dirty blocks lost!\n",
+				__func__);
+			err = EIO;
+		}
+		writeback_done(c);	/* cache_flush() is the last user */
+	}
+
 	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
 		if (c->done_tid[i] == 0)
 			continue;
@@ -1587,9 +2482,13 @@ int cblk_close(chunk_id_t id __attribute__((unused)),
 	}
 
         pthread_cond_destroy(&c->idle_c);
+	pthread_cond_destroy(&c->async_c);
 	snap_detach_action(c->act);
 	snap_card_free(c->card);
-	__free(c->buf);
+	snap_buf_put(c->buf);
+	c->buf = NULL;
+	__free(c->atag);
+	c->atag = NULL;
 
 	c->act = NULL;
 	c->card = NULL;
@@ -1599,6 +2498,11 @@ int cblk_close(chunk_id_t id __attribute__((unused)),
 
 	cache_done();
 	pp_done();
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
 	return 0;
 }
 
@@ -1634,9 +2538,6 @@ static int block_read(struct cblk_dev *c, void *buf, off_t lba,
 	struct cblk_req *req;
 	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
 
-	block_trace("[%s] reading (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
-
 	if (c->status != CBLK_READY) {	/* device in fatal error */
 		errno = EBADFD;
 		return -1;
@@ -1652,7 +2553,7 @@ static int block_read(struct cblk_dev *c, void *buf, off_t lba,
 		errno = EFAULT;
 		return -1;
 	}
-	req = get_req(c, 1, lba, nblocks, 0);
+	req = get_req(c, 1, lba, nblocks, 0, 0);
 	if (req == NULL)
 		return -1;
 
@@ -1661,6 +2562,7 @@ static int block_read(struct cblk_dev *c, void *buf, off_t lba,
 		return -1;
 	}
 
+	req_cache_reserve(req);
 	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
 		(uint64_t)req->buf,			/* dst */
 		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
@@ -1680,8 +2582,10 @@ static int block_read(struct cblk_dev *c, void *buf, off_t lba,
 	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
 		errno = ETIME;
 		nblocks = 0;
-	} else
+	} else {
+		req_cache_overlay(req);
 		memcpy(buf, req->buf, nblocks * __CBLK_BLOCK_SIZE);
+	}
 
 	__read_complete(c, req, 1);	/* mark as used one time */
 	return nblocks;
@@ -1717,8 +2621,6 @@ static int __cache_try_read(struct cblk_dev *c __attribute__((unused)),
 				continue;	/* Try again */
 			}
 			if (rc == 0) {		/* Success */
-				block_trace("    [%s] got LBA=%ld after %ld usecs\n",
-					__func__, lba + i, usecs);
 				from_cache++;
 				break;
 			}
@@ -1732,9 +2634,6 @@ static int __cache_try_read(struct cblk_dev *c __attribute__((unused)),
 
  out:
 	if (!prefetch_requested && (nblocks == from_cache)) {
-		block_trace("    [%s] trigger prefetching for LBA=%ld "
-			"nblocks=%ld from_cache=%ld\n",
-			__func__, lba, nblocks, from_cache);
 		__prefetch_blocks(c, lba, nblocks);
 		prefetch_requested = 1;
 	}
@@ -1751,6 +2650,7 @@ int cblk_read(chunk_id_t id __attribute__((unused)),
 	unsigned long usecs = 0;
 
 	gettimeofday(&start_time, NULL);
+	snap_tev(SNAP_TEV_BLK_READ, lba, nblocks);
 
 	c->block_reads++;
 	if (nblocks == 1)
@@ -1762,14 +2662,13 @@ int cblk_read(chunk_id_t id __attribute__((unused)),
 
 		/* ... we don't need to ask the NVMe hardware */
 		if (rc == (int)nblocks) {
-			block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
-				lba, lba + nblocks - 1);
-
 			c->cache_hits++;
 			if (nblocks == 1)
 				c->cache_hits_4k++;
+			snap_tev(SNAP_TEV_BLK_CACHE_HIT, lba, 0);
 			goto out;
 		}
+		snap_tev(SNAP_TEV_BLK_CACHE_MISS, lba, 0);
 	}
 
 	/* Else read them all for simplicity at this point in time ... */
@@ -1778,6 +2677,7 @@ out:
 	gettimeofday(&end_time, NULL);
 	usecs = timediff_usec(&end_time, &start_time);
 	pp_add_lba(lba, nblocks, usecs, 1);
+	snap_tev(SNAP_TEV_BLK_READ_END, rc, 0);
 
 	return rc;
 }
@@ -1788,9 +2688,6 @@ static int block_write(struct cblk_dev *c, void *buf, off_t lba,
 	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
 	struct cblk_req *req;
 
-	block_trace("[%s] writing (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
-
 	if (c->status != CBLK_READY) {	/* device in fatal error */
 		errno = EBADFD;
 		return 0;
@@ -1807,7 +2704,7 @@ static int block_write(struct cblk_dev *c, void *buf, off_t lba,
 		errno = EFAULT;
 		return 0;
 	}
-	req = get_req(c, 1, lba, nblocks, 1);
+	req = get_req(c, 1, lba, nblocks, 1, 0);
 	if (req == NULL)
 		return 0;
 
@@ -1817,6 +2714,7 @@ static int block_write(struct cblk_dev *c, void *buf, off_t lba,
 	}
 
 	memcpy(req->buf, buf, nblocks * __CBLK_BLOCK_SIZE);
+	req_cache_redirty(req);
 	req_setup(req, ACTION_CONFIG_COPY_HN,		/* NVMe to Host DDR */
 		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
 		(uint64_t)req->buf,			/* src */
@@ -1846,37 +2744,680 @@ int cblk_write(chunk_id_t id __attribute__((unused)),
 		int flags __attribute__((unused)))
 {
 	int rc;
-	unsigned  int i;
+	unsigned  int i, done = 0;
 	struct cblk_dev *c = &chunk;
 	struct timeval start_time, end_time;
 	time_t usecs;
 
 	gettimeofday(&start_time, NULL);
+	snap_tev(SNAP_TEV_BLK_WRITE, lba, nblocks);
 
 	c->block_writes++;
 	if (nblocks == 1)
 		c->block_writes_4k++;
 
-	nblocks = block_write(&chunk, buf, lba, nblocks);
+	/* Write-back: just keep the blocks dirty in the cache */
+	if (cblk_writeback && (c->status == CBLK_READY) && (lba >= 0) &&
+	    (nblocks <= CBLK_NBLOCKS_WRITE_MAX) &&
+	    (lba + nblocks <= c->nblocks) && (writeback_throttle(c) == 0)) {
+		for (done = 0; done < nblocks; done++)
+			if (cache_write_dirty(lba + done, buf +
+					done * __CBLK_BLOCK_SIZE) != 0)
+				break;	/* no room, write the rest through */
+		__atomic_fetch_add(&c->wb_blocks, done, __ATOMIC_RELAXED);
+		if (done == nblocks)
+			goto out;
+	}
+
+	nblocks = done + block_write(&chunk, buf + done * __CBLK_BLOCK_SIZE,
+				     lba + done, nblocks - done);
 
 	if (cblk_caching) {
-		for (i = 0; i < nblocks; i++) {
+		for (i = done; i < nblocks; i++) {
 			rc = cache_write(lba + i, buf + i * __CBLK_BLOCK_SIZE, 0);
 			if (rc != 0) {
 				dfprintf(stderr, "err: cache_write LBA=%ld "
 					"failed rc=%d!\n", (long int)lba, rc);
+				snap_tev(SNAP_TEV_BLK_WRITE_END, rc, 0);
 				return 0;
 			}
 		}
 	}
 
+ out:
 	gettimeofday(&end_time, NULL);
 	usecs = timediff_usec(&end_time, &start_time);
 	pp_add_lba(lba, nblocks, usecs, 0);
+	snap_tev(SNAP_TEV_BLK_WRITE_END, nblocks, 0);
 
 	return nblocks;
 }
 
+/**
+ * Write the dirty blocks of the write-back cache to the device. Returns
+ * 0, or -1 with errno set if a flush failed since the last call.
+ */
+int cblk_sync(chunk_id_t id __attribute__((unused)),
+	      int flags __attribute__((unused)))
+{
+	int err;
+	struct cblk_dev *c = &chunk;
+
+	if (c->card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!cblk_writeback)
+		return 0;
+
+	cache_flush(c);
+	err = c->wb_err;
+	c->wb_err = 0;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Serve a read entirely from the cache. Does not wait for blocks in
+ * flight, the async calls must not block. Returns 1 on a hit.
+ */
+static int async_cache_hit(struct cblk_dev *c, void *buf, off_t lba,
+			   size_t nblocks)
+{
+	size_t i;
+
+	for (i = 0; i < nblocks; i++) {
+		if (cache_read(lba + i, buf + i * __CBLK_BLOCK_SIZE) != 0) {
+			snap_tev(SNAP_TEV_BLK_CACHE_MISS, lba, 0);
+			return 0;
+		}
+	}
+	c->cache_hits++;
+	if (nblocks == 1)
+		c->cache_hits_4k++;
+	snap_tev(SNAP_TEV_BLK_CACHE_HIT, lba, 0);
+	pp_add_lba(lba, nblocks, 0, 1);
+	__prefetch_blocks(c, lba, nblocks);
+	return 1;
+}
+
+/*
+ * Take a free tag. Without wait, -1 and EAGAIN is returned if all tags
+ * are in use, that is pending or not yet harvested.
+ */
+static struct cblk_atag *atag_get(struct cblk_dev *c, int wait)
+{
+	int rc = 0;
+	unsigned int i;
+	struct cblk_atag *a;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += cblk_busytimeout;
+
+	pthread_mutex_lock(&c->async_m);
+	while (c->status == CBLK_READY) {
+		for (i = 0; i < c->atag_max; i++) {
+			a = &c->atag[c->atag_idx];
+			c->atag_idx = (c->atag_idx + 1) % c->atag_max;
+			if (a->state == CBLK_ATAG_FREE) {
+				a->state = CBLK_ATAG_PENDING;
+				pthread_mutex_unlock(&c->async_m);
+				return a;
+			}
+		}
+		if (!wait || (rc == ETIMEDOUT))
+			break;
+		rc = pthread_cond_timedwait(&c->async_c, &c->async_m, &ts);
+	}
+	pthread_mutex_unlock(&c->async_m);
+
+	errno = (c->status != CBLK_READY) ? EBADFD :
+		(rc == ETIMEDOUT) ? ETIMEDOUT : EAGAIN;
+	return NULL;
+}
+
+static void atag_put(struct cblk_dev *c, struct cblk_atag *a)
+{
+	pthread_mutex_lock(&c->async_m);
+	a->state = CBLK_ATAG_FREE;
+	pthread_cond_broadcast(&c->async_c);
+	pthread_mutex_unlock(&c->async_m);
+}
+
+/*
+ * Async requests use the same slots as the blocking calls. The tag is
+ * an index into c->atag unless the caller brings its own. Without
+ * CBLK_ARW_WAIT_CMD_FLAGS -1 and EAGAIN is returned if no tag or no
+ * slot is free.
+ */
+static int async_start(struct cblk_dev *c, void *buf, off_t lba,
+			size_t nblocks, int *tag, cblk_arw_status_t *status,
+			int flags, int is_write)
+{
+	int err;
+	struct cblk_atag *a;
+	struct cblk_req *req;
+	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
+	int wait = (flags & CBLK_ARW_WAIT_CMD_FLAGS) ? 1 : 0;
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return -1;
+	}
+	if ((lba < 0) || (lba + nblocks > c->nblocks)) { /* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, c->nblocks);
+		errno = EFAULT;
+		return -1;
+	}
+	if ((nblocks == 0) || (nblocks > (is_write ? CBLK_NBLOCKS_WRITE_MAX :
+					   CBLK_NBLOCKS_MAX))) {
+		fprintf(stderr, "[%s] err: %zu blocks not supported!\n",
+			__func__, nblocks);
+		errno = EFAULT;
+		return -1;
+	}
+	if (((flags & CBLK_ARW_USER_STATUS_FLAG) && (status == NULL)) ||
+	    (!(flags & CBLK_ARW_USER_STATUS_FLAG) && (tag == NULL)) ||
+	    ((flags & CBLK_ARW_USER_TAG_FLAG) && (tag == NULL))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	a = atag_get(c, wait);
+	if (a == NULL)
+		return -1;
+
+	a->user_tag = (flags & CBLK_ARW_USER_TAG_FLAG) ? 1 : 0;
+	a->tag = a->user_tag ? *tag : (int)(a - c->atag);
+	a->ubuf = buf;
+	a->nblocks = nblocks;
+	a->boff = 0;
+	a->next = NULL;
+	a->lio = NULL;
+	a->ustatus = NULL;
+	if (flags & CBLK_ARW_USER_STATUS_FLAG) {
+		status->status = CBLK_ARW_STATUS_PENDING;
+		status->blocks_transferred = 0;
+		status->fail_errno = 0;
+		a->ustatus = status;
+	}
+	if (tag != NULL)
+		*tag = a->tag;
+
+	if (is_write) {
+		c->block_awrites++;
+		snap_tev(SNAP_TEV_BLK_WRITE, lba, nblocks);
+	} else {
+		c->block_areads++;
+		snap_tev(SNAP_TEV_BLK_READ, lba, nblocks);
+	}
+
+	if (!is_write && cblk_caching &&
+	    async_cache_hit(c, buf, lba, nblocks)) {
+		pthread_mutex_lock(&c->async_m);
+		__atag_done(c, a, 0);
+		pthread_mutex_unlock(&c->async_m);
+		return 0;
+	}
+
+	req = get_req(c, 1, lba, nblocks, is_write, !wait);
+	if (req == NULL)
+		goto out_put_atag;
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		put_req(c, req);
+		errno = EBADFD;
+		goto out_put_atag;
+	}
+
+	req->atag = a;
+	if (is_write) {
+		memcpy(req->buf, buf, nblocks * __CBLK_BLOCK_SIZE);
+		req_cache_redirty(req);
+		req_setup(req, ACTION_CONFIG_COPY_HN,	/* Host DDR to NVMe */
+			lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
+			(uint64_t)req->buf,			/* src */
+			mem_size);				/* size */
+		req_start(req, c);
+		return 0;
+	}
+
+	req_cache_reserve(req);
+	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
+		(uint64_t)req->buf,			/* dst */
+		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+		mem_size);				/* size */
+	req_start(req, c);
+
+	__prefetch_blocks(c, lba, nblocks);
+	return 0;
+
+ out_put_atag:
+	err = errno;
+	atag_put(c, a);
+	errno = err;
+	return -1;
+}
+
+int cblk_aread(chunk_id_t id __attribute__((unused)),
+		void *buf, cflash_offset_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	return async_start(&chunk, buf, lba, nblocks, tag, status, flags, 0);
+}
+
+int cblk_awrite(chunk_id_t id __attribute__((unused)),
+		void *buf, cflash_offset_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	return async_start(&chunk, buf, lba, nblocks, tag, status, flags, 1);
+}
+
+/**
+ * Lookup the tag, or with CBLK_ARESULT_NEXT_TAG any DONE one. Tags
+ * posting to a user status are not harvested here. Called with
+ * c->async_m held. *pending counts the tags which may still match.
+ */
+static struct cblk_atag *atag_find(struct cblk_dev *c, int tag, int flags,
+				   unsigned int *pending)
+{
+	unsigned int i;
+	int user_tag = (flags & CBLK_ARESULT_USER_TAG) ? 1 : 0;
+
+	*pending = 0;
+	for (i = 0; i < c->atag_max; i++) {
+		struct cblk_atag *a = &c->atag[i];
+
+		if ((a->state == CBLK_ATAG_FREE) || (a->ustatus != NULL))
+			continue;
+
+		if (flags & CBLK_ARESULT_NEXT_TAG) {
+			if (a->state == CBLK_ATAG_DONE)
+				return a;
+			(*pending)++;
+			continue;
+		}
+		if ((a->user_tag == user_tag) && (a->tag == tag))
+			return a;
+	}
+	return NULL;
+}
+
+/**
+ * Returns the number of blocks transferred, 0 if the request did not
+ * complete yet and CBLK_ARESULT_BLOCKING is not set, or -1 with errno
+ * set. *status gets the errno of the request, 0 on success. The
+ * completion thread always pulls completions from the card, so
+ * CBLK_ARESULT_NO_HARVEST does not change anything here.
+ */
+int cblk_aresult(chunk_id_t id __attribute__((unused)),
+		int *tag, uint64_t *status, int flags)
+{
+	int rc, err;
+	unsigned int pending;
+	struct cblk_dev *c = &chunk;
+	struct cblk_atag *a;
+
+	if ((tag == NULL) || (c->atag == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->async_m);
+	while (1) {
+		a = atag_find(c, *tag, flags, &pending);
+		if ((a != NULL) && (a->state == CBLK_ATAG_DONE))
+			break;
+		if ((a == NULL) && (pending == 0)) {
+			pthread_mutex_unlock(&c->async_m);
+			errno = EINVAL;	/* no such request */
+			return -1;
+		}
+		if (!(flags & CBLK_ARESULT_BLOCKING)) {
+			c->aresult_no_cmplt++;
+			pthread_mutex_unlock(&c->async_m);
+			return 0;
+		}
+		pthread_cond_wait(&c->async_c, &c->async_m);
+	}
+
+	if (flags & CBLK_ARESULT_NEXT_TAG)
+		*tag = a->tag;
+	err = a->err;
+	rc = err ? -1 : (int)a->nblocks;
+	a->state = CBLK_ATAG_FREE;
+	pthread_cond_broadcast(&c->async_c);
+	pthread_mutex_unlock(&c->async_m);
+
+	if (status != NULL)
+		*status = err;
+	if (err)
+		errno = err;
+	return rc;
+}
+
+static int lio_valid(struct cblk_dev *c, cblk_io_t *io)
+{
+	size_t max;
+
+	if (io->request_type == CBLK_IO_TYPE_READ)
+		max = CBLK_NBLOCKS_MAX;
+	else if (io->request_type == CBLK_IO_TYPE_WRITE)
+		max = CBLK_NBLOCKS_WRITE_MAX;
+	else
+		return 0;
+
+	return (io->buf != NULL) && (io->nblocks != 0) &&
+		(io->nblocks <= max) && (io->lba >= 0) &&
+		(io->lba + io->nblocks <= c->nblocks);
+}
+
+/* Order by type and LBA such that adjacent blocks end up next to each other */
+static int lio_cmp(const void *_a, const void *_b)
+{
+	const cblk_io_t *a = *(cblk_io_t * const *)_a;
+	const cblk_io_t *b = *(cblk_io_t * const *)_b;
+
+	if (a->request_type != b->request_type)
+		return a->request_type - b->request_type;
+	if (a->lba != b->lba)
+		return (a->lba < b->lba) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Returns the end of the command starting at ios[j]: following ios of
+ * the same type continuing at the next LBA are merged, as long as the
+ * hardware takes the size.
+ */
+static unsigned int lio_cmd_end(cblk_io_t **ios, unsigned int j,
+				unsigned int n)
+{
+	unsigned int e;
+	cblk_io_t *io = ios[j];
+	size_t nb = io->nblocks;
+	size_t max = (io->request_type == CBLK_IO_TYPE_WRITE) ?
+		CBLK_NBLOCKS_WRITE_MAX : CBLK_NBLOCKS_MAX;
+
+	for (e = j + 1; e < n; e++) {
+		if ((ios[e]->request_type != io->request_type) ||
+		    (ios[e]->lba != io->lba + (off_t)nb) ||
+		    (nb + ios[e]->nblocks > max))
+			break;
+		nb += ios[e]->nblocks;
+	}
+	return e;
+}
+
+/*
+ * Start one command for ios[j..e-1]. The tags are chained so that the
+ * completion thread hands each io its part of req->buf.
+ */
+static void lio_start(struct cblk_dev *c, struct cblk_req *req,
+		      cblk_io_t **ios, struct cblk_atag *atag,
+		      unsigned int j, unsigned int e)
+{
+	unsigned int i;
+	size_t nb = 0;
+	off_t lba = ios[j]->lba;
+	int is_write = (ios[j]->request_type == CBLK_IO_TYPE_WRITE);
+
+	for (i = j; i < e; i++) {
+		atag[i].boff = nb;
+		atag[i].next = (i + 1 < e) ? &atag[i + 1] : NULL;
+		if (is_write)
+			memcpy(req->buf + nb * __CBLK_BLOCK_SIZE, ios[i]->buf,
+			       ios[i]->nblocks * __CBLK_BLOCK_SIZE);
+		nb += ios[i]->nblocks;
+	}
+
+	req->use_wait_sem = 1;
+	req->lba = lba;
+	req->nblocks = nb;
+	req->is_write = is_write;
+	cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
+	req->atag = &atag[j];
+	c->listio_cmds++;
+
+	if (is_write) {
+		req_cache_redirty(req);
+		req_setup(req, ACTION_CONFIG_COPY_HN,	/* Host DDR to NVMe */
+			lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
+			(uint64_t)req->buf,			/* src */
+			nb * __CBLK_BLOCK_SIZE);		/* size */
+	} else {
+		req_cache_reserve(req);
+		req_setup(req, ACTION_CONFIG_COPY_NH,	/* NVMe to Host DDR */
+			(uint64_t)req->buf,			/* dst */
+			lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+			nb * __CBLK_BLOCK_SIZE);		/* size */
+	}
+	req_start(req, c);
+}
+
+/*
+ * Issue the valid ios of the list. Full cache hits complete right away,
+ * the rest is sorted, merged into commands and started in batches of
+ * free slots. What cannot be started fails with the errno of the slot
+ * allocation.
+ */
+static int lio_issue(struct cblk_dev *c, cblk_io_t *list[], int items,
+		     int flags)
+{
+	int i, err = 0;
+	unsigned int j, k, e, got, nvalid = 0, invalid = 0;
+	unsigned int ncmds = 0;
+	cblk_io_t **ios;
+	struct cblk_lio *lio;
+	struct cblk_req *reqs[CBLK_IDX_MAX];
+	int nowait = (flags & CBLK_LISTIO_WAIT_ISSUE_CMD) ? 0 : 1;
+
+	ios = malloc(items * sizeof(*ios));
+	lio = malloc(sizeof(*lio) + items * sizeof(struct cblk_atag));
+	if ((ios == NULL) || (lio == NULL)) {
+		free(ios);
+		free(lio);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < items; i++) {
+		cblk_io_t *io = list[i];
+
+		if (io == NULL)
+			continue;
+		io->stat.blocks_transferred = 0;
+		io->stat.fail_errno = 0;
+		if (!lio_valid(c, io)) {
+			io->stat.fail_errno = EINVAL;
+			io->stat.status = CBLK_ARW_STATUS_INVALID;
+			invalid++;
+			continue;
+		}
+		if (!(io->flags & CBLK_IO_USER_TAG))
+			io->tag = i;
+		io->stat.status = CBLK_ARW_STATUS_PENDING;
+		c->listio_ios++;
+
+		if (io->request_type == CBLK_IO_TYPE_WRITE) {
+			c->block_awrites++;
+			snap_tev(SNAP_TEV_BLK_WRITE, io->lba, io->nblocks);
+		} else {
+			c->block_areads++;
+			snap_tev(SNAP_TEV_BLK_READ, io->lba, io->nblocks);
+			if (cblk_caching &&
+			    async_cache_hit(c, io->buf, io->lba, io->nblocks)) {
+				io->stat.blocks_transferred = io->nblocks;
+				io->stat.status = CBLK_ARW_STATUS_SUCCESS;
+				continue;
+			}
+		}
+		ios[nvalid++] = io;
+	}
+
+	qsort(ios, nvalid, sizeof(*ios), lio_cmp);
+	lio->refs = nvalid + 1;		/* + ours until everything is issued */
+	for (j = 0; j < nvalid; j++) {
+		struct cblk_atag *a = &lio->atag[j];
+
+		a->state = CBLK_ATAG_PENDING;
+		a->user_tag = (ios[j]->flags & CBLK_IO_USER_TAG) ? 1 : 0;
+		a->tag = ios[j]->tag;
+		a->ubuf = ios[j]->buf;
+		a->ustatus = &ios[j]->stat;
+		a->nblocks = ios[j]->nblocks;
+		a->boff = 0;
+		a->next = NULL;
+		a->lio = lio;
+		a->err = 0;
+	}
+	for (j = 0; j < nvalid; j = lio_cmd_end(ios, j, nvalid))
+		ncmds++;
+
+	for (j = 0; j < nvalid; ) {
+		got = get_reqs(c, reqs, MIN(ncmds, (unsigned int)CBLK_IDX_MAX),
+			       nowait);
+		if (got == 0) {
+			err = errno;
+			break;
+		}
+		for (k = 0; k < got; k++, ncmds--) {
+			e = lio_cmd_end(ios, j, nvalid);
+			lio_start(c, reqs[k], ios, lio->atag, j, e);
+			j = e;
+		}
+	}
+
+	pthread_mutex_lock(&c->async_m);
+	for (; j < nvalid; j++)
+		__atag_done(c, &lio->atag[j], err);
+	__lio_put(lio);
+	pthread_mutex_unlock(&c->async_m);
+	free(ios);
+
+	if (err || invalid) {
+		errno = err ? err : EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait until no io of the list is pending, timeout is in usec, 0 is forever */
+static int lio_wait(struct cblk_dev *c, cblk_io_t *list[], int items,
+		    uint64_t timeout)
+{
+	int i, rc = 0;
+	struct timespec ts;
+
+	if (timeout) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout / 1000000;
+		ts.tv_nsec += (timeout % 1000000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&c->async_m);
+	while (rc == 0) {
+		for (i = 0; i < items; i++)
+			if ((list[i] != NULL) &&
+			    (list[i]->stat.status == CBLK_ARW_STATUS_PENDING))
+				break;
+		if (i == items)
+			break;
+		if (timeout)
+			rc = pthread_cond_timedwait(&c->async_c, &c->async_m, &ts);
+		else
+			pthread_cond_wait(&c->async_c, &c->async_m);
+	}
+	pthread_mutex_unlock(&c->async_m);
+
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+/* Called with c->async_m held */
+static void __lio_collect(cblk_io_t *list[], int items,
+			  cblk_io_t *done[], int max, int *n)
+{
+	int i;
+
+	for (i = 0; (i < items) && (*n < max); i++)
+		if ((list[i] != NULL) &&
+		    (list[i]->stat.status != CBLK_ARW_STATUS_PENDING))
+			done[(*n)++] = list[i];
+}
+
+/**
+ * Issue the ios in issue_io_list with one slot allocation per batch of
+ * free slots. Requests of the same type on adjacent LBAs are merged into
+ * one NVMe command, so the order within one call is not defined. Each io
+ * completes through its stat, like the async calls with
+ * CBLK_ARW_USER_STATUS_FLAG; the tag is its index in the issue list
+ * unless CBLK_IO_USER_TAG is set. CBLK_IO_PRIORITY_REQ is ignored.
+ *
+ * Then waits for the ios in wait_io_list and returns the completed ones
+ * from issue_io_list and pending_io_list in completion_io_list. Returns
+ * -1 with errno EINVAL if any io was invalid; the valid ones are still
+ * issued.
+ */
+int cblk_listio(chunk_id_t id __attribute__((unused)),
+		cblk_io_t *issue_io_list[], int issue_items,
+		cblk_io_t *pending_io_list[], int pending_items,
+		cblk_io_t *wait_io_list[], int wait_items,
+		cblk_io_t *completion_io_list[], int *completion_items,
+		uint64_t timeout, int flags)
+{
+	int n = 0, err = 0;
+	struct cblk_dev *c = &chunk;
+
+	if ((issue_items < 0) || (pending_items < 0) || (wait_items < 0) ||
+	    (issue_items && (issue_io_list == NULL)) ||
+	    (pending_items && (pending_io_list == NULL)) ||
+	    (wait_items && (wait_io_list == NULL)) ||
+	    ((completion_io_list == NULL) != (completion_items == NULL))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return -1;
+	}
+
+	if (issue_items && (lio_issue(c, issue_io_list, issue_items,
+				      flags) != 0))
+		err = errno;
+	if (wait_items && (lio_wait(c, wait_io_list, wait_items,
+				    timeout) != 0) && !err)
+		err = errno;
+
+	if (completion_io_list != NULL) {
+		pthread_mutex_lock(&c->async_m);
+		__lio_collect(issue_io_list, issue_items, completion_io_list,
+			      *completion_items, &n);
+		__lio_collect(pending_io_list, pending_items,
+			      completion_io_list, *completion_items, &n);
+		pthread_mutex_unlock(&c->async_m);
+		*completion_items = n;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
 static void _init(void) __attribute__((constructor));
 
 static void _init(void)
@@ -1895,10 +3436,36 @@ static void _init(void)
 	if (env != NULL)
 		cblk_busytimeout = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_SLOTS");
+	if (env != NULL)
+		cblk_slots = MAX(MIN(strtol(env, (char **)NULL, 0),
+				     CBLK_IDX_MAX), 1);
+
 	env = getenv("CBLK_CACHING");
 	if (env != NULL)
 		cblk_caching = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_CACHE_SIZE");	/* MiB */
+	if (env != NULL) {
+		unsigned long sets = strtoul(env, (char **)NULL, 0) *
+			(MEGA_BYTE / __CBLK_BLOCK_SIZE / CACHE_WAYS);
+
+		for (cache_sets = 1; cache_sets * 2 <= sets; cache_sets *= 2)
+			;
+	}
+
+	env = getenv("CBLK_CACHE_POLICY");
+	if (env != NULL) {
+		if (strcasecmp(env, "LRU") == 0)
+			cache_policy = CACHE_POLICY_LRU;
+		else if (strcasecmp(env, "2Q") == 0)
+			cache_policy = CACHE_POLICY_2Q;
+		else
+			fprintf(stderr, "[%s] warn: CBLK_CACHE_POLICY=%s "
+				"unknown, using %s\n", __func__, env,
+				cache_policy_str[cache_policy]);
+	}
+
 	env = getenv("CBLK_NBLOCKS");
 	if (env != NULL)
 		cblk_nblocks = strtol(env, (char **)NULL, 0);
@@ -1917,10 +3484,26 @@ static void _init(void)
 	if (env != NULL)
 		cblk_prefetch_threshold = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_WRITEBACK");
+	if (env != NULL) {
+		cblk_writeback = strtol(env, (char **)NULL, 0);
+
+		/* NOTE: write-back implies caching */
+		if (cblk_writeback)
+			cblk_caching = 1;
+	}
+
+	env = getenv("CBLK_DIRTY_RATIO");	/* % */
+	if (env != NULL)
+		cblk_dirty_ratio = MAX(MIN(strtol(env, (char **)NULL, 0),
+					   100), 1);
+
 	block_trace("[%s] CBLK_MAXRETRIES=%d CBLK_REQTIMEOUT=%d CBLK_PREFETCH=%d "
-		"CBLK_PREFETCH_THRESHOLD=%d CBLK_CACHING=%d\n",
+		"CBLK_PREFETCH_THRESHOLD=%d CBLK_CACHING=%d CBLK_SLOTS=%d "
+		"CBLK_WRITEBACK=%d CBLK_DIRTY_RATIO=%d\n",
 		    __func__, cblk_maxretries, cblk_reqtimeout, cblk_prefetch,
-		cblk_prefetch_threshold, cblk_caching);
+		cblk_prefetch_threshold, cblk_caching, cblk_slots,
+		cblk_writeback, cblk_dirty_ratio);
 }
 
 static void _done(void) __attribute__((destructor));
@@ -1947,8 +3530,18 @@ static void _done(void)
 		"    block_reads_4k:    %ld\n"
 		"  block_writes:        %ld\n"
 		"    block_writes_4k:   %ld\n"
+		"  block_areads:        %ld\n"
+		"  block_awrites:       %ld\n"
+		"  aresult_no_cmplt:    %ld\n"
+		"  listio_ios:          %ld\n"
+		"  listio_cmds:         %ld\n"
+		"  wb_blocks:           %ld\n"
+		"  wb_flushed:          %ld\n"
+		"  wb_cmds:             %ld\n"
+		"  wb_throttled:        %ld\n"
 		"  idle_wakeups:        %ld\n"
 		"  cache_trashing_4k:   %ld\n"
+		"  cache_reserve_miss:  %ld\n"
 		"  running:             %ld usec\n"
 		"  reading:             %ld usec\n"
 		"  writing:             %ld usec\n"
@@ -1972,8 +3565,18 @@ static void _done(void)
 		c->block_reads_4k,
 		c->block_writes,
 		c->block_writes_4k,
+		c->block_areads,
+		c->block_awrites,
+		c->aresult_no_cmplt,
+		c->listio_ios,
+		c->listio_cmds,
+		c->wb_blocks,
+		c->wb_flushed,
+		c->wb_cmds,
+		c->wb_throttled,
 		c->idle_wakeups,
 		cache_trashing,
+		cache_reserve_misses,
 		(long int)usec,
 		c->avg_read_usecs,
 		c->avg_write_usecs,
@@ -1991,10 +3594,15 @@ static void _done(void)
 	stat_req_dump(c);
 
 	cache_trace("Cache Info\n"
-		"  entries/ways:        %d/%d per block %d KiB\n"
-		"  total_size:          %d MiB\n",
-		CACHE_ENTRIES, CACHE_WAYS, __CBLK_BLOCK_SIZE / 1024,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE / (1024*1024));
+		"  entries/ways:        %ld/%d per block %d KiB\n"
+		"  total_size:          %ld MiB\n"
+		"  policy:              %s\n"
+		"  ghost_hits:          %ld\n"
+		"  read_locked:         %ld\n",
+		cache_sets, CACHE_WAYS, __CBLK_BLOCK_SIZE / 1024,
+		cache_sets * CACHE_WAYS * __CBLK_BLOCK_SIZE / (1024*1024),
+		cache_policy_str[cache_policy], cache_ghost_hits,
+		cache_read_locked);
 
 	cblk_close(0, 0);
 }
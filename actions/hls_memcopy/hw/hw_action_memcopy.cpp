@@ -120,22 +120,15 @@ static void process_action(snap_membus_t *din_gmem,
 	// VARIABLES
 	snapu32_t xfer_size;
 	snapu32_t action_xfer_size;
-	snapu32_t nb_blocks_to_xfer;
-	snapu16_t i;
+	snapu32_t in_avail, out_avail;
 	short rc = 0;
 	snapu32_t ReturnCode = SNAP_RETC_SUCCESS;
-	snapu64_t InputAddress;
-	snapu64_t OutputAddress;
-	snapu64_t address_xfer_offset;
+	snap_sg_t in, out;
 	snap_membus_t  buf_gmem[MAX_NB_OF_WORDS_READ];
 	// if 4096 bytes max => 64 words
 
-	// byte address received need to be aligned with port width
-	InputAddress = (act_reg->Data.in.addr)   >> ADDR_RIGHT_SHIFT;
-	OutputAddress = (act_reg->Data.out.addr) >> ADDR_RIGHT_SHIFT;
-
-	address_xfer_offset = 0x0;
 	// testing sizes to prevent from writing out of bounds
+	// for scatter-gather operands size is the sum of all segments
 	action_xfer_size = MIN(act_reg->Data.in.size,
 			       act_reg->Data.out.size);
 
@@ -150,29 +143,38 @@ static void process_action(snap_membus_t *din_gmem,
 		return;
         }
 
-	// buffer size is hardware limited by MAX_NB_OF_BYTES_READ
-	if(action_xfer_size %MAX_NB_OF_BYTES_READ == 0)
-		nb_blocks_to_xfer = (action_xfer_size / MAX_NB_OF_BYTES_READ);
-	else
-		nb_blocks_to_xfer = (action_xfer_size / MAX_NB_OF_BYTES_READ) + 1;
+	snap_sg_init(&in, act_reg->Data.in.addr, act_reg->Data.in.size,
+		     act_reg->Data.in.type, act_reg->Data.in.flags);
+	snap_sg_init(&out, act_reg->Data.out.addr, act_reg->Data.out.size,
+		     act_reg->Data.out.type, act_reg->Data.out.flags);
 
-	// transferring buffers one after the other
+	// transferring buffers one after the other, a buffer never
+	// crosses a segment boundary of input or output
 	L0:
-	for ( i = 0; i < nb_blocks_to_xfer; i++ ) {
-#pragma HLS UNROLL		// cannot completely unroll a loop with a variable trip count
-
-		xfer_size = MIN(action_xfer_size,
-				(snapu32_t)MAX_NB_OF_BYTES_READ);
-
+	while (action_xfer_size > 0) {
+		in_avail = snap_sg_avail(&in, din_gmem);
+		out_avail = snap_sg_avail(&out, din_gmem);
+		if (in_avail == 0 || out_avail == 0) {
+			rc = 1;	// list shorter than its size claims
+			break;
+		}
+
+		xfer_size = MIN(MIN(in_avail, out_avail),
+				MIN(action_xfer_size,
+				    (snapu32_t)MAX_NB_OF_BYTES_READ));
+
+		// byte address received need to be aligned with port width
 		rc |= read_burst_of_data_from_mem(din_gmem, d_ddrmem,
-			act_reg->Data.in.type,
-			InputAddress + address_xfer_offset, buf_gmem, xfer_size);
+			in.type, in.addr >> ADDR_RIGHT_SHIFT,
+			buf_gmem, xfer_size);
 
 		rc |= write_burst_of_data_to_mem(dout_gmem, d_ddrmem,
-			act_reg->Data.out.type,
-			OutputAddress + address_xfer_offset, buf_gmem, xfer_size);
+			out.type, out.addr >> ADDR_RIGHT_SHIFT,
+			buf_gmem, xfer_size);
+
+		snap_sg_advance(&in, xfer_size);
+		snap_sg_advance(&out, xfer_size);
 		action_xfer_size -= xfer_size;
-		address_xfer_offset += (snapu64_t)(xfer_size >> ADDR_RIGHT_SHIFT);
 	} // end of L0 loop
 
 	if (rc != 0)
@@ -268,10 +270,12 @@ int main(void)
     act_reg.Data.in.addr = 0;
     act_reg.Data.in.size = 4096;
     act_reg.Data.in.type = SNAP_ADDRTYPE_HOST_DRAM;
+    act_reg.Data.in.flags = SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC;
 
     act_reg.Data.out.addr = 4096;
     act_reg.Data.out.size = 4096;
     act_reg.Data.out.type = SNAP_ADDRTYPE_HOST_DRAM;
+    act_reg.Data.out.flags = SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST;
 
     hls_action(din_gmem, dout_gmem, d_ddrmem, &act_reg, &Action_Config);
     if (act_reg.Control.Retc == SNAP_RETC_FAILURE) {
@@ -286,6 +290,34 @@ int main(void)
     else
     	printf(" ==> DATA COMPARE OK <==\n");
 
+    /* Input as scatter-gather list, two segments in reverse order */
+    struct snap_addr *sgl = (struct snap_addr *)((unsigned long)din_gmem + 8192);
+
+    for (i = 0; i < 4096; i++)
+	    ((uint8_t *)din_gmem)[i] = i / 64;
+    snap_addr_set(&sgl[0], (void *)2048, 2048, SNAP_ADDRTYPE_HOST_DRAM,
+		  SNAP_ADDRFLAG_ADDR);
+    snap_addr_set(&sgl[1], (void *)0, 2048, SNAP_ADDRTYPE_HOST_DRAM,
+		  SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_END);
+
+    act_reg.Data.in.addr = 8192;
+    act_reg.Data.in.flags |= SNAP_ADDRFLAG_EXT;
+
+    hls_action(din_gmem, dout_gmem, d_ddrmem, &act_reg, &Action_Config);
+    if (act_reg.Control.Retc == SNAP_RETC_FAILURE) {
+	    fprintf(stderr, " ==> SGL RETURN CODE FAILURE <==\n");
+	    return 1;
+    }
+    if (memcmp((void *)((unsigned long)din_gmem + 2048),
+	       (void *)((unsigned long)dout_gmem + 4096), 2048) != 0 ||
+	memcmp((void *)((unsigned long)din_gmem + 0),
+	       (void *)((unsigned long)dout_gmem + 6144), 2048) != 0) {
+	    fprintf(stderr, " ==> SGL DATA COMPARE FAILURE <==\n");
+	    return 1;
+    }
+    else
+	    printf(" ==> SGL DATA COMPARE OK <==\n");
+
     printf(">> ACTION TYPE = %08lx - RELEASE_LEVEL = %08lx <<\n",
                     (unsigned int)Action_Config.action_type,
                     (unsigned int)Action_Config.release_level);
@@ -56,6 +56,9 @@ static void usage(const char *prog)
 	       "  -m, --mode <mode>          mode flags.\n"
 	       "  -t, --timeout              timeout in sec to wait for done. (10 sec default)\n"
 	       "  -X, --verify               verify result if possible\n"
+	       "  -g, --fragments <num>      pass host buffers of input/output\n"
+	       "                             files as scatter-gather lists of\n"
+	       "                             <num> and <num>+1 segments.\n"
 	       "  -V, --version              provides version of software\n"
 	       "  -v, --verbose              provides extra (debug) information if any\n"
 	       "  -h, --help                 provides help summary\n"
@@ -156,6 +159,8 @@ int main(int argc, char *argv[])
 	struct timeval etime, stime;
 	ssize_t size = 1024 * 1024;
 	uint8_t *ibuff = NULL, *obuff = NULL;
+	unsigned int fragments = 0;
+	struct snap_sgl *isgl = NULL, *osgl = NULL;
 	uint16_t type_in = SNAP_ADDRTYPE_UNUSED;
 	uint64_t addr_in = 0x0ull;
 	uint16_t type_out = SNAP_ADDRTYPE_UNUSED;
@@ -181,6 +186,7 @@ int main(int argc, char *argv[])
 			{ "mode",	 required_argument, NULL, 'm' },
 			{ "timeout", 	 required_argument, NULL, 't' },
 			{ "verify",	 no_argument,	    NULL, 'X' },
+			{ "fragments",	 required_argument, NULL, 'g' },
 			{ "version", 	 no_argument,	    NULL, 'V' },
 			{ "verbose", 	 no_argument,	    NULL, 'v' },
 			{ "help",	 no_argument,	    NULL, 'h' },
@@ -190,7 +196,7 @@ int main(int argc, char *argv[])
 
 		ch = getopt_long(argc, argv,
 //			 "A:C:i:o:a:S:D:d:x:s:t:XVqvhI",
-         "C:i:o:A:a:D:d:s:m:t:XVvhN",
+         "C:i:o:A:a:D:d:s:m:t:Xg:VvhN",
 				 long_options, &option_index);
          
 		if (ch == -1)
@@ -248,6 +254,9 @@ int main(int argc, char *argv[])
 		case 'X':
 			verify++;
 			break;
+		case 'g':
+			fragments = strtol(optarg, (char **)NULL, 0);
+			break;
 			/* service */
 		case 'V':
 			printf("%s\n", version);
@@ -354,6 +363,22 @@ int main(int argc, char *argv[])
 			     (void *)addr_in,  size, type_in,
 			     (void *)addr_out, size, type_out);
 
+	if (fragments && ibuff) {
+		isgl = snap_sgl_split(ibuff, size, fragments);
+		if (isgl == NULL ||
+		    snap_addr_set_sgl(&mjob.in, isgl, SNAP_ADDRFLAG_ADDR |
+				      SNAP_ADDRFLAG_SRC) != 0)
+			goto out_error2;
+	}
+	if (fragments && obuff) {
+		osgl = snap_sgl_split(obuff, size, fragments + 1);
+		if (osgl == NULL ||
+		    snap_addr_set_sgl(&mjob.out, osgl, SNAP_ADDRFLAG_ADDR |
+				      SNAP_ADDRFLAG_DST |
+				      SNAP_ADDRFLAG_END) != 0)
+			goto out_error2;
+	}
+
 	__hexdump(stderr, &mjob, sizeof(mjob));
 
         printf("      get starting time\nAction is running ....");
@@ -387,6 +412,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "err: Unexpected RETC=%x!\n", cjob.retc);
 		goto out_error2;
 	}
+	snap_action_add_bytes(action, 2 * size);	/* read + written */
 
 	if (verify) {
 		if ((type_in  == SNAP_ADDRTYPE_HOST_DRAM) &&
@@ -418,6 +444,8 @@ int main(int argc, char *argv[])
 	snap_detach_action(action);
 	snap_card_free(card);
 
+	snap_sgl_free(osgl);
+	snap_sgl_free(isgl);
 	__free(obuff);
 	__free(ibuff);
 	exit(exit_code);
@@ -427,6 +455,8 @@ int main(int argc, char *argv[])
  out_error1:
 	snap_card_free(card);
  out_error:
+	snap_sgl_free(osgl);
+	snap_sgl_free(isgl);
 	__free(obuff);
 	__free(ibuff);
 	exit(EXIT_FAILURE);
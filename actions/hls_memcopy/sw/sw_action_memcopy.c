@@ -59,7 +59,7 @@ static int action_main(struct snap_sim_action *action,
 {
 	int rc;
 	struct memcopy_job *js = (struct memcopy_job *)job;
-	void *src, *dst;
+	struct snap_addr src;
 	size_t len;
 	void *ibuf = NULL;
 	void *obuf = NULL;
@@ -71,10 +71,10 @@ static int action_main(struct snap_sim_action *action,
 		  __func__, action, job, job_len, js->in.type, js->out.type,
 		  sizeof(*js));
 
-	__hexdump(stderr, js, sizeof(*js));
+	if (action_trace_enabled())
+		__hexdump(stderr, js, sizeof(*js));
 
 	len = js->out.size;
-	dst = (void *)js->out.addr;
 	if (js->in.size != js->out.size) {
 		act_trace("  err: size does not match in %d bytes versus "
 			  "out %d bytes!\n", js->in.size, js->out.size);
@@ -94,25 +94,37 @@ static int action_main(struct snap_sim_action *action,
 		if (rc < 0)
 			goto out_err;
 
-		src = ibuf;
+		snap_addr_set(&src, ibuf, len, SNAP_ADDRTYPE_HOST_DRAM,
+			      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 	} else
-		src = (void *)js->in.addr;
+		src = js->in;	/* plain or scatter-gather list */
 
 	if (js->out.type != SNAP_ADDRTYPE_HOST_DRAM) {
 		snprintf(ofname, sizeof(ofname), MEMORY_FILE,
 			 (long long)js->out.addr, (long long)js->out.size);
 
+		obuf = malloc(len);
+		if (obuf == NULL)
+			goto out_err;
+
+		if (snap_addr_gather(&src, obuf, len) != (ssize_t)len)
+			goto out_err;
+
 		act_trace("  writing output data to %s\n", ofname);
-		rc = __file_write(ofname, src, len);
+		rc = __file_write(ofname, obuf, len);
 		if (rc < 0)
 			goto out_err;
-
-		goto out_ok;
 	} else {
-		act_trace("   copy %p to %p %ld bytes\n", src, dst, len);
-		memcpy(dst, src, len);
+		act_trace("   copy %016llx to %016llx %ld bytes%s\n",
+			  (long long)src.addr, (long long)js->out.addr, len,
+			  ((src.flags | js->out.flags) & SNAP_ADDRFLAG_EXT) ?
+			  " (sgl)" : "");
+		if (snap_addr_copy(&js->out, &src, len) != (ssize_t)len)
+			goto out_err;
 	}
- out_ok:
+
+	__free(ibuf);
+	__free(obuf);
 	action->job.retc = SNAP_RETC_SUCCESS;
 	return 0;
 
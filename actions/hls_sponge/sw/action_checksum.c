@@ -684,19 +684,29 @@ static int action_main(struct snap_sim_action *action, void *job,
                 js->chk_out = sha3_main(js->test_choice, js->nb_elmts, js->freq, threads);
                 break;
 	}
-	case CHECKSUM_CRC32:
+	case CHECKSUM_CRC32: {
+		struct snap_sg_iter it;
+		size_t len, left = js->in.size;
+
 		/* checking parameters ... */
-		if (js->in.type != SNAP_ADDRTYPE_HOST_DRAM)
+		if (snap_sg_iter_init(&it, &js->in) != 0)
 			return 0;
-
-		src = (void *)js->in.addr;
-		if (src == NULL)
+		if (js->in.addr == 0)
 			return 0;
 
-		/* calculate the results ... */
-		js->chk_out = do_crc(js->chk_in, src, js->in.size);
+		/* calculate the results, segment by segment ... */
+		js->chk_out = js->chk_in;
+		while (left) {
+			len = left;
+			src = snap_sg_iter_next(&it, &len);
+			if (src == NULL)
+				return 0;
+			js->chk_out = do_crc(js->chk_out, src, len);
+			left -= len;
+		}
 		js->chk_out &= 0xffffffff; /* 32-bit only */
 		break;
+	}
 
 	default:
 		return 0;
@@ -58,6 +58,8 @@ static void usage(const char *prog)
 	       "  -T, --test                execute a test if available.\n"
 	       "  -t, --timeout             Timeout in sec (default 3600 sec).\n"
 	       "  -N, --irq                 Disable Interrupts\n"
+	       "  -g, --fragments <num>     pass input file as scatter-gather\n"
+	       "                            list of <num> segments (CRC32).\n"
 	       "\n"
 	       "Example:\n"
 	       "To run speed_test with generation of 65536*n/f = number of SHA3 calls :\n"
@@ -180,6 +182,7 @@ static int do_checksum(int card_no, unsigned long timeout,
 		       unsigned int threads,
 		       unsigned long addr_in,
 		       unsigned char type_in,  unsigned long size,
+		       const struct snap_sgl *sgl_in,
 		       uint64_t checksum_start,
 		       checksum_mode_t mode,
 		       test_choice_t test_choice,
@@ -240,6 +243,11 @@ static int do_checksum(int card_no, unsigned long timeout,
 			     (void *)addr_in, size, type_in,
 			      mode, checksum_start, test_choice, nb_elmts, freq,
 			      threads);
+	if (sgl_in && snap_addr_set_sgl(&mjob_in.in, sgl_in,
+					SNAP_ADDRFLAG_ADDR |
+					SNAP_ADDRFLAG_SRC |
+					SNAP_ADDRFLAG_END) != 0)
+		goto out_error2;
 
 	gettimeofday(&stime, NULL);
 	rc = snap_action_sync_execute_job(action, &cjob, timeout);
@@ -311,6 +319,8 @@ int main(int argc, char *argv[])
 	const char *space = "CARD_RAM";
 	ssize_t size = 1024 * 1024;
 	uint8_t *ibuff = NULL;
+	unsigned int fragments = 0;
+	struct snap_sgl *sgl_in = NULL;
 	unsigned int page_size = sysconf(_SC_PAGESIZE);
 	uint8_t type_in = SNAP_ADDRTYPE_HOST_DRAM;
 	uint64_t addr_in = 0x0ull;
@@ -341,11 +351,12 @@ int main(int argc, char *argv[])
 			{ "verbose",	 no_argument,	    NULL, 'v' },
 			{ "help",	 no_argument,	    NULL, 'h' },
 			{ "noirq", 	 no_argument,	    NULL, 'N' },
+			{ "fragments",	 required_argument, NULL, 'g' },
 			{ 0,		 no_argument,	    NULL, 0   },
 		};
 
 		ch = getopt_long(argc, argv,
-				 "A:C:i:a:S:Tx:c:n:f:m:s:t:x:VqvhN",
+				 "A:C:i:a:S:Tx:c:n:f:m:s:t:x:g:VqvhN",
 				 long_options, &option_index);
 		if (ch == -1)
 			break;
@@ -437,6 +448,9 @@ int main(int argc, char *argv[])
 		case 'N':
 			action_irq = 0;
 			break;
+		case 'g':
+			fragments = strtol(optarg, (char **)NULL, 0);
+			break;
 		default:
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -473,6 +487,12 @@ int main(int argc, char *argv[])
 
 		type_in = SNAP_ADDRTYPE_HOST_DRAM;
 		addr_in = (unsigned long)ibuff;
+
+		if (fragments) {
+			sgl_in = snap_sgl_split(ibuff, size, fragments);
+			if (sgl_in == NULL)
+				goto out_error1;
+		}
 	}
 
 	if (test) {
@@ -482,19 +502,21 @@ int main(int argc, char *argv[])
 		}
 	} else {
 		rc = do_checksum(card_no, timeout, threads, addr_in,
-				 type_in, size, checksum_start, mode,
+				 type_in, size, sgl_in, checksum_start, mode,
 				 test_choice, nb_elmts, freq, NULL, NULL, NULL,
 				 NULL, stderr, action_irq);
 		if (rc != 0)
 			goto out_error1;
 	}
 
+	snap_sgl_free(sgl_in);
 	if (ibuff)
 		free(ibuff);
 
 	exit(EXIT_SUCCESS);
 
  out_error1:
+	snap_sgl_free(sgl_in);
 	if (ibuff)
 		free(ibuff);
  out_error:
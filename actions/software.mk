@@ -26,7 +26,7 @@ endif
 
 include $(SNAP_ROOT)/software/config.mk
 
-CFLAGS += -std=c99
+CFLAGS += -std=c99 -fPIC
 LDLIBS += -lsnap -lcxl -lpthread
 LDFLAGS += -Wl,-rpath,$(SNAP_ROOT)/software/lib
 
@@ -76,6 +76,11 @@ endif
 %.o: %.c
 	$(CC) -c $(CPPFLAGS) $($(@:.o=)_CPPFLAGS) $(CFLAGS) $< -o $@
 
+### Software action plugin, loaded from SNAP_ACTION_PATH by libsnap.
+### libsnap itself comes from the host, do not link it in.
+snap_action_%.so:
+	$(CC) -shared $(LDFLAGS) $(filter %.o,$^) -o $@
+
 install: all
 	@mkdir -p $(DESTDIR)/bin
 	@for f in $(projs); do 					\
@@ -351,6 +351,9 @@ int cblk_listio(chunk_id_t chunk_id,
                 cblk_io_t *completion_io_list[],int *completion_items,
                 uint64_t timeout,int flags);
 
+/* Write the dirty blocks of the write-back cache to the device */
+int cblk_sync(chunk_id_t chunk_id, int flags);
+
 /* Clone a chunk (such as a parent and chilld process' chunk */
 int cblk_clone_after_fork(chunk_id_t chunk_id, int mode, int flags);
 
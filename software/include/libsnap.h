@@ -19,6 +19,9 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <snap_types.h>
 
 /**
@@ -91,6 +94,7 @@ extern "C" {
 #define SNAP_EINVAL			-7 /* Invalid parameters */
 #define SNAP_EATTACH                    -8 /* Attach error */
 #define SNAP_EDETACH                    -9 /* Detach error */
+#define SNAP_ENOMEM			-10 /* Out of memory */
 
 /**********************************************************************
  * SNAP Common Definitions
@@ -260,6 +264,37 @@ int snap_mmio_read32(struct snap_card *card, uint64_t offset,
 int snap_mmio_read32_nohwsync(struct snap_card *card,
 		uint64_t offset, uint32_t *data);
 
+/*
+ * MMIO access modes
+ *
+ * @SNAP_MMIO_CXL   Use the libcxl functions which put a hwsync around
+ *                  every access. This is the default.
+ * @SNAP_MMIO_FAST  Access the mapped MMIO area directly. Writes are
+ *                  posted without a barrier. Reads and
+ *                  snap_mmio_barrier() order all writes before them.
+ *                  The library places a barrier after passing a
+ *                  workitem and before starting the action. Code doing
+ *                  its own register sequences must call
+ *                  snap_mmio_barrier() where ordering matters.
+ */
+typedef enum snap_mmio_mode {
+	SNAP_MMIO_CXL = 0,
+	SNAP_MMIO_FAST = 1,
+} snap_mmio_mode_t;
+
+/**
+ * Select the MMIO access mode of a card. Not available in simulation,
+ * ignored in software mode.
+ *
+ * @card        snap_card device handle.
+ * @mode        SNAP_MMIO_CXL or SNAP_MMIO_FAST.
+ * @return      SNAP_OK in case of success, else error.
+ */
+int snap_card_set_mmio_mode(struct snap_card *card, snap_mmio_mode_t mode);
+
+/* Order all MMIO writes issued so far before any following access */
+void snap_mmio_barrier(struct snap_card *card);
+
 int snap_mmio_write64(struct snap_card *card, uint64_t offset,
 			uint64_t data);
 int snap_mmio_read64(struct snap_card *card, uint64_t offset,
@@ -272,9 +307,31 @@ int snap_mmio_read64(struct snap_card *card, uint64_t offset,
  *
  * @SNAP_ATTACH_IRQ       Use interrupt to determine if action got attached
  *                        from Job Manager.
+ *
+ * @SNAP_ACTION_BATCH     The hardware action can walk a ring of workitems,
+ *                        see snap_action_execute_batch(). Software actions
+ *                        always can.
+ *
+ * @SNAP_ACTION_COMPLETION_RECORD  The action writes retc and output
+ *                        parameters of a job to a completion record in host
+ *                        memory. Waiting for the job polls this record and
+ *                        the results are taken from it instead of reading
+ *                        them one by one via MMIO. Hardware actions must
+ *                        support this, the CPU emulation always does.
+ *
+ * @SNAP_ACTION_KEEP_ATTACHED  snap_detach_action() keeps an idle action
+ *                        attached. A following snap_attach_action() for the
+ *                        same action type returns it without going through
+ *                        the Job Manager. The action is released when
+ *                        another action type is attached, when it is
+ *                        detached without this flag or by snap_card_free().
+ *                        Other contexts cannot use the action meanwhile.
  */
 typedef enum snap_action_flag  {
 	SNAP_ACTION_DONE_IRQ = 0x01,   /* Enable Action Done Interrupt */
+	SNAP_ACTION_KEEP_ATTACHED = 0x100, /* Detach lazily */
+	SNAP_ACTION_BATCH = 0x200,     /* Action executes workitem rings */
+	SNAP_ACTION_COMPLETION_RECORD = 0x400, /* Results in host memory */
 	SNAP_ATTACH_IRQ = 0x10000      /* Enable Attach IRQ from Job Manager */
 } snap_action_flag_t;
 
@@ -344,6 +401,25 @@ struct snap_action *snap_attach_action(struct snap_card *card,
  */
 int snap_detach_action(struct snap_action *action);
 
+/* Attach statistics, see SNAP_ACTION_KEEP_ATTACHED */
+struct snap_attach_stats {
+	unsigned long long attaches;		/* Via Job Manager */
+	unsigned long long attaches_avoided;	/* Kept action reused */
+	unsigned long long detaches;		/* Via Job Manager */
+	unsigned long long lazy_detaches;	/* Action kept attached */
+	unsigned long long atri_scans;		/* Action table reads */
+};
+
+/**
+ * Get attach statistics of a card.
+ *
+ * @card        snap_card device handle.
+ * @stats       returns the counters.
+ * @return      SNAP_OK in case of success, else error.
+ */
+int snap_card_get_attach_stats(struct snap_card *card,
+			       struct snap_attach_stats *stats);
+
 /*
  * MMIO Access functions for actions
  *
@@ -373,6 +449,152 @@ int snap_action_is_idle(struct snap_action *action, int *rc);
 int snap_action_completed(struct snap_action *action, int *rc,
 			  int timeout_sec);
 
+/**
+ * Same as snap_action_completed() but with a timeout in microseconds,
+ * for callers which need to give up on a job in less than a second.
+ *
+ * @action       handle to the attached action
+ * @rc           returns the MMIO error code if not NULL
+ * @timeout_usec timeout in usec
+ * @return       1 if the action is idle, 0 if it timed out
+ */
+int snap_action_completed_usec(struct snap_action *action, int *rc,
+			       unsigned long timeout_usec);
+
+/**
+ * Completion policy. Waiting for an action to finish runs through up to
+ * three phases:
+ *
+ *  1. spin:  Read ACTION_CONTROL back to back for spin_usec. Gives the
+ *            lowest latency for short jobs.
+ *  2. poll:  Keep reading, but relax the CPU in between. The delay
+ *            starts at backoff_min_usec and doubles up to
+ *            backoff_max_usec. Delays of SNAP_POLL_SLEEP_USEC and more
+ *            are slept, so the waiting thread gives up its core.
+ *  3. irq:   Block on the action done interrupt.
+ *
+ * The irq phase is only used if the action was attached with
+ * SNAP_ACTION_DONE_IRQ and is entered after spin_usec + poll_usec.
+ * Without SNAP_ACTION_DONE_IRQ, the poll phase lasts until the timeout.
+ * A policy of all zeros (with SNAP_ACTION_DONE_IRQ) waits for the
+ * interrupt right away as older versions of the library did.
+ */
+#define SNAP_POLL_SLEEP_USEC	50
+
+struct snap_completion_policy {
+	unsigned int spin_usec;		/* Busy poll phase */
+	unsigned int poll_usec;		/* Backoff poll phase before irq */
+	unsigned int backoff_min_usec;	/* First poll delay */
+	unsigned int backoff_max_usec;	/* Poll delay limit */
+};
+
+/* Counters per completion phase, cleared when the policy is set */
+struct snap_completion_stats {
+	unsigned long long spin_completions;	/* Done in spin phase */
+	unsigned long long poll_completions;	/* Done in poll phase */
+	unsigned long long irq_completions;	/* Done in irq phase */
+	unsigned long long timeouts;		/* Not done in time */
+	unsigned long long mmio_polls;		/* ACTION_CONTROL reads */
+	unsigned long long record_polls;	/* Completion record checks */
+	unsigned long long irq_waits;		/* Calls to wait for irq */
+	unsigned long long wait_usec;		/* Total time waited */
+};
+
+/**
+ * Change or query the completion policy of a card. NULL for @policy
+ * restores the default policy.
+ *
+ * @card        snap_card device handle.
+ * @policy      new policy.
+ * @return      SNAP_OK in case of success, else error.
+ */
+int snap_card_set_completion_policy(struct snap_card *card,
+			const struct snap_completion_policy *policy);
+int snap_card_get_completion_policy(struct snap_card *card,
+			struct snap_completion_policy *policy);
+int snap_card_get_completion_stats(struct snap_card *card,
+			struct snap_completion_stats *stats);
+
+/*
+ * Counters and latency histograms, always collected. Each thread
+ * counts into its own copy, they are summed up when read. Histogram
+ * bucket 0 counts 0 nsec, bucket i counts [2^(i-1), 2^i) nsec, the
+ * last bucket everything above.
+ */
+#define SNAP_STATS_BUCKETS	40
+
+enum snap_stats_op {
+	SNAP_STATS_ATTACH = 0,		/* snap_attach_action() */
+	SNAP_STATS_SET_REGS,		/* Write job to the action */
+	SNAP_STATS_RUN,			/* Action start until done is seen */
+	SNAP_STATS_WAIT,		/* Waiting for completion */
+	SNAP_STATS_DETACH,		/* snap_detach_action() */
+	SNAP_STATS_JOB,			/* snap_action_sync_execute_job() */
+	SNAP_STATS_OPS,
+};
+
+struct snap_stats_hist {
+	uint64_t count;
+	uint64_t sum_nsec;
+	uint64_t max_nsec;
+	uint64_t bucket[SNAP_STATS_BUCKETS];
+};
+
+struct snap_stats {
+	uint64_t mmio_reads;
+	uint64_t mmio_writes;
+	uint64_t jobs;			/* Synchronous jobs */
+	uint64_t errors;		/* Jobs which failed */
+	uint64_t timeouts;		/* Completion waits which timed out */
+	uint64_t bytes;			/* See snap_action_add_bytes() */
+	struct snap_stats_hist hist[SNAP_STATS_OPS];
+};
+
+/**
+ * Statistics of a card context since it was opened.
+ *
+ * @card          card
+ * @stats         filled in
+ * @return        SNAP_OK or SNAP_EINVAL
+ */
+int snap_card_get_stats(struct snap_card *card, struct snap_stats *stats);
+
+/**
+ * Statistics since the action was attached. max_nsec covers the whole
+ * lifetime of the context.
+ *
+ * @action        attached action
+ * @stats         filled in
+ * @return        SNAP_OK or SNAP_EINVAL
+ */
+int snap_action_get_stats(struct snap_action *action,
+			  struct snap_stats *stats);
+
+/**
+ * Latency below which p percent of the samples are, estimated as the
+ * upper end of the histogram bucket, e.g. p = 99.9.
+ *
+ * @hist          histogram
+ * @p             percentile, 0.0 ... 100.0
+ * @return        nsec, 0 if the histogram is empty
+ */
+uint64_t snap_stats_percentile(const struct snap_stats_hist *hist, double p);
+
+/**
+ * Account the data a job moved. libsnap does not know the layout of
+ * the action specific job structure, so the application tells.
+ *
+ * @action        attached action
+ * @bytes         bytes read plus bytes written by the job
+ */
+void snap_action_add_bytes(struct snap_action *action, uint64_t bytes);
+
+/*
+ * With SNAP_STATS_SHM=<msec> in the environment, the statistics of all
+ * card contexts of the process are published at most every <msec> to
+ * /dev/shm/snap_stats.<pid>, see snap_shm.h and the snap_top tool.
+ */
+
 /**
  * Synchronous way to send a job away.  First step : set registers
  * This function writes through MMIO interface the registers
@@ -407,6 +629,15 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
                                  struct snap_job *cjob,
                                  unsigned int timeout_sec);
 
+/**
+ * Same as snap_action_sync_execute_job_check_completion() with the
+ * timeout given in microseconds.
+ */
+int snap_action_sync_execute_job_check_completion_usec(
+				 struct snap_action *action,
+				 struct snap_job *cjob,
+				 unsigned long timeout_usec);
+
 /**
  * Synchronous way to send a job away. Blocks until job is done.
  *  * These 3 steps can be called separately from the application
@@ -429,6 +660,25 @@ int snap_action_sync_execute_job(struct snap_action *action,
                                  struct snap_job *cjob,
                                  unsigned int timeout_sec);
 
+/**
+ * Execute a batch of jobs with a single start of the action. The
+ * workitems are placed in a ring in host memory, the action walks it
+ * and writes retc and results of each job back into the ring. This
+ * saves the MMIO round trips of passing each job through the action
+ * registers. If the action was not attached with SNAP_ACTION_BATCH
+ * (and runs in hardware), the jobs are executed one by one.
+ *
+ * @action      handle to the attached action
+ * @cjob        array of n jobs, retc and results are set per job
+ * @n           number of jobs
+ * @timeout_sec timeout for the whole batch
+ * @return      SNAP_OK if the batch was executed, else error. Check
+ *              cjob[i].retc for the result of each job.
+ */
+int snap_action_execute_batch(struct snap_action *action,
+			      struct snap_job *cjob, unsigned int n,
+			      unsigned int timeout_sec);
+
 #if 0 /* FIXME Discuss how this must be done correctly */
 /**
  * Allow the action to use interrupts to signal results back to the
@@ -464,16 +714,56 @@ int snap_action_free_irq(struct snap_action *action, int irq);
 
 int snap_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm);
 
+/**
+ * File descriptor which becomes readable when the card raises an
+ * interrupt, e.g. the done interrupt of an action attached with
+ * SNAP_ACTION_DONE_IRQ. In CPU mode this is an eventfd. Use it to
+ * wait for many cards at once, see snap_event_loop_alloc().
+ *
+ * @card          card
+ * @return        file descriptor, owned by the card
+ */
+int snap_card_get_fd(struct snap_card *card);
+
+/**
+ * NUMA node the card is attached to, from sysfs. SNAP_NUMA_NODE in the
+ * environment overrides it for all cards. libsnap binds the threads it
+ * runs for the card to this node and snap_buf_get() prefers it.
+ *
+ * @card          card
+ * @return        node, -1 if unknown
+ */
+int snap_card_numa_node(struct snap_card *card);
+
+/**
+ * Bind the calling thread to the CPUs of a NUMA node. Threads it
+ * creates inherit the binding.
+ *
+ * @node          node, nothing is done for -1
+ * @return        SNAP_OK, SNAP_ENOENT if the node has no CPUs
+ */
+int snap_thread_bind_node(int node);
+
 /******************************************************************************
  * SNAP Queue Operations
  *****************************************************************************/
 
 /**
  * Get a streaming framework queue handle.
+ *
+ * The queue takes over the card context. Jobs are kept in a ring of
+ * queue_length prepared workitems and are executed one after the
+ * other by a completion thread, which keeps the action attached for
+ * the lifetime of the queue. Do not use the card handle directly while
+ * the queue exists.
+ *
  * @card          Valid SNAP card handle
  * @action_type   Use special action_type for the queue.
- * @return        0 success
- *                SNAP_ENODEV no matching capi device found
+ * @action_flags  Flags passed to snap_attach_action().
+ * @queue_length  Number of jobs which can be submitted before the
+ *                submitter has to wait for a free entry.
+ * @attach_timeout_sec Timeout for action attachement.
+ * @return        queue handle, NULL on error and errno is set
  */
 
 struct snap_queue *snap_queue_alloc(struct snap_card *card,
@@ -482,6 +772,10 @@ struct snap_queue *snap_queue_alloc(struct snap_card *card,
 			unsigned int queue_length,
 			unsigned int attach_timeout_sec);
 
+/**
+ * Finishes all submitted jobs, detaches the action and frees the queue.
+ * @queue         handle to streaming framework queue
+ */
 void snap_queue_free(struct snap_queue *queue);
 
 /**
@@ -495,13 +789,18 @@ int snap_queue_sync_execute_job(struct snap_queue *queue,
 			  unsigned int timeout_sec);
 
 /**
- * Asynchronous way to send a job away.
+ * Asynchronous way to send a job away. Returns as soon as the job is
+ * in the queue, waits only if the queue is full. The finished callback
+ * is called from the completion thread once the job is done. cjob and
+ * the buffers it references must stay valid until then. If the job
+ * could not be executed, cjob->retc is set to SNAP_RETC_TIMEOUT or
+ * SNAP_RETC_FAILURE.
+ *
  * @queue         handle to streaming framework queue
  * @cjob          streaming framework job
  * @finished      callback function which is called once job is done
  * @return        0 on success.
  */
-/* NOTE: Discuss if such a construct as suggested below really works ok */
 typedef int (*snap_job_finished_t)(struct snap_queue *queue,
 			struct snap_job *cjob);
 
@@ -509,6 +808,398 @@ int snap_async_execute_job(struct snap_queue *queue,
 			struct snap_job *cjob,
 			snap_job_finished_t finished);
 
+/******************************************************************************
+ * SNAP Buffer Pool
+ *****************************************************************************/
+
+/**
+ * Get a buffer for data which the card accesses. Buffers are taken from
+ * hugepages where possible and are pre-faulted, so the first DMA does
+ * not run into translation faults. The size is rounded up to a power
+ * of two, at least 4 KiB, and the buffer is aligned to that size (at
+ * most to 2 MiB). The content is not initialized. Buffers are recycled
+ * by snap_buf_put() and kept in a per thread cache, so a get/put pair
+ * of the same size is cheap.
+ *
+ * @size          buffer size in bytes
+ * @return        buffer, NULL on error and errno is set
+ */
+void *snap_buf_get(size_t size);
+
+/**
+ * Like snap_buf_get(), the memory preferably comes from the given NUMA
+ * node. snap_buf_get() uses the node of the first card opened, if it
+ * knows one, see snap_card_numa_node().
+ *
+ * @size          buffer size in bytes
+ * @node          NUMA node, -1 for no preference
+ * @return        buffer, NULL on error and errno is set
+ */
+void *snap_buf_get_node(size_t size, int node);
+
+/**
+ * Return a buffer from snap_buf_get() to the pool.
+ *
+ * @buf           buffer, NULL is ignored
+ */
+void snap_buf_put(void *buf);
+
+/******************************************************************************
+ * SNAP Scatter-Gather Lists
+ *****************************************************************************/
+
+/*
+ * Builds a list of data segments which an action accesses as one
+ * operand, see SNAP_ADDRFLAG_EXT in snap_types.h. The entries are
+ * kept in host memory, the list must stay valid until the job is done.
+ */
+struct snap_sgl {
+	struct snap_addr *ent;		/* entries, last one has END */
+	unsigned int n;			/* used entries */
+	unsigned int max;		/* allocated entries */
+	uint64_t size;			/* total bytes of all segments */
+};
+
+/**
+ * Allocate an empty list. It grows if more entries are added.
+ *
+ * @max           initial number of entries
+ * @return        list, NULL on error and errno is set
+ */
+struct snap_sgl *snap_sgl_alloc(unsigned int max);
+
+/**
+ * Free a list from snap_sgl_alloc().
+ *
+ * @sgl           list, NULL is ignored
+ */
+void snap_sgl_free(struct snap_sgl *sgl);
+
+/**
+ * Remove all entries, the list can be reused for the next job.
+ *
+ * @sgl           list
+ */
+void snap_sgl_reset(struct snap_sgl *sgl);
+
+/**
+ * Append a segment. Segments of length 0 are skipped.
+ *
+ * @sgl           list
+ * @addr          start of segment
+ * @size          length of segment in bytes
+ * @type          memory type, e.g. SNAP_ADDRTYPE_HOST_DRAM
+ * @return        0 on success, SNAP_EINVAL or SNAP_ENOMEM on error
+ */
+int snap_sgl_add(struct snap_sgl *sgl, const void *addr, uint32_t size,
+		 snap_addrtype_t type);
+
+/**
+ * Append the host memory segments of an iovec array.
+ *
+ * @sgl           list
+ * @iov           segments
+ * @iovcnt        number of segments
+ * @return        0 on success, SNAP_EINVAL or SNAP_ENOMEM on error
+ */
+int snap_sgl_add_iov(struct snap_sgl *sgl, const struct iovec *iov,
+		     int iovcnt);
+
+/**
+ * Describe a host buffer as a list of about n segments of equal size,
+ * the last one takes the rest. Segment sizes are multiples of 64
+ * bytes, as hardware actions require.
+ *
+ * @buf           start of buffer
+ * @size          length of buffer in bytes
+ * @n             number of segments
+ * @return        list, free it with snap_sgl_free(). NULL on error and
+ *                errno is set
+ */
+struct snap_sgl *snap_sgl_split(void *buf, size_t size, unsigned int n);
+
+/**
+ * Let a job operand refer to a list. SNAP_ADDRFLAG_EXT is added to
+ * flags, the operand carries the total size of the list.
+ *
+ * @da            job operand
+ * @sgl           list with at least one entry
+ * @flags         e.g. SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC
+ * @return        0 on success, SNAP_EINVAL if the list is empty or
+ *                larger than 4 GiB
+ */
+int snap_addr_set_sgl(struct snap_addr *da, const struct snap_sgl *sgl,
+		      snap_addrflag_t flags);
+
+/*
+ * Walk the host memory segments of an operand, a plain one or a list.
+ * Used by software actions and to check results.
+ */
+struct snap_sg_iter {
+	const struct snap_addr *ent;	/* current entry, NULL at end */
+	uint64_t offs;			/* bytes consumed of ent */
+	struct snap_addr plain;		/* entry for a plain operand */
+};
+
+/**
+ * Start walking an operand.
+ *
+ * @it            iterator
+ * @op            job operand, must be in host memory
+ * @return        0 on success, SNAP_EINVAL for other memory types
+ */
+int snap_sg_iter_init(struct snap_sg_iter *it, const struct snap_addr *op);
+
+/**
+ * Get the next piece of contiguous memory.
+ *
+ * @it            iterator
+ * @len           in: maximum length wanted, out: length returned
+ * @return        start of the piece, NULL at the end of the operand or
+ *                if a segment is not in host memory (*len is 0)
+ */
+void *snap_sg_iter_next(struct snap_sg_iter *it, size_t *len);
+
+/**
+ * Copy from an operand into a contiguous buffer.
+ *
+ * @op            source operand in host memory
+ * @buf           destination
+ * @len           bytes to copy
+ * @return        bytes copied, less if the operand is shorter, or
+ *                SNAP_EINVAL
+ */
+ssize_t snap_addr_gather(const struct snap_addr *op, void *buf, size_t len);
+
+/**
+ * Copy a contiguous buffer into an operand.
+ *
+ * @op            destination operand in host memory
+ * @buf           source
+ * @len           bytes to copy
+ * @return        bytes copied, less if the operand is shorter, or
+ *                SNAP_EINVAL
+ */
+ssize_t snap_addr_scatter(const struct snap_addr *op, const void *buf,
+			  size_t len);
+
+/**
+ * Copy between two operands, following both lists.
+ *
+ * @dst           destination operand in host memory
+ * @src           source operand in host memory
+ * @len           bytes to copy
+ * @return        bytes copied, less if one operand is shorter, or
+ *                SNAP_EINVAL
+ */
+ssize_t snap_addr_copy(const struct snap_addr *dst,
+		       const struct snap_addr *src, size_t len);
+
+/******************************************************************************
+ * SNAP Card Pool
+ *****************************************************************************/
+
+/*
+ * Several slave contexts, on one or more cards, attached to the same
+ * action type. Threads sharing a pool get their jobs spread over all
+ * contexts, each context runs one job at a time. In CPU mode
+ * (SNAP_CONFIG=CPU) every context is an emulated card.
+ */
+struct snap_card_pool;
+
+typedef enum snap_pool_policy {
+	SNAP_POOL_LEAST_LOADED = 0,	/* Card with fewest jobs in flight */
+	SNAP_POOL_ROUND_ROBIN = 1,	/* Next idle context in turn */
+} snap_pool_policy_t;
+
+struct snap_card_pool_stats {
+	int card_no;
+	int busy;			/* Context runs a job */
+	unsigned int card_inflight;	/* Jobs in flight on its card */
+	unsigned long jobs;		/* Jobs run on the context */
+	unsigned long errors;		/* Jobs which failed */
+};
+
+/**
+ * Open @contexts slave contexts on each of the cards and attach the
+ * action on each of them. The policy is SNAP_POOL_LEAST_LOADED.
+ *
+ * @card_no       array of card numbers, as in /dev/cxl/afu<card_no>.0s
+ * @ncards        entries in card_no
+ * @contexts      contexts to open per card
+ * @action_type   action to attach
+ * @action_flags  as for snap_attach_action()
+ * @attach_timeout_sec  as for snap_attach_action()
+ * @return        pool, NULL on error and errno is set
+ */
+struct snap_card_pool *snap_card_pool_alloc(const int *card_no,
+					    unsigned int ncards,
+					    unsigned int contexts,
+					    snap_action_type_t action_type,
+					    snap_action_flag_t action_flags,
+					    int attach_timeout_sec);
+
+/**
+ * Detach the actions and close all contexts of a pool. No job may be
+ * in flight.
+ *
+ * @pool          pool, NULL is ignored
+ */
+void snap_card_pool_free(struct snap_card_pool *pool);
+
+/**
+ * Select how the pool picks a context for the next job.
+ *
+ * @pool          pool
+ * @policy        SNAP_POOL_LEAST_LOADED or SNAP_POOL_ROUND_ROBIN
+ * @return        SNAP_OK, or SNAP_EINVAL for an unknown policy
+ */
+int snap_card_pool_set_policy(struct snap_card_pool *pool,
+			      snap_pool_policy_t policy);
+
+/**
+ * @pool          pool
+ * @return        number of contexts in the pool
+ */
+unsigned int snap_card_pool_contexts(struct snap_card_pool *pool);
+
+/**
+ * Take an idle context out of the pool, for callers which drive the
+ * action themselves, e.g. with snap_action_start(). Blocks until a
+ * context is idle.
+ *
+ * @pool          pool
+ * @timeout_sec   time to wait for an idle context
+ * @return        attached action, NULL and errno ETIMEDOUT if no
+ *                context became idle in time
+ */
+struct snap_action *snap_card_pool_get(struct snap_card_pool *pool,
+				       unsigned int timeout_sec);
+
+/**
+ * Hand a context from snap_card_pool_get() back to the pool. The
+ * action must be idle, after a timeout detach it and attach it again
+ * first.
+ *
+ * @pool          pool
+ * @action        action from snap_card_pool_get()
+ * @return        SNAP_OK, or SNAP_EINVAL if action is not taken from
+ *                this pool
+ */
+int snap_card_pool_put(struct snap_card_pool *pool,
+		       struct snap_action *action);
+
+/**
+ * Run a job on the context picked by the pool policy and wait for it,
+ * like snap_action_sync_execute_job(). Can be called from many
+ * threads at once. If the job fails, e.g. times out, the action of the
+ * context is attached again before the context runs another job.
+ *
+ * @pool          pool
+ * @cjob          job, retc and output are set on return
+ * @timeout_sec   time to wait for an idle context and again for the job
+ * @return        SNAP_OK if the job ran, else error
+ */
+int snap_card_pool_execute_job(struct snap_card_pool *pool,
+			       struct snap_job *cjob,
+			       unsigned int timeout_sec);
+
+/**
+ * Per context counters of a pool.
+ *
+ * @pool          pool
+ * @stats         array of n entries
+ * @n             size of stats
+ * @return        number of entries filled in
+ */
+int snap_card_pool_get_stats(struct snap_card_pool *pool,
+			     struct snap_card_pool_stats *stats,
+			     unsigned int n);
+
+/******************************************************************************
+ * SNAP Event Loop
+ *****************************************************************************/
+
+/*
+ * Waits for the done interrupts of many actions, on one or more cards,
+ * with a single epoll set, so one thread can drive many contexts. Each
+ * action added to the loop runs at most one job at a time. The loop is
+ * not thread safe.
+ */
+struct snap_event_loop;
+
+/**
+ * Called from snap_event_loop_run() when a job is done or timed out.
+ * May submit the next job for the action.
+ *
+ * @action        action which ran the job
+ * @cjob          the job, retc and output are set
+ * @rc            SNAP_OK, or the error snap_action_sync_execute_job()
+ *                would return, e.g. SNAP_ETIMEDOUT
+ * @priv          as passed to snap_event_loop_submit()
+ */
+typedef void (*snap_event_cb_t)(struct snap_action *action,
+				struct snap_job *cjob, int rc, void *priv);
+
+struct snap_event_loop *snap_event_loop_alloc(void);
+void snap_event_loop_free(struct snap_event_loop *loop);
+
+/**
+ * Register an action. It must be attached with SNAP_ACTION_DONE_IRQ.
+ *
+ * @loop          event loop
+ * @action        attached action
+ * @return        SNAP_OK, or SNAP_EINVAL if the action has no done
+ *                interrupt or is registered already
+ */
+int snap_event_loop_add(struct snap_event_loop *loop,
+			struct snap_action *action);
+
+/**
+ * Remove an action which has no job in flight. An action whose job
+ * timed out can be removed and should then be detached.
+ *
+ * @return        SNAP_OK, SNAP_ENOENT or SNAP_EBUSY
+ */
+int snap_event_loop_del(struct snap_event_loop *loop,
+			struct snap_action *action);
+
+/**
+ * Write the job to the action and start it, without waiting. The
+ * callback is called by snap_event_loop_run() once the job is done.
+ *
+ * @loop          event loop
+ * @action        registered action without a job in flight
+ * @cjob          job, must stay valid until the callback
+ * @timeout_sec   time after which the job is completed as timed out
+ * @cb            completion callback, may be NULL
+ * @priv          passed to cb
+ * @return        SNAP_OK, SNAP_EBUSY if a job is in flight or a timed
+ *                out job still runs, SNAP_ENOENT if the action is not
+ *                registered, else error
+ */
+int snap_event_loop_submit(struct snap_event_loop *loop,
+			   struct snap_action *action,
+			   struct snap_job *cjob,
+			   unsigned int timeout_sec,
+			   snap_event_cb_t cb, void *priv);
+
+/**
+ * Wait for completions once and call their callbacks.
+ *
+ * @loop          event loop
+ * @timeout_ms    maximum time to wait, -1 waits until a job completes
+ *                or times out
+ * @return        jobs completed, 0 if none (also if no job is in
+ *                flight), SNAP_EIO if waiting failed
+ */
+int snap_event_loop_run(struct snap_event_loop *loop, int timeout_ms);
+
+/**
+ * @return        jobs in flight
+ */
+unsigned int snap_event_loop_pending(struct snap_event_loop *loop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,12 +20,14 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <libsnap.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <sys/syscall.h>   /* For SYS_xxx definitions */
 
 #include "snap_queue.h"
+#include "snap_tracebuf.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -75,8 +77,107 @@ struct snap_funcs {
 	int (* mmio_read64)(struct snap_card *card, uint64_t offset, uint64_t *data);
 	void (* card_free)(struct snap_card *card);
 	int (* card_ioctl)(struct snap_card *card, unsigned int cmd, unsigned long arg);
+	int (* wait_irq)(struct snap_card *card, unsigned long timeout_usec,
+			 int expect_irq);
 };
 
+/* Statistics of one card context, see snap_stats.c */
+struct snap_stats_block;
+struct snap_shm_slot;
+
+struct snap_stats_ctx {
+	uint64_t id;			/* Unique, never reused */
+	struct snap_stats_block *blocks; /* One per counting thread */
+	struct snap_stats base;		/* Snapshot at attach */
+	uint64_t t_start;		/* nsec, action started */
+	struct snap_shm_slot *shm;	/* Published here if not NULL */
+	uint64_t shm_next;		/* nsec, next publish */
+	int shm_busy;			/* A thread is publishing */
+};
+
+void snap_stats_init(struct snap_stats_ctx *ctx);
+void snap_stats_free(struct snap_stats_ctx *ctx);
+struct snap_stats *snap_stats_local(struct snap_stats_ctx *ctx);
+void snap_stats_hist_add(struct snap_stats_hist *h, uint64_t nsec);
+void snap_stats_op(struct snap_stats_ctx *ctx, enum snap_stats_op op,
+		   uint64_t nsec);
+void snap_stats_sum(struct snap_stats_ctx *ctx, struct snap_stats *out);
+void snap_stats_diff(struct snap_stats *out, const struct snap_stats *a,
+		     const struct snap_stats *b);
+void snap_stats_shm_open(struct snap_stats_ctx *ctx, const char *name);
+void snap_stats_shm_attach(struct snap_stats_ctx *ctx, uint32_t action_type);
+void snap_stats_shm_close(struct snap_stats_ctx *ctx);
+void snap_stats_shm_publish(struct snap_stats_ctx *ctx);
+
+/* NUMA placement, see snap_numa.c */
+#define SNAP_NUMA_NODES_MAX	64
+
+int snap_numa_card_node(const char *path);
+bool snap_numa_prefer(int node);
+void snap_numa_unprefer(void);
+void snap_buf_default_node(int node);
+
+/* Job manager state of one context on a virtual card, see snap_vcard.c */
+struct snap_vcard;
+
+struct snap_vctx {
+	struct snap_vcard *vc;
+	bool master;
+	int cir;			/* Context id */
+	int state;			/* SNAP_VCTX_* */
+	int aid;			/* Action instance, -1 if none */
+	uint64_t ccr;			/* Context Configuration Register */
+	uint16_t seq;			/* Of the CCR setup */
+	uint64_t ready_nsec;		/* End of attach or detach latency */
+};
+
+int snap_vcard_open(struct snap_vctx *x, const char *path,
+		    const snap_action_type_t *types, int ntypes);
+void snap_vcard_close(struct snap_vctx *x);
+int snap_vcard_read64(struct snap_vctx *x, uint64_t offs, uint64_t *data);
+int snap_vcard_write64(struct snap_vctx *x, uint64_t offs, uint64_t data);
+int snap_vcard_read32(struct snap_vctx *x, uint64_t offs, uint32_t *data);
+int snap_vcard_write32(struct snap_vctx *x, uint64_t offs, uint32_t data);
+bool snap_vcard_attached(struct snap_vctx *x);
+int snap_vcard_wait_attach(struct snap_vctx *x, unsigned long timeout_usec);
+void snap_vcard_delay(struct snap_vctx *x);
+
+/* MMIO record and replay, see snap_mrec.c and snap_mrec.h */
+struct snap_mrec_log;
+struct snap_mrec_ctx;
+struct snap_mplay;
+
+int snap_mrec_init(const char *file, uint32_t flags);
+struct snap_mrec_log *snap_mrec_open(const char *path, bool master, int cir,
+				     uint64_t cap_reg);
+void snap_mrec_add(struct snap_mrec_log *l, unsigned int op, uint64_t offs,
+		   uint64_t data);
+void snap_mrec_close(struct snap_mrec_log *l);
+struct snap_mplay *snap_mplay_open(const char *file, const char *path,
+				   struct snap_mrec_ctx *ctx, uint32_t *flags);
+int snap_mplay_read(struct snap_mplay *p, unsigned int op, uint64_t offs,
+		    uint64_t *data);
+int snap_mplay_write(struct snap_mplay *p, unsigned int op, uint64_t offs,
+		     uint64_t data);
+int snap_mplay_irq(struct snap_mplay *p, int irq);
+void snap_mplay_close(struct snap_mplay *p);
+
+/* Only the owning thread writes, readers may see any recent value */
+static inline void snap_stats_inc(uint64_t *p, uint64_t v)
+{
+	__atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+uint64_t snap_stats_nsec(void);
+
+/*
+ * For callers which wait on snap_card_get_fd() themselves: was the
+ * action attached with SNAP_ACTION_DONE_IRQ, and read the pending
+ * interrupt event without blocking (0 if there was one).
+ */
+bool snap_action_irq_enabled(struct snap_action *action);
+int snap_action_irq_ack(struct snap_action *action);
+
 static inline pid_t __gettid(void)
 {
 	return (pid_t)syscall(SYS_gettid);
@@ -89,17 +190,39 @@ static inline long long __get_usec(void)
 	return t.tv_sec * 1000000LL + t.tv_usec;
 }
 
+/*
+ * Hint to the core that we are in a busy wait loop. On POWER this
+ * drops the SMT thread priority for a moment, so the sibling threads
+ * can make progress, on x86 it is the pause instruction.
+ */
+static inline void snap_cpu_relax(void)
+{
+#if defined(__powerpc__) || defined(__powerpc64__)
+	__asm__ __volatile__("or 1,1,1\n\tor 2,2,2" : : : "memory");
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" : : : "memory");
+#endif
+}
+
 int action_trace_enabled(void);
 int block_trace_enabled(void);
 int cache_trace_enabled(void);
 int stat_trace_enabled(void);
 int pp_trace_enabled(void);
+int pool_trace_enabled(void);
 
 #define act_trace(fmt, ...) do {					\
 		if (action_trace_enabled())				\
 			fprintf(stderr, "A " fmt, ## __VA_ARGS__);	\
 	} while (0)
 
+#define pool_trace(fmt, ...) do {					\
+		if (pool_trace_enabled())				\
+			fprintf(stderr, "Q " fmt, ## __VA_ARGS__);	\
+	} while (0)
+
 #define block_trace(fmt, ...) do {                                     \
 		if (block_trace_enabled()) {                           \
 			fprintf(stderr, "B %08x.%08x %-16lld " fmt,    \
@@ -132,11 +255,38 @@ int pp_trace_enabled(void);
 		}                                                      \
 	} while (0)
 
+/* Binary event trace, SNAP_TRACE=0x400, see snap_tracebuf.h */
+extern int snap_tev_on;
+
+void snap_tev_init(void);
+int snap_tev_dump(const char *path);
+void __snap_tev(uint32_t id, uint64_t a0, uint64_t a1);
+
+static inline uint64_t snap_tev_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__powerpc64__) || defined(__powerpc__)
+	return __builtin_ppc_get_timebase();
+#else
+	return snap_stats_nsec();
+#endif
+}
+
+#define snap_tev(id, a0, a1) do {					\
+		if (__builtin_expect(snap_tev_on, 0))			\
+			__snap_tev((id), (uint64_t)(a0), (uint64_t)(a1)); \
+	} while (0)
+
 /**
  * Register a software version of the FPGA action to enable us
  * simulating high-level behavior of the same and allowing us to
  * implement the host applications even before the real hardware
  * implementation is completely working.
+ *
+ * The registered structure is used as template. Every card context
+ * which attaches the action works on its own copy, which holds the
+ * workitem, the results and the state of that context.
  */
 enum snap_action_state {
 	ACTION_IDLE = 0,
@@ -170,6 +320,7 @@ struct snap_sim_action {
 			     uint64_t offset, uint64_t *data);
 
 	struct snap_sim_action *next;
+	struct snap_sim_action *hnext;	/* In the action_type hash */
 };
 
 int snap_action_register(struct snap_sim_action *action);
@@ -0,0 +1,80 @@
+#ifndef __SNAP_MREC_H__
+#define __SNAP_MREC_H__
+
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * MMIO recordings. With SNAP_MMIO_RECORD=<file> libsnap logs every
+ * MMIO access and interrupt wait of each card context. With
+ * SNAP_MMIO_REPLAY=<file> no card is used: reads are answered from
+ * the recording and writes are checked against it.
+ *
+ * File layout: struct snap_mrec_file, then per context, in the order
+ * the contexts were freed, a struct snap_mrec_ctx followed by its
+ * records, the oldest first. Replay hands them out by seq.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_MREC_MAGIC		0x534e4d52	/* "SNMR" */
+#define SNAP_MREC_VERSION	1
+
+#define SNAP_MREC_JM		0x0001	/* Job manager accesses recorded */
+
+struct snap_mrec_file {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;			/* SNAP_MREC_* */
+	uint32_t reserved;
+};
+
+struct snap_mrec_ctx {
+	char path[64];			/* Device of the context */
+	uint32_t nrec;			/* Records which follow */
+	int32_t cir;			/* Context id */
+	uint32_t master;
+	uint32_t seq;			/* Order of allocation */
+	uint64_t cap_reg;		/* SNAP_S_CAP */
+};
+
+/* Operation in the upper 4 bits of offs_op */
+#define SNAP_MREC_READ32	0x1
+#define SNAP_MREC_WRITE32	0x2
+#define SNAP_MREC_READ64	0x3
+#define SNAP_MREC_WRITE64	0x4
+#define SNAP_MREC_IRQ		0x5	/* offs: irq, data: rc */
+#define SNAP_MREC_ERR		0x8	/* Or'ed in, the access failed */
+
+#define SNAP_MREC_OFFS_MASK	0x0fffffff
+#define SNAP_MREC_OP(r)		((r)->offs_op >> 28)
+#define SNAP_MREC_OFFS(r)	((r)->offs_op & SNAP_MREC_OFFS_MASK)
+
+struct snap_mrec {
+	uint64_t data;
+	uint32_t offs_op;
+	uint32_t dt_nsec;		/* Since the previous record, saturated */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_MREC_H__ */
@@ -65,6 +65,23 @@ extern "C" {
  * implementation.
  */
 
+/*
+ * Workitem flags. With SNAP_WORKITEM_RING the workitem is a doorbell:
+ * user.ext points to an array of workitems in host memory, which the
+ * action executes in order. Each entry is written back in place with
+ * its retc and output parameters, like ACTION_PARAMS_OUT for a single
+ * job.
+ *
+ * With SNAP_WORKITEM_CREC, priv_data holds the host address of a
+ * cacheline sized completion record. When the job is done, the action
+ * writes the workitem with retc and output parameters there, setting
+ * SNAP_WORKITEM_DONE in flags last, and only then goes idle.
+ */
+#define SNAP_WORKITEM_EXEC	0x01	/* Execute the job */
+#define SNAP_WORKITEM_RING	0x02	/* user.ext is a ring of workitems */
+#define SNAP_WORKITEM_CREC	0x04	/* priv_data is a completion record */
+#define SNAP_WORKITEM_DONE	0x80	/* Set in the completion record */
+
 struct snap_queue_workitem {
 	uint8_t short_action;		/* Job Manager Short Action ID */
 	uint8_t flags;			/* 0 is reserved for 1st start
@@ -0,0 +1,66 @@
+#ifndef __SNAP_SHM_H__
+#define __SNAP_SHM_H__
+
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Layout of the statistics segment libsnap publishes per process in
+ * /dev/shm/snap_stats.<pid> when SNAP_STATS_SHM is set. There is one
+ * slot per open card context. A slot is updated under a sequence lock:
+ * seq is odd while it is written. Readers copy the slot and retry if
+ * seq was odd or has changed meanwhile.
+ */
+
+#include <stdint.h>
+#include <libsnap.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_SHM_DIR		"/dev/shm"
+#define SNAP_SHM_PREFIX		"snap_stats."
+#define SNAP_SHM_MAGIC		0x534e4150	/* "SNAP" */
+#define SNAP_SHM_VERSION	1
+#define SNAP_SHM_SLOTS		64
+
+struct snap_shm_slot {
+	uint32_t seq;			/* Odd while being written */
+	uint32_t in_use;
+	uint64_t ctx_id;		/* Changes if the slot is reused */
+	uint32_t action_type;		/* 0 if no action is attached */
+	uint32_t inflight;		/* Jobs running on the context */
+	uint64_t update_nsec;		/* CLOCK_MONOTONIC of last update */
+	char name[64];			/* Device of the context */
+	struct snap_stats s;		/* Since the context was opened */
+} __attribute__((aligned(64)));
+
+struct snap_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t nslots;
+	uint64_t period_nsec;		/* Update interval */
+	char comm[32];			/* Program name */
+	struct snap_shm_slot slot[SNAP_SHM_SLOTS];
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_SHM_H__ */
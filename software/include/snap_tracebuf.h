@@ -0,0 +1,109 @@
+#ifndef __SNAP_TRACEBUF_H__
+#define __SNAP_TRACEBUF_H__
+
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Binary event tracing. With SNAP_TRACE=0x400 every thread records
+ * events into its own ring of SNAP_TRACE_EVENTS entries (default 64K),
+ * with a time stamp counter value and two integer arguments. Nothing is
+ * formatted while the program runs. At exit the rings are written to
+ * SNAP_TRACE_FILE (default snap_trace.<pid>.bin), the snap_trace tool
+ * decodes the file to text or to Chrome trace-event JSON.
+ *
+ * Events are B(egin)/E(nd) pairs, which must nest within one thread,
+ * b/e pairs, which may overlap and are matched by their first argument,
+ * or I(nstant). Append new events at the end of the list and bump
+ * SNAP_TEV_VERSION when the list changes.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_TEV_LIST(X)						\
+	X(SNAP_TEV_ATTACH,	"attach",	'B', "action_type", "flags") \
+	X(SNAP_TEV_ATTACH_END,	"attach",	'E', "rc", "")		\
+	X(SNAP_TEV_DETACH,	"detach",	'B', "", "")		\
+	X(SNAP_TEV_DETACH_END,	"detach",	'E', "rc", "")		\
+	X(SNAP_TEV_SET_REGS,	"set_regs",	'B', "win_size", "")	\
+	X(SNAP_TEV_SET_REGS_END, "set_regs",	'E', "rc", "")		\
+	X(SNAP_TEV_RUN,		"run",		'b', "ctx", "action_type") \
+	X(SNAP_TEV_RUN_END,	"run",		'e', "ctx", "nsec")	\
+	X(SNAP_TEV_WAIT,	"wait",		'B', "timeout_usec", "irq") \
+	X(SNAP_TEV_WAIT_END,	"wait",		'E', "idle", "rc")	\
+	X(SNAP_TEV_IRQ_WAIT,	"irq_wait",	'I', "timeout_usec", "") \
+	X(SNAP_TEV_MMIO_RD,	"mmio_rd",	'I', "offset", "data")	\
+	X(SNAP_TEV_MMIO_WR,	"mmio_wr",	'I', "offset", "data")	\
+	X(SNAP_TEV_BLK_READ,	"cblk_read",	'B', "lba", "nblocks")	\
+	X(SNAP_TEV_BLK_READ_END, "cblk_read",	'E', "rc", "")		\
+	X(SNAP_TEV_BLK_WRITE,	"cblk_write",	'B', "lba", "nblocks")	\
+	X(SNAP_TEV_BLK_WRITE_END, "cblk_write", 'E', "rc", "")		\
+	X(SNAP_TEV_BLK_HW_REQ,	"hw_req",	'I', "slot", "lba")	\
+	X(SNAP_TEV_BLK_HW_DONE,	"hw_done",	'I', "slot", "lba")	\
+	X(SNAP_TEV_BLK_CACHE_HIT, "cache_hit",	'I', "lba", "")		\
+	X(SNAP_TEV_BLK_CACHE_MISS, "cache_miss", 'I', "lba", "")	\
+	X(SNAP_TEV_BLK_PREFETCH, "prefetch",	'I', "lba", "nblocks")	\
+	X(SNAP_TEV_BLK_PREFETCH_SKIP, "prefetch_skip", 'I', "lba", "status")
+
+#define SNAP_TEV_ENUM(id, name, kind, a0, a1)	id,
+enum snap_tev_id {
+	SNAP_TEV_LIST(SNAP_TEV_ENUM)
+	SNAP_TEV_IDS,
+};
+#undef SNAP_TEV_ENUM
+
+struct snap_tev {
+	uint64_t tsc;			/* Time stamp counter */
+	uint32_t id;			/* enum snap_tev_id */
+	uint32_t cpu;			/* Reserved, 0 */
+	uint64_t a0;
+	uint64_t a1;
+};
+
+/*
+ * File layout: struct snap_tev_file, then per ring a struct
+ * snap_tev_ring_hdr followed by its events, the oldest first. The tsc
+ * and nsec pairs taken at start and at dump convert the time stamps.
+ */
+#define SNAP_TEV_MAGIC		0x534e5442	/* "SNTB" */
+#define SNAP_TEV_VERSION	1
+
+struct snap_tev_file {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t nrings;
+	uint32_t nids;			/* SNAP_TEV_IDS of the writer */
+	uint32_t reserved;
+	uint64_t tsc0, nsec0;		/* At trace start */
+	uint64_t tsc1, nsec1;		/* At dump */
+};
+
+struct snap_tev_ring_hdr {
+	uint32_t tid;
+	uint32_t nev;			/* Events which follow */
+	uint64_t lost;			/* Overwritten, older ones */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_TRACEBUF_H__ */
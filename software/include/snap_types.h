@@ -43,7 +43,7 @@ extern "C" {
 #define SNAP_ADDRFLAG_END		0x0001 /* last element in the list */
 #define SNAP_ADDRFLAG_ADDR		0x0002 /* this one is an address */
 #define SNAP_ADDRFLAG_DATA		0x0004 /* 64-bit address */
-#define SNAP_ADDRFLAG_EXT		0x0008 /* reserved for extension */
+#define SNAP_ADDRFLAG_EXT		0x0008 /* addr points to a list */
 #define SNAP_ADDRFLAG_SRC		0x0010 /* data source */
 #define SNAP_ADDRFLAG_DST		0x0020 /* data destination */
 
@@ -57,6 +57,17 @@ typedef struct snap_addr {
         snap_addrflag_t flags;		/* SRC, DST, EXT, ... */
 } snap_addr_t;				/* 16 bytes */
 
+/*
+ * Scatter-gather lists: An operand with SNAP_ADDRFLAG_EXT does not
+ * describe the data itself. Its addr points to an array of struct
+ * snap_addr in host memory, size is the total number of data bytes.
+ * The entries describe the data segments in order, the last one has
+ * SNAP_ADDRFLAG_END set. An entry with SNAP_ADDRFLAG_EXT links to the
+ * next array. The list must be 16 byte aligned. For hardware actions
+ * the segments must start on a 64 byte boundary and all but the last
+ * segment must be a multiple of 64 bytes long.
+ */
+
 static inline void snap_addr_set(struct snap_addr *da,
 				 const void *addr,
 				 uint32_t size,
@@ -23,7 +23,13 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <endian.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <dirent.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include <libsnap.h>
 #include <libcxl.h>
@@ -31,7 +37,9 @@
 #include <snap_internal.h>
 #include <snap_queue.h>
 #include <snap_s_regs.h>    /* Include SNAP Slave Regs */
+#include <snap_m_regs.h>    /* Action space size */
 #include <snap_hls_if.h>    /* Include SNAP -> HLS */
+#include <snap_mrec.h>
 
 
 /* Trace hardware implementation */
@@ -39,6 +47,10 @@ static unsigned int snap_trace = 0x0;
 static unsigned int snap_config = 0x0;
 static struct snap_sim_action *actions = NULL;
 
+#define SNAP_ACTION_HASH	64	/* Buckets, power of 2 */
+static struct snap_sim_action *action_hash[SNAP_ACTION_HASH];
+static pthread_mutex_t action_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define snap_trace_enabled()  (snap_trace & 0x0001)
 #define reg_trace_enabled()   (snap_trace & 0x0002)
 #define sim_trace_enabled()   (snap_trace & 0x0004)
@@ -69,7 +81,13 @@ int pp_trace_enabled(void)
 	return snap_trace & 0x0100;
 }
 
+int pool_trace_enabled(void)
+{
+	return snap_trace & 0x0200;
+}
+
 #define software_action_enabled()  (snap_config & 0x01)
+#define virtual_card_enabled()     (snap_config & 0x02)
 
 #define snap_trace(fmt, ...) do { \
 		if (snap_trace_enabled()) \
@@ -92,6 +110,7 @@ int pp_trace_enabled(void)
 	} while (0)
 
 #define	INVALID_SAT 0x0ffffffff
+#define	SNAP_ATRI_MAX	16		/* Max actions in SNAP_S_SSR */
 
 struct snap_card {
 	void *priv;
@@ -99,12 +118,11 @@ struct snap_card {
 	bool master;                    /* True if this is Master Device */
 	int cir;                        /* Context id */
 	void *mmio_ptr;
+	bool mmio_fast;                 /* Access mmio_ptr directly */
 	uint32_t action_base;
 	uint16_t vendor_id;
 	uint16_t device_id;
 	snap_action_type_t action_type;	/* Action Type for attach */
-	snap_action_type_t action_typeq;/* Action Type i like to have for q */
-	snap_action_flag_t action_flags;
 	uint32_t sat;                   /* Short Action Type */
 	bool start_attach;
 	snap_action_flag_t flags;       /* Flags from Application */
@@ -112,12 +130,39 @@ struct snap_card {
 	int afu_fd;
 
 	struct snap_sim_action *action; /* software simulation mode */
+	pthread_t sim_tid;              /* Runs software action */
+	pthread_mutex_t sim_lock;
+	pthread_cond_t sim_c;           /* Start, stop and idle changes */
+	bool sim_thread;                /* sim_tid is running */
+	bool sim_start;                 /* ACTION_CONTROL_START was written */
+	bool sim_stop;
+	uint32_t sim_irq_control;       /* ACTION_IRQ_CONTROL */
+	uint32_t sim_irq_app;           /* ACTION_IRQ_APP */
 	size_t errinfo_size;            /* Size of errinfo */
 	void *errinfo;                  /* Err info Buffer */
 	struct cxl_event event;         /* Buffer to keep event from IRQ */
 	unsigned int attach_timeout_sec;
-	unsigned int queue_length;      /* unused */
+	bool attached;                  /* Action is attached to context */
+	struct snap_attach_stats astats;
+	int atri_num;                   /* Valid entries in atri, -1: unread */
+	struct {
+		snap_action_type_t action_type;
+		uint32_t sat;
+	} atri[SNAP_ATRI_MAX];          /* Copy of the ATRI registers */
+	struct snap_queue_workitem *ring; /* Workitems for batch execution */
+	struct snap_queue_workitem *crec; /* Completion record */
+	uint16_t crec_seq;              /* Seq of the job using crec */
+	bool crec_pending;              /* Wait on crec instead of MMIO */
+	unsigned int ring_entries;
+	struct snap_completion_policy policy; /* How to wait for the action */
+	struct snap_completion_stats cstats;
+	struct snap_stats_ctx stats;    /* Counters and latencies */
+	struct snap_vctx vctx;          /* Virtual card job manager state */
+	struct snap_mrec_log *mrec;     /* MMIO recording */
+	struct snap_mplay *mplay;       /* MMIO replay */
+	bool mplay_jm;                  /* Replay includes the job manager */
 	uint64_t cap_reg;               /* Capability Register */
+	int numa_node;                  /* -1 if unknown */
 	const char *name;               /* Card name */
 };
 
@@ -169,6 +214,43 @@ static unsigned long tget_ms(void)
 	return tms;
 }
 
+/*	Get monotonic Time in usec, not affected by clock adjustments */
+static unsigned long long tget_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000ull +
+		(unsigned long long)(now.tv_nsec / 1000);
+}
+
+/* Wait usec, short delays relax the CPU, longer ones give it away */
+static void snap_action_backoff(unsigned long usec)
+{
+	unsigned long long t0;
+
+	if (usec >= SNAP_POLL_SLEEP_USEC) {
+		usleep(usec);
+		return;
+	}
+	t0 = tget_us();
+	do {
+		snap_cpu_relax();
+	} while (tget_us() - t0 < usec);
+}
+
+/*
+ * Default completion policy: Spin long enough to catch short jobs
+ * without a context switch, then back off. Long jobs end up in the
+ * irq wait or in a poll loop which sleeps most of the time.
+ */
+static const struct snap_completion_policy snap_default_policy = {
+	.spin_usec = 100,
+	.poll_usec = 1000,
+	.backoff_min_usec = 1,
+	.backoff_max_usec = 1000,
+};
+
 static void *hw_snap_card_alloc_dev(const char *path,
 				    uint16_t vendor_id,
 				    uint16_t device_id)
@@ -196,6 +278,7 @@ static void *hw_snap_card_alloc_dev(const char *path,
 
 	dn->sat = INVALID_SAT;	/* Invalid Short Action Type stands for not attached */
 	dn->action_type = 0xffffffff;
+	dn->atri_num = -1;
 	dn->vendor_id = vendor_id;
 	/* Read and check Vendor id if it was given by caller */
 	if (0xffff != vendor_id) {
@@ -277,6 +360,43 @@ static void *hw_snap_card_alloc_dev(const char *path,
 	return NULL;
 }
 
+/*
+ * The job manager protocol in hw_attach_action() and hw_detach_action()
+ * goes through df, such that the virtual card can run it as well.
+ */
+static struct snap_funcs hardware_funcs;
+static struct snap_funcs *df = &hardware_funcs;
+
+/*
+ * Fast MMIO: Access the mapped MMIO area directly. Other than
+ * cxl_mmio_*() this does not put a hwsync around each access. Stores
+ * are posted, a read or snap_mmio_barrier() orders them. The area was
+ * mapped with CXL_MMIO_BIG_ENDIAN.
+ */
+static inline void __mmio_write32(struct snap_card *card,
+				  uint64_t offset, uint32_t data)
+{
+	*(volatile uint32_t *)(card->mmio_ptr + offset) = htobe32(data);
+}
+
+static inline uint32_t __mmio_read32(struct snap_card *card, uint64_t offset)
+{
+	__sync_synchronize();
+	return be32toh(*(volatile uint32_t *)(card->mmio_ptr + offset));
+}
+
+static inline void __mmio_write64(struct snap_card *card,
+				  uint64_t offset, uint64_t data)
+{
+	*(volatile uint64_t *)(card->mmio_ptr + offset) = htobe64(data);
+}
+
+static inline uint64_t __mmio_read64(struct snap_card *card, uint64_t offset)
+{
+	__sync_synchronize();
+	return be64toh(*(volatile uint64_t *)(card->mmio_ptr + offset));
+}
+
 static int hw_snap_mmio_write32(struct snap_card *card,
 		uint64_t offset, uint32_t data)
 {
@@ -287,6 +407,10 @@ static int hw_snap_mmio_write32(struct snap_card *card,
 
 		reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
 			(long long)offset, (long)data);
+		if (card->mmio_fast) {
+			__mmio_write32(card, offset, data);
+			return 0;
+		}
 		rc = cxl_mmio_write32(card->afu_h, offset, data);
 	} else {
 		reg_trace("  %s Error\n", __func__);
@@ -304,7 +428,11 @@ static int hw_snap_mmio_read32(struct snap_card *card,
 	if ((card) && (card->afu_h)) {
 		offset += card->action_base; /* FIXME use action_*32 instead */
 
-		rc = cxl_mmio_read32(card->afu_h, offset, data);
+		if (card->mmio_fast) {
+			*data = __mmio_read32(card, offset);
+			rc = 0;
+		} else
+			rc = cxl_mmio_read32(card->afu_h, offset, data);
 		reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
 			(long long)offset, (long)*data, rc);
 	} else {
@@ -333,7 +461,7 @@ int snap_mmio_read32_nohwsync(struct snap_card *card,
 	}
 
 	offset += card->action_base; /* FIXME use action_*32 instead */
-	*data = be32toh(*(uint32_t *)(card->mmio_ptr + offset));
+	*data = be32toh(*(volatile uint32_t *)(card->mmio_ptr + offset));
 
 	reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
 		(long long)offset, (long)*data, rc);
@@ -350,7 +478,11 @@ static int hw_snap_mmio_write64(struct snap_card *card,
 	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
 		  (long long)offset, (long long)data);
 	if ((card) && (card->afu_h)) {
-		rc = cxl_mmio_write64(card->afu_h, offset, data);
+		if (card->mmio_fast) {
+			__mmio_write64(card, offset, data);
+			rc = 0;
+		} else
+			rc = cxl_mmio_write64(card->afu_h, offset, data);
 	} else {
 		errno = EINVAL;
 	}
@@ -363,7 +495,11 @@ static int hw_snap_mmio_read64(struct snap_card *card,
 	int rc = -1;
 
 	if ((card) && (card->afu_h)) {
-		rc = cxl_mmio_read64(card->afu_h, offset, data);
+		if (card->mmio_fast) {
+			*data = __mmio_read64(card, offset);
+			rc = 0;
+		} else
+			rc = cxl_mmio_read64(card->afu_h, offset, data);
 	} else {
 		errno = EINVAL;
 	}
@@ -389,20 +525,21 @@ static void hw_snap_card_free(struct snap_card *card)
 	__free(card);
 }
 
-static int hw_wait_irq(struct snap_card *card, int timeout_sec, int expect_irq)
+static int hw_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+		       int expect_irq)
 {
 	fd_set  set;
 	struct  timeval timeout;
 	int rc = 0;
 
-	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %d sec\n",
+	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %ld usec\n",
 		__func__, card->afu_fd,
-		card->flags, expect_irq, timeout_sec);
+		card->flags, expect_irq, timeout_usec);
 
 __hw_wait_irq_retry:
 	if (!cxl_event_pending(card->afu_h)) {
-		timeout.tv_sec = timeout_sec;
-		timeout.tv_usec = 0;
+		timeout.tv_sec = timeout_usec / 1000000;
+		timeout.tv_usec = timeout_usec % 1000000;
 		FD_ZERO(&set);
 		FD_SET(card->afu_fd, &set);
 
@@ -505,23 +642,36 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 		 * maintain and readable.
 		 */
 
-		hw_snap_mmio_read64(card, SNAP_S_SSR, &data);
-		/* Check if configure Slave s done */
-		if (0x100 != (data & 0x100)) {
-			snap_trace("%s Error AFU SLAVE need's setup\n",
-				   __func__);
-			errno = ENODEV;
-			return NULL;
+		/*
+		 * The action table does not change while the card is
+		 * in use, so read it only once.
+		 */
+		if (card->atri_num < 0) {
+			df->mmio_read64(card, SNAP_S_SSR, &data);
+			/* Check if configure Slave s done */
+			if (0x100 != (data & 0x100)) {
+				snap_trace("%s Error AFU SLAVE need's setup\n",
+					   __func__);
+				errno = ENODEV;
+				return NULL;
+			}
+			maid = (int)(data & 0xf) + 1;	/* Max Actions */
+
+			for (i = 0; i < maid; i++) {
+				df->mmio_read64(card, SNAP_S_ATRI + i*8,
+						    &data);
+				card->atri[i].action_type =
+					(snap_action_type_t)(data & 0xffffffff);
+				card->atri[i].sat = (uint32_t)(data >> 32ll);
+			}
+			card->atri_num = maid;
+			card->astats.atri_scans++;
 		}
-		maid = (int)(data & 0xf) + 1;	/* Max Actions */
 
 		/* Search action to get Short Action type */
-		for (i = 0; i < maid; i++) {
-			hw_snap_mmio_read64(card, SNAP_S_ATRI + i*8, &data);
-			if (action_type ==
-			    (snap_action_type_t)(data & 0xffffffff)) {
-				sat = (uint32_t)(data >>  32ll);
-				/* Short Action Type */
+		for (i = 0; i < card->atri_num; i++) {
+			if (action_type == card->atri[i].action_type) {
+				sat = card->atri[i].sat; /* Short Action Type */
 				break;	/* Found */
 			}
 		}
@@ -545,7 +695,7 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 		data |= (card->sat << 12) | mode;
 
 		/* Short Action Type and Direct Access */
-		hw_snap_mmio_write64(card, SNAP_S_CCR, data);
+		df->mmio_write64(card, SNAP_S_CCR, data);
 		card->start_attach = true;
 		card->attach_timeout_sec = timeout_sec; /* Save timeout */ 
 	}
@@ -555,18 +705,19 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 		data = ((uint64_t)card->seq << 48ll) | 1;
 
 		/* Start: Attach action to context */
-		hw_snap_mmio_write64(card, SNAP_S_JCR, data);
+		df->mmio_write64(card, SNAP_S_JCR, data);
 		card->seq++;
 	}
 
 	if (SNAP_ATTACH_IRQ & card->flags)
-		rc = hw_wait_irq(card, timeout_sec, SNAP_ATTACH_IRQ_NUM);
+		rc = df->wait_irq(card, timeout_sec * 1000000ul,
+				 SNAP_ATTACH_IRQ_NUM);
 	else {
 		t0 = tget_ms();
 		dt = 0;
 		rc = EBUSY;
 		while (dt < (timeout_sec * 1000)) {
-			hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
+			df->mmio_read64(card, SNAP_S_CSR, &data);
 			if (SNAP_CSR_ATTACHED == (data & SNAP_CSR_ATTACHED)) {
 				rc = 0;
 				break;
@@ -593,6 +744,7 @@ static int hw_detach_action(struct snap_action *action)
 	struct snap_card *card;
 	unsigned long t0;
 	unsigned int dt = 0;
+	unsigned long backoff = 1;
 
 	if (action == NULL) {
 		snap_trace("%s Error NULL Action\n", __func__);
@@ -608,24 +760,25 @@ static int hw_detach_action(struct snap_action *action)
 	card->start_attach = true;              /* Set Flag to Attach next Time again */
 
 	/* Read Action Control and check Action Status */
-	hw_snap_mmio_read32(card, ACTION_CONTROL, &action_control);
+	df->mmio_read32(card, ACTION_CONTROL, &action_control);
 	if (ACTION_CONTROL_IDLE & action_control)
 		data = SNAP_JCR_STOP;           /* Action is IDLE, send Stop */
 	else    data = SNAP_JCR_ABORT;          /* Action is not IDLE, send Abort */
-	hw_snap_mmio_write64(card, SNAP_S_JCR, data);
+	df->mmio_write64(card, SNAP_S_JCR, data);
 
 	/* Wait until Action gets detached. */
 	rc = SNAP_EDETACH;
 	t0 = tget_ms();
 	while (dt < (card->attach_timeout_sec * 1000)) {
 		/* Check if Action is detached */
-		hw_snap_mmio_read64(card, SNAP_S_CSR, &data);
+		df->mmio_read64(card, SNAP_S_CSR, &data);
 		if (0 == (data & SNAP_CSR_ATT)) {
 			rc = 0;             /* Ok */
 			break;              /* Detached */
 		}
 		/* Action detach can take a while for ABORT */
-		usleep(1000);
+		snap_action_backoff(backoff);
+		backoff = MIN(backoff * 2, 1000ul);
 		dt = (unsigned int)(tget_ms() - t0);
 	}
 
@@ -708,16 +861,39 @@ static struct snap_funcs hardware_funcs = {
 	.mmio_read64 = hw_snap_mmio_read64,
 	.card_free = hw_snap_card_free,
 	.card_ioctl = hw_card_ioctl,
+	.wait_irq = hw_wait_irq,
 };
 
-/* We access the hardware via this function pointer struct */
-static struct snap_funcs *df = &hardware_funcs;
-
 struct snap_card *snap_card_alloc_dev(const char *path,
 				      uint16_t vendor_id,
 				      uint16_t device_id)
 {
-	return df->card_alloc_dev(path, vendor_id, device_id);
+	struct snap_card *card;
+
+	card = df->card_alloc_dev(path, vendor_id, device_id);
+	if (card) {
+		card->policy = snap_default_policy;
+		card->numa_node = snap_numa_card_node(path);
+		snap_buf_default_node(card->numa_node);
+		snap_stats_init(&card->stats);
+		snap_stats_shm_open(&card->stats, path);
+	}
+	return card;
+}
+
+int snap_card_numa_node(struct snap_card *card)
+{
+	return card ? card->numa_node : -1;
+}
+
+static int __snap_detach_action(struct snap_card *card)
+{
+	int rc;
+
+	rc = df->detach_action((struct snap_action *)card);
+	card->attached = false;
+	card->astats.detaches++;
+	return rc;
 }
 
 struct snap_action *snap_attach_action(struct snap_card *card,
@@ -725,27 +901,144 @@ struct snap_action *snap_attach_action(struct snap_card *card,
 				       snap_action_flag_t action_flags,
 				       int timeout_ms)
 {
-	if (software_action_enabled())
+	struct snap_action *action;
+	uint64_t t0;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	t0 = snap_stats_nsec();
+	snap_tev(SNAP_TEV_ATTACH, action_type, action_flags);
+
+	/* Still attached from a previous lazy detach? */
+	if (card->attached) {
+		if (action_type == card->action_type) {
+			snap_trace("%s Reuse Action: 0x%x\n", __func__,
+				   action_type);
+			card->flags = action_flags;
+			card->astats.attaches_avoided++;
+			snap_stats_op(&card->stats, SNAP_STATS_ATTACH,
+				      snap_stats_nsec() - t0);
+			snap_tev(SNAP_TEV_ATTACH_END, 0, 0);
+			return (struct snap_action *)card;
+		}
+		__snap_detach_action(card);
+	}
+
+	if (software_action_enabled() || virtual_card_enabled())
 		snap_map_funcs(card, action_type);
 
-	return df->attach_action(card, action_type, action_flags, timeout_ms);
+	action = df->attach_action(card, action_type, action_flags, timeout_ms);
+	if (action) {
+		card->attached = true;
+		card->astats.attaches++;
+		snap_stats_sum(&card->stats, &card->stats.base);
+		snap_stats_shm_attach(&card->stats, action_type);
+	}
+	snap_stats_op(&card->stats, SNAP_STATS_ATTACH, snap_stats_nsec() - t0);
+	snap_tev(SNAP_TEV_ATTACH_END, action ? 0 : -1, 0);
+	return action;
 }
 
 int snap_detach_action(struct snap_action *action)
 {
 	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	uint64_t t0 = snap_stats_nsec();
 
 	snap_trace("%s Enter\n", __func__);
-	rc = df->detach_action(action);
+	if (card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap_tev(SNAP_TEV_DETACH, 0, 0);
+
+	/*
+	 * Keep an idle action attached, the next snap_attach_action()
+	 * for the same type can use it without talking to the job manager.
+	 * Busy actions are aborted as usual.
+	 */
+	if ((card->flags & SNAP_ACTION_KEEP_ATTACHED) && card->attached &&
+	    snap_action_is_idle(action, &rc) && (rc == 0)) {
+		card->astats.lazy_detaches++;
+		snap_stats_op(&card->stats, SNAP_STATS_DETACH,
+			      snap_stats_nsec() - t0);
+		snap_tev(SNAP_TEV_DETACH_END, 0, 0);
+		snap_trace("%s Exit Action kept attached\n", __func__);
+		return 0;
+	}
+	rc = __snap_detach_action(card);
+	if (rc == 0)
+		snap_stats_shm_attach(&card->stats, 0);
+	snap_stats_op(&card->stats, SNAP_STATS_DETACH, snap_stats_nsec() - t0);
+	snap_tev(SNAP_TEV_DETACH_END, rc, 0);
 	snap_trace("%s Exit rc: %d\n", __func__, rc);
 	return rc;
 }
 
+int snap_card_get_attach_stats(struct snap_card *card,
+			       struct snap_attach_stats *stats)
+{
+	if ((card == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	*stats = card->astats;
+	return SNAP_OK;
+}
+
+int snap_card_get_stats(struct snap_card *card, struct snap_stats *stats)
+{
+	if ((card == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	snap_stats_sum(&card->stats, stats);
+	return SNAP_OK;
+}
+
+int snap_action_get_stats(struct snap_action *action,
+			  struct snap_stats *stats)
+{
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_stats now;
+
+	if ((card == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	snap_stats_sum(&card->stats, &now);
+	snap_stats_diff(stats, &now, &card->stats.base);
+	return SNAP_OK;
+}
+
+void snap_action_add_bytes(struct snap_action *action, uint64_t bytes)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	snap_stats_inc(&snap_stats_local(&card->stats)->bytes, bytes);
+}
+
+static void snap_mmio_count(struct snap_card *card, bool is_write)
+{
+	struct snap_stats *s = snap_stats_local(&card->stats);
+
+	snap_stats_inc(is_write ? &s->mmio_writes : &s->mmio_reads, 1);
+}
+
 int snap_mmio_write32(struct snap_card *_card,
 		      uint64_t offset, uint32_t data)
 {
 	int rc;
+
+	if (_card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap_mmio_count(_card, true);
 	rc = df->mmio_write32(_card, offset, data);
+	snap_tev(SNAP_TEV_MMIO_WR, offset, data);
 	return rc;
 }
 
@@ -753,7 +1046,14 @@ int snap_mmio_read32(struct snap_card *_card,
 		     uint64_t offset, uint32_t *data)
 {
 	int rc;
+
+	if (_card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap_mmio_count(_card, false);
 	rc = df->mmio_read32(_card, offset, data);
+	snap_tev(SNAP_TEV_MMIO_RD, offset, *data);
 	return rc;
 }
 
@@ -766,10 +1066,13 @@ int snap_action_write32(struct snap_action *action,
 	int rc;
 	struct snap_card *card = (struct snap_card *)action;
 
-	if (card->action_base == 0) /* must be attached to make this work */
+	/* must be attached to make this work */
+	if ((card == NULL) || (card->action_base == 0))
 		return SNAP_EATTACH;
 
+	snap_mmio_count(card, true);
 	rc = df->mmio_write32(card, card->action_base + offset, data);
+	snap_tev(SNAP_TEV_MMIO_WR, card->action_base + offset, data);
 	return rc;
 }
 
@@ -779,10 +1082,13 @@ int snap_action_read32(struct snap_action *action,
 	int rc;
 	struct snap_card *card = (struct snap_card *)action;
 
-	if (card->action_base == 0) /* must be attached to make this work */
+	/* must be attached to make this work */
+	if ((card == NULL) || (card->action_base == 0))
 		return SNAP_EATTACH;
 
+	snap_mmio_count(card, false);
 	rc = df->mmio_read32(card, card->action_base + offset, data);
+	snap_tev(SNAP_TEV_MMIO_RD, card->action_base + offset, *data);
 	return rc;
 }
 
@@ -791,7 +1097,13 @@ int snap_mmio_write64(struct snap_card *_card,
 {
 	int rc;
 
+	if (_card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap_mmio_count(_card, true);
 	rc = df->mmio_write64(_card, offset, data);
+	snap_tev(SNAP_TEV_MMIO_WR, offset, data);
 	return rc;
 }
 
@@ -800,13 +1112,60 @@ int snap_mmio_read64(struct snap_card *_card,
 {
 	int rc;
 
+	if (_card == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	snap_mmio_count(_card, false);
 	rc = df->mmio_read64(_card, offset, data);
+	snap_tev(SNAP_TEV_MMIO_RD, offset, *data);
 	return rc;
 }
 
 
+int snap_card_set_mmio_mode(struct snap_card *card, snap_mmio_mode_t mode)
+{
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	switch (mode) {
+	case SNAP_MMIO_CXL:
+		__sync_synchronize();
+		card->mmio_fast = false;
+		break;
+	case SNAP_MMIO_FAST:
+		/* Nothing mapped in simulation or software mode */
+		if (!software_action_enabled() && (card->mmio_ptr == NULL)) {
+			errno = ENODEV;
+			return SNAP_ENODEV;
+		}
+		card->mmio_fast = !software_action_enabled();
+		break;
+	default:
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	snap_trace("%s: fast MMIO %d\n", __func__, card->mmio_fast);
+	return SNAP_OK;
+}
+
+void snap_mmio_barrier(struct snap_card *card __unused)
+{
+	__sync_synchronize();
+}
+
 void snap_card_free(struct snap_card *_card)
 {
+	/* Release an action which was kept attached */
+	if (_card && _card->attached)
+		__snap_detach_action(_card);
+	if (_card) {
+		__free(_card->ring);
+		__free(_card->crec);
+		snap_stats_shm_close(&_card->stats);
+		snap_stats_free(&_card->stats);
+	}
 	df->card_free(_card);
 }
 
@@ -815,48 +1174,23 @@ int snap_card_ioctl(struct snap_card *_card, unsigned int cmd, unsigned long arg
 	return df->card_ioctl(_card, cmd, arg);
 }
 
-/******************************************************************************
- * JOB QUEUE Operations
- *****************************************************************************/
-
-struct snap_queue *snap_queue_alloc(struct snap_card *card,
-				    snap_action_type_t action_type,
-				    snap_action_flag_t action_flags,
-				    unsigned int queue_length __unused,
-				    unsigned int attach_timeout_sec)
+int snap_card_get_fd(struct snap_card *card)
 {
-	card->action_typeq = action_type;     /* Save Action Type */
-	card->action_flags = action_flags;
-	card->queue_length = queue_length;
-	card->attach_timeout_sec = attach_timeout_sec;
-
-	return (struct snap_queue *)card;
+	return card->afu_fd;
 }
 
-/*
- * @note At this point in time we emulate a real queue behavior by
- * doing the same as we do when using snap_sync_execute_job directly.
- * This is basically a queue of length 1. Once there are use-cases
- * which will profit from a real hardware job queue, this must be
- * changed along with a real hardware queue implementation.
- */
-int snap_queue_sync_execute_job(struct snap_queue *queue,
-                          struct snap_job *cjob,
-                          unsigned int timeout_sec)
+bool snap_action_irq_enabled(struct snap_action *action)
 {
-	struct snap_card *card = (struct snap_card *)queue;
+	struct snap_card *card = (struct snap_card *)action;
 
-	return snap_sync_execute_job(card, card->action_typeq, /* Uses Save Action type */
-				     card->action_flags,
-				     cjob,
-				     card->attach_timeout_sec,
-				     timeout_sec);
+	return (card->flags & SNAP_ACTION_DONE_IRQ) != 0;
 }
 
-void snap_queue_free(struct snap_queue *queue __unused)
+int snap_action_irq_ack(struct snap_action *action)
 {
-	struct snap_card *card = (struct snap_card *)queue;
-	card->action_type = 0xffffffff;
+	struct snap_card *card = (struct snap_card *)action;
+
+	return df->wait_irq(card, 0, SNAP_ACTION_IRQ_NUM);
 }
 
 /*****************************************************************************
@@ -870,10 +1204,13 @@ int snap_action_start(struct snap_action *action)
 	struct snap_card *card = (struct snap_card *)action;
 
 	snap_trace("%s: START Action 0x%x Flags %x\n", __func__, card->action_type, card->flags);
+	card->stats.t_start = snap_stats_nsec();
+	snap_tev(SNAP_TEV_RUN, card->stats.id, card->action_type);
 	/* Enable Ready IRQ if set by application */
 	if (SNAP_ACTION_DONE_IRQ  & card->flags) {
 		snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
 		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_ON);
+		snap_mmio_barrier(card);
 	}
 	return snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_START);
 }
@@ -897,58 +1234,162 @@ int snap_action_is_idle(struct snap_action *action, int *rc)
 	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
 }
 
-int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+/*
+ * Check the completion record if one is used, else read ACTION_CONTROL.
+ * Returns true if the job is done or if the read failed.
+ */
+static bool snap_action_poll(struct snap_card *card, int *rc)
 {
-	int _rc = 0;
 	uint32_t action_data = 0;
+
+	if (card->crec_pending) {
+		card->cstats.record_polls++;
+		*rc = 0;
+		return (__atomic_load_n(&card->crec->flags, __ATOMIC_ACQUIRE) &
+			SNAP_WORKITEM_DONE) &&
+			(card->crec->seq == card->crec_seq);
+	}
+	card->cstats.mmio_polls++;
+	*rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
+	if (*rc != 0)
+		return true;
+	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+}
+
+int snap_action_completed_usec(struct snap_action *action, int *rc,
+			       unsigned long timeout_usec)
+{
+	int _rc = 0;
+	bool idle, irq;
 	struct snap_card *card = (struct snap_card *)action;
-	unsigned long t0;
-	int dt, timeout_ms;
+	struct snap_completion_policy *p = &card->policy;
+	unsigned long long t0, dt, poll_end;
+	unsigned long backoff;
+	uint64_t ns0 = snap_stats_nsec(), run_nsec = 0;
+
+	irq = (SNAP_ACTION_DONE_IRQ & card->flags);
+	snap_tev(SNAP_TEV_WAIT, timeout_usec, irq);
+	poll_end = irq ? (unsigned long long)p->spin_usec + p->poll_usec :
+		timeout_usec;
+	t0 = tget_us();
+
+	/* Spin phase, at least one read even if timeout is 0 */
+	do {
+		idle = snap_action_poll(card, &_rc);
+		dt = tget_us() - t0;
+		if (idle) {
+			card->cstats.spin_completions++;
+			goto __completed;
+		}
+	} while ((dt < p->spin_usec) && (dt < timeout_usec));
+
+	/* Poll phase with exponential backoff */
+	backoff = MAX(p->backoff_min_usec, 1u);
+	while ((dt < poll_end) && (dt < timeout_usec)) {
+		snap_action_backoff(MIN(backoff, timeout_usec - dt));
+		idle = snap_action_poll(card, &_rc);
+		dt = tget_us() - t0;
+		if (idle) {
+			card->cstats.poll_completions++;
+			goto __completed;
+		}
+		backoff = MIN(backoff * 2, MAX(p->backoff_max_usec, 1u));
+	}
 
-	if (SNAP_ACTION_DONE_IRQ & card->flags) {
-		hw_wait_irq(card, timeout, SNAP_ACTION_IRQ_NUM);
+	/*
+	 * Irq phase. Events might be left over from jobs which completed
+	 * in an earlier phase, so check the action state after each one.
+	 */
+	while (irq && (dt < timeout_usec)) {
+		card->cstats.irq_waits++;
+		snap_tev(SNAP_TEV_IRQ_WAIT, timeout_usec - dt, 0);
+		df->wait_irq(card, timeout_usec - dt, SNAP_ACTION_IRQ_NUM);
+		idle = snap_action_poll(card, &_rc);
+		dt = tget_us() - t0;
+		if (idle) {
+			card->cstats.irq_completions++;
+			goto __completed;
+		}
+	}
+	card->cstats.timeouts++;
+	snap_stats_inc(&snap_stats_local(&card->stats)->timeouts, 1);
+
+ __completed:
+	card->cstats.wait_usec += dt;
+	if (idle && card->stats.t_start) {
+		run_nsec = snap_stats_nsec() - card->stats.t_start;
+		snap_stats_op(&card->stats, SNAP_STATS_RUN, run_nsec);
+		card->stats.t_start = 0;
+	}
+	snap_stats_op(&card->stats, SNAP_STATS_WAIT, snap_stats_nsec() - ns0);
+	snap_tev(SNAP_TEV_WAIT_END, idle, _rc);
+	if (run_nsec)
+		snap_tev(SNAP_TEV_RUN_END, card->stats.id, run_nsec);
+	if (irq) {
 		snap_mmio_write32(card, ACTION_IRQ_STATUS, ACTION_IRQ_STATUS_DONE);
 		snap_mmio_write32(card, ACTION_IRQ_APP, 0);
 		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_OFF);
-		_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-	} else {
-		/* Busy poll timout sec */
-		t0 = tget_ms();
-		dt = 0;
-		timeout_ms = timeout * 1000;
-		while (dt < timeout_ms) {
-			_rc = snap_mmio_read32(card, ACTION_CONTROL, &action_data);
-			if ((action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE)
-				break;
-			dt = (int)(tget_ms() - t0);
-		}
 	}
+	poll_trace("%s: idle: %d rc: %d after %lld usec\n", __func__,
+		   idle, _rc, dt);
 	if (rc)
 		*rc = _rc;
 
-	return (action_data & ACTION_CONTROL_IDLE) == ACTION_CONTROL_IDLE;
+	return idle && (_rc == 0);
 }
 
-/**
- * Synchronous way to send a job away.  First step : set registers
- * This function writes through MMIO interface the registers
- * to the action / in the FPGA internal memory
- *
- * @action	handle to streaming framework action/action
- * @cjob	streaming framework job
- * @return	0 on success.
- */
+int snap_action_completed(struct snap_action *action, int *rc, int timeout)
+{
+	if (timeout < 0)
+		timeout = 0;
+	return snap_action_completed_usec(action, rc, timeout * 1000000ul);
+}
 
-int snap_action_sync_execute_job_set_regs(struct snap_action *action,
-				 struct snap_job *cjob)
+int snap_card_set_completion_policy(struct snap_card *card,
+				    const struct snap_completion_policy *policy)
 {
-	int rc = 0;
-	unsigned int i;
-	struct snap_card *card = (struct snap_card *)action;
-	struct snap_queue_workitem job;
-	uint32_t action_addr;
-	uint32_t *job_data;
-	unsigned int mmio_in, mmio_out;
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	card->policy = policy ? *policy : snap_default_policy;
+	memset(&card->cstats, 0, sizeof(card->cstats));
+	return SNAP_OK;
+}
+
+int snap_card_get_completion_policy(struct snap_card *card,
+				    struct snap_completion_policy *policy)
+{
+	if ((card == NULL) || (policy == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	*policy = card->policy;
+	return SNAP_OK;
+}
+
+int snap_card_get_completion_stats(struct snap_card *card,
+				   struct snap_completion_stats *stats)
+{
+	if ((card == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	*stats = card->cstats;
+	return SNAP_OK;
+}
+
+/*
+ * Translate the caller's job description into the cacheline sized
+ * workitem which the action expects. Small jobs are copied inline,
+ * larger ones are passed via the extension address. Short action type
+ * and sequence number are filled in when the workitem is written to the
+ * card. *mmio_in returns the number of 32-bit words to transfer.
+ */
+static int snap_prepare_workitem(struct snap_queue_workitem *job,
+				 struct snap_job *cjob, unsigned int *mmio_in)
+{
+	unsigned int mmio_out;
 
 	/* Size must be less than addr[6] */
 	if (cjob->wout_size > SNAP_JOBSIZE) {
@@ -963,52 +1404,143 @@ int snap_action_sync_execute_job_set_regs(struct snap_action *action,
 		return -1;
 	}
 
-	/* job.short_action = 0x00; */	/* Set later */
-	job.flags = 0x01; /* FIXME Set Flag to Execute */
-	job.seq = 0x0000; /* Set later */
-	job.retc = 0x00000000;
-	job.priv_data = 0xdeadbeefc0febabeull;
+	job->short_action = 0x00; /* Set later */
+	job->flags = 0x01; /* FIXME Set Flag to Execute */
+	job->seq = 0x0000; /* Set later */
+	job->retc = 0x00000000;
+	job->priv_data = 0xdeadbeefc0febabeull;
 
 	/* Fill workqueue cacheline which we need to transfer to the action */
 	if (cjob->win_size <= (6 * 16)) {
-		memcpy(&job.user, (void *)(unsigned long)cjob->win_addr,
-		       MIN(cjob->win_size, sizeof(job.user)));
+		memcpy(&job->user, (void *)(unsigned long)cjob->win_addr,
+		       MIN(cjob->win_size, sizeof(job->user)));
 		mmio_out = cjob->win_size / sizeof(uint32_t);
 	} else {
-		job.user.ext.addr  = cjob->win_addr;
-		job.user.ext.size  = cjob->win_size;
-		job.user.ext.type  = SNAP_ADDRTYPE_HOST_DRAM;
-		job.user.ext.flags = (SNAP_ADDRFLAG_EXT |
-				      SNAP_ADDRFLAG_END);
-		mmio_out = sizeof(job.user.ext) / sizeof(uint32_t);
+		job->user.ext.addr  = cjob->win_addr;
+		job->user.ext.size  = cjob->win_size;
+		job->user.ext.type  = SNAP_ADDRTYPE_HOST_DRAM;
+		job->user.ext.flags = (SNAP_ADDRFLAG_EXT |
+				       SNAP_ADDRFLAG_END);
+		mmio_out = sizeof(job->user.ext) / sizeof(uint32_t);
 	}
-	mmio_in = 16 / sizeof(uint32_t) + mmio_out;
+	*mmio_in = 16 / sizeof(uint32_t) + mmio_out;
 
 	snap_trace("    win_size: %d wout_size: %d mmio_in: %d mmio_out: %d\n",
-		cjob->win_size, cjob->wout_size, mmio_in, mmio_out);
-	
-	job.short_action = card->sat;/* Set correct Value after attach */
-	job.seq = card->seq++; /* Set correct Value after attach */
+		cjob->win_size, cjob->wout_size, *mmio_in, mmio_out);
+	return 0;
+}
+
+/*
+ * Pass a prepared workitem to the attached action. This stamps the
+ * short action type and sequence number of the current attachment.
+ */
+static int snap_write_workitem(struct snap_card *card,
+			       struct snap_queue_workitem *job,
+			       unsigned int mmio_in)
+{
+	int rc = 0;
+	unsigned int i;
+	uint32_t action_addr;
+	uint32_t *job_data;
+
+	job->short_action = card->sat;/* Set correct Value after attach */
+	job->seq = card->seq++; /* Set correct Value after attach */
+
+	/* Ask the action to write its results to the completion record */
+	card->crec_pending = false;
+	if ((card->flags & SNAP_ACTION_COMPLETION_RECORD) &&
+	    !(job->flags & SNAP_WORKITEM_RING)) {
+		if (card->crec == NULL) {
+			card->crec = snap_malloc(sizeof(*card->crec));
+			if (card->crec == NULL) {
+				errno = ENOMEM;
+				return SNAP_ENOMEM;
+			}
+		}
+		__atomic_store_n(&card->crec->flags, 0, __ATOMIC_RELAXED);
+		job->flags |= SNAP_WORKITEM_CREC;
+		job->priv_data = (unsigned long)card->crec;
+		card->crec_seq = job->seq;
+		card->crec_pending = true;
+	}
 
 	snap_trace("%s: PASS PARAMETERS to Short Action %d Seq: %x\n",
-		   __func__, job.short_action, job.seq);
+		   __func__, job->short_action, job->seq);
 
-	/* __hexdump(stderr, &job, sizeof(job)); */
+	/* __hexdump(stderr, job, sizeof(*job)); */
 
 	/* Pass action control and job to the action, should be 128
 	   bytes or a little less */
-	job_data = (uint32_t *)(unsigned long)&job;
+	job_data = (uint32_t *)(unsigned long)job;
 	for (i = 0, action_addr = ACTION_PARAMS_IN; i < mmio_in;
 		i++, action_addr += sizeof(uint32_t)) {
 		rc = snap_mmio_write32(card, action_addr, job_data[i]);
 		if (rc != 0)
-			goto __snap_action_sync_execute_job_exit;
+			break;
 	}
-
-__snap_action_sync_execute_job_exit:
-	snap_action_stop(action);
+	/* One barrier for the whole workitem */
+	snap_mmio_barrier(card);
 	return rc;
 }
+
+/**
+ * Synchronous way to send a job away.  First step : set registers
+ * This function writes through MMIO interface the registers
+ * to the action / in the FPGA internal memory
+ *
+ * @action	handle to streaming framework action/action
+ * @cjob	streaming framework job
+ * @return	0 on success.
+ */
+
+int snap_action_sync_execute_job_set_regs(struct snap_action *action,
+				 struct snap_job *cjob)
+{
+	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_queue_workitem job;
+	unsigned int mmio_in;
+	uint64_t t0 = snap_stats_nsec();
+
+	snap_tev(SNAP_TEV_SET_REGS, cjob->win_size, 0);
+	rc = snap_prepare_workitem(&job, cjob, &mmio_in);
+	if (rc != 0)
+		goto __exit;
+
+	rc = snap_write_workitem(card, &job, mmio_in);
+	snap_action_stop(action);
+	snap_stats_op(&card->stats, SNAP_STATS_SET_REGS,
+		      snap_stats_nsec() - t0);
+ __exit:
+	snap_tev(SNAP_TEV_SET_REGS_END, rc, 0);
+	return rc;
+}
+
+/*
+ * Copy retc and results of a workitem which the action wrote back to
+ * host memory (ring entry or completion record) to the caller, the
+ * same way check_completion does it from ACTION_PARAMS_OUT.
+ */
+static void snap_workitem_results(struct snap_queue_workitem *w,
+			       struct snap_job *cjob)
+{
+	unsigned int len;
+	void *job_data;
+
+	cjob->retc = w->retc;
+	if (cjob->wout_addr == 0) {
+		job_data = (void *)(unsigned long)cjob->win_addr;
+		if (cjob->win_size <= (6 * 16))
+			len = cjob->win_size;
+		else	len = sizeof(w->user.ext);
+	} else {
+		job_data = (void *)(unsigned long)cjob->wout_addr;
+		len = cjob->wout_size;
+	}
+	len &= ~(sizeof(uint32_t) - 1);
+	memcpy(job_data, &w->user, MIN(len, (unsigned int)sizeof(w->user)));
+}
+
 /**
  * Synchronous way to send a job away.  Last step : check completion
  * This function check the completion of the action, manage the IRQ
@@ -1023,6 +1555,15 @@ __snap_action_sync_execute_job_exit:
 int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 				 struct snap_job *cjob,
 				 unsigned int timeout_sec)
+{
+	return snap_action_sync_execute_job_check_completion_usec(action, cjob,
+				timeout_sec * 1000000ul);
+}
+
+int snap_action_sync_execute_job_check_completion_usec(
+				 struct snap_action *action,
+				 struct snap_job *cjob,
+				 unsigned long timeout_usec)
 {
 	int rc;
 	unsigned int i;
@@ -1033,7 +1574,7 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 	uint32_t *job_data;
 	unsigned int mmio_out;
 
-	completed = snap_action_completed(action, &rc, timeout_sec);
+	completed = snap_action_completed_usec(action, &rc, timeout_usec);
 	/* Issue #360 */
 	if (rc != 0) {
 		snap_trace("%s: EIO rc=%d completed=%d\n", __func__,
@@ -1071,6 +1612,13 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 		mmio_out = sizeof(job.user.ext) / sizeof(uint32_t);
 	}
 
+	if (card->crec_pending) {
+		snap_trace("%s: RETURN RESULTS from completion record\n",
+			   __func__);
+		snap_workitem_results(card->crec, cjob);
+		goto __snap_action_sync_execute_job_exit;
+	}
+
 	/* Get RETC (0x184) back to the caller */
 	rc = snap_mmio_read32(card, ACTION_RETC_OUT, &cjob->retc);
 	if (rc != 0)
@@ -1098,6 +1646,7 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 	}
 
 __snap_action_sync_execute_job_exit:
+	card->crec_pending = false;
 	snap_action_stop(action);
 	return rc;
 }
@@ -1121,11 +1670,14 @@ int snap_action_sync_execute_job(struct snap_action *action,
 				 unsigned int timeout_sec)
 {
 	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_stats *s;
+	uint64_t t0 = snap_stats_nsec();
 
 	/* Set action registers through MMIO */
 	rc = snap_action_sync_execute_job_set_regs(action, cjob);
 	if (rc != 0)
-		return rc;
+		goto __exit;
 
 	/* Start Action */
 	snap_action_start(action);
@@ -1133,9 +1685,95 @@ int snap_action_sync_execute_job(struct snap_action *action,
 	/* Wait for finish */
 	rc = snap_action_sync_execute_job_check_completion(action, cjob, 
 				timeout_sec);
+ __exit:
+	s = snap_stats_local(&card->stats);
+	snap_stats_op(&card->stats, SNAP_STATS_JOB, snap_stats_nsec() - t0);
+	snap_stats_inc(&s->jobs, 1);
+	if ((rc != 0) || (cjob->retc != SNAP_RETC_SUCCESS))
+		snap_stats_inc(&s->errors, 1);
 	return rc;
 }
 
+int snap_action_execute_batch(struct snap_action *action,
+			      struct snap_job *cjob, unsigned int n,
+			      unsigned int timeout_sec)
+{
+	int rc = 0;
+	unsigned int i, mmio_in;
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_queue_workitem doorbell, *ring;
+
+	if ((card == NULL) || (cjob == NULL) ||
+	    (n > UINT32_MAX / sizeof(*ring))) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (n == 0)
+		return SNAP_OK;
+
+	/* Hardware action which does not know about rings */
+	if (!software_action_enabled() && !(card->flags & SNAP_ACTION_BATCH)) {
+		for (i = 0; i < n; i++) {
+			rc = snap_action_sync_execute_job(action, &cjob[i],
+							  timeout_sec);
+			if (rc != 0)
+				break;
+		}
+		return rc;
+	}
+
+	if (n > card->ring_entries) {
+		ring = snap_malloc(n * sizeof(*ring));
+		if (ring == NULL) {
+			errno = ENOMEM;
+			return SNAP_ENOMEM;
+		}
+		__free(card->ring);
+		card->ring = ring;
+		card->ring_entries = n;
+	}
+	ring = card->ring;
+
+	for (i = 0; i < n; i++) {
+		rc = snap_prepare_workitem(&ring[i], &cjob[i], &mmio_in);
+		if (rc != 0)
+			return rc;
+		ring[i].short_action = card->sat;
+		ring[i].seq = card->seq++;
+	}
+
+	memset(&doorbell, 0, sizeof(doorbell));
+	doorbell.flags = SNAP_WORKITEM_EXEC | SNAP_WORKITEM_RING;
+	doorbell.priv_data = 0xdeadbeefc0febabeull;
+	doorbell.user.ext.addr = (unsigned long)ring;
+	doorbell.user.ext.size = n * sizeof(*ring);
+	doorbell.user.ext.type = SNAP_ADDRTYPE_HOST_DRAM;
+	doorbell.user.ext.flags = SNAP_ADDRFLAG_EXT | SNAP_ADDRFLAG_END;
+	mmio_in = (16 + sizeof(doorbell.user.ext)) / sizeof(uint32_t);
+
+	snap_trace("%s: %u jobs in ring %p\n", __func__, n, ring);
+
+	/* Ring must be visible before the action gets started */
+	__sync_synchronize();
+	rc = snap_write_workitem(card, &doorbell, mmio_in);
+	if (rc != 0)
+		return rc;
+	snap_action_start(action);
+
+	if (!snap_action_completed(action, &rc, timeout_sec)) {
+		snap_trace("%s: rc=%d\n", __func__, rc);
+		if (rc != 0)
+			return SNAP_EIO;
+		errno = ETIME;
+		return SNAP_ETIMEDOUT;
+	}
+	__sync_synchronize();
+
+	for (i = 0; i < n; i++)
+		snap_workitem_results(&ring[i], &cjob[i]);
+	return SNAP_OK;
+}
+
 int snap_sync_execute_job(struct snap_card *card,
 			  snap_action_type_t action_type,
 			  snap_action_flag_t action_flags,
@@ -1160,18 +1798,323 @@ int snap_sync_execute_job(struct snap_card *card,
 	return rc;
  }
 
+/******************************************************************************
+ * JOB QUEUE Operations
+ *****************************************************************************/
+
+#define SNAP_QUEUE_TIMEOUT_SEC	10	/* Job timeout for asynchronous jobs */
+
+/* Used by snap_queue_sync_execute_job() to wait for its own job */
+struct snap_queue_waiter {
+	bool done;
+	int rc;
+};
+
+struct snap_queue_entry {
+	struct snap_queue_workitem job;	/* prepared at submission time */
+	unsigned int mmio_in;		/* # of 32-bit words to pass */
+	unsigned int timeout_sec;
+	struct snap_job *cjob;
+	snap_job_finished_t finished;	/* asynchronous completion */
+	struct snap_queue_waiter *waiter; /* synchronous completion */
+};
+
+/*
+ * The queue owns the card context while it exists. Jobs are put into
+ * a ring of prepared workitems by the submitting threads. The
+ * completion thread attaches the action once, pushes the workitems
+ * to the action one after the other, reads back the results and
+ * informs the submitter. Attaching and detaching is therefore not
+ * done per job anymore, and the caller does not need to wait until
+ * the previous job has finished before it can submit the next one.
+ */
+struct snap_queue {
+	struct snap_card *card;
+	struct snap_action *action;	/* NULL if not attached */
+	snap_action_type_t action_type;
+	snap_action_flag_t action_flags;
+	unsigned int attach_timeout_sec;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;	/* completion thread waits for work */
+	pthread_cond_t not_full;	/* submitters wait for a free entry */
+	pthread_cond_t done;		/* synchronous submitters wait here */
+	unsigned int length;		/* # of entries in ring */
+	unsigned int head;		/* next entry to execute */
+	unsigned int count;		/* # of entries waiting for execution */
+	bool stop;
+	pthread_t tid;
+	struct snap_queue_entry *ring;
+};
+
+static int snap_queue_run(struct snap_queue *queue,
+			  struct snap_queue_entry *e)
+{
+	int rc;
+
+	if (queue->action == NULL) {
+		queue->action = snap_attach_action(queue->card,
+						   queue->action_type,
+						   queue->action_flags,
+						   queue->attach_timeout_sec);
+		if (queue->action == NULL) {
+			snap_trace("%s: Error Can not attach to Action 0x%x\n",
+				   __func__, queue->action_type);
+			errno = ETIME;
+			rc = SNAP_EATTACH;
+			goto __snap_queue_run_exit;
+		}
+	}
+
+	rc = snap_write_workitem(queue->card, &e->job, e->mmio_in);
+	if (rc != 0)
+		goto __snap_queue_run_exit;
+
+	snap_action_start(queue->action);
+	rc = snap_action_sync_execute_job_check_completion(queue->action,
+							   e->cjob,
+							   e->timeout_sec);
+
+ __snap_queue_run_exit:
+	if (rc == 0)
+		return rc;
+
+	/* Action might still be busy, start over with a fresh attach */
+	if (queue->action != NULL) {
+		snap_detach_action(queue->action);
+		queue->action = NULL;
+	}
+	e->cjob->retc = (rc == SNAP_ETIMEDOUT) ? SNAP_RETC_TIMEOUT :
+		SNAP_RETC_FAILURE;
+	return rc;
+}
+
+static void *snap_queue_thread(void *arg)
+{
+	int rc;
+	struct snap_queue *queue = (struct snap_queue *)arg;
+	struct snap_queue_entry e;
+
+	snap_trace("%s: Enter queue %p\n", __func__, queue);
+	snap_thread_bind_node(queue->card->numa_node);
+
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		while ((queue->count == 0) && !queue->stop)
+			pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+		if (queue->count == 0)	/* stop requested and all done */
+			break;
+
+		/* Free the ring entry before running the job */
+		e = queue->ring[queue->head];
+		queue->head = (queue->head + 1) % queue->length;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+		pthread_mutex_unlock(&queue->lock);
+
+		rc = snap_queue_run(queue, &e);
+
+		if (e.finished)
+			e.finished(queue, e.cjob);
+
+		pthread_mutex_lock(&queue->lock);
+		if (e.waiter) {
+			e.waiter->rc = rc;
+			e.waiter->done = true;
+			pthread_cond_broadcast(&queue->done);
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	snap_trace("%s: Exit queue %p\n", __func__, queue);
+	return NULL;
+}
+
+static int snap_queue_submit(struct snap_queue *queue,
+			     struct snap_job *cjob,
+			     snap_job_finished_t finished,
+			     struct snap_queue_waiter *waiter,
+			     unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_queue_entry e;
+
+	rc = snap_prepare_workitem(&e.job, cjob, &e.mmio_in);
+	if (rc != 0)
+		return rc;
+
+	e.timeout_sec = timeout_sec;
+	e.cjob = cjob;
+	e.finished = finished;
+	e.waiter = waiter;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->length)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	queue->ring[(queue->head + queue->count) % queue->length] = e;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return SNAP_OK;
+}
+
+struct snap_queue *snap_queue_alloc(struct snap_card *card,
+				    snap_action_type_t action_type,
+				    snap_action_flag_t action_flags,
+				    unsigned int queue_length,
+				    unsigned int attach_timeout_sec)
+{
+	int rc;
+	struct snap_queue *queue;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (queue_length == 0)
+		queue_length = 1;
+
+	queue = calloc(1, sizeof(*queue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->ring = calloc(queue_length, sizeof(*queue->ring));
+	if (queue->ring == NULL)
+		goto __snap_queue_alloc_err0;
+
+	queue->card = card;
+	queue->action = NULL;		/* Attached by first job */
+	queue->action_type = action_type;
+	queue->action_flags = action_flags;
+	queue->attach_timeout_sec = attach_timeout_sec;
+	queue->length = queue_length;
+	queue->head = 0;
+	queue->count = 0;
+	queue->stop = false;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	pthread_cond_init(&queue->done, NULL);
+
+	rc = pthread_create(&queue->tid, NULL, snap_queue_thread, queue);
+	if (rc != 0) {
+		errno = rc;
+		goto __snap_queue_alloc_err1;
+	}
+
+	snap_trace("%s: Queue %p Action: 0x%x Length: %d\n", __func__,
+		   queue, action_type, queue_length);
+	return queue;
+
+ __snap_queue_alloc_err1:
+	pthread_cond_destroy(&queue->done);
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->ring);
+ __snap_queue_alloc_err0:
+	free(queue);
+	return NULL;
+}
+
+int snap_queue_sync_execute_job(struct snap_queue *queue,
+				struct snap_job *cjob,
+				unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_queue_waiter waiter = { .done = false, .rc = 0 };
+
+	rc = snap_queue_submit(queue, cjob, NULL, &waiter, timeout_sec);
+	if (rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!waiter.done)
+		pthread_cond_wait(&queue->done, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+
+	return waiter.rc;
+}
+
+int snap_async_execute_job(struct snap_queue *queue,
+			   struct snap_job *cjob,
+			   snap_job_finished_t finished)
+{
+	return snap_queue_submit(queue, cjob, finished, NULL,
+				 SNAP_QUEUE_TIMEOUT_SEC);
+}
+
+void snap_queue_free(struct snap_queue *queue)
+{
+	struct snap_card *card;
+
+	if (queue == NULL)
+		return;
+
+	/* Completion thread finishes all pending jobs before leaving */
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = true;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->tid, NULL);
+
+	card = queue->card;
+	if (queue->action != NULL)
+		snap_detach_action(queue->action);
+	if (!card->attached)
+		card->action_type = 0xffffffff;
+
+	pthread_cond_destroy(&queue->done);
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->ring);
+	free(queue);
+}
+
 /******************************************************************************
  * SOFTWARE EMULATION OF FPGA ACTIONS
  *****************************************************************************/
 
+/*
+ * Actions register from constructors, but might show up later too,
+ * e.g. from a plugin. Pushing to the list and to the hash bucket is
+ * lock-free and both are never modified otherwise, such that lookups
+ * can run without any locking. The list keeps the registration order,
+ * the hash serves find_action().
+ */
+static inline unsigned int action_hash_idx(snap_action_type_t action_type)
+{
+	return (action_type ^ (action_type >> 16)) & (SNAP_ACTION_HASH - 1);
+}
+
+static void action_push(struct snap_sim_action **head,
+			struct snap_sim_action *a,
+			struct snap_sim_action **next)
+{
+	struct snap_sim_action *old;
+
+	old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	do {
+		*next = old;
+	} while (!__atomic_compare_exchange_n(head, &old, a, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
+}
+
 int snap_action_register(struct snap_sim_action *new_action)
 {
 	if (new_action == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	new_action->next = actions;
-	actions = new_action;
+	action_push(&actions, new_action, &new_action->next);
+	action_push(&action_hash[action_hash_idx(new_action->action_type)],
+		    new_action, &new_action->hnext);
 	return 0;
 }
 
@@ -1180,27 +2123,144 @@ struct snap_sim_action *snap_card_to_sim_action(struct snap_card *card)
 	return card->action;
 }
 
-static struct snap_sim_action *find_action(snap_action_type_t action_type)
+static struct snap_sim_action *lookup_action(snap_action_type_t action_type)
 {
 	struct snap_sim_action *a;
 
-	snap_trace("  %s: Searching action_type %x\n", __func__, action_type);
-
-	for (a = actions; a != NULL; a = a->next) {
+	for (a = __atomic_load_n(&action_hash[action_hash_idx(action_type)],
+				 __ATOMIC_ACQUIRE); a != NULL; a = a->hnext) {
 		if (a->action_type == action_type)
 			return a;
 	}
 	return NULL;
 }
 
+/*
+ * Software actions which were not linked in are looked up as
+ * <dir>/snap_action_<action_type>.so in the colon separated
+ * directories of SNAP_ACTION_PATH. The plugin registers its action
+ * from a constructor like a linked in one does; libsnap symbols are
+ * resolved from the host, so the plugin must not carry its own copy.
+ * Plugins stay loaded until the process exits.
+ */
+static struct snap_sim_action *load_action(snap_action_type_t action_type)
+{
+	const char *path;
+	const char *dir, *end;
+	char fname[PATH_MAX];
+	struct snap_sim_action *a;
+	void *dl;
+	int len;
+
+	path = getenv("SNAP_ACTION_PATH");
+	if ((path == NULL) || (*path == '\0'))
+		return NULL;
+
+	pthread_mutex_lock(&action_load_lock);
+	a = lookup_action(action_type);  /* Another thread was faster */
+
+	for (dir = path; (a == NULL) && (*dir != '\0'); dir = end) {
+		end = strchrnul(dir, ':');
+		len = end - dir;
+		if (*end == ':')
+			end++;
+		if (len == 0)
+			continue;
+
+		snprintf(fname, sizeof(fname), "%.*s/snap_action_%08x.so",
+			 len, dir, action_type);
+		if (access(fname, R_OK) != 0)
+			continue;
+
+		dl = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+		if (dl == NULL) {
+			fprintf(stderr, "err: cannot load action %s: %s\n",
+				fname, dlerror());
+			continue;
+		}
+		/*
+		 * Never dlclose() it: its constructors may have registered
+		 * other action types, which must stay mapped.
+		 */
+		a = lookup_action(action_type);
+		snap_trace("  %s: Loaded %s\n", __func__, fname);
+		if (a == NULL)
+			fprintf(stderr, "warn: %s does not provide action "
+				"type %08x\n", fname, action_type);
+	}
+	pthread_mutex_unlock(&action_load_lock);
+	return a;
+}
+
+/*
+ * Load all plugins of SNAP_ACTION_PATH, such that a virtual card can
+ * offer their action types from the start like a real card does.
+ */
+static void load_actions(void)
+{
+	const char *path;
+	const char *dir, *end;
+	char dname[PATH_MAX];
+	struct dirent *d;
+	DIR *dp;
+	unsigned int action_type;
+	int len, n;
+
+	path = getenv("SNAP_ACTION_PATH");
+	if (path == NULL)
+		return;
+
+	for (dir = path; *dir != '\0'; dir = end) {
+		end = strchrnul(dir, ':');
+		len = end - dir;
+		if (*end == ':')
+			end++;
+		if (len == 0)
+			continue;
+
+		snprintf(dname, sizeof(dname), "%.*s", len, dir);
+		dp = opendir(dname);
+		if (dp == NULL)
+			continue;
+		while ((d = readdir(dp)) != NULL) {
+			n = 0;
+			if ((sscanf(d->d_name, "snap_action_%8x.so%n",
+				    &action_type, &n) != 1) ||
+			    (n != 23) || (d->d_name[n] != '\0'))
+				continue;
+			if (lookup_action(action_type) == NULL)
+				load_action(action_type);
+		}
+		closedir(dp);
+	}
+}
+
+static struct snap_sim_action *find_action(snap_action_type_t action_type)
+{
+	struct snap_sim_action *a;
+
+	snap_trace("  %s: Searching action_type %x\n", __func__, action_type);
+
+	a = lookup_action(action_type);
+	if (a == NULL)
+		a = load_action(action_type);
+	return a;
+}
+
+/*
+ * The registered action is only a template. Each context gets its own
+ * copy, such that workitem, results and state of concurrent contexts
+ * using the same action type do not overwrite each other.
+ */
 static int snap_map_funcs(struct snap_card *card,
 			  snap_action_type_t action_type)
 {
-	struct snap_sim_action *a;
+	struct snap_sim_action *a, *ctx;
 
 	snap_trace("%s: Mapping action_type %x\n", __func__, action_type);
 
-	card->action_type = action_type;
+	if (card->action && (card->action->action_type == action_type))
+		return SNAP_OK;		/* Context is already set up */
 
 	/* search action and map in its mmios */
 	a = find_action(action_type);
@@ -1210,8 +2270,20 @@ static int snap_map_funcs(struct snap_card *card,
 		return SNAP_ENOENT;
 	}
 
-	snap_trace("  %s: Action found %p.\n", __func__, a);
-	card->action = a;
+	ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		return SNAP_ENOMEM;
+
+	*ctx = *a;
+	ctx->state = ACTION_IDLE;
+	ctx->next = NULL;
+	ctx->hnext = NULL;
+
+	snap_trace("  %s: Action found %p context %p.\n", __func__, a, ctx);
+	pthread_mutex_lock(&card->sim_lock);
+	__free(card->action);
+	card->action = ctx;
+	pthread_mutex_unlock(&card->sim_lock);
 	return SNAP_OK;
 }
 
@@ -1229,17 +2301,165 @@ static void *sw_card_alloc_dev(const char *path __unused,
 	dn->vendor_id = vendor_id;
 	dn->device_id = device_id;
 	dn->name = snap_card_id_2_name(vendor_id); /* Makes invalid name */ 
+
+	/* The eventfd takes the role of the AFU fd for the done irq */
+	dn->afu_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (dn->afu_fd < 0)
+		goto __snap_alloc_err;
+
+	pthread_mutex_init(&dn->sim_lock, NULL);
+	pthread_cond_init(&dn->sim_c, NULL);
+	dn->sim_thread = false;
+	dn->sim_start = false;
+	dn->sim_stop = false;
 	return (struct snap_card *)dn;
 
  __snap_alloc_err:
+	__free(dn);
 	return NULL;
 }
 
 static void sw_card_free(struct snap_card *card)
 {
+	if (!card)
+		return;
+
+	if (card->sim_thread) {
+		pthread_mutex_lock(&card->sim_lock);
+		card->sim_stop = true;
+		pthread_cond_broadcast(&card->sim_c);
+		pthread_mutex_unlock(&card->sim_lock);
+		pthread_join(card->sim_tid, NULL);
+	}
+	pthread_cond_destroy(&card->sim_c);
+	pthread_mutex_destroy(&card->sim_lock);
+	close(card->afu_fd);
+	__free(card->action);
 	__free(card);
 }
 
+/*
+ * Walk a ring of workitems like a hardware action would. Each entry
+ * takes the place of the MMIO workitem while the action runs on it and
+ * is written back afterwards.
+ */
+static void sw_action_run_ring(struct snap_sim_action *a)
+{
+	unsigned int i, n;
+	struct snap_queue_workitem doorbell = a->job;
+	struct snap_queue_workitem *ring;
+
+	ring = (struct snap_queue_workitem *)(unsigned long)
+		doorbell.user.ext.addr;
+	n = doorbell.user.ext.size / sizeof(*ring);
+
+	sim_trace("  %s: %u jobs in ring %p\n", __func__, n, ring);
+	for (i = 0; i < n; i++) {
+		a->job = ring[i];
+		a->main(a, &a->job.user, sizeof(a->job.user));
+		ring[i] = a->job;
+	}
+	a->job = doorbell;
+	a->job.retc = SNAP_RETC_SUCCESS;
+}
+
+/*
+ * Write retc and output parameters to the completion record as one
+ * cacheline. The done flag is stored last, the host waits on it.
+ */
+static void sw_action_write_crec(struct snap_sim_action *a)
+{
+	struct snap_queue_workitem *rec;
+
+	rec = (struct snap_queue_workitem *)(unsigned long)a->job.priv_data;
+	rec->short_action = a->job.short_action;
+	rec->seq = a->job.seq;
+	rec->retc = a->job.retc;
+	rec->priv_data = a->job.priv_data;
+	memcpy(&rec->user, &a->job.user, sizeof(rec->user));
+	__atomic_store_n(&rec->flags, a->job.flags | SNAP_WORKITEM_DONE,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Executes the software action on behalf of the context, like the
+ * FPGA would do it. The submitter can poll ACTION_CONTROL or wait
+ * for the emulated done interrupt in the meantime.
+ */
+static void *sw_action_thread(void *arg)
+{
+	struct snap_card *card = (struct snap_card *)arg;
+	struct snap_sim_action *a;
+	uint64_t irq = 1;
+
+	/* Threads of the action, e.g. hls_sponge, inherit the binding */
+	snap_thread_bind_node(card->numa_node);
+	pthread_mutex_lock(&card->sim_lock);
+	while (1) {
+		while (!card->sim_start && !card->sim_stop)
+			pthread_cond_wait(&card->sim_c, &card->sim_lock);
+
+		if (card->sim_stop)
+			break;
+
+		card->sim_start = false;
+		a = card->action;
+		pthread_mutex_unlock(&card->sim_lock);
+
+		sim_trace("  %s: starting action %p\n", __func__, a);
+		/* __hexdump(stdout, &a->job.user, sizeof(a->job.user)); */
+		if (a->job.flags & SNAP_WORKITEM_RING)
+			sw_action_run_ring(a);
+		else
+			a->main(a, &a->job.user, sizeof(a->job.user));
+
+		pthread_mutex_lock(&card->sim_lock);
+		a->state = ACTION_IDLE;
+		if (a->job.flags & SNAP_WORKITEM_CREC)
+			sw_action_write_crec(a);
+		if ((card->sim_irq_control & ACTION_IRQ_CONTROL_ON) &&
+		    (card->sim_irq_app & ACTION_IRQ_APP_DONE)) {
+			sim_trace("  %s: action %p done, send irq\n",
+				  __func__, a);
+			if (write(card->afu_fd, &irq, sizeof(irq)) < 0)
+				sim_trace("  %s: eventfd write failed %s\n",
+					  __func__, strerror(errno));
+		}
+		pthread_cond_broadcast(&card->sim_c);
+	}
+	pthread_mutex_unlock(&card->sim_lock);
+	return NULL;
+}
+
+static int sw_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+		       int expect_irq __unused)
+{
+	int rc;
+	uint64_t irq;
+	struct pollfd pfd = { .fd = card->afu_fd, .events = POLLIN, };
+
+	snap_trace("  %s: Enter fd: %d Timeout: %ld usec\n", __func__,
+		   card->afu_fd, timeout_usec);
+
+	/* poll() counts in msec, round up to not return too early */
+	rc = poll(&pfd, 1, (int)MIN((timeout_usec + 999) / 1000,
+				    (unsigned long)INT_MAX));
+	if (rc == 0) {
+		snap_trace("    Timeout......\n");
+		rc = EBUSY;
+	} else if (rc < 0) {
+		rc = EINTR;
+	} else {
+		/* Reading resets the eventfd counter */
+		if (read(card->afu_fd, &irq, sizeof(irq)) < 0)
+			rc = EINTR;
+		else	rc = 0;
+	}
+
+	snap_trace("  %s: Exit fd: %d rc: %d\n", __func__, card->afu_fd, rc);
+	return rc;
+}
+
 static int sw_mmio_write32(struct snap_card *card,
 			   uint64_t offs, uint32_t data)
 {
@@ -1260,19 +2480,35 @@ static int sw_mmio_write32(struct snap_card *card,
 	}
 	w = &a->job;
 
-	if (offs == ACTION_CONTROL) {
+	switch (offs) {
+	case ACTION_CONTROL:
+		if (!(data & ACTION_CONTROL_START))
+			return 0;
+
+		pthread_mutex_lock(&card->sim_lock);
+		if (a->state == ACTION_RUNNING) {
+			pthread_mutex_unlock(&card->sim_lock);
+			snap_trace("  action already running!!\n");
+			return 0;
+		}
 		snap_trace("  starting action!!\n");
 		a->state = ACTION_RUNNING;
-		/* __hexdump(stdout, &w->user, sizeof(w->user)); */
-		a->main(a, &w->user, sizeof(w->user));
-		a->state = ACTION_IDLE;
-
+		card->sim_start = true;
+		pthread_cond_broadcast(&card->sim_c);
+		pthread_mutex_unlock(&card->sim_lock);
 		return 0;
-	}
-
-	if ((offs >= ACTION_PARAMS_IN) &&
-	    (offs < ACTION_PARAMS_IN + CACHELINE_BYTES)) {
-		((uint32_t *)&a->job)[(offs - ACTION_PARAMS_IN)/4] = data;
+	case ACTION_IRQ_CONTROL:
+		card->sim_irq_control = data;
+		break;
+	case ACTION_IRQ_APP:
+		card->sim_irq_app = data;
+		break;
+	default:
+		if ((offs >= ACTION_PARAMS_IN) &&
+		    (offs < ACTION_PARAMS_IN + CACHELINE_BYTES)) {
+			((uint32_t *)w)[(offs - ACTION_PARAMS_IN)/4] = data;
+		}
+		break;
 	}
 
 	if (a->mmio_write32)
@@ -1302,6 +2538,7 @@ static int sw_mmio_read32(struct snap_card *card,
 
 	switch (offs) {
 	case ACTION_CONTROL:
+		pthread_mutex_lock(&card->sim_lock);
 		switch (a->state) {
 		case ACTION_IDLE:
 			*data = ACTION_CONTROL_IDLE; break;
@@ -1310,6 +2547,13 @@ static int sw_mmio_read32(struct snap_card *card,
 		case ACTION_ERROR:
 			*data = 0x0; break;
 		}
+		pthread_mutex_unlock(&card->sim_lock);
+		break;
+	case ACTION_IRQ_CONTROL:
+		*data = card->sim_irq_control;
+		break;
+	case ACTION_IRQ_APP:
+		*data = card->sim_irq_app;
 		break;
 	default:
 		if ((offs >= ACTION_PARAMS_OUT) &&
@@ -1358,6 +2602,21 @@ static int sw_mmio_read64(struct snap_card *card,
 	return rc;
 }
 
+static int sw_action_thread_start(struct snap_card *card)
+{
+	int rc;
+
+	if (card->sim_thread)
+		return 0;
+	rc = pthread_create(&card->sim_tid, NULL, sw_action_thread, card);
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	card->sim_thread = true;
+	return 0;
+}
+
 static struct snap_action *sw_attach_action(struct snap_card *card,
 					    snap_action_type_t action_type,
 					    snap_action_flag_t action_flags,
@@ -1366,12 +2625,30 @@ static struct snap_action *sw_attach_action(struct snap_card *card,
 	snap_trace("  %s(%p, %x %d %d)\n", __func__,
 		   card, action_type, action_flags, timeout_ms);
 
+	if (card->action == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	card->flags = action_flags;
+	card->action_type = action_type;
+
+	if (sw_action_thread_start(card) != 0)
+		return NULL;
 	return (struct snap_action *)card;
 }
 
 static int sw_detach_action(struct snap_action *action)
 {
+	struct snap_card *card = (struct snap_card *)action;
+	struct snap_sim_action *a = card->action;
+
 	snap_trace("  %s(%p)\n", __func__, action);
+
+	/* A software action cannot be aborted, let it finish */
+	pthread_mutex_lock(&card->sim_lock);
+	while (card->sim_thread && a && (a->state == ACTION_RUNNING))
+		pthread_cond_wait(&card->sim_c, &card->sim_lock);
+	pthread_mutex_unlock(&card->sim_lock);
 	return 0;
 }
 
@@ -1426,6 +2703,420 @@ static struct snap_funcs software_funcs = {
 	.mmio_read64 = sw_mmio_read64,
 	.card_free = sw_card_free,
 	.card_ioctl = sw_card_ioctl,
+	.wait_irq = sw_wait_irq,
+};
+
+/******************************************************************************
+ * VIRTUAL CARD
+ * The hw_* attach and detach code runs against the job manager model
+ * of snap_vcard.c, the action space is served by the software actions.
+ *****************************************************************************/
+
+static void *vc_card_alloc_dev(const char *path,
+			       uint16_t vendor_id,
+			       uint16_t device_id)
+{
+	struct snap_card *dn;
+	struct snap_sim_action *a;
+	snap_action_type_t types[SNAP_ATRI_MAX];
+	uint64_t reg;
+	int i, n = 0;
+
+	snap_trace("%s Enter %s\n", __func__, path);
+	if (((vendor_id != SNAP_VENDOR_ID_ANY) &&
+	     (vendor_id != SNAP_VENDOR_ID_IBM)) ||
+	    ((device_id != SNAP_DEVICE_ID_ANY) &&
+	     (device_id != SNAP_DEVICE_ID_SNAP))) {
+		snap_trace("  %s: ERR Vendor/Device 0x%x/0x%x Invalid\n",
+			   __func__, vendor_id, device_id);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	/* The registered actions are the action instances, oldest first */
+	load_actions();
+	for (a = __atomic_load_n(&actions, __ATOMIC_ACQUIRE); a != NULL;
+	     a = a->next) {
+		for (i = 0; (i < n) && (types[i] != a->action_type); i++)
+			;
+		if ((i == n) && (n < SNAP_ATRI_MAX)) {
+			memmove(&types[1], &types[0], n * sizeof(types[0]));
+			types[0] = a->action_type;
+			n++;
+		}
+	}
+
+	dn = sw_card_alloc_dev(path, SNAP_VENDOR_ID_IBM, SNAP_DEVICE_ID_SNAP);
+	if (dn == NULL)
+		return NULL;
+	if (snap_vcard_open(&dn->vctx, path, types, n) != SNAP_OK) {
+		sw_card_free(dn);
+		return NULL;
+	}
+
+	dn->sat = INVALID_SAT;
+	dn->action_type = 0xffffffff;
+	dn->atri_num = -1;
+	dn->action_base = 0;
+	snap_vcard_read64(&dn->vctx, SNAP_S_CIR, &reg);
+	dn->master = (reg & 0x8000000000000000) != 0;
+	dn->cir = (int)(reg & 0xffff);
+	snap_vcard_read64(&dn->vctx, SNAP_S_CAP, &reg);
+	dn->cap_reg = reg;
+	dn->name = snap_card_id_2_name((int)(reg & 0xff));
+
+	snap_trace("%s Exit %p OK Context: %d Master: %d Card: %s\n", __func__,
+		   dn, dn->cir, dn->master, dn->name);
+	return dn;
+}
+
+static void vc_card_free(struct snap_card *card)
+{
+	if (!card)
+		return;
+
+	snap_vcard_close(&card->vctx);
+	sw_card_free(card);
+}
+
+/* Action space of the slave, like hw_snap_mmio_*32() relative to action_base */
+static bool vc_action_space(struct snap_card *card, uint64_t *offset)
+{
+	if (card->master || (*offset < ACTION_BASE_S) ||
+	    (*offset >= ACTION_BASE_S + SNAP_M_ACT_SIZE) ||
+	    !snap_vcard_attached(&card->vctx))
+		return false;
+	*offset -= ACTION_BASE_S;
+	return true;
+}
+
+static int vc_mmio_write32(struct snap_card *card,
+			   uint64_t offset, uint32_t data)
+{
+	int rc;
+
+	offset += card->action_base;
+	reg_trace("  %s(%p, %llx, %lx)\n", __func__, card,
+		  (long long)offset, (long)data);
+	if (card->master)
+		return snap_vcard_write32(&card->vctx, offset, data);
+	if (!vc_action_space(card, &offset)) {
+		errno = EFAULT;
+		return -1;
+	}
+	snap_vcard_delay(&card->vctx);
+	rc = sw_mmio_write32(card, offset, data);
+	return rc;
+}
+
+static int vc_mmio_read32(struct snap_card *card,
+			  uint64_t offset, uint32_t *data)
+{
+	int rc;
+
+	offset += card->action_base;
+	if (card->master)
+		rc = snap_vcard_read32(&card->vctx, offset, data);
+	else if (vc_action_space(card, &offset)) {
+		snap_vcard_delay(&card->vctx);
+		rc = sw_mmio_read32(card, offset, data);
+	} else {
+		*data = 0;
+		errno = EFAULT;
+		rc = -1;
+	}
+	reg_trace("  %s(%p, %llx, %lx) %d\n", __func__, card,
+		  (long long)offset, (long)*data, rc);
+	return rc;
+}
+
+static int vc_mmio_write64(struct snap_card *card,
+			   uint64_t offset, uint64_t data)
+{
+	reg_trace("  %s(%p, %llx, %llx)\n", __func__, card,
+		  (long long)offset, (long long)data);
+
+	/* A software action cannot be aborted, let it finish first */
+	if ((offset == SNAP_S_JCR) && (data & (SNAP_JCR_STOP | SNAP_JCR_ABORT)))
+		sw_detach_action((struct snap_action *)card);
+	return snap_vcard_write64(&card->vctx, offset, data);
+}
+
+static int vc_mmio_read64(struct snap_card *card,
+			  uint64_t offset, uint64_t *data)
+{
+	int rc;
+
+	rc = snap_vcard_read64(&card->vctx, offset, data);
+	reg_trace("  %s(%p, %llx, %llx) %d\n", __func__, card,
+		  (long long)offset, (long long)*data, rc);
+	return rc;
+}
+
+static int vc_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+		       int expect_irq)
+{
+	if (expect_irq == SNAP_ATTACH_IRQ_NUM)
+		return snap_vcard_wait_attach(&card->vctx, timeout_usec);
+	return sw_wait_irq(card, timeout_usec, expect_irq);
+}
+
+static struct snap_action *vc_attach_action(struct snap_card *card,
+					    snap_action_type_t action_type,
+					    snap_action_flag_t action_flags,
+					    int timeout_sec)
+{
+	struct snap_action *action;
+
+	action = hw_attach_action(card, action_type, action_flags,
+				  timeout_sec);
+	if ((action != NULL) && (sw_action_thread_start(card) != 0))
+		return NULL;
+	return action;
+}
+
+/* Virtual card version of the lowlevel functions */
+static struct snap_funcs virtual_funcs = {
+	.card_alloc_dev = vc_card_alloc_dev,
+	.attach_action = vc_attach_action, /* hw_attach_action */
+	.detach_action = hw_detach_action,
+	.mmio_write32 = vc_mmio_write32,
+	.mmio_read32 = vc_mmio_read32,
+	.mmio_write64 = vc_mmio_write64,
+	.mmio_read64 = vc_mmio_read64,
+	.card_free = vc_card_free,
+	.card_ioctl = hw_card_ioctl,
+	.wait_irq = vc_wait_irq,
+};
+
+/******************************************************************************
+ * MMIO RECORD AND REPLAY
+ * Recording wraps the backend selected by SNAP_CONFIG. Replay needs no
+ * card, the hw_* attach and detach code runs against the recording.
+ *****************************************************************************/
+
+static struct snap_funcs *mrec_df;	/* Backend which is recorded */
+static const char *mplay_file;
+
+static void *mrec_card_alloc_dev(const char *path,
+				 uint16_t vendor_id,
+				 uint16_t device_id)
+{
+	struct snap_card *card;
+
+	card = mrec_df->card_alloc_dev(path, vendor_id, device_id);
+	if (card)
+		card->mrec = snap_mrec_open(path, card->master, card->cir,
+					    card->cap_reg);
+	return card;
+}
+
+static void mrec_card_free(struct snap_card *card)
+{
+	if (card)
+		snap_mrec_close(card->mrec);
+	mrec_df->card_free(card);
+}
+
+static void mrec_add(struct snap_card *card, unsigned int op, int rc,
+		     uint64_t offset, uint64_t data)
+{
+	if (card->mrec)
+		snap_mrec_add(card->mrec, op | (rc ? SNAP_MREC_ERR : 0),
+			      offset, data);
+}
+
+static int mrec_mmio_write32(struct snap_card *card,
+			     uint64_t offset, uint32_t data)
+{
+	int rc = mrec_df->mmio_write32(card, offset, data);
+
+	mrec_add(card, SNAP_MREC_WRITE32, rc, offset, data);
+	return rc;
+}
+
+static int mrec_mmio_read32(struct snap_card *card,
+			    uint64_t offset, uint32_t *data)
+{
+	int rc = mrec_df->mmio_read32(card, offset, data);
+
+	mrec_add(card, SNAP_MREC_READ32, rc, offset, *data);
+	return rc;
+}
+
+static int mrec_mmio_write64(struct snap_card *card,
+			     uint64_t offset, uint64_t data)
+{
+	int rc = mrec_df->mmio_write64(card, offset, data);
+
+	mrec_add(card, SNAP_MREC_WRITE64, rc, offset, data);
+	return rc;
+}
+
+static int mrec_mmio_read64(struct snap_card *card,
+			    uint64_t offset, uint64_t *data)
+{
+	int rc = mrec_df->mmio_read64(card, offset, data);
+
+	mrec_add(card, SNAP_MREC_READ64, rc, offset, *data);
+	return rc;
+}
+
+static int mrec_wait_irq(struct snap_card *card, unsigned long timeout_usec,
+			 int expect_irq)
+{
+	int rc = mrec_df->wait_irq(card, timeout_usec, expect_irq);
+
+	mrec_add(card, SNAP_MREC_IRQ, 0, expect_irq, rc);
+	return rc;
+}
+
+static struct snap_action *mrec_attach_action(struct snap_card *card,
+					      snap_action_type_t action_type,
+					      snap_action_flag_t action_flags,
+					      int timeout_sec)
+{
+	return mrec_df->attach_action(card, action_type, action_flags,
+				      timeout_sec);
+}
+
+static int mrec_detach_action(struct snap_action *action)
+{
+	return mrec_df->detach_action(action);
+}
+
+static int mrec_card_ioctl(struct snap_card *card, unsigned int cmd,
+			   unsigned long parm)
+{
+	return mrec_df->card_ioctl(card, cmd, parm);
+}
+
+/* Recording version of the lowlevel functions */
+static struct snap_funcs record_funcs = {
+	.card_alloc_dev = mrec_card_alloc_dev,
+	.attach_action = mrec_attach_action,
+	.detach_action = mrec_detach_action,
+	.mmio_write32 = mrec_mmio_write32,
+	.mmio_read32 = mrec_mmio_read32,
+	.mmio_write64 = mrec_mmio_write64,
+	.mmio_read64 = mrec_mmio_read64,
+	.card_free = mrec_card_free,
+	.card_ioctl = mrec_card_ioctl,
+	.wait_irq = mrec_wait_irq,
+};
+
+static void *mplay_card_alloc_dev(const char *path,
+				  uint16_t vendor_id,
+				  uint16_t device_id)
+{
+	struct snap_card *dn;
+	struct snap_mrec_ctx ctx;
+	uint32_t flags;
+
+	dn = calloc(1, sizeof(*dn));
+	if (dn == NULL)
+		return NULL;
+
+	dn->mplay = snap_mplay_open(mplay_file, path, &ctx, &flags);
+	if (dn->mplay == NULL) {
+		snap_trace("%s: No recording of %s\n", __func__, path);
+		__free(dn);
+		return NULL;
+	}
+	/* Without the job manager in the recording attach always works */
+	dn->mplay_jm = (flags & SNAP_MREC_JM);
+	dn->vendor_id = vendor_id;
+	dn->device_id = device_id;
+	dn->sat = INVALID_SAT;
+	dn->action_type = 0xffffffff;
+	dn->atri_num = -1;
+	dn->master = ctx.master;
+	dn->cir = ctx.cir;
+	dn->cap_reg = ctx.cap_reg;
+	dn->name = snap_card_id_2_name((int)(ctx.cap_reg & 0xff));
+	dn->afu_fd = -1;
+	return dn;
+}
+
+static void mplay_card_free(struct snap_card *card)
+{
+	if (!card)
+		return;
+
+	snap_mplay_close(card->mplay);
+	__free(card->action);
+	__free(card);
+}
+
+static int mplay_mmio_write32(struct snap_card *card,
+			      uint64_t offset, uint32_t data)
+{
+	return snap_mplay_write(card->mplay, SNAP_MREC_WRITE32, offset, data);
+}
+
+static int mplay_mmio_read32(struct snap_card *card,
+			     uint64_t offset, uint32_t *data)
+{
+	uint64_t d;
+	int rc;
+
+	rc = snap_mplay_read(card->mplay, SNAP_MREC_READ32, offset, &d);
+	*data = (uint32_t)d;
+	return rc;
+}
+
+static int mplay_mmio_write64(struct snap_card *card,
+			      uint64_t offset, uint64_t data)
+{
+	return snap_mplay_write(card->mplay, SNAP_MREC_WRITE64, offset, data);
+}
+
+static int mplay_mmio_read64(struct snap_card *card,
+			     uint64_t offset, uint64_t *data)
+{
+	return snap_mplay_read(card->mplay, SNAP_MREC_READ64, offset, data);
+}
+
+static int mplay_wait_irq(struct snap_card *card,
+			  unsigned long timeout_usec __unused, int expect_irq)
+{
+	return snap_mplay_irq(card->mplay, expect_irq);
+}
+
+static struct snap_action *mplay_attach_action(struct snap_card *card,
+					       snap_action_type_t action_type,
+					       snap_action_flag_t action_flags,
+					       int timeout_sec)
+{
+	if (card->mplay_jm)
+		return hw_attach_action(card, action_type, action_flags,
+					timeout_sec);
+	card->flags = action_flags;
+	card->action_type = action_type;
+	return (struct snap_action *)card;
+}
+
+static int mplay_detach_action(struct snap_action *action)
+{
+	struct snap_card *card = (struct snap_card *)action;
+
+	if (card->mplay_jm)
+		return hw_detach_action(action);
+	return 0;
+}
+
+/* Replay version of the lowlevel functions */
+static struct snap_funcs replay_funcs = {
+	.card_alloc_dev = mplay_card_alloc_dev,
+	.attach_action = mplay_attach_action,
+	.detach_action = mplay_detach_action,
+	.mmio_write32 = mplay_mmio_write32,
+	.mmio_read32 = mplay_mmio_read32,
+	.mmio_write64 = mplay_mmio_write64,
+	.mmio_read64 = mplay_mmio_read64,
+	.card_free = mplay_card_free,
+	.card_ioctl = hw_card_ioctl,
+	.wait_irq = mplay_wait_irq,
 };
 
 /**********************************************************************
@@ -1438,6 +3129,7 @@ static void _init(void)
 {
 	const char *trace_env;
 	const char *config_env;
+	const char *record_env;
 
 	trace_env = getenv("SNAP_TRACE");
 	if (trace_env != NULL)
@@ -1451,6 +3143,9 @@ static void _init(void)
 		else if ( (strcmp(config_env, "CPU") == 0) ||
 			(strcmp(config_env, "cpu") == 0) )
 			snap_config = 0x1;
+		else if ( (strcmp(config_env, "VIRT") == 0) ||
+			(strcmp(config_env, "virt") == 0) )
+			snap_config = 0x2;
 		else {
 			snap_config = strtol(config_env, (char **)NULL, 0);
 		}
@@ -1458,4 +3153,24 @@ static void _init(void)
 
 	if (software_action_enabled())
 		df = &software_funcs; /* Map Software Functions */
+	else if (virtual_card_enabled())
+		df = &virtual_funcs;  /* Job manager model, software actions */
+
+	/* Replay needs no card, recording goes on top of any backend */
+	mplay_file = getenv("SNAP_MMIO_REPLAY");
+	record_env = getenv("SNAP_MMIO_RECORD");
+	if (mplay_file != NULL)
+		df = &replay_funcs;
+	else if (record_env != NULL) {
+		if (snap_mrec_init(record_env, (df == &software_funcs) ? 0 :
+				   SNAP_MREC_JM) == SNAP_OK) {
+			mrec_df = df;
+			df = &record_funcs;
+		} else
+			fprintf(stderr, "err: cannot record MMIO to %s: %s\n",
+				record_env, strerror(errno));
+	}
+
+	if (snap_trace & 0x0400)
+		snap_tev_init();
 }
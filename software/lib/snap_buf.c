@@ -0,0 +1,344 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Buffer pool for data which the card accesses via DMA.
+ *
+ * Buffers are taken from 2 MiB chunks, backed by 2 MiB hugepages if
+ * the system has some reserved, else aligned such that transparent
+ * hugepages can be used. Chunks are pre-faulted when they are mapped,
+ * so neither the first CPU access nor the first DMA of the card hits a
+ * page fault. Buffer sizes are rounded up to a power of two, each size
+ * class has a free list. Buffers smaller than a chunk share one, larger
+ * ones are mapped individually. Memory is kept in the pool until the
+ * process ends.
+ *
+ * Each thread keeps a few buffers per size class in a local cache,
+ * such that a get/put pair does normally not need the pool lock.
+ *
+ * Chunks are mapped with a preference for a NUMA node, the free lists
+ * and caches are kept per node. Node index 0 holds the buffers without
+ * a preference, higher nodes than the pool knows end up there as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+#define SNAP_BUF_CHUNK_SHIFT	21		/* 2 MiB */
+#define SNAP_BUF_CHUNK_SIZE	(1ul << SNAP_BUF_CHUNK_SHIFT)
+#define SNAP_BUF_MIN_SHIFT	12		/* 4 KiB, smallest buffer */
+#define SNAP_BUF_MAX_SHIFT	34		/* 16 GiB, largest buffer */
+#define SNAP_BUF_CLASSES	(SNAP_BUF_MAX_SHIFT - SNAP_BUF_MIN_SHIFT + 1)
+#define SNAP_BUF_TLC_MAX	8		/* Buffers per class and thread */
+#define SNAP_BUF_CHUNKS_MAX	16384		/* Must be power of 2 */
+#define SNAP_BUF_NODES		8		/* Node -1, 0 ... 6 */
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT		26
+#endif
+#define SNAP_BUF_MAP_HUGE	(SNAP_BUF_CHUNK_SHIFT << MAP_HUGE_SHIFT)
+
+/* Free buffers are linked through their first bytes */
+struct snap_buf_free {
+	struct snap_buf_free *next;
+};
+
+/* Tells snap_buf_put() the size class and node of a buffer */
+struct snap_buf_chunk {
+	uintptr_t base;			/* 0: unused */
+	unsigned int cls;
+	unsigned int nidx;		/* Node index */
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct snap_buf_free *free[SNAP_BUF_NODES][SNAP_BUF_CLASSES];
+	unsigned int chunks;		/* Used entries in chunk */
+	struct snap_buf_chunk chunk[SNAP_BUF_CHUNKS_MAX];
+	int default_node;		/* For snap_buf_get() */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.default_node = -1,
+};
+
+struct snap_buf_tlc {
+	unsigned int n[SNAP_BUF_NODES][SNAP_BUF_CLASSES];
+	void *buf[SNAP_BUF_NODES][SNAP_BUF_CLASSES][SNAP_BUF_TLC_MAX];
+};
+
+static __thread struct snap_buf_tlc *tlc;
+static pthread_key_t tlc_key;
+static pthread_once_t tlc_once = PTHREAD_ONCE_INIT;
+
+static unsigned int snap_buf_class(size_t size)
+{
+	unsigned int shift = SNAP_BUF_MIN_SHIFT;
+
+	while ((shift <= SNAP_BUF_MAX_SHIFT) && ((1ull << shift) < size))
+		shift++;
+	return shift - SNAP_BUF_MIN_SHIFT;
+}
+
+static inline size_t snap_buf_class_size(unsigned int cls)
+{
+	return 1ul << (cls + SNAP_BUF_MIN_SHIFT);
+}
+
+static inline unsigned int snap_buf_nidx(int node)
+{
+	return ((node < 0) || (node >= SNAP_BUF_NODES - 1)) ? 0 : node + 1;
+}
+
+static inline unsigned int snap_buf_hash(uintptr_t base)
+{
+	return (unsigned int)((base >> SNAP_BUF_CHUNK_SHIFT) *
+			      2654435761u) & (SNAP_BUF_CHUNKS_MAX - 1);
+}
+
+/* Called with pool.lock held */
+static int snap_buf_chunk_add(uintptr_t base, unsigned int cls,
+			      unsigned int nidx)
+{
+	unsigned int i;
+
+	if (pool.chunks >= SNAP_BUF_CHUNKS_MAX / 2) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = snap_buf_hash(base); pool.chunk[i].base != 0;
+	     i = (i + 1) & (SNAP_BUF_CHUNKS_MAX - 1))
+		;
+	pool.chunk[i].cls = cls;
+	pool.chunk[i].nidx = nidx;
+	/* Lookups do not take the lock, base is the valid flag */
+	__atomic_store_n(&pool.chunk[i].base, base, __ATOMIC_RELEASE);
+	pool.chunks++;
+	return 0;
+}
+
+static struct snap_buf_chunk *snap_buf_chunk_find(void *buf)
+{
+	unsigned int i;
+	uintptr_t b, base = (uintptr_t)buf & ~(SNAP_BUF_CHUNK_SIZE - 1);
+
+	for (i = snap_buf_hash(base);
+	     (b = __atomic_load_n(&pool.chunk[i].base, __ATOMIC_ACQUIRE)) != 0;
+	     i = (i + 1) & (SNAP_BUF_CHUNKS_MAX - 1)) {
+		if (b == base)
+			return &pool.chunk[i];
+	}
+	return NULL;
+}
+
+/*
+ * Map len bytes (multiple of the chunk size), chunk aligned and
+ * pre-faulted. Try hugetlbfs pages of the chunk size first, then
+ * transparent hugepages. The page size is passed explicitly, the
+ * default one is 16 MiB on POWER. Where the kernel has no 2 MiB
+ * hugepages, it refuses the mapping.
+ */
+static void *__snap_buf_map(size_t len)
+{
+	uint8_t *p, *a;
+	size_t off, page = sysconf(_SC_PAGESIZE);
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | SNAP_BUF_MAP_HUGE |
+		 MAP_POPULATE, -1, 0);
+	if ((p != MAP_FAILED) &&
+	    (((uintptr_t)p & (SNAP_BUF_CHUNK_SIZE - 1)) == 0))
+		return p;
+	if (p != MAP_FAILED)
+		munmap(p, len);
+
+	p = mmap(NULL, len + SNAP_BUF_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	a = (uint8_t *)(((uintptr_t)p + SNAP_BUF_CHUNK_SIZE - 1) &
+			~(SNAP_BUF_CHUNK_SIZE - 1));
+	if (a != p)
+		munmap(p, a - p);
+	munmap(a + len, p + SNAP_BUF_CHUNK_SIZE - a);
+
+	madvise(a, len, MADV_HUGEPAGE);
+	for (off = 0; off < len; off += page)
+		((volatile uint8_t *)a)[off] = 0;
+	return a;
+}
+
+/* Pages are faulted in by the mapping thread, so its policy applies */
+static void *snap_buf_map(size_t len, int node)
+{
+	void *p;
+	bool prefer = snap_numa_prefer(node);
+
+	p = __snap_buf_map(len);
+	if (prefer)
+		snap_numa_unprefer();
+	return p;
+}
+
+/* Map a new chunk for cls, returns one buffer and adds the others */
+static void *snap_buf_grow(unsigned int cls, int node)
+{
+	size_t size = snap_buf_class_size(cls);
+	size_t len = MAX(size, SNAP_BUF_CHUNK_SIZE);
+	unsigned int nidx = snap_buf_nidx(node);
+	struct snap_buf_free *f;
+	uint8_t *p;
+	size_t off;
+
+	p = snap_buf_map(len, nidx ? node : -1);
+	if (p == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (snap_buf_chunk_add((uintptr_t)p, cls, nidx) != 0) {
+		pthread_mutex_unlock(&pool.lock);
+		munmap(p, len);
+		return NULL;
+	}
+	for (off = size; off < len; off += size) {
+		f = (struct snap_buf_free *)(p + off);
+		f->next = pool.free[nidx][cls];
+		pool.free[nidx][cls] = f;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return p;
+}
+
+static void snap_buf_put_pool(unsigned int nidx, unsigned int cls, void *buf)
+{
+	struct snap_buf_free *f = (struct snap_buf_free *)buf;
+
+	pthread_mutex_lock(&pool.lock);
+	f->next = pool.free[nidx][cls];
+	pool.free[nidx][cls] = f;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Hand the cached buffers of an exiting thread back to the pool */
+static void snap_buf_tlc_flush(void *arg)
+{
+	struct snap_buf_tlc *t = (struct snap_buf_tlc *)arg;
+	unsigned int nidx, cls;
+
+	for (nidx = 0; nidx < SNAP_BUF_NODES; nidx++)
+		for (cls = 0; cls < SNAP_BUF_CLASSES; cls++)
+			while (t->n[nidx][cls])
+				snap_buf_put_pool(nidx, cls,
+					t->buf[nidx][cls][--t->n[nidx][cls]]);
+	free(t);
+}
+
+static void snap_buf_tlc_init(void)
+{
+	pthread_key_create(&tlc_key, snap_buf_tlc_flush);
+}
+
+static struct snap_buf_tlc *snap_buf_tlc(void)
+{
+	if (tlc)
+		return tlc;
+
+	pthread_once(&tlc_once, snap_buf_tlc_init);
+	tlc = calloc(1, sizeof(*tlc));
+	if (tlc)
+		pthread_setspecific(tlc_key, tlc);
+	return tlc;
+}
+
+/* The first card opened with a known node decides */
+void snap_buf_default_node(int node)
+{
+	int none = -1;
+
+	if (node >= 0)
+		__atomic_compare_exchange_n(&pool.default_node, &none, node,
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED);
+}
+
+void *snap_buf_get_node(size_t size, int node)
+{
+	unsigned int cls, nidx;
+	struct snap_buf_tlc *t;
+	struct snap_buf_free *f;
+
+	cls = snap_buf_class(size);
+	if ((size == 0) || (cls >= SNAP_BUF_CLASSES)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	nidx = snap_buf_nidx(node);
+
+	t = snap_buf_tlc();
+	if (t && t->n[nidx][cls])
+		return t->buf[nidx][cls][--t->n[nidx][cls]];
+
+	pthread_mutex_lock(&pool.lock);
+	f = pool.free[nidx][cls];
+	if (f)
+		pool.free[nidx][cls] = f->next;
+	pthread_mutex_unlock(&pool.lock);
+	if (f)
+		return f;
+
+	return snap_buf_grow(cls, node);
+}
+
+void *snap_buf_get(size_t size)
+{
+	return snap_buf_get_node(size, __atomic_load_n(&pool.default_node,
+						       __ATOMIC_RELAXED));
+}
+
+void snap_buf_put(void *buf)
+{
+	struct snap_buf_chunk *c;
+	struct snap_buf_tlc *t;
+
+	if (buf == NULL)
+		return;
+
+	c = snap_buf_chunk_find(buf);
+	if (c == NULL) {
+		fprintf(stderr, "err: %s: %p not from snap_buf_get\n",
+			__func__, buf);
+		return;
+	}
+
+	t = snap_buf_tlc();
+	if (t && (t->n[c->nidx][c->cls] < SNAP_BUF_TLC_MAX)) {
+		t->buf[c->nidx][c->cls][t->n[c->nidx][c->cls]++] = buf;
+		return;
+	}
+	snap_buf_put_pool(c->nidx, c->cls, buf);
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Event loop which waits for the done interrupts of many actions with
+ * one epoll set, such that one thread can drive many contexts. Each
+ * registered action has at most one job in flight. When the fd of its
+ * card becomes readable, the interrupt event is consumed and if the
+ * action is idle, the results are read like in
+ * snap_action_sync_execute_job() and the callback is called.
+ *
+ * The loop is not thread safe, submit and run from the same thread.
+ * Callbacks may submit the next job for their action, but must not
+ * remove actions from the loop.
+ *
+ * A job which runs out of time is reported to its callback, but the
+ * action may still be running it. Such an entry stays stale, submit
+ * refuses it with SNAP_EBUSY until the action is idle again. Callers
+ * which do not want to wait remove the action and detach it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+#define SNAP_EVENT_MAX		64	/* Events per epoll_wait() */
+
+struct snap_event_entry {
+	struct snap_event_entry *next;
+	struct snap_action *action;
+	int fd;
+	bool busy;			/* A job is in flight */
+	bool stale;			/* Timed out job may still run */
+	struct snap_job *cjob;
+	unsigned long long deadline;	/* usec, CLOCK_MONOTONIC */
+	snap_event_cb_t cb;
+	void *priv;
+};
+
+struct snap_event_loop {
+	int epfd;
+	unsigned int pending;		/* Jobs in flight */
+	struct snap_event_entry *entries;
+};
+
+static unsigned long long snap_event_usec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+static struct snap_event_entry *snap_event_find(struct snap_event_loop *loop,
+						struct snap_action *action)
+{
+	struct snap_event_entry *e;
+
+	for (e = loop->entries; e != NULL; e = e->next)
+		if (e->action == action)
+			return e;
+	return NULL;
+}
+
+struct snap_event_loop *snap_event_loop_alloc(void)
+{
+	struct snap_event_loop *loop;
+
+	loop = calloc(1, sizeof(*loop));
+	if (loop == NULL)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		free(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+void snap_event_loop_free(struct snap_event_loop *loop)
+{
+	struct snap_event_entry *e;
+
+	if (loop == NULL)
+		return;
+
+	while ((e = loop->entries) != NULL) {
+		loop->entries = e->next;
+		free(e);
+	}
+	close(loop->epfd);
+	free(loop);
+}
+
+int snap_event_loop_add(struct snap_event_loop *loop,
+			struct snap_action *action)
+{
+	struct snap_event_entry *e;
+	struct epoll_event ev;
+
+	if (!snap_action_irq_enabled(action) ||
+	    (snap_event_find(loop, action) != NULL)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return SNAP_ENOMEM;
+
+	e->action = action;
+	e->fd = snap_card_get_fd((struct snap_card *)action); /* same handle */
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = e;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, e->fd, &ev) != 0) {
+		free(e);
+		return SNAP_EINVAL;
+	}
+	e->next = loop->entries;
+	loop->entries = e;
+	return SNAP_OK;
+}
+
+int snap_event_loop_del(struct snap_event_loop *loop,
+			struct snap_action *action)
+{
+	struct snap_event_entry **pe, *e;
+
+	for (pe = &loop->entries; (e = *pe) != NULL; pe = &e->next)
+		if (e->action == action)
+			break;
+
+	if ((e == NULL) || e->busy) {
+		errno = e ? EBUSY : ENOENT;
+		return e ? SNAP_EBUSY : SNAP_ENOENT;
+	}
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	*pe = e->next;
+	free(e);
+	return SNAP_OK;
+}
+
+int snap_event_loop_submit(struct snap_event_loop *loop,
+			   struct snap_action *action,
+			   struct snap_job *cjob,
+			   unsigned int timeout_sec,
+			   snap_event_cb_t cb, void *priv)
+{
+	int rc;
+	struct snap_event_entry *e;
+
+	e = snap_event_find(loop, action);
+	if (e == NULL) {
+		errno = ENOENT;
+		return SNAP_ENOENT;
+	}
+	if (e->busy ||
+	    (e->stale && !snap_action_is_idle(action, NULL))) {
+		errno = EBUSY;
+		return SNAP_EBUSY;
+	}
+	e->stale = false;
+
+	rc = snap_action_sync_execute_job_set_regs(action, cjob);
+	if (rc != 0)
+		return rc;
+
+	e->cjob = cjob;
+	e->cb = cb;
+	e->priv = priv;
+	e->deadline = snap_event_usec() + timeout_sec * 1000000ull;
+	e->busy = true;
+	loop->pending++;
+
+	rc = snap_action_start(action);
+	if (rc != 0) {
+		e->busy = false;
+		loop->pending--;
+	}
+	return rc;
+}
+
+unsigned int snap_event_loop_pending(struct snap_event_loop *loop)
+{
+	return loop->pending;
+}
+
+/* Read results, also on timeout, then hand the job to the callback */
+static void snap_event_complete(struct snap_event_loop *loop,
+				struct snap_event_entry *e)
+{
+	int rc;
+
+	rc = snap_action_sync_execute_job_check_completion_usec(e->action,
+								e->cjob, 0);
+	e->busy = false;
+	e->stale = (rc != SNAP_OK) && !snap_action_is_idle(e->action, NULL);
+	loop->pending--;
+	if (e->cb)
+		e->cb(e->action, e->cjob, rc, e->priv);
+}
+
+int snap_event_loop_run(struct snap_event_loop *loop, int timeout_ms)
+{
+	int i, n, wait_ms, done = 0;
+	unsigned long long now, next;
+	struct epoll_event ev[SNAP_EVENT_MAX];
+	struct snap_event_entry *e, *e_next;
+
+	if (loop->pending == 0)
+		return 0;
+
+	/* Do not sleep past the earliest job deadline */
+	now = snap_event_usec();
+	next = ULLONG_MAX;
+	for (e = loop->entries; e != NULL; e = e->next)
+		if (e->busy && (e->deadline < next))
+			next = e->deadline;
+	wait_ms = (next <= now) ? 0 :
+		(int)MIN((next - now + 999) / 1000, (unsigned long long)INT_MAX);
+	if ((timeout_ms >= 0) && (timeout_ms < wait_ms))
+		wait_ms = timeout_ms;
+
+	n = epoll_wait(loop->epfd, ev, SNAP_EVENT_MAX, wait_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		return SNAP_EIO;
+	}
+
+	for (i = 0; i < n; i++) {
+		e = (struct snap_event_entry *)ev[i].data.ptr;
+		snap_action_irq_ack(e->action);
+		if (!e->busy)
+			continue;	/* Left over from an earlier job */
+		if (!snap_action_is_idle(e->action, NULL))
+			continue;
+		snap_event_complete(loop, e);
+		done++;
+	}
+
+	/* Jobs which ran out of time */
+	now = snap_event_usec();
+	for (e = loop->entries; e != NULL; e = e_next) {
+		e_next = e->next;
+		if (e->busy && (e->deadline <= now)) {
+			snap_event_complete(loop, e);
+			done++;
+		}
+	}
+	return done;
+}
@@ -0,0 +1,436 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Recording and replay of MMIO accesses, see snap_mrec.h.
+ *
+ * Recording keeps the records of a context in memory and appends them
+ * to the file when the context is freed, or at exit. Replay loads the
+ * whole file. A context gets the oldest unused recording of the same
+ * device, so contexts must be allocated in the recorded order. Accesses
+ * are matched in order. If the host does something the recording did
+ * not, e.g. one more poll because the timing differs, the next few
+ * records are searched for a match and the ones in between skipped.
+ *
+ *   SNAP_MMIO_REPLAY_TIMING=1  Answer no earlier than recorded.
+ *   SNAP_MMIO_REPLAY_STRICT=1  Fail mismatching accesses with EIO.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+#include <snap_mrec.h>
+
+#define SNAP_MREC_RESYNC	64	/* Records searched for a match */
+
+struct snap_mrec_log {
+	struct snap_mrec_log *next;
+	pthread_mutex_t lock;
+	struct snap_mrec_ctx ctx;
+	struct snap_mrec *rec;
+	uint32_t nmax;
+	uint64_t last_nsec;
+};
+
+struct snap_mplay {
+	struct snap_mrec_ctx *ctx;
+	struct snap_mrec *rec;
+	uint32_t pos;
+	uint32_t mismatches;
+	uint32_t skipped;
+	uint64_t *t;			/* Recorded time of each record */
+	uint64_t t0;			/* Replay time of recorded time 0 */
+};
+
+static pthread_mutex_t mrec_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *mrec_fp;
+static char mrec_path[256];
+static struct snap_mrec_log *mrec_logs;	/* Not yet written */
+static uint32_t mrec_seq;
+
+static pthread_once_t mplay_once = PTHREAD_ONCE_INIT;
+static const char *mplay_file;
+static char *mplay_buf;			/* The whole recording */
+static struct snap_mrec_ctx **mplay_ctx;
+static bool *mplay_used;
+static int mplay_nctx;
+static bool mplay_timing;
+static bool mplay_strict;
+
+/*****************************************************************************
+ * Recording
+ ****************************************************************************/
+
+static void snap_mrec_write(struct snap_mrec_log *l)
+{
+	if ((fwrite(&l->ctx, sizeof(l->ctx), 1, mrec_fp) != 1) ||
+	    (fwrite(l->rec, sizeof(l->rec[0]), l->ctx.nrec, mrec_fp) !=
+	     l->ctx.nrec) || (fflush(mrec_fp) != 0))
+		fprintf(stderr, "err: cannot write MMIO recording %s: %s\n",
+			mrec_path, strerror(errno));
+}
+
+static void snap_mrec_exit(void)
+{
+	struct snap_mrec_log *l;
+
+	pthread_mutex_lock(&mrec_lock);
+	for (l = mrec_logs; l != NULL; l = l->next) {
+		pthread_mutex_lock(&l->lock);
+		snap_mrec_write(l);
+		pthread_mutex_unlock(&l->lock);
+	}
+	mrec_logs = NULL;
+	fclose(mrec_fp);
+	mrec_fp = NULL;
+	pthread_mutex_unlock(&mrec_lock);
+}
+
+int snap_mrec_init(const char *file, uint32_t flags)
+{
+	struct snap_mrec_file fh;
+
+	mrec_fp = fopen(file, "w");
+	if (mrec_fp == NULL)
+		return SNAP_EINVAL;
+	snprintf(mrec_path, sizeof(mrec_path), "%s", file);
+
+	memset(&fh, 0, sizeof(fh));
+	fh.magic = SNAP_MREC_MAGIC;
+	fh.version = SNAP_MREC_VERSION;
+	fh.flags = flags;
+	if (fwrite(&fh, sizeof(fh), 1, mrec_fp) != 1) {
+		fclose(mrec_fp);
+		mrec_fp = NULL;
+		return SNAP_EIO;
+	}
+	atexit(snap_mrec_exit);
+	return SNAP_OK;
+}
+
+struct snap_mrec_log *snap_mrec_open(const char *path, bool master, int cir,
+				     uint64_t cap_reg)
+{
+	struct snap_mrec_log *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return NULL;
+
+	snprintf(l->ctx.path, sizeof(l->ctx.path), "%s", path ? path : "");
+	l->ctx.cir = cir;
+	l->ctx.master = master;
+	l->ctx.cap_reg = cap_reg;
+	l->last_nsec = snap_stats_nsec();
+	pthread_mutex_init(&l->lock, NULL);
+
+	pthread_mutex_lock(&mrec_lock);
+	l->ctx.seq = mrec_seq++;
+	l->next = mrec_logs;
+	mrec_logs = l;
+	pthread_mutex_unlock(&mrec_lock);
+	return l;
+}
+
+void snap_mrec_add(struct snap_mrec_log *l, unsigned int op, uint64_t offs,
+		   uint64_t data)
+{
+	struct snap_mrec *r;
+	uint64_t now;
+
+	pthread_mutex_lock(&l->lock);
+	if (l->ctx.nrec == l->nmax) {
+		uint32_t n = l->nmax ? l->nmax * 2 : 4096;
+
+		r = realloc(l->rec, n * sizeof(*r));
+		if (r == NULL) {
+			pthread_mutex_unlock(&l->lock);
+			return;		/* The replay will notice the gap */
+		}
+		l->rec = r;
+		l->nmax = n;
+	}
+	now = snap_stats_nsec();
+	r = &l->rec[l->ctx.nrec++];
+	r->data = data;
+	r->offs_op = (op << 28) | (offs & SNAP_MREC_OFFS_MASK);
+	r->dt_nsec = (uint32_t)MIN(now - l->last_nsec, (uint64_t)UINT32_MAX);
+	l->last_nsec = now;
+	pthread_mutex_unlock(&l->lock);
+}
+
+void snap_mrec_close(struct snap_mrec_log *l)
+{
+	struct snap_mrec_log **p;
+
+	if (l == NULL)
+		return;
+
+	pthread_mutex_lock(&mrec_lock);
+	for (p = &mrec_logs; *p != NULL; p = &(*p)->next) {
+		if (*p == l) {
+			*p = l->next;
+			if (mrec_fp)
+				snap_mrec_write(l);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mrec_lock);
+
+	pthread_mutex_destroy(&l->lock);
+	free(l->rec);
+	free(l);
+}
+
+/*****************************************************************************
+ * Replay
+ ****************************************************************************/
+
+static void snap_mplay_load(void)
+{
+	FILE *fp;
+	long size, off;
+	struct snap_mrec_file *fh;
+	struct snap_mrec_ctx *c;
+	const char *env;
+
+	env = getenv("SNAP_MMIO_REPLAY_TIMING");
+	mplay_timing = (env != NULL) && (strtol(env, NULL, 0) != 0);
+	env = getenv("SNAP_MMIO_REPLAY_STRICT");
+	mplay_strict = (env != NULL) && (strtol(env, NULL, 0) != 0);
+
+	fp = fopen(mplay_file, "r");
+	if (fp == NULL)
+		goto __load_err;
+	if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0) ||
+	    (fseek(fp, 0, SEEK_SET) != 0))
+		goto __load_err;
+	mplay_buf = malloc(size);
+	if ((mplay_buf == NULL) ||
+	    (fread(mplay_buf, 1, size, fp) != (size_t)size))
+		goto __load_err;
+	fclose(fp);
+	fp = NULL;
+
+	fh = (struct snap_mrec_file *)mplay_buf;
+	if ((size < (long)sizeof(*fh)) || (fh->magic != SNAP_MREC_MAGIC) ||
+	    (fh->version != SNAP_MREC_VERSION)) {
+		errno = EINVAL;
+		goto __load_err;
+	}
+
+	for (off = sizeof(*fh); off + (long)sizeof(*c) <= size; ) {
+		c = (struct snap_mrec_ctx *)(mplay_buf + off);
+		off += sizeof(*c) + (long)c->nrec * sizeof(struct snap_mrec);
+		if (off > size)
+			break;		/* Truncated */
+		mplay_ctx = realloc(mplay_ctx, (mplay_nctx + 1) *
+				    sizeof(*mplay_ctx));
+		mplay_used = realloc(mplay_used, (mplay_nctx + 1) *
+				     sizeof(*mplay_used));
+		if ((mplay_ctx == NULL) || (mplay_used == NULL))
+			goto __load_err;
+		mplay_ctx[mplay_nctx] = c;
+		mplay_used[mplay_nctx++] = false;
+	}
+	return;
+
+ __load_err:
+	fprintf(stderr, "err: cannot load MMIO recording %s: %s\n",
+		mplay_file, strerror(errno));
+	if (fp)
+		fclose(fp);
+	mplay_nctx = 0;
+}
+
+/* flags gets the snap_mrec_file flags of the recording */
+struct snap_mplay *snap_mplay_open(const char *file, const char *path,
+				   struct snap_mrec_ctx *ctx, uint32_t *flags)
+{
+	struct snap_mplay *p;
+	int i, best = -1;
+	uint64_t t;
+
+	mplay_file = file;
+	pthread_once(&mplay_once, snap_mplay_load);
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+
+	/* The oldest unused context of the device */
+	pthread_mutex_lock(&mrec_lock);
+	for (i = 0; i < mplay_nctx; i++) {
+		if (mplay_used[i] ||
+		    (strncmp(mplay_ctx[i]->path, path ? path : "",
+			     sizeof(mplay_ctx[i]->path)) != 0))
+			continue;
+		if ((best < 0) || (mplay_ctx[i]->seq < mplay_ctx[best]->seq))
+			best = i;
+	}
+	if (best >= 0) {
+		mplay_used[best] = true;
+		p->ctx = mplay_ctx[best];
+		p->rec = (struct snap_mrec *)(p->ctx + 1);
+	}
+	pthread_mutex_unlock(&mrec_lock);
+
+	if (p->ctx == NULL) {
+		free(p);
+		errno = ENODEV;
+		return NULL;
+	}
+	p->t = malloc((p->ctx->nrec + 1) * sizeof(*p->t));
+	if (p->t == NULL) {
+		free(p);
+		return NULL;
+	}
+	for (i = 0, t = 0; i < (int)p->ctx->nrec; i++)
+		p->t[i] = t += p->rec[i].dt_nsec;
+
+	*ctx = *p->ctx;
+	*flags = ((struct snap_mrec_file *)mplay_buf)->flags;
+	p->t0 = snap_stats_nsec();
+	return p;
+}
+
+static bool snap_mplay_match(const struct snap_mrec *r, unsigned int op,
+			     uint64_t offs)
+{
+	return ((SNAP_MREC_OP(r) & ~SNAP_MREC_ERR) == op) &&
+		(SNAP_MREC_OFFS(r) == (offs & SNAP_MREC_OFFS_MASK));
+}
+
+/*
+ * Find the record for the next access with op and offs, skipping up to
+ * SNAP_MREC_RESYNC records.
+ *
+ * With timing, an access is not answered before its recorded time,
+ * relative to the previous one. The host polls by time, not by count,
+ * so within a run of polls of one register the next value counts as
+ * current once the time of the poll before it has passed; how long the
+ * recording host slept before it noticed the change does not matter.
+ * If the host is slower than the recording, the time line moves along
+ * with it.
+ */
+static struct snap_mrec *snap_mplay_next(struct snap_mplay *p,
+					 unsigned int op, uint64_t offs)
+{
+	uint32_t i, end, n = p->ctx->nrec;
+	uint64_t now;
+	bool poll;
+
+	end = MIN(p->pos + SNAP_MREC_RESYNC, n);
+	for (i = p->pos; i < end; i++)
+		if (snap_mplay_match(&p->rec[i], op, offs))
+			break;
+	if (i == end) {
+		p->mismatches++;
+		return NULL;
+	}
+	p->skipped += i - p->pos;
+
+	if (!mplay_timing) {
+		p->pos = i + 1;
+		return &p->rec[i];
+	}
+
+	poll = (op == SNAP_MREC_READ32) || (op == SNAP_MREC_READ64);
+	now = snap_stats_nsec();
+	while (poll && (i + 1 < n) &&
+	       snap_mplay_match(&p->rec[i + 1], op, offs) &&
+	       (p->t0 + p->t[i] <= now))
+		i++;
+	while (now < p->t0 + p->t[i]) {
+		snap_cpu_relax();
+		now = snap_stats_nsec();
+	}
+	if (poll && (i + 1 < n) && snap_mplay_match(&p->rec[i + 1], op, offs)) {
+		p->pos = i;		/* Still within the run */
+		return &p->rec[i];
+	}
+	p->pos = i + 1;
+	if (now > p->t0 + p->t[i])
+		p->t0 = now - p->t[i];
+	return &p->rec[i];
+}
+
+int snap_mplay_read(struct snap_mplay *p, unsigned int op, uint64_t offs,
+		    uint64_t *data)
+{
+	struct snap_mrec *r = snap_mplay_next(p, op, offs);
+
+	if (r == NULL) {
+		*data = 0;
+		errno = EIO;
+		return -1;
+	}
+	*data = r->data;
+	if (SNAP_MREC_OP(r) & SNAP_MREC_ERR) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int snap_mplay_write(struct snap_mplay *p, unsigned int op, uint64_t offs,
+		     uint64_t data)
+{
+	struct snap_mrec *r = snap_mplay_next(p, op, offs);
+
+	if ((r != NULL) && (r->data != data))
+		p->mismatches++;
+	if (mplay_strict && ((r == NULL) || (r->data != data))) {
+		errno = EIO;
+		return -1;
+	}
+	if ((r != NULL) && (SNAP_MREC_OP(r) & SNAP_MREC_ERR)) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* A wait which was not recorded returns at once, as if the irq came */
+int snap_mplay_irq(struct snap_mplay *p, int irq)
+{
+	struct snap_mrec *r;
+
+	if ((p->pos >= p->ctx->nrec) ||
+	    (SNAP_MREC_OP(&p->rec[p->pos]) != SNAP_MREC_IRQ))
+		return 0;
+	r = snap_mplay_next(p, SNAP_MREC_IRQ, irq);
+	return r ? (int)r->data : 0;
+}
+
+void snap_mplay_close(struct snap_mplay *p)
+{
+	if (p == NULL)
+		return;
+
+	if (p->mismatches || p->skipped || (p->pos != p->ctx->nrec))
+		fprintf(stderr, "MMIO replay %s: reached record %u of %u, "
+			"%u skipped, %u mismatches\n", p->ctx->path,
+			p->pos, p->ctx->nrec, p->skipped, p->mismatches);
+	free(p->t);
+	free(p);
+}
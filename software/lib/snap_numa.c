@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * NUMA placement. A card is PCIe attached to one node, DMA to memory
+ * of another node crosses the socket link. The node of a card comes
+ * from the numa_node of its PCI device in sysfs, SNAP_NUMA_NODE
+ * overrides it for all cards (-1 turns placement off). Memory policy
+ * and CPU binding use the plain system calls, such that libsnap does
+ * not depend on libnuma.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+#define SNAP_NUMA_SYSFS_CXL	"/sys/class/cxl"
+#define SNAP_NUMA_SYSFS_NODE	"/sys/devices/system/node"
+
+static int snap_numa_read_int(const char *fname, int *val)
+{
+	FILE *fp;
+	int rc;
+
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
+	rc = fscanf(fp, "%d", val);
+	fclose(fp);
+	return (rc == 1) ? 0 : -1;
+}
+
+int snap_numa_card_node(const char *path)
+{
+	const char *env = getenv("SNAP_NUMA_NODE");
+	const char *afu;
+	char fname[128];
+	int card_no, node;
+
+	if ((env != NULL) && (*env != '\0'))
+		return strtol(env, (char **)NULL, 0);
+
+	/* /dev/cxl/afu<card>.0[ms] is an AFU of /sys/class/cxl/card<card> */
+	afu = strrchr(path, '/');
+	afu = afu ? afu + 1 : path;
+	if (sscanf(afu, "afu%d.", &card_no) != 1)
+		return -1;
+	snprintf(fname, sizeof(fname), SNAP_NUMA_SYSFS_CXL
+		 "/card%d/device/numa_node", card_no);
+	if (snap_numa_read_int(fname, &node) != 0)
+		return -1;
+	return node;		/* -1 if the platform does not know */
+}
+
+/* cpulist format: 0-7,16-23 */
+static int snap_numa_node_cpus(int node, cpu_set_t *cpus)
+{
+	FILE *fp;
+	char fname[128];
+	int first, last, n = 0;
+	char sep;
+
+	snprintf(fname, sizeof(fname), SNAP_NUMA_SYSFS_NODE
+		 "/node%d/cpulist", node);
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
+
+	CPU_ZERO(cpus);
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		sep = fgetc(fp);
+		if (sep == '-') {
+			if (fscanf(fp, "%d", &last) != 1)
+				break;
+			sep = fgetc(fp);
+		}
+		for (; (first <= last) && (first < CPU_SETSIZE); first++) {
+			CPU_SET(first, cpus);
+			n++;
+		}
+		if (sep != ',')
+			break;
+	}
+	fclose(fp);
+	return (n == 0) ? -1 : 0;
+}
+
+int snap_thread_bind_node(int node)
+{
+	cpu_set_t cpus;
+	int rc;
+
+	if (node < 0)
+		return 0;
+	if (snap_numa_node_cpus(node, &cpus) != 0) {
+		errno = ENOENT;
+		return SNAP_ENOENT;
+	}
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (rc != 0) {
+		errno = rc;
+		return SNAP_EINVAL;
+	}
+	return SNAP_OK;
+}
+
+/*
+ * Let the memory which the calling thread faults in next come from
+ * node, as long as the node has some. Nothing is changed if the thread
+ * has a memory policy already, the application knows better then.
+ * Returns true if snap_numa_unprefer() has to be called.
+ */
+bool snap_numa_prefer(int node)
+{
+	int mode;
+	unsigned long mask[(SNAP_NUMA_NODES_MAX + 63) / 64];
+
+	if ((node < 0) || (node >= SNAP_NUMA_NODES_MAX))
+		return false;
+	if ((syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0) != 0) ||
+	    (mode != MPOL_DEFAULT))
+		return false;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / 64] = 1ul << (node % 64);
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		       SNAP_NUMA_NODES_MAX + 1) == 0;
+}
+
+void snap_numa_unprefer(void)
+{
+	syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Pool of slave contexts on one or more cards, all attached to the
+ * same action type. A context runs one job at a time, a caller takes
+ * an idle context from the pool, runs its job and hands it back.
+ * The pool picks the context by policy:
+ *
+ *   SNAP_POOL_LEAST_LOADED  idle context on the card with the fewest
+ *                           jobs in flight, cards share the load.
+ *   SNAP_POOL_ROUND_ROBIN   next idle context after the one handed
+ *                           out last.
+ *
+ * In CPU mode (SNAP_CONFIG=CPU) each context is a software card with
+ * its own action thread, the card numbers are not used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+struct snap_pool_ctx {
+	struct snap_card *card;
+	struct snap_action *action;
+	unsigned int card_idx;		/* index into card_load */
+	int card_no;
+	bool busy;
+	unsigned long jobs;
+	unsigned long errors;
+};
+
+struct snap_card_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;		/* A context was put back */
+	snap_pool_policy_t policy;
+	snap_action_type_t action_type;	/* To reattach after a timeout */
+	snap_action_flag_t action_flags;
+	int attach_timeout_sec;
+	unsigned int next;		/* Round robin position */
+	unsigned int ncards;
+	unsigned int *card_load;	/* Jobs in flight per card */
+	unsigned int nctx;
+	struct snap_pool_ctx ctx[];
+};
+
+void snap_card_pool_free(struct snap_card_pool *pool)
+{
+	unsigned int i;
+
+	if (pool == NULL)
+		return;
+
+	for (i = 0; i < pool->nctx; i++) {
+		if (pool->ctx[i].action)
+			snap_detach_action(pool->ctx[i].action);
+		if (pool->ctx[i].card)
+			snap_card_free(pool->ctx[i].card);
+	}
+	pthread_cond_destroy(&pool->idle);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->card_load);
+	free(pool);
+}
+
+struct snap_card_pool *snap_card_pool_alloc(const int *card_no,
+					    unsigned int ncards,
+					    unsigned int contexts,
+					    snap_action_type_t action_type,
+					    snap_action_flag_t action_flags,
+					    int attach_timeout_sec)
+{
+	unsigned int c, i, n;
+	char device[128];
+	struct snap_card_pool *pool;
+	struct snap_pool_ctx *ctx;
+
+	if ((card_no == NULL) || (ncards == 0) || (contexts == 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool) + ncards * contexts * sizeof(*ctx));
+	if (pool == NULL)
+		return NULL;
+
+	pool->card_load = calloc(ncards, sizeof(*pool->card_load));
+	if (pool->card_load == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->policy = SNAP_POOL_LEAST_LOADED;
+	pool->action_type = action_type;
+	pool->action_flags = action_flags;
+	pool->attach_timeout_sec = attach_timeout_sec;
+	pool->ncards = ncards;
+
+	/* Interleave the cards, such that round robin alternates them */
+	for (i = 0, n = 0; i < contexts; i++) {
+		for (c = 0; c < ncards; c++, n++) {
+			ctx = &pool->ctx[n];
+			ctx->card_idx = c;
+			ctx->card_no = card_no[c];
+
+			snprintf(device, sizeof(device) - 1,
+				 "/dev/cxl/afu%d.0s", card_no[c]);
+			ctx->card = snap_card_alloc_dev(device,
+						SNAP_VENDOR_ID_IBM,
+						SNAP_DEVICE_ID_SNAP);
+			if (ctx->card == NULL) {
+				pool_trace("  %s: cannot open %s\n",
+					   __func__, device);
+				goto err_out;
+			}
+			pool->nctx++;
+
+			ctx->action = snap_attach_action(ctx->card,
+					action_type, action_flags,
+					attach_timeout_sec);
+			if (ctx->action == NULL) {
+				pool_trace("  %s: cannot attach %s\n",
+					   __func__, device);
+				goto err_out;
+			}
+		}
+	}
+	return pool;
+
+ err_out:
+	snap_card_pool_free(pool);
+	return NULL;
+}
+
+int snap_card_pool_set_policy(struct snap_card_pool *pool,
+			      snap_pool_policy_t policy)
+{
+	if ((policy != SNAP_POOL_LEAST_LOADED) &&
+	    (policy != SNAP_POOL_ROUND_ROBIN)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->policy = policy;
+	pthread_mutex_unlock(&pool->lock);
+	return SNAP_OK;
+}
+
+unsigned int snap_card_pool_contexts(struct snap_card_pool *pool)
+{
+	return pool->nctx;
+}
+
+/* Called with pool->lock held, returns an idle context or NULL */
+static struct snap_pool_ctx *snap_pool_pick(struct snap_card_pool *pool)
+{
+	unsigned int i, n;
+	struct snap_pool_ctx *ctx, *best = NULL;
+
+	/* Start after the last pick, so ties do not favor one context */
+	for (i = 0; i < pool->nctx; i++) {
+		n = (pool->next + i) % pool->nctx;
+		ctx = &pool->ctx[n];
+		if (ctx->busy)
+			continue;
+		if (pool->policy == SNAP_POOL_ROUND_ROBIN) {
+			best = ctx;
+			break;
+		}
+		if ((best == NULL) ||
+		    (pool->card_load[ctx->card_idx] <
+		     pool->card_load[best->card_idx]))
+			best = ctx;
+	}
+	if (best)
+		pool->next = (best - pool->ctx + 1) % pool->nctx;
+	return best;
+}
+
+struct snap_action *snap_card_pool_get(struct snap_card_pool *pool,
+				       unsigned int timeout_sec)
+{
+	int rc = 0;
+	struct timespec ts;
+	struct snap_pool_ctx *ctx;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_sec;
+
+	pthread_mutex_lock(&pool->lock);
+	while ((ctx = snap_pool_pick(pool)) == NULL) {
+		rc = pthread_cond_timedwait(&pool->idle, &pool->lock, &ts);
+		if (rc == ETIMEDOUT)
+			break;
+	}
+	if (ctx) {
+		ctx->busy = true;
+		pool->card_load[ctx->card_idx]++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (ctx == NULL) {
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	pool_trace("  %s: context %ld card %d\n", __func__,
+		   (long)(ctx - pool->ctx), ctx->card_no);
+	return ctx->action;
+}
+
+/* Called with pool->lock held */
+static struct snap_pool_ctx *snap_pool_find(struct snap_card_pool *pool,
+					    struct snap_action *action)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nctx; i++)
+		if (pool->ctx[i].action == action)
+			return &pool->ctx[i];
+	return NULL;
+}
+
+/*
+ * After a timeout or an MMIO error the action may still run the job,
+ * the next job must not be written over it. Detaching aborts the
+ * action, a context which cannot be attached again stays busy for good.
+ */
+static void snap_pool_reattach(struct snap_card_pool *pool,
+			       struct snap_pool_ctx *ctx)
+{
+	snap_detach_action(ctx->action);
+	ctx->action = snap_attach_action(ctx->card, pool->action_type,
+					 pool->action_flags,
+					 pool->attach_timeout_sec);
+	if (ctx->action == NULL)
+		pool_trace("  %s: context %ld card %d lost\n", __func__,
+			   (long)(ctx - pool->ctx), ctx->card_no);
+}
+
+static int __snap_card_pool_put(struct snap_card_pool *pool,
+				struct snap_action *action, int job_rc,
+				bool reattach)
+{
+	struct snap_pool_ctx *ctx;
+
+	pthread_mutex_lock(&pool->lock);
+	ctx = snap_pool_find(pool, action);
+	if ((ctx == NULL) || !ctx->busy) {
+		pthread_mutex_unlock(&pool->lock);
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (reattach) {		/* ctx stays busy, nobody else touches it */
+		pthread_mutex_unlock(&pool->lock);
+		snap_pool_reattach(pool, ctx);
+		pthread_mutex_lock(&pool->lock);
+	}
+	ctx->busy = (ctx->action == NULL);
+	ctx->jobs++;
+	if (job_rc != 0)
+		ctx->errors++;
+	pool->card_load[ctx->card_idx]--;
+	pthread_cond_signal(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+	return SNAP_OK;
+}
+
+int snap_card_pool_put(struct snap_card_pool *pool, struct snap_action *action)
+{
+	return __snap_card_pool_put(pool, action, 0, false);
+}
+
+int snap_card_pool_execute_job(struct snap_card_pool *pool,
+			       struct snap_job *cjob,
+			       unsigned int timeout_sec)
+{
+	int rc;
+	struct snap_action *action;
+
+	action = snap_card_pool_get(pool, timeout_sec);
+	if (action == NULL)
+		return SNAP_ETIMEDOUT;
+
+	rc = snap_action_sync_execute_job(action, cjob, timeout_sec);
+	__snap_card_pool_put(pool, action,
+			     (rc != 0) || (cjob->retc != SNAP_RETC_SUCCESS),
+			     rc != SNAP_OK);
+	return rc;
+}
+
+int snap_card_pool_get_stats(struct snap_card_pool *pool,
+			     struct snap_card_pool_stats *stats,
+			     unsigned int n)
+{
+	unsigned int i;
+	struct snap_pool_ctx *ctx;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; (i < n) && (i < pool->nctx); i++) {
+		ctx = &pool->ctx[i];
+		stats[i].card_no = ctx->card_no;
+		stats[i].busy = ctx->busy;
+		stats[i].card_inflight = pool->card_load[ctx->card_idx];
+		stats[i].jobs = ctx->jobs;
+		stats[i].errors = ctx->errors;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return i;
+}
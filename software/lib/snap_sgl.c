@@ -0,0 +1,293 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scatter-gather lists of struct snap_addr, see snap_types.h for the
+ * layout the actions expect. The builder keeps all entries in one
+ * array, so it never emits SNAP_ADDRFLAG_EXT links, the iterator
+ * follows them for lists built by other means.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+
+#define SNAP_SGL_ALIGN		64	/* One cache line, one bus word */
+#define SNAP_SGL_MIN		16u
+
+static int snap_sgl_grow(struct snap_sgl *sgl, unsigned int max)
+{
+	struct snap_addr *ent;
+
+	if (posix_memalign((void **)&ent, SNAP_SGL_ALIGN,
+			   max * sizeof(*ent)) != 0) {
+		errno = ENOMEM;
+		return SNAP_ENOMEM;
+	}
+	if (sgl->ent) {
+		memcpy(ent, sgl->ent, sgl->n * sizeof(*ent));
+		free(sgl->ent);
+	}
+	sgl->ent = ent;
+	sgl->max = max;
+	return 0;
+}
+
+struct snap_sgl *snap_sgl_alloc(unsigned int max)
+{
+	struct snap_sgl *sgl;
+
+	sgl = calloc(1, sizeof(*sgl));
+	if (sgl == NULL)
+		return NULL;
+
+	if (snap_sgl_grow(sgl, MAX(max, SNAP_SGL_MIN)) != 0) {
+		free(sgl);
+		return NULL;
+	}
+	return sgl;
+}
+
+void snap_sgl_free(struct snap_sgl *sgl)
+{
+	if (sgl == NULL)
+		return;
+	free(sgl->ent);
+	free(sgl);
+}
+
+void snap_sgl_reset(struct snap_sgl *sgl)
+{
+	sgl->n = 0;
+	sgl->size = 0;
+}
+
+int snap_sgl_add(struct snap_sgl *sgl, const void *addr, uint32_t size,
+		 snap_addrtype_t type)
+{
+	int rc;
+
+	if ((addr == NULL) && (type == SNAP_ADDRTYPE_HOST_DRAM)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (size == 0)
+		return 0;
+
+	if (sgl->n == sgl->max) {
+		rc = snap_sgl_grow(sgl, sgl->max * 2);
+		if (rc != 0)
+			return rc;
+	}
+	if (sgl->n)
+		sgl->ent[sgl->n - 1].flags &= ~SNAP_ADDRFLAG_END;
+
+	snap_addr_set(&sgl->ent[sgl->n++], addr, size, type,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_END);
+	sgl->size += size;
+	return 0;
+}
+
+int snap_sgl_add_iov(struct snap_sgl *sgl, const struct iovec *iov,
+		     int iovcnt)
+{
+	int i, rc;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > UINT32_MAX) {
+			errno = EINVAL;
+			return SNAP_EINVAL;
+		}
+		rc = snap_sgl_add(sgl, iov[i].iov_base, iov[i].iov_len,
+				  SNAP_ADDRTYPE_HOST_DRAM);
+		if (rc != 0)
+			return rc;
+	}
+	return 0;
+}
+
+struct snap_sgl *snap_sgl_split(void *buf, size_t size, unsigned int n)
+{
+	struct snap_sgl *sgl;
+	size_t frag, off;
+
+	if (n == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	frag = (size + n - 1) / n;
+	frag = (frag + SNAP_SGL_ALIGN - 1) & ~(SNAP_SGL_ALIGN - 1ul);
+	if (frag > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sgl = snap_sgl_alloc(n);
+	if (sgl == NULL)
+		return NULL;
+
+	for (off = 0; off < size; off += frag) {
+		if (snap_sgl_add(sgl, (uint8_t *)buf + off,
+				 MIN(frag, size - off),
+				 SNAP_ADDRTYPE_HOST_DRAM) != 0) {
+			snap_sgl_free(sgl);
+			return NULL;
+		}
+	}
+	return sgl;
+}
+
+int snap_addr_set_sgl(struct snap_addr *da, const struct snap_sgl *sgl,
+		      snap_addrflag_t flags)
+{
+	if ((sgl->n == 0) || (sgl->size > UINT32_MAX)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	snap_addr_set(da, sgl->ent, sgl->size, SNAP_ADDRTYPE_HOST_DRAM,
+		      flags | SNAP_ADDRFLAG_EXT);
+	return 0;
+}
+
+/* Skip links to the next array, returns the next data entry or NULL */
+static const struct snap_addr *snap_sg_entry(const struct snap_addr *ent)
+{
+	while (ent && (ent->flags & SNAP_ADDRFLAG_EXT))
+		ent = (const struct snap_addr *)(unsigned long)ent->addr;
+	return ent;
+}
+
+int snap_sg_iter_init(struct snap_sg_iter *it, const struct snap_addr *op)
+{
+	it->offs = 0;
+	if (op->type != SNAP_ADDRTYPE_HOST_DRAM) {
+		it->ent = NULL;
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (op->flags & SNAP_ADDRFLAG_EXT) {
+		it->ent = snap_sg_entry(
+			(const struct snap_addr *)(unsigned long)op->addr);
+		return 0;
+	}
+	it->plain = *op;
+	it->plain.flags |= SNAP_ADDRFLAG_END;
+	it->ent = &it->plain;
+	return 0;
+}
+
+void *snap_sg_iter_next(struct snap_sg_iter *it, size_t *len)
+{
+	const struct snap_addr *ent;
+	uint8_t *p;
+
+	while ((ent = it->ent) != NULL && (it->offs == ent->size)) {
+		it->ent = (ent->flags & SNAP_ADDRFLAG_END) ?
+			NULL : snap_sg_entry(ent + 1);
+		it->offs = 0;
+	}
+	if ((ent == NULL) || (ent->type != SNAP_ADDRTYPE_HOST_DRAM)) {
+		it->ent = NULL;
+		*len = 0;
+		return NULL;
+	}
+
+	p = (uint8_t *)(unsigned long)ent->addr + it->offs;
+	*len = MIN(*len, ent->size - it->offs);
+	it->offs += *len;
+	return p;
+}
+
+ssize_t snap_addr_gather(const struct snap_addr *op, void *buf, size_t len)
+{
+	struct snap_sg_iter it;
+	uint8_t *dst = (uint8_t *)buf;
+	size_t n, done = 0;
+	void *src;
+
+	if (snap_sg_iter_init(&it, op) != 0)
+		return SNAP_EINVAL;
+
+	while (done < len) {
+		n = len - done;
+		src = snap_sg_iter_next(&it, &n);
+		if (src == NULL)
+			break;
+		memcpy(dst + done, src, n);
+		done += n;
+	}
+	return done;
+}
+
+ssize_t snap_addr_scatter(const struct snap_addr *op, const void *buf,
+			  size_t len)
+{
+	struct snap_sg_iter it;
+	const uint8_t *src = (const uint8_t *)buf;
+	size_t n, done = 0;
+	void *dst;
+
+	if (snap_sg_iter_init(&it, op) != 0)
+		return SNAP_EINVAL;
+
+	while (done < len) {
+		n = len - done;
+		dst = snap_sg_iter_next(&it, &n);
+		if (dst == NULL)
+			break;
+		memcpy(dst, src + done, n);
+		done += n;
+	}
+	return done;
+}
+
+ssize_t snap_addr_copy(const struct snap_addr *dst,
+		       const struct snap_addr *src, size_t len)
+{
+	struct snap_sg_iter d, s;
+	uint8_t *dp = NULL, *sp = NULL;
+	size_t dn = 0, sn = 0, n, done = 0;
+
+	if ((snap_sg_iter_init(&d, dst) != 0) ||
+	    (snap_sg_iter_init(&s, src) != 0))
+		return SNAP_EINVAL;
+
+	while (done < len) {
+		if (dn == 0) {
+			dn = len - done;
+			dp = snap_sg_iter_next(&d, &dn);
+			if (dp == NULL)
+				break;
+		}
+		if (sn == 0) {
+			sn = len - done;
+			sp = snap_sg_iter_next(&s, &sn);
+			if (sp == NULL)
+				break;
+		}
+		n = MIN(dn, sn);
+		memcpy(dp, sp, n);
+		dp += n; dn -= n;
+		sp += n; sn -= n;
+		done += n;
+	}
+	return done;
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Always-on counters and latency histograms per card context.
+ *
+ * Every thread which uses a context counts into its own block, so the
+ * hot path takes no lock and shares no cacheline. The blocks of a
+ * context are linked, a reader sums them up. A small per thread cache
+ * maps the context id to the block of the thread. Ids are never
+ * reused, so a stale cache entry of a freed context cannot match.
+ *
+ * If SNAP_STATS_SHM=<msec> is set, the sums are also copied to a slot
+ * of the shared memory segment of the process (see snap_shm.h), when a
+ * counting thread notices that <msec> have passed. Only one thread
+ * publishes at a time, the others go on without waiting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+#include <snap_shm.h>
+
+#define SNAP_STATS_TLC		8	/* Contexts cached per thread */
+
+struct snap_stats_block {
+	struct snap_stats_block *next;
+	const void *owner;		/* Thread which counts into it */
+	struct snap_stats s;
+} __attribute__((aligned(64)));
+
+static uint64_t snap_stats_ids;
+
+static pthread_once_t shm_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_shm_hdr *shm_hdr;	/* NULL if not published */
+static char shm_path[64];
+
+static __thread struct {
+	uint64_t id;
+	struct snap_stats_block *b;
+} stats_tlc[SNAP_STATS_TLC];
+
+/* CLOCK_MONOTONIC is a vDSO call on the supported platforms */
+uint64_t snap_stats_nsec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+void snap_stats_init(struct snap_stats_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->id = __atomic_add_fetch(&snap_stats_ids, 1, __ATOMIC_RELAXED);
+}
+
+/* No thread may count into ctx anymore */
+void snap_stats_free(struct snap_stats_ctx *ctx)
+{
+	struct snap_stats_block *b;
+
+	while ((b = ctx->blocks) != NULL) {
+		ctx->blocks = b->next;
+		free(b);
+	}
+}
+
+static struct snap_stats_block *snap_stats_block_new(struct snap_stats_ctx *ctx,
+						     const void *owner)
+{
+	struct snap_stats_block *b, *head;
+
+	/* The thread might have been evicted from the cache only */
+	for (b = __atomic_load_n(&ctx->blocks, __ATOMIC_ACQUIRE); b != NULL;
+	     b = b->next)
+		if (b->owner == owner)
+			return b;
+
+	if (posix_memalign((void **)&b, 64, sizeof(*b)) != 0)
+		return NULL;
+	memset(b, 0, sizeof(*b));
+	b->owner = owner;
+
+	head = __atomic_load_n(&ctx->blocks, __ATOMIC_ACQUIRE);
+	do {
+		b->next = head;
+	} while (!__atomic_compare_exchange_n(&ctx->blocks, &head, b, false,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
+	return b;
+}
+
+struct snap_stats *snap_stats_local(struct snap_stats_ctx *ctx)
+{
+	static struct snap_stats dummy;	/* If we run out of memory */
+	unsigned int i = ctx->id % SNAP_STATS_TLC;
+	struct snap_stats_block *b;
+
+	if (stats_tlc[i].id == ctx->id)
+		return &stats_tlc[i].b->s;
+
+	b = snap_stats_block_new(ctx, &stats_tlc);
+	if (b == NULL)
+		return &dummy;
+	stats_tlc[i].id = ctx->id;
+	stats_tlc[i].b = b;
+	return &b->s;
+}
+
+void snap_stats_hist_add(struct snap_stats_hist *h, uint64_t nsec)
+{
+	unsigned int i = nsec ? 64 - __builtin_clzll(nsec) : 0;
+
+	i = MIN(i, SNAP_STATS_BUCKETS - 1u);
+	snap_stats_inc(&h->bucket[i], 1);
+	snap_stats_inc(&h->count, 1);
+	snap_stats_inc(&h->sum_nsec, nsec);
+	if (nsec > h->max_nsec)
+		__atomic_store_n(&h->max_nsec, nsec, __ATOMIC_RELAXED);
+}
+
+void snap_stats_op(struct snap_stats_ctx *ctx, enum snap_stats_op op,
+		   uint64_t nsec)
+{
+	snap_stats_hist_add(&snap_stats_local(ctx)->hist[op], nsec);
+	if (ctx->shm)
+		snap_stats_shm_publish(ctx);
+}
+
+static inline uint64_t snap_stats_rd(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+void snap_stats_sum(struct snap_stats_ctx *ctx, struct snap_stats *out)
+{
+	unsigned int op, i;
+	struct snap_stats_block *b;
+	const struct snap_stats_hist *h;
+	struct snap_stats_hist *o;
+
+	memset(out, 0, sizeof(*out));
+	for (b = __atomic_load_n(&ctx->blocks, __ATOMIC_ACQUIRE); b != NULL;
+	     b = b->next) {
+		out->mmio_reads += snap_stats_rd(&b->s.mmio_reads);
+		out->mmio_writes += snap_stats_rd(&b->s.mmio_writes);
+		out->jobs += snap_stats_rd(&b->s.jobs);
+		out->errors += snap_stats_rd(&b->s.errors);
+		out->timeouts += snap_stats_rd(&b->s.timeouts);
+		out->bytes += snap_stats_rd(&b->s.bytes);
+
+		for (op = 0; op < SNAP_STATS_OPS; op++) {
+			h = &b->s.hist[op];
+			o = &out->hist[op];
+			o->count += snap_stats_rd(&h->count);
+			o->sum_nsec += snap_stats_rd(&h->sum_nsec);
+			o->max_nsec = MAX(o->max_nsec,
+					  snap_stats_rd(&h->max_nsec));
+			for (i = 0; i < SNAP_STATS_BUCKETS; i++)
+				o->bucket[i] += snap_stats_rd(&h->bucket[i]);
+		}
+	}
+}
+
+/* out = a - b, for counters since a snapshot. max_nsec is kept. */
+void snap_stats_diff(struct snap_stats *out, const struct snap_stats *a,
+		     const struct snap_stats *b)
+{
+	unsigned int op, i;
+
+	out->mmio_reads = a->mmio_reads - b->mmio_reads;
+	out->mmio_writes = a->mmio_writes - b->mmio_writes;
+	out->jobs = a->jobs - b->jobs;
+	out->errors = a->errors - b->errors;
+	out->timeouts = a->timeouts - b->timeouts;
+	out->bytes = a->bytes - b->bytes;
+	for (op = 0; op < SNAP_STATS_OPS; op++) {
+		out->hist[op].count = a->hist[op].count - b->hist[op].count;
+		out->hist[op].sum_nsec = a->hist[op].sum_nsec -
+			b->hist[op].sum_nsec;
+		out->hist[op].max_nsec = a->hist[op].max_nsec;
+		for (i = 0; i < SNAP_STATS_BUCKETS; i++)
+			out->hist[op].bucket[i] = a->hist[op].bucket[i] -
+				b->hist[op].bucket[i];
+	}
+}
+
+uint64_t snap_stats_percentile(const struct snap_stats_hist *hist, double p)
+{
+	unsigned int i;
+	uint64_t n = 0, rank;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * hist->count);
+	if (rank >= hist->count)
+		rank = hist->count - 1;
+
+	for (i = 0; i < SNAP_STATS_BUCKETS; i++) {
+		n += hist->bucket[i];
+		if (n > rank)
+			break;
+	}
+	/* Upper end of the bucket, but not above what was seen */
+	if (i == 0)
+		return 0;
+	return MIN(1ull << i, hist->max_nsec);
+}
+
+/* Shared memory segment */
+
+static void snap_stats_shm_unlink(void)
+{
+	unlink(shm_path);
+}
+
+static void snap_stats_shm_init(void)
+{
+	int fd;
+	unsigned long msec;
+	const char *env = getenv("SNAP_STATS_SHM");
+	struct snap_shm_hdr *hdr;
+
+	if (env == NULL)
+		return;
+	msec = strtoul(env, (char **)NULL, 0);
+	if (msec == 0)
+		return;
+
+	snprintf(shm_path, sizeof(shm_path), "%s/%s%d", SNAP_SHM_DIR,
+		 SNAP_SHM_PREFIX, (int)getpid());
+	fd = open(shm_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	if (ftruncate(fd, sizeof(*hdr)) != 0) {
+		close(fd);
+		unlink(shm_path);
+		return;
+	}
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		unlink(shm_path);
+		return;
+	}
+
+	hdr->version = SNAP_SHM_VERSION;
+	hdr->pid = getpid();
+	hdr->nslots = SNAP_SHM_SLOTS;
+	hdr->period_nsec = msec * 1000000ull;
+	strncpy(hdr->comm, program_invocation_short_name,
+		sizeof(hdr->comm) - 1);
+	/* Readers check the magic last */
+	__atomic_store_n(&hdr->magic, SNAP_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm_hdr = hdr;
+	atexit(snap_stats_shm_unlink);
+}
+
+/* Claim a slot for a new context, no-op if publishing is off */
+void snap_stats_shm_open(struct snap_stats_ctx *ctx, const char *name)
+{
+	unsigned int i;
+	struct snap_shm_slot *slot;
+
+	pthread_once(&shm_once, snap_stats_shm_init);
+	if (shm_hdr == NULL)
+		return;
+
+	pthread_mutex_lock(&shm_lock);
+	for (i = 0; i < SNAP_SHM_SLOTS; i++) {
+		slot = &shm_hdr->slot[i];
+		if (slot->in_use)
+			continue;
+
+		slot->seq++;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memset(&slot->s, 0, sizeof(slot->s));
+		slot->ctx_id = ctx->id;
+		slot->action_type = 0;
+		slot->inflight = 0;
+		slot->update_nsec = snap_stats_nsec();
+		strncpy(slot->name, name ? name : "", sizeof(slot->name) - 1);
+		slot->name[sizeof(slot->name) - 1] = 0;
+		slot->in_use = 1;
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+		ctx->shm = slot;
+		ctx->shm_next = 0;
+		break;
+	}
+	pthread_mutex_unlock(&shm_lock);
+}
+
+void snap_stats_shm_attach(struct snap_stats_ctx *ctx, uint32_t action_type)
+{
+	if (ctx->shm == NULL)
+		return;
+	__atomic_store_n(&ctx->shm->action_type, action_type,
+			 __ATOMIC_RELAXED);
+	ctx->shm_next = 0;
+	snap_stats_shm_publish(ctx);
+}
+
+void snap_stats_shm_close(struct snap_stats_ctx *ctx)
+{
+	struct snap_shm_slot *slot = ctx->shm;
+
+	if (slot == NULL)
+		return;
+	ctx->shm_next = 0;
+	snap_stats_shm_publish(ctx);	/* Last numbers */
+
+	pthread_mutex_lock(&shm_lock);
+	__atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+	ctx->shm = NULL;
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/* Cheap unless the update period has passed */
+void snap_stats_shm_publish(struct snap_stats_ctx *ctx)
+{
+	struct snap_shm_slot *slot = ctx->shm;
+	struct snap_stats sum;
+	uint64_t now = snap_stats_nsec();
+
+	if (now < __atomic_load_n(&ctx->shm_next, __ATOMIC_RELAXED))
+		return;
+	if (__atomic_exchange_n(&ctx->shm_busy, 1, __ATOMIC_ACQUIRE))
+		return;			/* Another thread is at it */
+
+	snap_stats_sum(ctx, &sum);
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->s = sum;
+	slot->inflight = (ctx->t_start != 0);
+	slot->update_nsec = now;
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&ctx->shm_next, now + shm_hdr->period_nsec,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->shm_busy, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Per thread rings of binary trace events, see snap_tracebuf.h. Only
+ * the owning thread writes its ring, so recording an event is a time
+ * stamp read and four stores. Rings are linked into a global list once
+ * and are kept after their thread is gone, such that the dump at exit
+ * still sees them. Events recorded while the dump runs may be torn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+#include <snap_tracebuf.h>
+
+#define SNAP_TEV_EVENTS		(64 * 1024)
+
+struct snap_tev_ring {
+	struct snap_tev_ring *next;
+	uint32_t tid;
+	uint32_t mask;
+	uint64_t head;			/* Events recorded so far */
+	struct snap_tev ev[];
+};
+
+int snap_tev_on = 0;
+
+static unsigned int tev_events = SNAP_TEV_EVENTS;
+static struct snap_tev_ring *tev_rings;
+static __thread struct snap_tev_ring *tev_ring;
+static uint64_t tev_tsc0, tev_nsec0;
+static char tev_path[256];
+
+static struct snap_tev_ring *snap_tev_ring_new(void)
+{
+	struct snap_tev_ring *r;
+
+	r = calloc(1, sizeof(*r) + tev_events * sizeof(r->ev[0]));
+	if (r == NULL)
+		return NULL;
+
+	r->tid = __gettid();
+	r->mask = tev_events - 1;
+	r->next = __atomic_load_n(&tev_rings, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&tev_rings, &r->next, r, false,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_ACQUIRE))
+		;
+	tev_ring = r;
+	return r;
+}
+
+void __snap_tev(uint32_t id, uint64_t a0, uint64_t a1)
+{
+	struct snap_tev_ring *r = tev_ring;
+	struct snap_tev *e;
+
+	if (r == NULL) {
+		r = snap_tev_ring_new();
+		if (r == NULL)
+			return;
+	}
+	e = &r->ev[r->head & r->mask];
+	e->tsc = snap_tev_tsc();
+	e->id = id;
+	e->a0 = a0;
+	e->a1 = a1;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static int snap_tev_write_ring(FILE *fp, struct snap_tev_ring *r)
+{
+	struct snap_tev_ring_hdr rh;
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t first, i;
+
+	first = (head > (uint64_t)r->mask + 1) ? head - r->mask - 1 : 0;
+	rh.tid = r->tid;
+	rh.nev = head - first;
+	rh.lost = first;
+	if (fwrite(&rh, sizeof(rh), 1, fp) != 1)
+		return -1;
+
+	/* Oldest first, the ring may wrap once */
+	for (i = first; i < head; ) {
+		uint64_t n = MIN(head - i, (uint64_t)r->mask + 1 -
+				 (i & r->mask));
+
+		if (fwrite(&r->ev[i & r->mask], sizeof(r->ev[0]), n, fp) != n)
+			return -1;
+		i += n;
+	}
+	return 0;
+}
+
+int snap_tev_dump(const char *path)
+{
+	FILE *fp;
+	struct snap_tev_file fh;
+	struct snap_tev_ring *r;
+	int rc = 0;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return SNAP_EINVAL;
+
+	memset(&fh, 0, sizeof(fh));
+	fh.magic = SNAP_TEV_MAGIC;
+	fh.version = SNAP_TEV_VERSION;
+	fh.pid = getpid();
+	fh.nids = SNAP_TEV_IDS;
+	fh.tsc0 = tev_tsc0;
+	fh.nsec0 = tev_nsec0;
+	fh.tsc1 = snap_tev_tsc();
+	fh.nsec1 = snap_stats_nsec();
+	for (r = __atomic_load_n(&tev_rings, __ATOMIC_ACQUIRE); r != NULL;
+	     r = r->next)
+		fh.nrings++;
+
+	if (fwrite(&fh, sizeof(fh), 1, fp) != 1)
+		rc = SNAP_EIO;
+	for (r = __atomic_load_n(&tev_rings, __ATOMIC_ACQUIRE);
+	     (rc == 0) && (r != NULL) && (fh.nrings-- > 0); r = r->next)
+		if (snap_tev_write_ring(fp, r) != 0)
+			rc = SNAP_EIO;
+
+	if (fclose(fp) != 0)
+		rc = SNAP_EIO;
+	return rc;
+}
+
+static void snap_tev_exit(void)
+{
+	snap_tev_on = 0;
+	if (snap_tev_dump(tev_path) != 0)
+		fprintf(stderr, "err: cannot write trace %s: %s\n",
+			tev_path, strerror(errno));
+}
+
+void snap_tev_init(void)
+{
+	const char *env;
+	unsigned long n;
+
+	env = getenv("SNAP_TRACE_EVENTS");
+	if (env != NULL) {
+		n = strtoul(env, (char **)NULL, 0);
+		/* Power of 2, for the index mask */
+		for (tev_events = 16; (tev_events < n) &&
+			     (tev_events < (1u << 30)); tev_events <<= 1)
+			;
+	}
+	env = getenv("SNAP_TRACE_FILE");
+	if (env != NULL)
+		snprintf(tev_path, sizeof(tev_path), "%s", env);
+	else
+		snprintf(tev_path, sizeof(tev_path), "snap_trace.%d.bin",
+			 (int)getpid());
+
+	tev_tsc0 = snap_tev_tsc();
+	tev_nsec0 = snap_stats_nsec();
+	atexit(snap_tev_exit);
+	snap_tev_on = 1;
+}
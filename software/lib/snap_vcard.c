@@ -0,0 +1,498 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Register model of the SNAP job manager for SNAP_CONFIG=VIRT. The
+ * hw_* attach and detach code of snap.c talks to it like to a card:
+ * SSR and ATRI tell which actions exist, CCR selects one, JCR starts
+ * the attach with the sequence number of CCR, and CSR shows when an
+ * action instance was assigned. Contexts which want the same action
+ * instance are served one after the other. The master context can
+ * take the SLR lock and explore the actions like snap_maint does.
+ *
+ * Cards exist per process, /dev/cxl/afu<n>.0s and afu<n>.0m share
+ * card <n>. A card comes up explored like one snap_maint has set up.
+ * The action instances are the registered software actions, together
+ * with the plugins found in SNAP_ACTION_PATH.
+ * Latencies are configured with
+ *   SNAP_VCARD_ATTACH_USEC   from JCR start until CSR shows attached
+ *   SNAP_VCARD_DETACH_USEC   from JCR stop/abort until CSR shows detached
+ *   SNAP_VCARD_MMIO_NSEC     added to each MMIO access
+ *   SNAP_VCARD_INSTANCES     action instances per action type (1)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libsnap.h>
+#include <snap_internal.h>
+#include <snap_s_regs.h>
+#include <snap_m_regs.h>
+#include <snap_hls_if.h>
+
+#define SNAP_VCARD_MAX		4	/* Cards per process */
+#define SNAP_VCARD_IVR		0x0001000000000000ull	/* v0.1.0 */
+#define SNAP_VCARD_BDR		0x0000201710171200ull
+#define SNAP_VCARD_CAP		(6ull << 32 | N250SP_CARD) /* 64 B aligned */
+
+enum {
+	SNAP_VCTX_IDLE = 0,
+	SNAP_VCTX_WAIT,			/* Started, no free action instance */
+	SNAP_VCTX_ATTACH,		/* Instance assigned, latency running */
+	SNAP_VCTX_ATTACHED,
+	SNAP_VCTX_DETACH,		/* Stop or abort, latency running */
+};
+
+struct snap_vcard_action {
+	snap_action_type_t action_type;
+	uint32_t version;		/* SNAP_ACTION_VERS_REG */
+	struct snap_vctx *owner;	/* Attached context or NULL */
+};
+
+struct snap_vcard {
+	pthread_mutex_t lock;
+	pthread_cond_t c;		/* Attach state changes */
+	int users;
+	bool slr;			/* SNAP Lock Register */
+	bool explored;			/* SSR bit 8 */
+	int msat;			/* Maximum Short Action Type */
+	int maid;			/* Action instances */
+	int next_cir;
+	uint64_t t0;			/* For the free running timer */
+	uint64_t atri[SNAP_M_ACT_MAX_COUNT];
+	uint32_t casv[SNAP_CASV_NUM];	/* Attached contexts */
+	struct snap_vcard_action act[SNAP_M_ACT_MAX_COUNT];
+};
+
+static pthread_mutex_t vcard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snap_vcard *vcards[SNAP_VCARD_MAX];
+static unsigned long vcard_attach_nsec;
+static unsigned long vcard_detach_nsec;
+static unsigned long vcard_mmio_nsec;
+
+static unsigned long vcard_env(const char *name, unsigned long def)
+{
+	const char *env = getenv(name);
+
+	if (env == NULL)
+		return def;
+	return strtoul(env, (char **)NULL, 0);
+}
+
+/*
+ * Action instances in ATRI order. Short action types are assigned
+ * like snap_maint does it: instances of one type share the number.
+ */
+static struct snap_vcard *snap_vcard_new(const snap_action_type_t *types,
+					 int ntypes)
+{
+	struct snap_vcard *vc;
+	unsigned long instances;
+	int i, k;
+
+	vc = calloc(1, sizeof(*vc));
+	if (vc == NULL)
+		return NULL;
+
+	vcard_attach_nsec = vcard_env("SNAP_VCARD_ATTACH_USEC", 0) * 1000;
+	vcard_detach_nsec = vcard_env("SNAP_VCARD_DETACH_USEC", 0) * 1000;
+	vcard_mmio_nsec = vcard_env("SNAP_VCARD_MMIO_NSEC", 0);
+	instances = MAX(vcard_env("SNAP_VCARD_INSTANCES", 1), 1ul);
+
+	for (i = 0; i < ntypes; i++) {
+		for (k = 0; (k < (int)instances) &&
+			     (vc->maid < SNAP_M_ACT_MAX_COUNT); k++) {
+			vc->act[vc->maid].action_type = types[i];
+			vc->act[vc->maid].version = 1;
+			vc->atri[vc->maid] = (uint64_t)i << 32 | types[i];
+			vc->maid++;
+		}
+	}
+	vc->msat = MAX(ntypes - 1, 0);
+	vc->maid = MAX(vc->maid, 1);	/* SSR cannot tell 0 actions */
+	vc->explored = true;
+
+	pthread_mutex_init(&vc->lock, NULL);
+	pthread_cond_init(&vc->c, NULL);
+	vc->t0 = snap_stats_nsec();
+	vc->next_cir = 1;
+	return vc;
+}
+
+int snap_vcard_open(struct snap_vctx *x, const char *path,
+		    const snap_action_type_t *types, int ntypes)
+{
+	int card = 0;
+	char mode = 's';
+	struct snap_vcard *vc;
+
+	if ((path != NULL) &&
+	    (sscanf(path, "/dev/cxl/afu%d.0%c", &card, &mode) < 1))
+		card = 0;
+	if ((card < 0) || (card >= SNAP_VCARD_MAX)) {
+		errno = ENODEV;
+		return SNAP_ENODEV;
+	}
+
+	pthread_mutex_lock(&vcard_lock);
+	vc = vcards[card];
+	if (vc == NULL) {
+		vc = vcards[card] = snap_vcard_new(types, ntypes);
+		if (vc == NULL) {
+			pthread_mutex_unlock(&vcard_lock);
+			errno = ENOMEM;
+			return SNAP_ENOMEM;
+		}
+	}
+	vc->users++;
+	pthread_mutex_unlock(&vcard_lock);
+
+	memset(x, 0, sizeof(*x));
+	x->vc = vc;
+	x->aid = -1;
+	x->master = (mode == 'm');
+	pthread_mutex_lock(&vc->lock);
+	x->cir = x->master ? 0 : vc->next_cir++ % (SNAP_CASV_NUM * 32);
+	pthread_mutex_unlock(&vc->lock);
+	return SNAP_OK;
+}
+
+/* vc->lock held */
+static void snap_vcard_release(struct snap_vctx *x)
+{
+	struct snap_vcard *vc = x->vc;
+
+	if (x->aid >= 0) {
+		vc->act[x->aid].owner = NULL;
+		vc->casv[x->cir / 32] &= ~(1u << (x->cir % 32));
+		x->aid = -1;
+		pthread_cond_broadcast(&vc->c);
+	}
+	x->state = SNAP_VCTX_IDLE;
+}
+
+/* Let the state of x catch up with the time, vc->lock held */
+static void snap_vcard_update(struct snap_vctx *x)
+{
+	struct snap_vcard *vc = x->vc;
+	uint32_t sat = (x->ccr >> 12) & 0xf;
+	int i;
+
+	switch (x->state) {
+	case SNAP_VCTX_WAIT:
+		for (i = 0; i < vc->maid; i++) {
+			if ((vc->act[i].owner != NULL) ||
+			    (vc->act[i].action_type == 0) ||
+			    ((uint32_t)(vc->atri[i] >> 32) != sat))
+				continue;
+			vc->act[i].owner = x;
+			vc->casv[x->cir / 32] |= 1u << (x->cir % 32);
+			x->aid = i;
+			x->state = SNAP_VCTX_ATTACH;
+			x->ready_nsec = snap_stats_nsec() + vcard_attach_nsec;
+			break;
+		}
+		if (x->state != SNAP_VCTX_ATTACH)
+			break;
+		/* fall through */
+	case SNAP_VCTX_ATTACH:
+		if (snap_stats_nsec() >= x->ready_nsec)
+			x->state = SNAP_VCTX_ATTACHED;
+		break;
+	case SNAP_VCTX_DETACH:
+		if (snap_stats_nsec() >= x->ready_nsec)
+			snap_vcard_release(x);
+		break;
+	}
+}
+
+void snap_vcard_close(struct snap_vctx *x)
+{
+	struct snap_vcard *vc = x->vc;
+	int i;
+
+	if (vc == NULL)
+		return;
+
+	pthread_mutex_lock(&vc->lock);
+	snap_vcard_release(x);
+	pthread_mutex_unlock(&vc->lock);
+
+	pthread_mutex_lock(&vcard_lock);
+	if (--vc->users == 0) {
+		for (i = 0; i < SNAP_VCARD_MAX; i++)
+			if (vcards[i] == vc)
+				vcards[i] = NULL;
+		pthread_cond_destroy(&vc->c);
+		pthread_mutex_destroy(&vc->lock);
+		free(vc);
+	}
+	pthread_mutex_unlock(&vcard_lock);
+	x->vc = NULL;
+}
+
+void snap_vcard_delay(struct snap_vctx *x __unused)
+{
+	uint64_t t;
+
+	if (vcard_mmio_nsec == 0)
+		return;
+	t = snap_stats_nsec() + vcard_mmio_nsec;
+	while (snap_stats_nsec() < t)
+		snap_cpu_relax();
+}
+
+static uint64_t snap_vcard_csr(struct snap_vctx *x)
+{
+	snap_vcard_update(x);
+	switch (x->state) {
+	case SNAP_VCTX_ATTACHED:
+	case SNAP_VCTX_DETACH:
+		return SNAP_CSR_ATTACHED;
+	case SNAP_VCTX_WAIT:
+	case SNAP_VCTX_ATTACH:
+		return SNAP_CSR_SAT;
+	}
+	return 0;
+}
+
+int snap_vcard_read64(struct snap_vctx *x, uint64_t offs, uint64_t *data)
+{
+	struct snap_vcard *vc = x->vc;
+	int rc = 0;
+
+	snap_vcard_delay(x);
+	pthread_mutex_lock(&vc->lock);
+	switch (offs) {
+	case SNAP_S_IVR:
+		*data = SNAP_VCARD_IVR;
+		break;
+	case SNAP_S_BDR:
+		*data = SNAP_VCARD_BDR;
+		break;
+	case SNAP_S_SSR:
+		*data = (vc->explored ? 0x100 : 0) |
+			(uint64_t)(vc->msat & 0xf) << 4 | ((vc->maid - 1) & 0xf);
+		break;
+	case SNAP_SLR:
+		/* Set on read */
+		*data = x->master ? vc->slr : 0;
+		if (x->master)
+			vc->slr = true;
+		break;
+	case SNAP_S_CAP:
+		*data = SNAP_VCARD_CAP;
+		break;
+	case SNAP_S_FRT:
+		*data = (snap_stats_nsec() - vc->t0) / 4; /* 250 MHz */
+		break;
+	case SNAP_S_CIR:
+		*data = x->master ? 0x8000000000000000ull : (uint64_t)x->cir;
+		break;
+	case SNAP_S_CCR:
+		*data = x->master ? 0 : x->ccr;
+		break;
+	case SNAP_S_CSR:
+		*data = x->master ? 0 : snap_vcard_csr(x);
+		break;
+	default:
+		if ((offs >= SNAP_S_ATRI) &&
+		    (offs < SNAP_S_ATRI + SNAP_M_ACT_MAX_COUNT * 8))
+			*data = vc->atri[(offs - SNAP_S_ATRI) / 8];
+		else if (x->master && (offs >= SNAP_M_CASV) &&
+			 (offs < SNAP_M_CASV + SNAP_CASV_NUM * 8))
+			*data = vc->casv[(offs - SNAP_M_CASV) / 8];
+		else {
+			*data = 0;	/* Not modeled */
+			rc = -1;
+			errno = EFAULT;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&vc->lock);
+	return rc;
+}
+
+int snap_vcard_write64(struct snap_vctx *x, uint64_t offs, uint64_t data)
+{
+	struct snap_vcard *vc = x->vc;
+	int rc = 0;
+
+	snap_vcard_delay(x);
+	pthread_mutex_lock(&vc->lock);
+	switch (offs) {
+	case SNAP_S_SCR:
+		/* Exploration done with the maximum short action type */
+		if (x->master && ((data & 0xff) == 0x10)) {
+			vc->explored = true;
+			vc->msat = (int)(data >> 48) & 0xf;
+		}
+		break;
+	case SNAP_SLR:
+		if (x->master)
+			vc->slr = (data & 1);
+		break;
+	case SNAP_S_CCR:
+		if (x->master || (x->state != SNAP_VCTX_IDLE))
+			break;		/* Ignored while attached */
+		x->ccr = data;
+		x->seq = (uint16_t)(data >> 48);
+		break;
+	case SNAP_S_JCR:
+		if (x->master)
+			break;
+		if (data & (SNAP_JCR_STOP | SNAP_JCR_ABORT)) {
+			if (x->state == SNAP_VCTX_WAIT)
+				snap_vcard_release(x);
+			else if ((x->state == SNAP_VCTX_ATTACH) ||
+				 (x->state == SNAP_VCTX_ATTACHED)) {
+				x->state = SNAP_VCTX_DETACH;
+				x->ready_nsec = snap_stats_nsec() +
+					vcard_detach_nsec;
+			}
+			snap_vcard_update(x);
+		} else if (data & SNAP_JCR_START) {
+			/*
+			 * libsnap numbers jobs with the same counter, so
+			 * only reject starts older than the CCR setup.
+			 */
+			if (((int16_t)((uint16_t)(data >> 48) - x->seq) < 0) ||
+			    (x->state != SNAP_VCTX_IDLE) || !vc->explored)
+				break;
+			x->state = SNAP_VCTX_WAIT;
+			snap_vcard_update(x);
+		}
+		break;
+	default:
+		if (x->master && (offs >= SNAP_S_ATRI) &&
+		    (offs < SNAP_S_ATRI + SNAP_M_ACT_MAX_COUNT * 8))
+			vc->atri[(offs - SNAP_S_ATRI) / 8] = data;
+		else if (!x->master) {
+			rc = -1;	/* Read only or not modeled */
+			errno = EFAULT;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&vc->lock);
+	return rc;
+}
+
+/*
+ * The master sees the registers of all action instances. Only the
+ * ones exploration needs are modeled: type, version and an action
+ * which is always done and idle.
+ */
+int snap_vcard_read32(struct snap_vctx *x, uint64_t offs, uint32_t *data)
+{
+	struct snap_vcard *vc = x->vc;
+	int i;
+
+	snap_vcard_delay(x);
+	*data = 0;
+	if (!x->master || (offs < SNAP_M_ACT_OFFSET) ||
+	    (offs >= SNAP_M_ACT_END)) {
+		errno = EFAULT;
+		return -1;
+	}
+	i = (offs - SNAP_M_ACT_OFFSET) / SNAP_M_ACT_SIZE;
+	if (i >= vc->maid)
+		return 0;
+
+	switch ((offs - SNAP_M_ACT_OFFSET) % SNAP_M_ACT_SIZE) {
+	case ACTION_CONTROL:
+		*data = ACTION_CONTROL_DONE | ACTION_CONTROL_IDLE;
+		break;
+	case SNAP_ACTION_ID_REG:
+		*data = vc->act[i].action_type;
+		break;
+	case SNAP_ACTION_VERS_REG:
+		*data = vc->act[i].version;
+		break;
+	}
+	return 0;
+}
+
+int snap_vcard_write32(struct snap_vctx *x, uint64_t offs,
+		       uint32_t data __unused)
+{
+	snap_vcard_delay(x);
+	if (!x->master || (offs < SNAP_M_ACT_OFFSET) ||
+	    (offs >= SNAP_M_ACT_END)) {
+		errno = EFAULT;
+		return -1;
+	}
+	return 0;
+}
+
+bool snap_vcard_attached(struct snap_vctx *x)
+{
+	bool attached;
+
+	pthread_mutex_lock(&x->vc->lock);
+	snap_vcard_update(x);
+	attached = (x->state == SNAP_VCTX_ATTACHED) ||
+		(x->state == SNAP_VCTX_DETACH);
+	pthread_mutex_unlock(&x->vc->lock);
+	return attached;
+}
+
+/*
+ * Stands in for the attach interrupt if CCR asked for it: sleep until
+ * an action instance is free and the attach latency is over.
+ */
+int snap_vcard_wait_attach(struct snap_vctx *x, unsigned long timeout_usec)
+{
+	struct snap_vcard *vc = x->vc;
+	uint64_t now, end, wake;
+	struct timespec ts;
+	int rc = EBUSY;
+
+	if (!(x->ccr & SNAP_CCR_IRQ_ATTACH))
+		return EBUSY;		/* Interrupt not enabled */
+
+	now = snap_stats_nsec();
+	end = now + timeout_usec * 1000ull;
+	pthread_mutex_lock(&vc->lock);
+	while (1) {
+		snap_vcard_update(x);
+		if (x->state == SNAP_VCTX_ATTACHED) {
+			rc = 0;
+			break;
+		}
+		if ((x->state != SNAP_VCTX_WAIT) &&
+		    (x->state != SNAP_VCTX_ATTACH))
+			break;
+		now = snap_stats_nsec();
+		if (now >= end)
+			break;
+		wake = (x->state == SNAP_VCTX_ATTACH) ?
+			MIN(x->ready_nsec, end) : end;
+
+		/* The condition variable counts in CLOCK_REALTIME */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		wake = ts.tv_sec * 1000000000ull + ts.tv_nsec + (wake - now);
+		ts.tv_sec = wake / 1000000000ull;
+		ts.tv_nsec = wake % 1000000000ull;
+		pthread_cond_timedwait(&vc->c, &vc->lock, &ts);
+	}
+	pthread_mutex_unlock(&vc->lock);
+	return rc;
+}
@@ -0,0 +1,691 @@
+/*
+ * Copyright 2017, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput and latency of an action for a set of job sizes. Every
+ * thread opens its own card context and keeps up to <queue depth> jobs
+ * in a snap_queue. The action is driven with the job layout most
+ * streaming actions share: an input and an output snap_addr in host
+ * memory (hls_memcopy, hls_helloworld). With SNAP_CONFIG=CPU the
+ * software action is loaded from SNAP_ACTION_PATH.
+ *
+ * Results are printed as text, JSON or CSV. A CSV file from an earlier
+ * run can be given as baseline, rows which lost more than the allowed
+ * throughput or gained more p99 latency are flagged as regressions.
+ * Rows only match a run with the same SNAP_CONFIG.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include <snap_tools.h>
+#include <libsnap.h>
+#include "snap_actions.h"
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+#define BENCH_SIZES_MAX		32
+
+enum bench_format { FMT_TEXT, FMT_JSON, FMT_CSV };
+
+/* Input and output buffer, as hls_memcopy and hls_helloworld use */
+struct bench_job {
+	struct snap_addr in;
+	struct snap_addr out;
+};
+
+struct bench_slot {
+	struct snap_job cjob;		/* First, the callback gets it */
+	struct bench_job job;
+	struct bench_thread *t;
+	unsigned long long t0;
+	void *ibuf;
+	void *obuf;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	int card_no;
+	snap_action_type_t action_type;
+	snap_action_flag_t flags;
+	unsigned int qd;
+	unsigned long count;
+	uint32_t size;
+
+	sem_t free_slots;
+	unsigned long done;
+	unsigned long errors;
+	uint64_t *lat;			/* nsec, one per job */
+	unsigned long long nsec;
+	int rc;
+};
+
+struct bench_result {
+	snap_action_type_t action_type;
+	char config[16];
+	uint32_t size;
+	int threads;
+	unsigned int qd;
+	unsigned long jobs;
+	unsigned long errors;
+	double sec;
+	double mib_s;
+	double iops;
+	double lat_avg;			/* usec */
+	double lat_p50;
+	double lat_p99;
+	double lat_p999;
+	double lat_max;
+};
+
+static pthread_barrier_t start_barrier;
+
+static unsigned long long get_nsec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static int bench_finished(struct snap_queue *queue __attribute__((unused)),
+			  struct snap_job *cjob)
+{
+	struct bench_slot *s = (struct bench_slot *)cjob;
+	struct bench_thread *t = s->t;
+
+	/* Completions come in submission order, only this thread counts */
+	t->lat[t->done++] = get_nsec() - s->t0;
+	if (cjob->retc != SNAP_RETC_SUCCESS)
+		t->errors++;
+	sem_post(&t->free_slots);
+	return 0;
+}
+
+static void bench_job_set(struct bench_slot *s, uint32_t size)
+{
+	snap_addr_set(&s->job.in, s->ibuf, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
+	snap_addr_set(&s->job.out, s->obuf, size, SNAP_ADDRTYPE_HOST_DRAM,
+		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
+		      SNAP_ADDRFLAG_END);
+	snap_job_set(&s->cjob, &s->job, sizeof(s->job), NULL, 0);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+	struct snap_card *card = NULL;
+	struct snap_queue *queue = NULL;
+	struct bench_slot *slot;
+	char device[128];
+	unsigned long i;
+	unsigned long long t0;
+	unsigned int j;
+
+	slot = calloc(t->qd, sizeof(*slot));
+	if (slot == NULL) {
+		t->rc = SNAP_ENOMEM;
+		goto out;
+	}
+	for (j = 0; j < t->qd; j++) {
+		slot[j].t = t;
+		slot[j].ibuf = snap_buf_get(t->size);
+		slot[j].obuf = snap_buf_get(t->size);
+		if ((slot[j].ibuf == NULL) || (slot[j].obuf == NULL)) {
+			t->rc = SNAP_ENOMEM;
+			goto out;
+		}
+		memset(slot[j].ibuf, 'A' + j % 26, t->size);
+		bench_job_set(&slot[j], t->size);
+	}
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", t->card_no);
+	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				   SNAP_DEVICE_ID_SNAP);
+	if (card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			t->card_no, strerror(errno));
+		t->rc = SNAP_ENODEV;
+		goto out;
+	}
+	queue = snap_queue_alloc(card, t->action_type, t->flags, t->qd, 60);
+	if (queue == NULL) {
+		t->rc = SNAP_ENOMEM;
+		goto out;
+	}
+
+	/* Attach outside of the measurement */
+	t->rc = snap_queue_sync_execute_job(queue, &slot[0].cjob, 60);
+	if ((t->rc == 0) && (slot[0].cjob.retc != SNAP_RETC_SUCCESS))
+		t->rc = SNAP_EIO;
+	if (t->rc != 0)
+		fprintf(stderr, "err: action 0x%08x does not run: %d\n",
+			t->action_type, t->rc);
+
+ out:
+	pthread_barrier_wait(&start_barrier);
+	if (t->rc != 0)
+		goto free;
+
+	sem_init(&t->free_slots, 0, t->qd);
+	t0 = get_nsec();
+	for (i = 0; i < t->count; i++) {
+		struct bench_slot *s = &slot[i % t->qd];
+
+		/* In order completion: slot i % qd is done once a slot is */
+		sem_wait(&t->free_slots);
+		s->t0 = get_nsec();
+		t->rc = snap_async_execute_job(queue, &s->cjob,
+					       bench_finished);
+		if (t->rc != 0) {
+			sem_post(&t->free_slots);
+			break;
+		}
+	}
+	for (j = 0; j < t->qd; j++)
+		sem_wait(&t->free_slots);
+	t->nsec = get_nsec() - t0;
+	sem_destroy(&t->free_slots);
+
+ free:
+	snap_queue_free(queue);
+	snap_card_free(card);
+	for (j = 0; (slot != NULL) && (j < t->qd); j++) {
+		snap_buf_put(slot[j].ibuf);
+		snap_buf_put(slot[j].obuf);
+	}
+	free(slot);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static double percentile_usec(const uint64_t *lat, unsigned long n, double p)
+{
+	unsigned long i;
+
+	if (n == 0)
+		return 0.0;
+	i = (unsigned long)(p / 100.0 * n + 0.999999);
+	i = (i == 0) ? 0 : i - 1;
+	return lat[MIN(i, n - 1)] / 1000.0;
+}
+
+/* Name of the SNAP_CONFIG backend, as libsnap reads the variable */
+static const char *bench_config(void)
+{
+	const char *config = getenv("SNAP_CONFIG");
+
+	if ((config == NULL) || (*config == '\0') ||
+	    (strcasecmp(config, "FPGA") == 0) || (strcmp(config, "0") == 0))
+		return "FPGA";
+	if ((strcasecmp(config, "CPU") == 0) || (strcmp(config, "1") == 0))
+		return "CPU";
+	if ((strcasecmp(config, "VIRT") == 0) || (strcmp(config, "2") == 0))
+		return "VIRT";
+	return config;
+}
+
+static int run_bench(struct bench_thread *t, int threads,
+		     struct bench_result *r)
+{
+	int i, rc = 0;
+	unsigned long n = 0, k;
+	unsigned long long nsec = 0, sum = 0;
+	uint64_t *lat;
+
+	pthread_barrier_init(&start_barrier, NULL, threads);
+	for (i = 0; i < threads; i++) {
+		t[i].done = 0;
+		t[i].errors = 0;
+		t[i].nsec = 0;
+		t[i].rc = 0;
+		rc = pthread_create(&t[i].tid, NULL, bench_thread, &t[i]);
+		if (rc != 0) {
+			fprintf(stderr, "err: pthread_create: %s\n",
+				strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		if (t[i].rc != 0)
+			rc = t[i].rc;
+		nsec = MAX(nsec, t[i].nsec);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	if (rc != 0)
+		return rc;
+
+	memset(r, 0, sizeof(*r));
+	lat = t[0].lat;			/* All threads' samples, in a row */
+	for (i = 0; i < threads; i++) {
+		memmove(&lat[n], t[i].lat, t[i].done * sizeof(*lat));
+		n += t[i].done;
+		r->errors += t[i].errors;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	for (k = 0; k < n; k++)
+		sum += lat[k];
+
+	r->action_type = t[0].action_type;
+	snprintf(r->config, sizeof(r->config), "%s", bench_config());
+	r->size = t[0].size;
+	r->threads = threads;
+	r->qd = t[0].qd;
+	r->jobs = n;
+	r->sec = nsec / 1e9;
+	r->mib_s = (nsec == 0) ? 0.0 :
+		(double)n * r->size * 1e9 / nsec / (1024 * 1024);
+	r->iops = (nsec == 0) ? 0.0 : (double)n * 1e9 / nsec;
+	r->lat_avg = (n == 0) ? 0.0 : (double)sum / n / 1000.0;
+	r->lat_p50 = percentile_usec(lat, n, 50.0);
+	r->lat_p99 = percentile_usec(lat, n, 99.0);
+	r->lat_p999 = percentile_usec(lat, n, 99.9);
+	r->lat_max = (n == 0) ? 0.0 : lat[n - 1] / 1000.0;
+	return 0;
+}
+
+#define CSV_HEADER "action,config,size,threads,qd,jobs,errors,sec,mib_s,"\
+	"iops,lat_avg_usec,lat_p50_usec,lat_p99_usec,lat_p999_usec,"\
+	"lat_max_usec"
+
+static void print_result(const struct bench_result *r, enum bench_format fmt,
+			 bool first)
+{
+	switch (fmt) {
+	case FMT_JSON:
+		printf("%s{\"action\":\"0x%08x\",\"config\":\"%s\","
+		       "\"size\":%u,\"threads\":%d,\"qd\":%u,\"jobs\":%lu,"
+		       "\"errors\":%lu,\"sec\":%.6f,\"mib_s\":%.3f,"
+		       "\"iops\":%.1f,\"lat_usec\":{\"avg\":%.3f,"
+		       "\"p50\":%.3f,\"p99\":%.3f,\"p99.9\":%.3f,"
+		       "\"max\":%.3f}}",
+		       first ? "" : ",\n", r->action_type, r->config,
+		       r->size, r->threads, r->qd, r->jobs, r->errors,
+		       r->sec, r->mib_s, r->iops, r->lat_avg, r->lat_p50,
+		       r->lat_p99, r->lat_p999, r->lat_max);
+		break;
+	case FMT_CSV:
+		printf("0x%08x,%s,%u,%d,%u,%lu,%lu,%.6f,%.3f,%.1f,"
+		       "%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		       r->action_type, r->config, r->size, r->threads,
+		       r->qd, r->jobs, r->errors, r->sec, r->mib_s, r->iops,
+		       r->lat_avg, r->lat_p50, r->lat_p99, r->lat_p999,
+		       r->lat_max);
+		break;
+	default:
+		printf("%10u %3d %3u %8lu %10.1f %10.0f %9.1f %9.1f "
+		       "%9.1f %9.1f %9.1f%s\n",
+		       r->size, r->threads, r->qd, r->jobs, r->mib_s,
+		       r->iops, r->lat_avg, r->lat_p50, r->lat_p99,
+		       r->lat_p999, r->lat_max,
+		       r->errors ? " errors!" : "");
+		break;
+	}
+}
+
+/*
+ * Compare with the rows of a CSV file written by an earlier run.
+ * Returns the number of regressions.
+ */
+static int compare_baseline(const char *fname, const struct bench_result *r,
+			    int nres, double tolerance)
+{
+	FILE *fp;
+	char line[512];
+	struct bench_result b;
+	int i, regressions = 0;
+	bool *seen;
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "err: cannot open baseline %s: %s\n", fname,
+			strerror(errno));
+		exit(EX_ERRNO);
+	}
+	seen = calloc(nres, sizeof(*seen));
+	if (seen == NULL)
+		exit(EX_MEMORY);
+
+	fprintf(stderr, "%-10s %10s %3s %3s %10s %8s %10s %8s\n",
+		"baseline", "size", "thr", "qd", "MiB/s", "delta",
+		"p99 usec", "delta");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		memset(&b, 0, sizeof(b));
+		if (sscanf(line, "%x,%15[^,],%u,%d,%u,%lu,%lu,%lf,%lf,%lf,"
+			   "%lf,%lf,%lf,%lf,%lf", &b.action_type, b.config,
+			   &b.size, &b.threads, &b.qd, &b.jobs, &b.errors,
+			   &b.sec, &b.mib_s, &b.iops, &b.lat_avg, &b.lat_p50,
+			   &b.lat_p99, &b.lat_p999, &b.lat_max) != 15)
+			continue;	/* Header or garbage */
+
+		for (i = 0; i < nres; i++) {
+			double dt, dl;
+			bool bad;
+
+			if ((r[i].action_type != b.action_type) ||
+			    (strcmp(r[i].config, b.config) != 0) ||
+			    (r[i].size != b.size) ||
+			    (r[i].threads != b.threads) || (r[i].qd != b.qd))
+				continue;
+
+			seen[i] = true;
+			dt = (b.mib_s > 0.0) ?
+				(r[i].mib_s / b.mib_s - 1.0) * 100.0 : 0.0;
+			dl = (b.lat_p99 > 0.0) ?
+				(r[i].lat_p99 / b.lat_p99 - 1.0) * 100.0 : 0.0;
+			bad = (dt < -tolerance) || (dl > tolerance);
+			if (bad)
+				regressions++;
+			fprintf(stderr, "%-10s %10u %3d %3u %10.1f %+7.1f%% "
+				"%10.1f %+7.1f%%%s\n", b.config, b.size,
+				b.threads, b.qd, b.mib_s, dt, b.lat_p99, dl,
+				bad ? " REGRESSION" : "");
+		}
+	}
+	for (i = 0; i < nres; i++)
+		if (!seen[i])
+			fprintf(stderr, "%-10s %10u %3d %3u not in baseline\n",
+				r[i].config, r[i].size, r[i].threads, r[i].qd);
+	free(seen);
+	fclose(fp);
+	return regressions;
+}
+
+static int parse_sizes(const char *arg, uint32_t *sizes)
+{
+	char *end;
+	unsigned long long v;
+	int n = 0;
+
+	while (*arg != '\0') {
+		v = strtoull(arg, &end, 0);
+		switch (*end) {
+		case 'k': case 'K': v <<= 10; end++; break;
+		case 'm': case 'M': v <<= 20; end++; break;
+		case 'g': case 'G': v <<= 30; end++; break;
+		}
+		if ((end == arg) || (v == 0) || (v > (1ull << 30)) ||
+		    (n == BENCH_SIZES_MAX) || ((*end != ',') && (*end != '\0')))
+			return -1;
+		sizes[n++] = v;
+		arg = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+/* Lower case letters and digits only, "HLS Hello World" is hlshelloworld */
+static void action_name_norm(const char *name, char *norm, size_t len)
+{
+	size_t n = 0;
+
+	for (; (*name != '\0') && (n < len - 1); name++)
+		if (isalnum(*name))
+			norm[n++] = tolower(*name);
+	norm[n] = '\0';
+}
+
+/*
+ * Hex action type, or a name from ActionTypes.md: an exact match, else
+ * a unique part of it, e.g. "hls memcopy" or "hlshello".
+ */
+static int parse_action(const char *arg, snap_action_type_t *action_type)
+{
+	char *end;
+	char name[128], desc[128];
+	unsigned int i, found = 0;
+
+	*action_type = strtoul(arg, &end, 16);
+	if ((end != arg) && (*end == '\0'))
+		return 0;
+
+	action_name_norm(arg, name, sizeof(name));
+	if (name[0] == '\0')
+		return -1;
+	for (i = 0; i < ARRAY_SIZE(snap_actions); i++) {
+		if (snap_actions[i].dev1 != snap_actions[i].dev2)
+			continue;	/* Ranges */
+		action_name_norm(snap_actions[i].description, desc,
+				 sizeof(desc));
+		if (strcmp(desc, name) == 0) {
+			*action_type = snap_actions[i].dev1;
+			return 0;
+		}
+		if (strstr(desc, name) != NULL) {
+			if (found++)
+				fprintf(stderr, "err: %s matches 0x%08x and "
+					"0x%08x\n", arg, *action_type,
+					snap_actions[i].dev1);
+			*action_type = snap_actions[i].dev1;
+		}
+	}
+	return (found == 1) ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -C,--card <cardno>      can be (0...3)\n"
+	       "  -V, --version           print version.\n"
+	       "  -A, --action <type>     action type in hex or a unique part of\n"
+	       "                          its name in ActionTypes.md,\n"
+	       "                          0x10141000 (HLS Memcopy): default.\n"
+	       "                          The job must be an input and an output\n"
+	       "                          snap_addr, like hls_memcopy uses.\n"
+	       "  -s, --sizes <list>      job sizes, e.g. 4K,64K,1M, 64K: default.\n"
+	       "  -t, --threads <num>     threads, each with own context, 1: default.\n"
+	       "  -q, --queue-depth <num> jobs in flight per thread, 1: default.\n"
+	       "  -c, --count <num>       jobs per thread and size, 1000: default.\n"
+	       "  -I, --irq               wait for completion by interrupt.\n"
+	       "  -f, --format <fmt>      text (default), json or csv.\n"
+	       "  -b, --baseline <file>   CSV output of an earlier run to compare\n"
+	       "                          with, exits with 2 on regressions.\n"
+	       "  -T, --tolerance <pct>   allowed loss in MiB/s or gain in p99\n"
+	       "                          latency, 10: default.\n"
+	       "With SNAP_CONFIG=CPU the software action is loaded from\n"
+	       "SNAP_ACTION_PATH.\n"
+	       "Example:\n"
+	       "  $ snap_bench -s 4K,64K,1M -t 4 -q 8 -f csv > base.csv\n"
+	       "  $ snap_bench -s 4K,64K,1M -t 4 -q 8 -b base.csv\n\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, i, rc = 0;
+	int card_no = 0;
+	int threads = 1;
+	unsigned int qd = 1;
+	unsigned long count = 1000;
+	snap_action_type_t action_type = 0x10141000;
+	snap_action_flag_t flags = 0;
+	uint32_t sizes[BENCH_SIZES_MAX] = { 64 * 1024 };
+	int nsizes = 1;
+	enum bench_format fmt = FMT_TEXT;
+	const char *baseline = NULL;
+	double tolerance = 10.0;
+	struct bench_thread *t;
+	struct bench_result *r;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "action",	 required_argument, NULL, 'A' },
+			{ "sizes",	 required_argument, NULL, 's' },
+			{ "threads",	 required_argument, NULL, 't' },
+			{ "queue-depth", required_argument, NULL, 'q' },
+			{ "count",	 required_argument, NULL, 'c' },
+			{ "irq",	 no_argument,	    NULL, 'I' },
+			{ "format",	 required_argument, NULL, 'f' },
+			{ "baseline",	 required_argument, NULL, 'b' },
+			{ "tolerance",	 required_argument, NULL, 'T' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:A:s:t:q:c:If:b:T:Vvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'A':
+			if (parse_action(optarg, &action_type) != 0) {
+				fprintf(stderr, "err: unknown action %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			nsizes = parse_sizes(optarg, sizes);
+			if (nsizes <= 0) {
+				fprintf(stderr, "err: bad sizes %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			threads = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'q':
+			qd = strtoul(optarg, (char **)NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, (char **)NULL, 0);
+			break;
+		case 'I':
+			flags |= SNAP_ACTION_DONE_IRQ;
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0)
+				fmt = FMT_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				fmt = FMT_CSV;
+			else if (strcmp(optarg, "text") == 0)
+				fmt = FMT_TEXT;
+			else {
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'T':
+			tolerance = strtod(optarg, (char **)NULL);
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((threads < 1) || (qd < 1) || (count == 0)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	t = calloc(threads, sizeof(*t));
+	r = calloc(nsizes, sizeof(*r));
+	if ((t == NULL) || (r == NULL))
+		exit(EX_MEMORY);
+	for (i = 0; i < threads; i++) {
+		t[i].card_no = card_no;
+		t[i].action_type = action_type;
+		t[i].flags = flags;
+		t[i].qd = qd;
+		t[i].count = count;
+	}
+	/* Thread 0 gets room for the samples of all threads */
+	t[0].lat = malloc(threads * count * sizeof(uint64_t));
+	if (t[0].lat == NULL)
+		exit(EX_MEMORY);
+	for (i = 1; i < threads; i++) {
+		t[i].lat = malloc(count * sizeof(uint64_t));
+		if (t[i].lat == NULL)
+			exit(EX_MEMORY);
+	}
+
+	if (fmt == FMT_TEXT)
+		printf("action 0x%08x%s\n%10s %3s %3s %8s %10s %10s %9s %9s "
+		       "%9s %9s %9s\n", action_type,
+		       (flags & SNAP_ACTION_DONE_IRQ) ? " irq" : "",
+		       "size", "thr", "qd", "jobs", "MiB/s", "IOPS",
+		       "avg usec", "p50", "p99", "p99.9", "max");
+	else if (fmt == FMT_JSON)
+		printf("[\n");
+	else
+		printf("%s\n", CSV_HEADER);
+
+	for (i = 0; i < nsizes; i++) {
+		int j;
+
+		for (j = 0; j < threads; j++)
+			t[j].size = sizes[i];
+		rc = run_bench(t, threads, &r[i]);
+		if (rc != 0)
+			break;
+		print_result(&r[i], fmt, i == 0);
+		fflush(stdout);
+	}
+	if (fmt == FMT_JSON)
+		printf("\n]\n");
+
+	if ((rc == 0) && (baseline != NULL) &&
+	    (compare_baseline(baseline, r, nsizes, tolerance) != 0))
+		rc = 2;
+
+	for (i = 0; i < threads; i++)
+		free(t[i].lat);
+	free(t);
+	free(r);
+	if (rc == 2)
+		exit(2);
+	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2017, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compare MMIO access via libcxl with the fast MMIO mode. Every thread
+ * opens its own slave context and reads (or writes) one register in a
+ * loop, first with SNAP_MMIO_CXL, then with SNAP_MMIO_FAST.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <snap_tools.h>
+#include <libsnap.h>
+#include <snap_s_regs.h>
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+struct bench_thread {
+	pthread_t tid;
+	int card_no;
+	snap_mmio_mode_t mode;
+	uint64_t offs;
+	int write;			/* 0: read, else writes per barrier */
+	unsigned long count;
+	unsigned long long nsec;
+	int rc;
+};
+
+static pthread_barrier_t start_barrier;
+
+static unsigned long long get_nsec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *)arg;
+	struct snap_card *card;
+	char device[128];
+	unsigned long i;
+	unsigned long long t0;
+	uint64_t val = 0;
+	int j;
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", t->card_no);
+	card = snap_card_alloc_dev(device, SNAP_VENDOR_ID_IBM,
+				   SNAP_DEVICE_ID_SNAP);
+	if (card == NULL) {
+		fprintf(stderr, "err: failed to open card %u: %s\n",
+			t->card_no, strerror(errno));
+		t->rc = -1;
+		pthread_barrier_wait(&start_barrier);
+		return NULL;
+	}
+	t->rc = snap_card_set_mmio_mode(card, t->mode);
+	if (t->rc == 0)
+		t->rc = snap_mmio_read64(card, t->offs, &val);
+
+	pthread_barrier_wait(&start_barrier);
+	if (t->rc != 0)
+		goto out;
+
+	t0 = get_nsec();
+	if (t->write) {
+		for (i = 0; i < t->count; i += t->write) {
+			for (j = 0; j < t->write; j++)
+				snap_mmio_write64(card, t->offs, val);
+			snap_mmio_barrier(card);
+		}
+	} else {
+		for (i = 0; i < t->count; i++)
+			snap_mmio_read64(card, t->offs, &val);
+	}
+	t->nsec = get_nsec() - t0;
+ out:
+	snap_card_free(card);
+	return NULL;
+}
+
+static int run_bench(struct bench_thread *t, int threads,
+		     snap_mmio_mode_t mode, const char *name)
+{
+	int i, rc = 0;
+	unsigned long long nsec = 0;
+	unsigned long ops = 0;
+
+	pthread_barrier_init(&start_barrier, NULL, threads);
+	for (i = 0; i < threads; i++) {
+		t[i].mode = mode;
+		t[i].nsec = 0;
+		t[i].rc = 0;
+		rc = pthread_create(&t[i].tid, NULL, bench_thread, &t[i]);
+		if (rc != 0) {
+			fprintf(stderr, "err: pthread_create: %s\n",
+				strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		if (t[i].rc != 0)
+			rc = t[i].rc;
+		nsec = MAX(nsec, t[i].nsec);
+		ops += t[i].count;
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	if (rc != 0) {
+		printf("%-6s failed rc=%d\n", name, rc);
+		return rc;
+	}
+	printf("%-6s threads: %3d ops: %10ld %8.1f nsec/op %8.3f Mops/s\n",
+	       name, threads, ops,
+	       (double)nsec * threads / ops,
+	       (double)ops * 1000.0 / nsec);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -C,--card <cardno>      can be (0...3)\n"
+	       "  -V, --version           print version.\n"
+	       "  -t, --threads <num>     threads, each with own context, 1: default.\n"
+	       "  -c, --count <num>       accesses per thread, 100000: default.\n"
+	       "  -o, --offset <offs>     64-bit register, SNAP_S_IVR: default.\n"
+	       "  -w, --write <num>       write the value read before, with one\n"
+	       "                          barrier every <num> writes. Only use on\n"
+	       "                          registers which are safe to write!\n"
+	       "Example:\n"
+	       "  $ snap_mmio_bench -t 16 -c 1000000\n\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, i, rc = 0;
+	int card_no = 0;
+	int threads = 1;
+	int write = 0;
+	unsigned long count = 100000;
+	uint64_t offs = SNAP_S_IVR;
+	struct bench_thread *t;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "threads",	 required_argument, NULL, 't' },
+			{ "count",	 required_argument, NULL, 'c' },
+			{ "offset",	 required_argument, NULL, 'o' },
+			{ "write",	 required_argument, NULL, 'w' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "C:t:c:o:w:Vvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 't':
+			threads = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, (char **)NULL, 0);
+			break;
+		case 'o':
+			offs = strtoull(optarg, (char **)NULL, 0);
+			break;
+		case 'w':
+			write = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((threads < 1) || (write < 0) || (count == 0)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	t = calloc(threads, sizeof(*t));
+	if (t == NULL)
+		exit(EX_MEMORY);
+	for (i = 0; i < threads; i++) {
+		t[i].card_no = card_no;
+		t[i].offs = offs;
+		t[i].write = write;
+		t[i].count = count;
+	}
+
+	printf("%s [%08llx] %s\n", write ? "write" : "read",
+	       (long long)offs, write ? "(barrier per batch)" : "");
+	rc = run_bench(t, threads, SNAP_MMIO_CXL, "libcxl");
+	if (rc == 0)
+		rc = run_bench(t, threads, SNAP_MMIO_FAST, "fast");
+
+	free(t);
+	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2017, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Live view of the libsnap statistics of all processes which run with
+ * SNAP_STATS_SHM=<msec>. Shows per context and per card job rates,
+ * bandwidth, jobs in flight and the latency percentiles of the jobs
+ * which completed during the last interval. Job latency is the time
+ * from action start until libsnap saw the action done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <snap_tools.h>
+#include <libsnap.h>
+#include <snap_shm.h>
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+/* One card context of one process */
+struct top_ctx {
+	struct top_ctx *next;
+	int pid;
+	unsigned int slot;
+	uint64_t ctx_id;
+	char comm[32];
+	struct snap_shm_slot cur;
+	struct snap_stats prev;
+	bool seen;			/* Found in this round */
+	bool valid;			/* cur was read */
+	bool has_prev;			/* prev was read, rates are known */
+};
+
+/* Sum over all contexts of one device */
+struct top_card {
+	char name[64];
+	unsigned int contexts;
+	unsigned int inflight;
+	double jobs, mbytes;
+	struct snap_stats_hist lat;
+};
+
+static struct top_ctx *ctx_list;
+
+static unsigned long long get_nsec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static struct top_ctx *find_ctx(int pid, unsigned int slot, uint64_t ctx_id)
+{
+	struct top_ctx *c;
+
+	for (c = ctx_list; c != NULL; c = c->next)
+		if ((c->pid == pid) && (c->slot == slot) &&
+		    (c->ctx_id == ctx_id))
+			return c;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		exit(EX_MEMORY);
+	c->pid = pid;
+	c->slot = slot;
+	c->ctx_id = ctx_id;
+	c->next = ctx_list;
+	ctx_list = c;
+	return c;
+}
+
+/* Seqlock read, false if the writer kept us out */
+static bool read_slot(const struct snap_shm_slot *slot,
+		      struct snap_shm_slot *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+	return false;
+}
+
+static void read_segment(const char *path)
+{
+	int fd;
+	unsigned int i;
+	struct stat st;
+	struct snap_shm_hdr *hdr;
+	struct snap_shm_slot copy;
+	struct top_ctx *c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(*hdr))) {
+		close(fd);
+		return;
+	}
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return;
+
+	if ((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SNAP_SHM_MAGIC) ||
+	    (hdr->version != SNAP_SHM_VERSION) ||
+	    (kill(hdr->pid, 0) != 0 && errno == ESRCH))	/* left over */
+		goto out;
+
+	for (i = 0; i < MIN(hdr->nslots, (uint32_t)SNAP_SHM_SLOTS); i++) {
+		if (!__atomic_load_n(&hdr->slot[i].in_use, __ATOMIC_ACQUIRE))
+			continue;
+		if (!read_slot(&hdr->slot[i], &copy) || !copy.in_use)
+			continue;
+
+		c = find_ctx(hdr->pid, i, copy.ctx_id);
+		if (c->valid) {
+			c->prev = c->cur.s;
+			c->has_prev = true;
+		}
+		c->cur = copy;
+		c->valid = true;
+		c->seen = true;
+		memcpy(c->comm, hdr->comm, sizeof(c->comm));
+		c->comm[sizeof(c->comm) - 1] = 0;
+	}
+ out:
+	munmap(hdr, sizeof(*hdr));
+}
+
+static void scan(void)
+{
+	DIR *d;
+	struct dirent *e;
+	char path[PATH_MAX];
+	struct top_ctx *c, **pc;
+
+	for (c = ctx_list; c != NULL; c = c->next)
+		c->seen = false;
+
+	d = opendir(SNAP_SHM_DIR);
+	if (d == NULL)
+		return;
+	while ((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, SNAP_SHM_PREFIX,
+			    strlen(SNAP_SHM_PREFIX)) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", SNAP_SHM_DIR, e->d_name);
+		read_segment(path);
+	}
+	closedir(d);
+
+	/* Forget contexts which went away */
+	for (pc = &ctx_list; (c = *pc) != NULL; ) {
+		if (!c->seen) {
+			*pc = c->next;
+			free(c);
+		} else
+			pc = &c->next;
+	}
+}
+
+/* Latencies of the jobs completed since the previous round */
+static void hist_delta(struct snap_stats_hist *d, const struct top_ctx *c)
+{
+	unsigned int i;
+	const struct snap_stats_hist *a = &c->cur.s.hist[SNAP_STATS_RUN];
+	const struct snap_stats_hist *b = &c->prev.hist[SNAP_STATS_RUN];
+
+	*d = *a;
+	if (!c->has_prev)
+		return;
+	d->count = a->count - b->count;
+	d->sum_nsec = a->sum_nsec - b->sum_nsec;
+	for (i = 0; i < SNAP_STATS_BUCKETS; i++)
+		d->bucket[i] = a->bucket[i] - b->bucket[i];
+}
+
+static void hist_add(struct snap_stats_hist *s, const struct snap_stats_hist *d)
+{
+	unsigned int i;
+
+	s->count += d->count;
+	s->sum_nsec += d->sum_nsec;
+	s->max_nsec = MAX(s->max_nsec, d->max_nsec);
+	for (i = 0; i < SNAP_STATS_BUCKETS; i++)
+		s->bucket[i] += d->bucket[i];
+}
+
+static void print_line(const char *what, unsigned int inflight,
+		       double jobs, double mbytes,
+		       const struct snap_stats_hist *h)
+{
+	printf("%-40s %10.1f %9.1f %4u %9.1f %9.1f %9.1f\n", what,
+	       jobs, mbytes, inflight,
+	       snap_stats_percentile(h, 50.0) / 1000.0,
+	       snap_stats_percentile(h, 99.0) / 1000.0,
+	       snap_stats_percentile(h, 99.9) / 1000.0);
+}
+
+static void show(double sec, bool cards_only)
+{
+	unsigned int i, n = 0;
+	char what[128];
+	double jobs, mbytes;
+	struct top_ctx *c;
+	struct top_card *cards, *card;
+	struct snap_stats_hist d;
+
+	for (c = ctx_list; c != NULL; c = c->next)
+		n++;
+	cards = calloc(n + 1, sizeof(*cards));
+	if (cards == NULL)
+		exit(EX_MEMORY);
+
+	printf("%-40s %10s %9s %4s %9s %9s %9s\n", "PID/PROGRAM DEVICE ACTION",
+	       "JOBS/s", "MB/s", "QD", "p50[us]", "p99[us]", "p999[us]");
+
+	for (c = ctx_list, n = 0; c != NULL; c = c->next) {
+		hist_delta(&d, c);
+		jobs = c->has_prev ? d.count / sec : 0.0;
+		mbytes = c->has_prev ?
+			(c->cur.s.bytes - c->prev.bytes) / sec / 1e6 : 0.0;
+
+		for (card = cards; card < cards + n; card++)
+			if (strcmp(card->name, c->cur.name) == 0)
+				break;
+		if (card == cards + n) {
+			memcpy(card->name, c->cur.name, sizeof(card->name));
+			n++;
+		}
+		card->contexts++;
+		card->inflight += c->cur.inflight;
+		card->jobs += jobs;
+		card->mbytes += mbytes;
+		hist_add(&card->lat, &d);
+
+		if (cards_only)
+			continue;
+		snprintf(what, sizeof(what), "%d/%.12s %s %08x", c->pid,
+			 c->comm, c->cur.name, c->cur.action_type);
+		print_line(what, c->cur.inflight, jobs, mbytes, &d);
+	}
+
+	if (!cards_only)
+		printf("\n");
+	for (i = 0; i < n; i++) {
+		snprintf(what, sizeof(what), "%s (%u contexts)",
+			 cards[i].name, cards[i].contexts);
+		print_line(what, cards[i].inflight, cards[i].jobs,
+			   cards[i].mbytes, &cards[i].lat);
+	}
+	free(cards);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -V, --version           print version.\n"
+	       "  -d, --delay <sec>       update interval, 1: default.\n"
+	       "  -n, --iterations <num>  stop after <num> updates.\n"
+	       "  -c, --cards             only show the sums per card.\n"
+	       "  -b, --batch             do not clear the screen.\n"
+	       "Processes show up if started with SNAP_STATS_SHM=<msec>, e.g.\n"
+	       "  $ SNAP_STATS_SHM=100 snap_memcopy ...\n"
+	       "  $ snap_top -d 2\n\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch;
+	double delay = 1.0;
+	long iterations = -1;
+	bool cards_only = false, batch = false;
+	unsigned long long t0, t1;
+	struct timespec ts;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "delay",	 required_argument, NULL, 'd' },
+			{ "iterations",	 required_argument, NULL, 'n' },
+			{ "cards",	 no_argument,	    NULL, 'c' },
+			{ "batch",	 no_argument,	    NULL, 'b' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "d:n:cbVvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'd':
+			delay = strtod(optarg, (char **)NULL);
+			break;
+		case 'n':
+			iterations = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'c':
+			cards_only = true;
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (delay <= 0.0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (!isatty(STDOUT_FILENO))
+		batch = true;
+
+	t0 = get_nsec();
+	scan();
+	while (iterations != 0) {
+		ts.tv_sec = (time_t)delay;
+		ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+
+		scan();
+		t1 = get_nsec();
+		if (!batch)
+			printf("\033[H\033[2J");
+		show((t1 - t0) / 1e9, cards_only);
+		printf("\n");
+		fflush(stdout);
+		t0 = t1;
+		if (iterations > 0)
+			iterations--;
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2017, International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Decoder for the binary trace files libsnap writes with
+ * SNAP_TRACE=0x400. Prints the events of all threads ordered by time,
+ * as text or as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <snap_tools.h>
+#include <snap_tracebuf.h>
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+struct tev_desc {
+	const char *name;
+	char kind;
+	const char *a0;
+	const char *a1;
+};
+
+#define SNAP_TEV_DESC(id, name, kind, a0, a1)	{ name, kind, a0, a1 },
+static const struct tev_desc tev_desc[SNAP_TEV_IDS] = {
+	SNAP_TEV_LIST(SNAP_TEV_DESC)
+};
+#undef SNAP_TEV_DESC
+
+struct event {
+	struct snap_tev ev;
+	uint32_t tid;
+};
+
+static int cmp_event(const void *a, const void *b)
+{
+	const struct event *ea = (const struct event *)a;
+	const struct event *eb = (const struct event *)b;
+
+	if (ea->ev.tsc != eb->ev.tsc)
+		return (ea->ev.tsc < eb->ev.tsc) ? -1 : 1;
+	return 0;
+}
+
+static struct snap_tev_file fh;
+static long double nsec_per_tick = 1.0;
+
+static long double tev_nsec(uint64_t tsc)
+{
+	return ((long double)tsc - fh.tsc0) * nsec_per_tick;
+}
+
+static void print_text(const struct event *e, unsigned long n)
+{
+	unsigned long i;
+	const struct tev_desc *d;
+
+	for (i = 0; i < n; i++) {
+		d = &tev_desc[e[i].ev.id];
+		printf("%14.3Lf %6u %c %-12s", tev_nsec(e[i].ev.tsc) / 1000.0,
+		       e[i].tid, d->kind, d->name);
+		if (d->a0[0])
+			printf(" %s=0x%llx", d->a0,
+			       (unsigned long long)e[i].ev.a0);
+		if (d->a1[0])
+			printf(" %s=0x%llx", d->a1,
+			       (unsigned long long)e[i].ev.a1);
+		printf("\n");
+	}
+}
+
+static void print_json(const struct event *e, unsigned long n)
+{
+	unsigned long i;
+	const struct tev_desc *d;
+	const char *sep = "";
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		d = &tev_desc[e[i].ev.id];
+		printf("%s{\"name\":\"%s\",\"cat\":\"snap\",\"ph\":\"%c\","
+		       "\"ts\":%.3Lf,\"pid\":%d,\"tid\":%u",
+		       sep, d->name, (d->kind == 'I') ? 'i' : d->kind,
+		       tev_nsec(e[i].ev.tsc) / 1000.0, fh.pid, e[i].tid);
+		if (d->kind == 'I')
+			printf(",\"s\":\"t\"");
+		if ((d->kind == 'b') || (d->kind == 'e'))
+			printf(",\"id\":\"0x%llx\"",
+			       (unsigned long long)e[i].ev.a0);
+		printf(",\"args\":{");
+		if (d->a0[0])
+			printf("\"%s\":%llu", d->a0,
+			       (unsigned long long)e[i].ev.a0);
+		if (d->a1[0])
+			printf("%s\"%s\":%llu", d->a0[0] ? "," : "", d->a1,
+			       (unsigned long long)e[i].ev.a1);
+		printf("}}");
+		sep = ",\n";
+	}
+	printf("\n]}\n");
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -V, --version           print version.\n"
+	       "  -i, --input <file>      trace file, written with SNAP_TRACE=0x400.\n"
+	       "  -j, --json              Chrome trace-event JSON instead of text.\n"
+	       "Example:\n"
+	       "  $ SNAP_TRACE=0x400 SNAP_TRACE_FILE=t.bin snap_memcopy ...\n"
+	       "  $ snap_trace -j -i t.bin > t.json\n\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch;
+	const char *input = NULL;
+	bool json = false;
+	FILE *fp;
+	uint32_t r, k;
+	unsigned long n = 0, nmax = 0, lost = 0;
+	struct snap_tev_ring_hdr rh;
+	struct event *e = NULL;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "input",	 required_argument, NULL, 'i' },
+			{ "json",	 no_argument,	    NULL, 'j' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "i:jVvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'i':
+			input = optarg;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (input == NULL) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fp = fopen(input, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "err: cannot open %s: %s\n", input,
+			strerror(errno));
+		exit(EX_ERRNO);
+	}
+	if ((fread(&fh, sizeof(fh), 1, fp) != 1) ||
+	    (fh.magic != SNAP_TEV_MAGIC)) {
+		fprintf(stderr, "err: %s is no snap trace file\n", input);
+		exit(EXIT_FAILURE);
+	}
+	if ((fh.version != SNAP_TEV_VERSION) || (fh.nids != SNAP_TEV_IDS)) {
+		fprintf(stderr, "err: %s has version %u with %u events, "
+			"this decoder knows version %u with %u events\n",
+			input, fh.version, fh.nids, SNAP_TEV_VERSION,
+			SNAP_TEV_IDS);
+		exit(EXIT_FAILURE);
+	}
+	if (fh.tsc1 > fh.tsc0)
+		nsec_per_tick = (long double)(fh.nsec1 - fh.nsec0) /
+			(fh.tsc1 - fh.tsc0);
+
+	for (r = 0; r < fh.nrings; r++) {
+		if (fread(&rh, sizeof(rh), 1, fp) != 1)
+			break;
+		lost += rh.lost;
+		if (n + rh.nev > nmax) {
+			nmax = n + rh.nev;
+			e = realloc(e, nmax * sizeof(*e));
+			if (e == NULL)
+				exit(EX_MEMORY);
+		}
+		for (k = 0; k < rh.nev; k++) {
+			if (fread(&e[n].ev, sizeof(e[n].ev), 1, fp) != 1)
+				break;
+			if (e[n].ev.id >= SNAP_TEV_IDS)
+				continue;	/* torn while dumping */
+			e[n++].tid = rh.tid;
+		}
+	}
+	fclose(fp);
+
+	qsort(e, n, sizeof(*e), cmp_event);
+	if (json)
+		print_json(e, n);
+	else
+		print_text(e, n);
+
+	if (verbose_flag || lost)
+		fprintf(stderr, "%lu events from %u threads, %lu lost, "
+			"%.3Lf nsec per tick\n", n, fh.nrings, lost,
+			nsec_per_tick);
+	free(e);
+	exit(EXIT_SUCCESS);
+}